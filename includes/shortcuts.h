@@ -13,10 +13,29 @@
 #include <linux/uvcvideo.h>
 #include <sys/fcntl.h> /* for open() syscall */ 
 #include <sys/mman.h> /* for using mmap */
+#include <sys/stat.h>
+#include <time.h>
 
 #define CLEAR(x) memset(&(x), 0, sizeof(x))
 #define SIZE(a) (sizeof(a) / sizeof(*a))
 
+/* monotonic clock in microseconds, the clock of v4l2 dequeue times */
+static inline double monotonic_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* remove a unix socket file left behind by an earlier run, nothing else */
+static inline void unlink_socket(const char *path)
+{
+	struct stat st;
+
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+}
+
 /*clip value between 0 and 255*/
 #define CLIP(value) (uint8_t)(((value)>0xFF)?0xff:(((value)<0)?0:(value)))
 
@@ -49,4 +68,7 @@ struct device
     unsigned int height;
     unsigned int bytesperline;
     unsigned int imagesize;
+    unsigned int pixelformat;
+    struct buffer_arena *arena; /* V4L2_MEMORY_USERPTR frame memory */
+    int lock_buffers;           /* mlock the arena */
 };
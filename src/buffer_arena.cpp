@@ -0,0 +1,101 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, one block of memory
+  the V4L2_MEMORY_USERPTR frame buffers are carved from, on huge pages
+  where possible, touched up front and optionally locked.
+*****************************************************************************/
+#include "../includes/shortcuts.h"
+#include "buffer_arena.h"
+
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << 26)		/* log2(2MB) << MAP_HUGE_SHIFT */
+#endif
+
+/*****************************************************************************
+**                           Function definition
+*****************************************************************************/
+
+/*
+ * map the arena, 2MB huge pages first, then transparent huge pages on
+ * normal memory
+ * args:
+ * 		arena - arena to set up
+ * 		size  - bytes needed, rounded up to a huge page
+ * 		lock  - mlock it, a failure only costs the locking
+ * returns:
+ * 		error value
+ */
+int buffer_arena_init(struct buffer_arena *arena, size_t size, int lock)
+{
+	void *p;
+
+	CLEAR(*arena);
+	size = (size + ARENA_HUGE_PAGE - 1) & ~(ARENA_HUGE_PAGE - 1);
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB |
+				 MAP_POPULATE,
+			 -1, 0);
+	if (p != MAP_FAILED)
+		arena->huge = 1;
+	else
+	{
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+		{
+			perror("ARENA: mmap");
+			return -ENOMEM;
+		}
+		/* before the first touch, so the faults below get huge pages */
+		madvise(p, size, MADV_HUGEPAGE);
+		memset(p, 0, size);
+	}
+	arena->base = (unsigned char *)p;
+	arena->size = size;
+
+	if (lock)
+	{
+		if (mlock(arena->base, arena->size) == 0)
+			arena->locked = 1;
+		else
+			printf("ARENA: couldn't lock %zu MB: %s\n", size >> 20,
+				   strerror(errno));
+	}
+	printf("ARENA: %zu MB on %s pages%s\n", size >> 20,
+		   arena->huge ? "2MB" : "normal or transparent huge",
+		   arena->locked ? ", locked" : "");
+	return 0;
+}
+
+/*
+ * unmap the arena, everything allocated from it goes with it
+ * args:
+ * 		arena - arena, a cleared one is ignored
+ */
+void buffer_arena_free(struct buffer_arena *arena)
+{
+	if (arena->base != NULL)
+		munmap(arena->base, arena->size);
+	CLEAR(*arena);
+}
+
+/*
+ * take the next piece of the arena, there is no freeing pieces one by one
+ * args:
+ * 		arena - arena
+ * 		size  - bytes
+ * returns:
+ * 		ARENA_ALIGN aligned memory, NULL once the arena is used up
+ */
+void *buffer_arena_alloc(struct buffer_arena *arena, size_t size)
+{
+	size = (size + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1);
+	if (arena->used + size > arena->size)
+		return NULL;
+	arena->used += size;
+	return arena->base + arena->used - size;
+}
@@ -0,0 +1,39 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, one block of memory
+  the V4L2_MEMORY_USERPTR frame buffers are carved from. It is backed by
+  2MB huge pages where the kernel has them reserved, so a 25MB frame takes
+  a dozen TLB entries instead of thousands, and by transparent huge pages
+  or normal pages otherwise. All of it is touched up front and can be
+  locked, streaming never takes a page fault on it.
+
+  	echo 64 > /proc/sys/vm/nr_hugepages
+*****************************************************************************/
+#pragma once
+#include <stddef.h>
+
+/****************************************************************************
+**                      	Global data
+*****************************************************************************/
+#define ARENA_HUGE_PAGE (2UL << 20)
+/* page aligned, fine for the widest simd loads and for O_DIRECT writes */
+#define ARENA_ALIGN 4096
+
+struct buffer_arena
+{
+	unsigned char *base;
+	size_t size;			/* mapped */
+	size_t used;			/* handed out */
+	int huge;				/* hugetlbfs pages, not just transparent ones */
+	int locked;				/* mlock'ed */
+};
+
+/****************************************************************************
+**							 Function declaration
+*****************************************************************************/
+int buffer_arena_init(struct buffer_arena *arena, size_t size, int lock);
+void buffer_arena_free(struct buffer_arena *arena);
+void *buffer_arena_alloc(struct buffer_arena *arena, size_t size);
@@ -0,0 +1,185 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, buffer count tuning
+  from the hold times, buffers out and skipped frames of a warm-up window.
+*****************************************************************************/
+#include <math.h>
+
+#include "../includes/shortcuts.h"
+#include "buffer_tune.h"
+
+/*****************************************************************************
+**                           Function definition
+*****************************************************************************/
+
+/*
+ * args:
+ * 		tune 	   - buffer tuning
+ * 		seconds    - warm-up window, 0 turns tuning off
+ * 		percentile - of hold times the buffers have to cover, e.g. 99
+ */
+void buffer_tune_init(struct buffer_tune *tune, double seconds,
+					  double percentile)
+{
+	CLEAR(*tune);
+	tune->window = seconds;
+	tune->percentile = percentile;
+}
+
+/* forget what was measured, the next frame starts a new window */
+void buffer_tune_reset(struct buffer_tune *tune)
+{
+	buffer_tune_init(tune, tune->window, tune->percentile);
+}
+
+/*
+ * a buffer was dequeued, called with the capture ring's mutex held
+ * args:
+ * 		tune 	  - buffer tuning
+ * 		now_us 	  - when, monotonic
+ * 		in_flight - buffers userspace has, this one included
+ * 		nbufs 	  - buffers there are
+ * 		gap 	  - frames the driver skipped before this one
+ */
+void buffer_tune_dequeued(struct buffer_tune *tune, double now_us,
+						  unsigned int in_flight, unsigned int nbufs,
+						  unsigned int gap)
+{
+	if (tune->done)
+		return;
+	if (tune->frames == 0)
+		tune->first = now_us;
+	tune->last = now_us;
+	tune->in_flight[tune->frames % BUFFER_TUNE_SAMPLES] =
+		in_flight > 255 ? 255 : in_flight;
+	tune->frames++;
+	if (in_flight > tune->max_in_flight)
+		tune->max_in_flight = in_flight;
+
+	tune->gaps += gap;
+	if (tune->starved)
+		tune->starved_gaps += gap;
+	tune->starved = in_flight >= nbufs;
+
+	if (now_us - tune->first >= tune->window * 1e6)
+		__atomic_store_n(&tune->done, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * a buffer went back to the driver, called with the capture ring's mutex
+ * held
+ * args:
+ * 		tune 	- buffer tuning
+ * 		hold_us - how long userspace had it
+ */
+void buffer_tune_held(struct buffer_tune *tune, double hold_us)
+{
+	if (tune->done || tune->frames == 0)
+		return;
+	tune->hold[tune->holds % BUFFER_TUNE_SAMPLES] = (float)hold_us;
+	tune->holds++;
+}
+
+/* 1 once the warm-up window is over, safe from any thread */
+int buffer_tune_done(struct buffer_tune *tune)
+{
+	return __atomic_load_n(&tune->done, __ATOMIC_ACQUIRE);
+}
+
+static int compare_float(const void *a, const void *b)
+{
+	float x = *(const float *)a, y = *(const float *)b;
+	return x < y ? -1 : x > y;
+}
+
+static int compare_uchar(const void *a, const void *b)
+{
+	return *(const unsigned char *)a - *(const unsigned char *)b;
+}
+
+/* index of the percentile in n sorted samples */
+static unsigned long rank(double percentile, unsigned long n)
+{
+	unsigned long i = (unsigned long)ceil(percentile / 100 * n);
+	return i > 0 ? i - 1 : 0;
+}
+
+/*
+ * the smallest buffer count that keeps the driver supplied for the
+ * percentile of hold times the window saw, printed with why
+ * args:
+ * 		tune  - buffer tuning, done
+ * 		nbufs - buffers used during the window
+ * returns:
+ * 		buffer count, nbufs if the window saw too little to tell
+ */
+unsigned int buffer_tune_choose(struct buffer_tune *tune, unsigned int nbufs)
+{
+	unsigned long nhold = tune->holds < BUFFER_TUNE_SAMPLES ? tune->holds
+														   : BUFFER_TUNE_SAMPLES;
+	unsigned long nflight = tune->frames < BUFFER_TUNE_SAMPLES ? tune->frames
+															  : BUFFER_TUNE_SAMPLES;
+	float *hold;
+	unsigned char *in_flight;
+
+	if (tune->frames < 2 || nhold == 0)
+	{
+		printf("buffer tune: %lu frames in the window, keeping %u buffers\n",
+			   tune->frames, nbufs);
+		return nbufs;
+	}
+	hold = (float *)malloc(nhold * sizeof hold[0]);
+	in_flight = (unsigned char *)malloc(nflight);
+	if (hold == NULL || in_flight == NULL)
+	{
+		free(hold);
+		free(in_flight);
+		return nbufs;
+	}
+	memcpy(hold, tune->hold, nhold * sizeof hold[0]);
+	memcpy(in_flight, tune->in_flight, nflight);
+	qsort(hold, nhold, sizeof hold[0], compare_float);
+	qsort(in_flight, nflight, 1, compare_uchar);
+
+	double period = (tune->last - tune->first) / (tune->frames - 1);
+	double hold_p = hold[rank(tune->percentile, nhold)];
+	unsigned int depth_p = in_flight[rank(tune->percentile, nflight)];
+	free(hold);
+	free(in_flight);
+
+	/* buffers processing has at once, whichever way of counting says more */
+	unsigned int held = (unsigned int)ceil(hold_p / period);
+	if (held < depth_p)
+		held = depth_p;
+	if (held < 1)
+		held = 1;
+	unsigned int count = held + BUFFER_TUNE_DRIVER;
+
+	printf("buffer tune: %lu frames in %.1f s, %.1f ms apart, %u buffers\n",
+		   tune->frames, (tune->last - tune->first) / 1e6, period / 1e3, nbufs);
+	printf("buffer tune: p%g hold %.1f ms, %.2f frame periods, p%g %u buffers "
+		   "out (max %u)\n",
+		   tune->percentile, hold_p / 1e3, hold_p / period, tune->percentile,
+		   depth_p, tune->max_in_flight);
+	printf("buffer tune: %lu frames skipped, %lu of them with no buffer queued\n",
+		   tune->gaps, tune->starved_gaps);
+
+	/* the driver ran dry anyway, the tail is worse than the percentile */
+	if (tune->starved_gaps > 0 && count <= nbufs)
+	{
+		count = nbufs + 1;
+		printf("buffer tune: the driver ran out of buffers, one more than now\n");
+	}
+	if (count > V4L_BUFFERS_MAX)
+	{
+		count = V4L_BUFFERS_MAX;
+		printf("buffer tune: capped at %d, processing can't keep up\n",
+			   V4L_BUFFERS_MAX);
+	}
+	printf("buffer tune: %u buffers, %u for processing and %d for the driver\n",
+		   count, count - BUFFER_TUNE_DRIVER, BUFFER_TUNE_DRIVER);
+	return count;
+}
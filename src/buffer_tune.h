@@ -0,0 +1,59 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, picks the number of
+  v4l2 buffers from what the first seconds of streaming look like. Too few
+  and the driver runs out of buffers when processing takes longer now and
+  then, too many only add latency and pin memory.
+
+  Over a warm-up window the capture ring reports how long every buffer was
+  kept from the driver, how many were out at each dequeue and the frames
+  the driver skipped. At one frame per period, a buffer held for h is one
+  of ceil(h / period) that processing has at once, the driver needs one to
+  fill and one queued behind it. Taken at a percentile of the hold times,
+  that is the smallest count that drops nothing as long as processing
+  stays within it. Frames skipped while the driver had no buffer mean the
+  window saw worse than the percentile, the count then grows past the
+  current one.
+*****************************************************************************/
+#pragma once
+
+/****************************************************************************
+**                      	Global data
+*****************************************************************************/
+#define BUFFER_TUNE_SAMPLES 4096	/* newest ones are kept */
+#define BUFFER_TUNE_DRIVER 2		/* one being filled, one queued behind it */
+
+struct buffer_tune
+{
+	double window;			/* seconds of warm-up, 0 for no tuning */
+	double percentile;		/* of hold times to cover, e.g. 99 */
+
+	double first;			/* first and last dequeue of the window, us */
+	double last;
+	unsigned long frames;
+	unsigned long gaps;		/* frames the driver skipped */
+	unsigned long starved_gaps; /* of those, right after it had no buffer */
+	int starved;			/* userspace had every buffer since the last dequeue */
+	unsigned int max_in_flight;
+
+	unsigned long holds;
+	float hold[BUFFER_TUNE_SAMPLES];	/* us */
+	unsigned char in_flight[BUFFER_TUNE_SAMPLES];
+	int done;				/* window is over, nothing is added any more */
+};
+
+/****************************************************************************
+**							 Function declaration
+*****************************************************************************/
+void buffer_tune_init(struct buffer_tune *tune, double seconds,
+					  double percentile);
+void buffer_tune_reset(struct buffer_tune *tune);
+void buffer_tune_dequeued(struct buffer_tune *tune, double now_us,
+						  unsigned int in_flight, unsigned int nbufs,
+						  unsigned int gap);
+void buffer_tune_held(struct buffer_tune *tune, double hold_us);
+int buffer_tune_done(struct buffer_tune *tune);
+unsigned int buffer_tune_choose(struct buffer_tune *tune, unsigned int nbufs);
@@ -0,0 +1,295 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, pre-trigger ring for
+  event based burst capture. The last frames are kept in a preallocated,
+  locked ring of memory, a trigger freezes the ring and a background thread
+  flushes it into a raw container file while streaming carries on.
+
+  Everything, including the file header and index blocks, is allocated
+  once in burst_ring_init.
+*****************************************************************************/
+#include "../includes/shortcuts.h"
+#include "burst_ring.h"
+#include "frame_trace.h"
+
+/*****************************************************************************
+**                           Function definition
+*****************************************************************************/
+
+static int write_all(int fd, const void *data, size_t size, off_t offset)
+{
+	const char *p = (const char *)data;
+	size_t done = 0;
+
+	TRACE_SCOPE("burst write");
+	while (done < size)
+	{
+		ssize_t n = pwrite(fd, p + done, size - done, offset + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		done += n;
+	}
+	return 0;
+}
+
+/*
+ * write the frozen ring into a container, oldest frame first
+ * args:
+ * 		ring     - frozen burst ring
+ * 		filename - file to create
+ * returns:
+ * 		error value
+ */
+static int flush_ring(struct burst_ring *ring, const char *filename)
+{
+	struct raw_record_index_entry *index =
+		(struct raw_record_index_entry *)ring->index_block;
+	size_t stride = ring->header.frame_stride;
+	unsigned int first = (ring->next + ring->nslots - ring->count) % ring->nslots;
+	off_t offset = ring->header.header_size;
+	size_t index_size = raw_record_index_size(ring->count);
+	int fd, ret = 0;
+
+	fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+	{
+		fprintf(stderr, "BURST: couldn't open %s: %s\n",
+				filename, strerror(errno));
+		return -1;
+	}
+	fallocate(fd, 0, 0, offset + ring->count * stride + index_size);
+
+	ret = write_all(fd, ring->header_block, RAW_RECORD_ALIGN, 0);
+	memset(ring->index_block, 0, index_size);
+	for (unsigned int i = 0; i < ring->count && ret == 0; i++)
+	{
+		unsigned char *slot = ring->slots + (size_t)((first + i) % ring->nslots) * stride;
+		struct raw_frame_header *hdr = (struct raw_frame_header *)slot;
+
+		/* frame numbers count from the start of this file */
+		hdr->index = i;
+		index[i].offset = offset;
+		index[i].timestamp = hdr->timestamp;
+		index[i].sequence = hdr->sequence;
+		ret = write_all(fd, slot, stride, offset);
+		offset += stride;
+	}
+	if (ret == 0)
+	{
+		raw_record_set_footer(ring->index_block, index_size, ring->count,
+							  offset);
+		ret = write_all(fd, ring->index_block, index_size, offset);
+	}
+	if (ret == 0 && (ftruncate(fd, offset + index_size) < 0 || fdatasync(fd) < 0))
+		ret = -1;
+	if (ret < 0)
+		fprintf(stderr, "BURST: couldn't write %s: %s\n",
+				filename, strerror(errno));
+	close(fd);
+	return ret;
+}
+
+/*
+ * flush thread, waits for a trigger, writes the ring out and
+ * unfreezes it again
+ * args:
+ * 		arg - struct burst_ring *ring
+ */
+static void *flush_thread(void *arg)
+{
+	struct burst_ring *ring = (struct burst_ring *)arg;
+	char filename[32];
+
+	while (1)
+	{
+		__LOCK_MUTEX(&ring->mutex);
+		while (ring->running && !ring->frozen)
+			pthread_cond_wait(&ring->cond, &ring->mutex);
+		if (!ring->frozen)
+		{
+			__UNLOCK_MUTEX(&ring->mutex);
+			break;
+		}
+		__UNLOCK_MUTEX(&ring->mutex);
+
+		/* frozen, the capture side doesn't touch the slots */
+		snprintf(filename, sizeof(filename), "burst_%lu.lraw", ring->bursts);
+		if (flush_ring(ring, filename) == 0)
+			printf("BURST: saved %u frames to %s\n", ring->count, filename);
+
+		__LOCK_MUTEX(&ring->mutex);
+		ring->bursts++;
+		ring->count = 0;
+		ring->frozen = 0;
+		__UNLOCK_MUTEX(&ring->mutex);
+	}
+	return NULL;
+}
+
+/*
+ * preallocate and lock a ring for the given number of frames of the
+ * current format and start the flush thread
+ * args:
+ * 		ring   - burst ring
+ * 		dev    - camera, frames are dev->imagesize bytes
+ * 		frames - frames to keep, cut down to BURST_RING_MAX_BYTES
+ * returns:
+ * 		error value
+ */
+int burst_ring_init(struct burst_ring *ring, struct device *dev,
+					unsigned int frames)
+{
+	int ret;
+
+	CLEAR(*ring);
+	raw_record_init_header(&ring->header, dev);
+	if ((size_t)frames * ring->header.frame_stride > BURST_RING_MAX_BYTES)
+	{
+		frames = BURST_RING_MAX_BYTES / ring->header.frame_stride;
+		printf("BURST: ring limited to %u frames\n", frames);
+	}
+	if (frames == 0)
+		return -EINVAL;
+
+	ring->nslots = frames;
+	ring->slots_size = (size_t)frames * ring->header.frame_stride;
+	ring->slots = (unsigned char *)mmap(NULL, ring->slots_size,
+										PROT_READ | PROT_WRITE,
+										MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE,
+										-1, 0);
+	if (ring->slots == MAP_FAILED)
+	{
+		ring->slots = NULL;
+		printf("BURST: couldn't allocate %zu bytes\n", ring->slots_size);
+		return -ENOMEM;
+	}
+	/* a burst that got swapped out is worthless, keep it in ram */
+	ring->locked = mlock(ring->slots, ring->slots_size) == 0;
+	if (!ring->locked)
+		printf("BURST: couldn't lock the ring in memory (%s), check "
+			   "ulimit -l\n", strerror(errno));
+
+	ring->index_block_size = raw_record_index_size(frames);
+	if (posix_memalign(&ring->header_block, RAW_RECORD_ALIGN,
+					   RAW_RECORD_ALIGN) != 0 ||
+		posix_memalign(&ring->index_block, RAW_RECORD_ALIGN,
+					   ring->index_block_size) != 0)
+	{
+		burst_ring_free(ring);
+		return -ENOMEM;
+	}
+	memset(ring->header_block, 0, RAW_RECORD_ALIGN);
+	memcpy(ring->header_block, &ring->header, sizeof ring->header);
+	memset(ring->index_block, 0, ring->index_block_size);
+
+	__INIT_MUTEX(&ring->mutex);
+	pthread_cond_init(&ring->cond, NULL);
+	ring->running = 1;
+	ret = __THREAD_CREATE(&ring->thread, flush_thread, ring);
+	if (ret != 0)
+	{
+		printf("couldn't start burst flush thread: %s\n", strerror(ret));
+		ring->running = 0;
+		burst_ring_free(ring);
+		return -ret;
+	}
+	printf("BURST: keeping the last %u frames (%zu MB%s)\n", frames,
+		   ring->slots_size >> 20, ring->locked ? ", locked" : "");
+	return 0;
+}
+
+/*
+ * finish a running flush, stop the thread and release the memory
+ * args:
+ * 		ring - burst ring
+ */
+void burst_ring_free(struct burst_ring *ring)
+{
+	if (ring->running)
+	{
+		__LOCK_MUTEX(&ring->mutex);
+		ring->running = 0;
+		pthread_cond_signal(&ring->cond);
+		__UNLOCK_MUTEX(&ring->mutex);
+		__THREAD_JOIN(ring->thread);
+	}
+	if (ring->slots)
+	{
+		if (ring->locked)
+			munlock(ring->slots, ring->slots_size);
+		munmap(ring->slots, ring->slots_size);
+		ring->slots = NULL;
+	}
+	free(ring->header_block);
+	free(ring->index_block);
+	ring->header_block = NULL;
+	ring->index_block = NULL;
+	if (ring->skipped)
+		printf("BURST: %lu bursts, %lu frames not kept during flushes\n",
+			   ring->bursts, ring->skipped);
+}
+
+/*
+ * keep a copy of the frame, overwriting the oldest one once the ring
+ * is full, frames that arrive while a flush runs are not kept
+ * args:
+ * 		ring - burst ring
+ * 		buf  - dequeued v4l2 buffer
+ * 		data - its data
+ * 		meta - exposure, gain, datatype and bayer pattern
+ */
+void burst_ring_add_frame(struct burst_ring *ring,
+						  const struct v4l2_buffer *buf, const void *data,
+						  const struct raw_frame_meta *meta)
+{
+	unsigned char *slot;
+
+	/* held over the copy, so a trigger never freezes half a frame */
+	__LOCK_MUTEX(&ring->mutex);
+	if (ring->frozen)
+	{
+		ring->skipped++;
+		__UNLOCK_MUTEX(&ring->mutex);
+		return;
+	}
+	slot = ring->slots + (size_t)ring->next * ring->header.frame_stride;
+	raw_record_fill_block(slot, &ring->header, buf, data, meta, 0);
+	ring->next = (ring->next + 1) % ring->nslots;
+	if (ring->count < ring->nslots)
+		ring->count++;
+	__UNLOCK_MUTEX(&ring->mutex);
+}
+
+/*
+ * freeze the ring and flush it to burst_N.lraw in the background
+ * args:
+ * 		ring - burst ring
+ * returns:
+ * 		error value, -EBUSY while the previous burst is still being written
+ */
+int burst_ring_trigger(struct burst_ring *ring)
+{
+	int ret = 0;
+
+	__LOCK_MUTEX(&ring->mutex);
+	if (!ring->running)
+		ret = -EINVAL;
+	else if (ring->frozen)
+		ret = -EBUSY;
+	else if (ring->count == 0)
+		ret = -ENODATA;
+	else
+	{
+		ring->frozen = 1;
+		pthread_cond_signal(&ring->cond);
+	}
+	__UNLOCK_MUTEX(&ring->mutex);
+	if (ret == -EBUSY)
+		printf("BURST: still writing the last burst, trigger ignored\n");
+	return ret;
+}
@@ -0,0 +1,55 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, pre-trigger ring for
+  event based burst capture. The last frames are kept in a preallocated,
+  locked ring of memory, a trigger freezes the ring and a background thread
+  flushes it into a raw container file while streaming carries on.
+*****************************************************************************/
+#pragma once
+#include <stdint.h>
+#include "raw_recorder.h"
+
+/****************************************************************************
+**                      	Global data
+*****************************************************************************/
+/* never lock more than this much memory for the ring */
+#define BURST_RING_MAX_BYTES (2048UL << 20)
+
+struct burst_ring
+{
+	struct raw_record_header header;
+	unsigned char *slots;	/* nslots * frame_stride, raw container layout */
+	size_t slots_size;
+	unsigned int nslots;
+	unsigned int next;		/* slot the next frame goes into */
+	unsigned int count;		/* slots holding a frame */
+	int locked;				/* slots are mlock'ed */
+
+	void *header_block;		/* RAW_RECORD_ALIGN bytes */
+	void *index_block;		/* index for a full ring */
+	size_t index_block_size;
+
+	int frozen;				/* a flush is running, no new frames */
+	int running;
+	unsigned long bursts;
+	unsigned long skipped;	/* frames that came in while frozen */
+
+	__THREAD_TYPE thread;
+	__MUTEX_TYPE mutex;
+	pthread_cond_t cond;
+};
+
+/****************************************************************************
+**							 Function declaration
+*****************************************************************************/
+int burst_ring_init(struct burst_ring *ring, struct device *dev,
+					unsigned int frames);
+void burst_ring_free(struct burst_ring *ring);
+
+void burst_ring_add_frame(struct burst_ring *ring,
+						  const struct v4l2_buffer *buf, const void *data,
+						  const struct raw_frame_meta *meta);
+int burst_ring_trigger(struct burst_ring *ring);
@@ -0,0 +1,113 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, one context per camera
+  holds everything about it: the device and its buffers, the revisions read
+  from the extension unit, the settings the gui changes while streaming and
+  the whole streaming pipeline.
+*****************************************************************************/
+#include "../includes/shortcuts.h"
+#include "cam_context.h"
+#include "cam_formats.h"
+#include "extend_cam_ctrl.h"
+
+/*****************************************************************************
+**                           Function definition
+*****************************************************************************/
+
+/*
+ * allocate a context with the same defaults the camera tool starts with,
+ * use it for a replay as is or open a camera with cam_ctx_open
+ * returns:
+ * 		the context, NULL if out of memory
+ */
+struct cam_ctx *cam_ctx_create(void)
+{
+	struct cam_ctx *ctx = (struct cam_ctx *)calloc(1, sizeof *ctx);
+
+	if (ctx == NULL)
+		return NULL;
+	__INIT_MUTEX(&ctx->stream_mutex);
+	__INIT_MUTEX(&ctx->show_mutex);
+	cam_tone_init(&ctx->tone);
+
+	ctx->controls.exposure_val = -1;
+	ctx->controls.gain_val = -1;
+	ctx->controls.gamma_val = 1.0;
+	ctx->dev.fd = -1;
+	ctx->dev.nbufs = V4L_BUFFERS_DEFAULT;
+	ctx->dev.memtype = V4L2_MEMORY_MMAP;
+	ctx->capture_cpu = -1;
+	ctx->realtime = -1;
+	ctx->replay_loops = 1;
+	ctx->display_enabled = 1;
+	ctx->out_of_place_decode = 1;
+	ctx->snapshot_fsync = 1;
+	ctx->record_backend = &record_backend_buffered;
+	return ctx;
+}
+
+/*
+ * stop streaming, close the camera and free the context
+ * args:
+ * 		ctx - from cam_ctx_create, NULL is ignored
+ */
+void cam_ctx_destroy(struct cam_ctx *ctx)
+{
+	if (ctx == NULL)
+		return;
+	cam_ctx_close(ctx);
+	free(ctx->show_buf);
+	__CLOSE_MUTEX(&ctx->stream_mutex);
+	__CLOSE_MUTEX(&ctx->show_mutex);
+	free(ctx);
+}
+
+/*
+ * open a camera and read its revisions from the extension unit
+ * args:
+ * 		ctx 		- from cam_ctx_create, no camera open yet
+ * 		device_name - /dev/video#
+ * returns:
+ * 		file descriptor, negative on error
+ */
+int cam_ctx_open(struct cam_ctx *ctx, const char *device_name)
+{
+	int fd;
+
+	if (device_name == NULL)
+		return -EINVAL;
+	snprintf(ctx->name, sizeof(ctx->name), "%s", device_name);
+	fd = open_v4l2_device(ctx->name, &ctx->dev);
+	if (fd < 0)
+	{
+		ctx->name[0] = 0;
+		return fd;
+	}
+	ctx->fw_rev = read_cam_uuid_hwfw_rev(fd, &ctx->hw_rev, ctx->uuid);
+	return fd;
+}
+
+/*
+ * stop streaming, give the buffers back and close the camera, the context
+ * can open another one afterwards
+ * args:
+ * 		ctx - camera context
+ */
+void cam_ctx_close(struct cam_ctx *ctx)
+{
+	streaming_stop(ctx);
+	if (ctx->dev.fd < 0)
+		return;
+	if (ctx->dev.buffers != NULL)
+	{
+		stop_Camera(&ctx->dev);
+		video_free_buffers(&ctx->dev);
+	}
+	cam_caps_forget(ctx->dev.fd);
+	close(ctx->dev.fd);
+	ctx->dev.fd = -1;
+	ctx->name[0] = 0;
+}
@@ -0,0 +1,210 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, one context per camera
+  holds everything about it: the device and its buffers, the revisions read
+  from the extension unit, the settings the gui changes while streaming and
+  the whole streaming pipeline. Several cameras can stream and be controlled
+  from different threads of one process, each one with its own context.
+
+  The gui thread changes settings with the setters in extend_cam_ctrl.h and
+  shows frames with cam_ctx_show, streaming_start runs the capture, decode
+  and isp of the camera on a thread of its own.
+
+  This header is C++ only: the layout of the context and the CamContext
+  owner. C callers include cam_handle.h, where the context is opaque.
+*****************************************************************************/
+#pragma once
+#include "cam_handle.h"
+#include "capture_ring.h"
+#include "frame_source.h"
+#include "frame_share.h"
+#include "frame_pool.h"
+#include "snapshot_writer.h"
+#include "raw_recorder.h"
+#include "burst_ring.h"
+#include "isp_kernels.h"
+#include "stage_timer.h"
+#include "uvc_extension_unit_ctrl.h"
+
+/****************************************************************************
+**                      	Global data
+*****************************************************************************/
+/*
+ * settings the gui changes while the camera streams, the streaming thread
+ * reads them once per frame
+ */
+struct cam_controls
+{
+	int save_bmp;	 /* flag for saving bmp */
+	int save_raw;	 /* flag for saving raw */
+	int bayer_flag;	 /* flag for choosing bayer pattern */
+	int shift_flag;	 /* flag for shift raw data */
+	int awb_flag;	 /* flag for enable/disable software awb*/
+	int abc_flag;	 /* flag for enable/disable software brightness & contrast optimization */
+	int record_flag; /* flag for continuous raw recording */
+	int exposure_val; /* last exposure set from gui, for recorded frame headers */
+	int gain_val;	 /* last gain set from gui, for recorded frame headers */
+	int burst_flag;	 /* flag for flushing the pre-trigger ring */
+	float gamma_val;
+};
+
+/*
+ * gamma, awb gains and abc of one camera folded into lookup tables, each
+ * table is rebuilt only when what it is made of changes
+ */
+struct cam_tone
+{
+	/* fixed-point rr..bb colour correction matrix, gains live in the lut */
+	struct ccm_q12 awb_ccm;
+	double ccm_param[9];
+
+	unsigned char gamma_curve[256];
+	float gamma;
+	double pre_abc_param[4];
+	unsigned char pre_abc_lut[3][256];
+
+	/* per-channel table that does everything in one pass, bgr */
+	unsigned char lut[256][3];
+	float lut_param[3];
+	int lut_identity;
+
+	/* abc alone, applied after the colour correction matrix when awb is on */
+	unsigned char abc_lut[256];
+	float abc_lut_param[2];
+
+	/* auto brightness and contrast, O(x,y) = alpha * I(x,y) + beta */
+	float abc_alpha;
+	float abc_beta;
+	int abc_sample_step;
+	int abc_update_period;
+	float abc_smoothing;
+	unsigned int abc_frame_count;
+	int abc_settled;
+};
+
+struct cam_ctx
+{
+	char name[64];			/* /dev/video#, empty for a replay */
+	struct device dev;
+	int hw_rev;
+	int fw_rev;
+	char uuid[LI_UUID_SIZE];
+
+	struct cam_controls controls;
+	struct cam_tone tone;
+	int image_count;
+
+	/* buffers dequeued by the capture thread, waiting for decode */
+	struct capture_ring ring;
+	enum frame_queue_policy queue_policy; /* when decode falls behind */
+	int capture_cpu;		/* for the capture thread, -1 anywhere */
+	int realtime;			/* capture SCHED_FIFO priority, see realtime.h */
+	struct stream_stats stats; /* lost frames and latencies, over format switches */
+	double frame_dq_time;	/* of the frame in processing, us, 0 for a replay */
+
+	/* stage times printed while streaming, see stage_timer.h */
+	double stage_report_seconds; /* 0 only prints them at the end */
+	double stage_report_time;
+	struct stage_snapshot stage_report;	/* at the last report */
+
+	/* buffer count from the first seconds of streaming, see buffer_tune.h */
+	struct buffer_tune tune;
+	int tune_apply;			/* restart with the count it picks */
+	unsigned int tune_chosen; /* 0 until the window is over */
+
+	/* where frames come from, the camera's capture ring or a replay */
+	struct frame_source source;
+	const char *replay_path;
+	double replay_fps;
+	unsigned int replay_loops;
+
+	/* camera buffers other processes map as dmabufs, see frame_share.h */
+	struct frame_share share;
+	const char *share_path;
+
+	/*
+	 * working copies of frames, the 8-bit bayer or yuyv data is unpacked
+	 * here so the v4l2 buffer can go back to the driver before the isp runs
+	 */
+	struct frame_pool decode_pool;
+	int out_of_place_decode;
+
+	/* raw and bmp captures are written to disk by a background thread */
+	struct snapshot_writer snapshots;
+	int snapshot_fsync;
+
+	/* every frame goes into one container file while recording */
+	struct raw_recorder recorder;
+	int record_count;
+	const struct record_backend_ops *record_backend;
+
+	/* the last seconds of raw frames, flushed on a trigger */
+	struct burst_ring burst;
+	int pre_trigger_seconds;
+
+	/* streaming_loop on a thread of its own, see streaming_start */
+	__THREAD_TYPE stream_thread;
+	__MUTEX_TYPE stream_mutex;
+	int source_started;
+	int stop_requested;
+	int streaming;
+
+	/* format streaming_loop switches to next, see stream_reconfigure */
+	int reconfig_pending;
+	unsigned int reconfig_width;
+	unsigned int reconfig_height;
+	unsigned int reconfig_pixelformat;
+	unsigned int reconfig_fps;		/* 0 for the driver's default */
+	unsigned int reconfig_nbufs;	/* 0 keeps the buffer count */
+	unsigned int reconfig_count;
+	double reconfig_gap_total;		/* ms from the last old frame to the first new one */
+	double reconfig_gap_max;
+
+	/*
+	 * newest processed frame, shown by whichever thread owns the windows,
+	 * a frame that comes while the last one is still waiting isn't shown
+	 */
+	int display_enabled;
+	__MUTEX_TYPE show_mutex;
+	unsigned char *show_buf;
+	size_t show_size;
+	unsigned int show_width;
+	unsigned int show_height;
+	unsigned int show_window_width; /* resize the window to this, 0 keeps it */
+	unsigned int show_window_height;
+	int show_pending;
+	double show_dq_time;	/* of the frame waiting, 0 for a replay */
+	int show_window;
+};
+
+/*
+ * C++ owner of a context, the camera is stopped and closed and the context
+ * freed along with the object
+ */
+class CamContext
+{
+public:
+	CamContext() : ctx(cam_ctx_create()) {}
+	explicit CamContext(const char *device_name) : ctx(cam_ctx_create())
+	{
+		if (ctx != NULL && cam_ctx_open(ctx, device_name) < 0)
+		{
+			cam_ctx_destroy(ctx);
+			ctx = NULL;
+		}
+	}
+	~CamContext() { cam_ctx_destroy(ctx); }
+
+	/* NULL if the camera couldn't be opened */
+	struct cam_ctx *get() const { return ctx; }
+	operator struct cam_ctx *() const { return ctx; }
+
+private:
+	CamContext(const CamContext &);
+	CamContext &operator=(const CamContext &);
+
+	struct cam_ctx *ctx;
+};
@@ -0,0 +1,370 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, lists the formats,
+  frame sizes and frame rates a camera supports with VIDIOC_ENUM_FMT,
+  VIDIOC_ENUM_FRAMESIZES and VIDIOC_ENUM_FRAMEINTERVALS, the same table
+  v4l2-ctl --list-formats-ext prints. It is read once per device and kept.
+*****************************************************************************/
+#include <math.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "../includes/shortcuts.h"
+#include "cam_formats.h"
+
+/****************************************************************************
+**                      	Global data
+*****************************************************************************/
+static struct cam_caps *cache[CAM_CACHE_MAX];
+static __MUTEX_TYPE cache_mutex = __STATIC_MUTEX_INIT;
+
+/*****************************************************************************
+**                           Function definition
+*****************************************************************************/
+
+/* ioctl that retries when a signal came in */
+static int xioctl(int fd, unsigned long request, void *arg)
+{
+	int ret;
+
+	do
+		ret = ioctl(fd, request, arg);
+	while (ret < 0 && errno == EINTR);
+	return ret;
+}
+
+/*
+ * read the frame intervals of one frame size
+ * args:
+ * 		fd          - file descriptor
+ * 		pixelformat - format the size belongs to
+ * 		size        - frame size, gets the intervals
+ */
+static void enum_intervals(int fd, unsigned int pixelformat,
+						   struct cam_frame_size *size)
+{
+	struct v4l2_frmivalenum ival;
+
+	CLEAR(ival);
+	ival.pixel_format = pixelformat;
+	ival.width = size->width;
+	ival.height = size->height;
+	while (size->nintervals < CAM_INTERVALS_MAX &&
+		   xioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &ival) == 0)
+	{
+		if (ival.type == V4L2_FRMIVAL_TYPE_DISCRETE)
+		{
+			size->intervals[size->nintervals++] = ival.discrete;
+			ival.index++;
+			continue;
+		}
+		/* stepwise or continuous, only one entry describes the range */
+		size->continuous = 1;
+		size->intervals[0] = ival.stepwise.min;
+		size->intervals[1] = ival.stepwise.max;
+		size->nintervals = 2;
+		break;
+	}
+}
+
+/*
+ * read the frame sizes of one format
+ * args:
+ * 		fd  - file descriptor
+ * 		fmt - format, gets the sizes
+ */
+static void enum_sizes(int fd, struct cam_format *fmt)
+{
+	struct v4l2_frmsizeenum fsize;
+
+	CLEAR(fsize);
+	fsize.pixel_format = fmt->pixelformat;
+	while (fmt->nsizes < CAM_SIZES_MAX &&
+		   xioctl(fd, VIDIOC_ENUM_FRAMESIZES, &fsize) == 0)
+	{
+		struct cam_frame_size *size = &fmt->sizes[fmt->nsizes++];
+
+		if (fsize.type == V4L2_FRMSIZE_TYPE_DISCRETE)
+		{
+			size->width = size->max_width = fsize.discrete.width;
+			size->height = size->max_height = fsize.discrete.height;
+			enum_intervals(fd, fmt->pixelformat, size);
+			fsize.index++;
+			continue;
+		}
+		/* stepwise or continuous, intervals are listed for the largest */
+		size->width = fsize.stepwise.min_width;
+		size->height = fsize.stepwise.min_height;
+		size->max_width = fsize.stepwise.max_width;
+		size->max_height = fsize.stepwise.max_height;
+		size->step_width = fsize.stepwise.step_width ? fsize.stepwise.step_width : 1;
+		size->step_height = fsize.stepwise.step_height ? fsize.stepwise.step_height : 1;
+		struct cam_frame_size largest = *size;
+		largest.width = size->max_width;
+		largest.height = size->max_height;
+		enum_intervals(fd, fmt->pixelformat, &largest);
+		size->nintervals = largest.nintervals;
+		size->continuous = largest.continuous;
+		memcpy(size->intervals, largest.intervals, sizeof size->intervals);
+		break;
+	}
+}
+
+/* the kept table of a camera, read from the driver if there is none */
+static struct cam_caps *read_caps(int fd)
+{
+	struct v4l2_fmtdesc fmtdesc;
+	struct cam_caps *caps;
+	struct stat st;
+	int slot = -1;
+
+	if (fd < 0 || fstat(fd, &st) < 0)
+		return NULL;
+	for (int i = 0; i < CAM_CACHE_MAX; i++)
+	{
+		caps = cache[i];
+		if (caps != NULL && caps->fd == fd && caps->rdev == st.st_rdev &&
+			caps->ino == st.st_ino)
+			return caps;
+		if (caps == NULL && slot < 0)
+			slot = i;
+	}
+	if (slot < 0)
+	{
+		printf("CAM_FORMATS: more than %d cameras, table not kept\n",
+			   CAM_CACHE_MAX);
+		return NULL;
+	}
+
+	caps = (struct cam_caps *)calloc(1, sizeof *caps);
+	if (caps == NULL)
+		return NULL;
+	caps->fd = fd;
+	caps->rdev = st.st_rdev;
+	caps->ino = st.st_ino;
+
+	CLEAR(fmtdesc);
+	fmtdesc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	while (caps->nformats < CAM_FORMATS_MAX &&
+		   xioctl(fd, VIDIOC_ENUM_FMT, &fmtdesc) == 0)
+	{
+		struct cam_format *fmt = &caps->formats[caps->nformats++];
+
+		fmt->pixelformat = fmtdesc.pixelformat;
+		snprintf(fmt->description, sizeof(fmt->description), "%s",
+				 (const char *)fmtdesc.description);
+		enum_sizes(fd, fmt);
+		fmtdesc.index++;
+	}
+	if (caps->nformats == 0)
+	{
+		printf("CAM_FORMATS: VIDIOC_ENUM_FMT failed: %s\n", strerror(errno));
+		free(caps);
+		return NULL;
+	}
+	cache[slot] = caps;
+	return caps;
+}
+
+/*
+ * get the format table of a camera, it is read from the driver the first
+ * time and kept until cam_caps_forget, it stays valid until then
+ * args:
+ * 		fd - file descriptor
+ * returns:
+ * 		the table, NULL if it couldn't be read
+ */
+const struct cam_caps *cam_caps_get(int fd)
+{
+	struct cam_caps *caps;
+
+	__LOCK_MUTEX(&cache_mutex);
+	caps = read_caps(fd);
+	__UNLOCK_MUTEX(&cache_mutex);
+	return caps;
+}
+
+/*
+ * drop the kept table, e.g. before the fd gets closed, frees what
+ * cam_caps_get returned, so never while another thread still uses it
+ * args:
+ * 		fd - file descriptor
+ */
+void cam_caps_forget(int fd)
+{
+	__LOCK_MUTEX(&cache_mutex);
+	for (int i = 0; i < CAM_CACHE_MAX; i++)
+	{
+		if (cache[i] != NULL && cache[i]->fd == fd)
+		{
+			free(cache[i]);
+			cache[i] = NULL;
+		}
+	}
+	__UNLOCK_MUTEX(&cache_mutex);
+}
+
+/* frames per second of a time per frame */
+static double fract_fps(const struct v4l2_fract *tpf)
+{
+	return tpf->numerator ? (double)tpf->denominator / tpf->numerator : 0;
+}
+
+/* print the rates of one frame size on the current line */
+static void print_rates(const struct cam_frame_size *size)
+{
+	if (size->continuous)
+	{
+		printf(" %.3g-%.3g fps", fract_fps(&size->intervals[1]),
+			   fract_fps(&size->intervals[0]));
+		return;
+	}
+	for (unsigned int i = 0; i < size->nintervals; i++)
+		printf(" %.3g", fract_fps(&size->intervals[i]));
+	if (size->nintervals)
+		printf(" fps");
+}
+
+/*
+ * list all the resolutions and their frame rates
+ * args:
+ * 		caps - from cam_caps_get
+ */
+void cam_caps_print(const struct cam_caps *caps)
+{
+	if (caps == NULL)
+		return;
+	for (unsigned int i = 0; i < caps->nformats; i++)
+	{
+		const struct cam_format *fmt = &caps->formats[i];
+
+		printf("Format: %c%c%c%c (%s)\n",
+			   fmt->pixelformat & 0xff, (fmt->pixelformat >> 8) & 0xff,
+			   (fmt->pixelformat >> 16) & 0xff, (fmt->pixelformat >> 24) & 0xff,
+			   fmt->description);
+		for (unsigned int j = 0; j < fmt->nsizes; j++)
+		{
+			const struct cam_frame_size *size = &fmt->sizes[j];
+
+			if (size->step_width)
+				printf("Resolution:%ux%u-%ux%u", size->width, size->height,
+					   size->max_width, size->max_height);
+			else
+				printf("Resolution:%ux%u", size->width, size->height);
+			print_rates(size);
+			printf("\n");
+		}
+	}
+}
+
+/*
+ * look up a frame size in the table
+ * args:
+ * 		caps        - from cam_caps_get
+ * 		pixelformat - V4L2_PIX_FMT_*
+ * 		width       - frame width
+ * 		height      - frame height
+ * returns:
+ * 		the entry, NULL if the camera doesn't do it
+ */
+const struct cam_frame_size *cam_caps_find_size(const struct cam_caps *caps,
+												unsigned int pixelformat,
+												unsigned int width,
+												unsigned int height)
+{
+	for (unsigned int i = 0; i < caps->nformats; i++)
+	{
+		const struct cam_format *fmt = &caps->formats[i];
+
+		if (fmt->pixelformat != pixelformat)
+			continue;
+		for (unsigned int j = 0; j < fmt->nsizes; j++)
+		{
+			const struct cam_frame_size *size = &fmt->sizes[j];
+
+			if (size->step_width == 0)
+			{
+				if (size->width == width && size->height == height)
+					return size;
+				continue;
+			}
+			if (width >= size->width && width <= size->max_width &&
+				height >= size->height && height <= size->max_height &&
+				(width - size->width) % size->step_width == 0 &&
+				(height - size->height) % size->step_height == 0)
+				return size;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * check a format against the table before setting it
+ * args:
+ * 		fd          - file descriptor
+ * 		pixelformat - V4L2_PIX_FMT_*
+ * 		width       - frame width
+ * 		height      - frame height
+ * returns:
+ * 		0 if the camera does it or the table couldn't be read, -EINVAL if not
+ */
+int cam_caps_check_format(int fd, unsigned int pixelformat,
+						  unsigned int width, unsigned int height)
+{
+	const struct cam_caps *caps = cam_caps_get(fd);
+
+	if (caps == NULL)
+		return 0;
+	if (cam_caps_find_size(caps, pixelformat, width, height) != NULL)
+		return 0;
+	printf("%ux%u is not supported by this camera, pick one of:\n",
+		   width, height);
+	cam_caps_print(caps);
+	return -EINVAL;
+}
+
+/*
+ * check a frame rate against the table before setting it
+ * args:
+ * 		fd          - file descriptor
+ * 		pixelformat - current format
+ * 		width       - current frame width
+ * 		height      - current frame height
+ * 		fps         - frame rate wanted
+ * returns:
+ * 		0 if the camera does it or the table couldn't be read, -EINVAL if not
+ */
+int cam_caps_check_rate(int fd, unsigned int pixelformat, unsigned int width,
+						unsigned int height, unsigned int fps)
+{
+	const struct cam_caps *caps = cam_caps_get(fd);
+	const struct cam_frame_size *size;
+
+	if (caps == NULL)
+		return 0;
+	size = cam_caps_find_size(caps, pixelformat, width, height);
+	if (size == NULL || size->nintervals == 0)
+		return 0;
+
+	if (size->continuous)
+	{
+		if (fps >= fract_fps(&size->intervals[1]) &&
+			fps <= fract_fps(&size->intervals[0]))
+			return 0;
+	}
+	else
+	{
+		/* the driver takes the nearest interval to 1/fps, 1001/30000 for 30 */
+		for (unsigned int i = 0; i < size->nintervals; i++)
+			if (fabs(fract_fps(&size->intervals[i]) - fps) < 0.5)
+				return 0;
+	}
+	printf("%u fps is not supported at %ux%u, pick one of:", fps,
+		   width, height);
+	print_rates(size);
+	printf("\n");
+	return -EINVAL;
+}
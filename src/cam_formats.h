@@ -0,0 +1,72 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, lists the formats,
+  frame sizes and frame rates a camera supports with VIDIOC_ENUM_FMT,
+  VIDIOC_ENUM_FRAMESIZES and VIDIOC_ENUM_FRAMEINTERVALS, the same table
+  v4l2-ctl --list-formats-ext prints. It is read once per device and kept.
+
+  Any thread may get and use the table of a camera. cam_caps_forget frees
+  it, so only the owner of the fd calls it, when it closes the camera and
+  nothing uses the table any more.
+*****************************************************************************/
+#pragma once
+#include <sys/types.h>
+#include <linux/videodev2.h>
+
+/****************************************************************************
+**                      	Global data
+*****************************************************************************/
+#define CAM_FORMATS_MAX 8
+#define CAM_SIZES_MAX 64
+#define CAM_INTERVALS_MAX 16
+#define CAM_CACHE_MAX 8			/* devices whose table is kept */
+
+struct cam_frame_size
+{
+	unsigned int width;
+	unsigned int height;
+	/* stepwise sizes go up to max in steps, discrete ones have step 0 */
+	unsigned int max_width, max_height;
+	unsigned int step_width, step_height;
+
+	/* time per frame, a continuous range has the shortest and longest */
+	unsigned int nintervals;
+	int continuous;
+	struct v4l2_fract intervals[CAM_INTERVALS_MAX];
+};
+
+struct cam_format
+{
+	unsigned int pixelformat;
+	char description[32];
+	unsigned int nsizes;
+	struct cam_frame_size sizes[CAM_SIZES_MAX];
+};
+
+struct cam_caps
+{
+	int fd;
+	dev_t rdev;				/* tells a reused fd apart */
+	ino_t ino;
+	unsigned int nformats;
+	struct cam_format formats[CAM_FORMATS_MAX];
+};
+
+/****************************************************************************
+**							 Function declaration
+*****************************************************************************/
+const struct cam_caps *cam_caps_get(int fd);
+void cam_caps_forget(int fd);
+void cam_caps_print(const struct cam_caps *caps);
+
+const struct cam_frame_size *cam_caps_find_size(const struct cam_caps *caps,
+												unsigned int pixelformat,
+												unsigned int width,
+												unsigned int height);
+int cam_caps_check_format(int fd, unsigned int pixelformat,
+						  unsigned int width, unsigned int height);
+int cam_caps_check_rate(int fd, unsigned int pixelformat, unsigned int width,
+						unsigned int height, unsigned int fps);
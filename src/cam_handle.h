@@ -0,0 +1,35 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, the C handle of a
+  camera context. The context stays opaque here and this header includes
+  nothing, C callers go through the cam_ctx_* functions. C++ callers can
+  use the CamContext owner in cam_context.h instead.
+*****************************************************************************/
+#pragma once
+
+/****************************************************************************
+**                      	Global data
+*****************************************************************************/
+struct cam_ctx;
+
+/****************************************************************************
+**							 Function declaration
+*****************************************************************************/
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct cam_ctx *cam_ctx_create(void);
+void cam_ctx_destroy(struct cam_ctx *ctx);
+
+int cam_ctx_open(struct cam_ctx *ctx, const char *device_name);
+void cam_ctx_close(struct cam_ctx *ctx);
+
+int cam_ctx_show(struct cam_ctx *ctx);
+
+#ifdef __cplusplus
+}
+#endif
@@ -14,6 +14,7 @@
 *****************************************************************************/
 #include "../includes/shortcuts.h"
 #include "cam_property.h"
+#include "cam_formats.h"
 /*
  * handle the error for camera control
  * args:
@@ -88,11 +89,29 @@ void uvc_set_control(int fd, unsigned int id, int value)
            ctrl.value);
 }
 /*--------------------------------------------------------------------------- */
+/*
+ * set the frame rate, checked against the rates the camera lists for the
+ * current format first
+ * args:
+ * 		int fd - file descriptor
+ * 		fps    - frames per second
+ */
 void set_frame_rate(int fd, int fps)
 {
     struct v4l2_streamparm param;
+    struct v4l2_format fmt;
+
+    CLEAR(fmt);
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (fps <= 0)
+        return;
+    if (ioctl(fd, VIDIOC_G_FMT, &fmt) == 0 &&
+        cam_caps_check_rate(fd, fmt.fmt.pix.pixelformat, fmt.fmt.pix.width,
+                            fmt.fmt.pix.height, fps) < 0)
+        return;
+
     CLEAR(param);
-    param.type = (v4l2_buf_type) V4L2_CAP_VIDEO_CAPTURE;
+    param.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     param.parm.capture.timeperframe.numerator = 1;
     param.parm.capture.timeperframe.denominator = fps;
     if(ioctl(fd, VIDIOC_S_PARM, &param) < 0)
@@ -104,13 +123,12 @@ int get_frame_rate(int fd)
 {
     struct v4l2_streamparm param;
     CLEAR(param);
-    param.type =  (v4l2_buf_type) V4L2_CAP_VIDEO_CAPTURE;
+    param.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     if(ioctl(fd, VIDIOC_G_PARM, &param) < 0)
         error_handle_cam_ctrl();
     printf("Get frame rate = %d\n", param.parm.capture.timeperframe.denominator);
     //printf("Get frame rate num= %d\n", param.parm.capture.timeperframe.numerator);
-    //return param.parm.capture.timeperframe.denominator;
-    return 0;
+    return param.parm.capture.timeperframe.denominator;
 }
 
 
@@ -213,4 +231,47 @@ void usage( const char *argv0)
 	printf("-n, --nbufs n			Set the number of video buffers\n");
 	printf("-s, --size WxH			Set the frame size\n");
 	printf("-t, --time-per-frame	Set the time per frame (eg. 25 = 25 fps)\n");
+	printf("-i, --in-place			Requeue buffers after display instead of after unpack\n");
+	printf("-a, --abc-stats S[:P[:W]]	Auto brightness&contrast samples every S-th pixel,\n");
+	printf("				every P frames, smoothing weight W (default 4:4:0.25)\n");
+	printf("-f, --fsync 0|1			Fsync every raw/bmp capture (default 1)\n");
+	printf("-r, --record			Record every raw frame into record_N.lraw\n");
+	printf("-b, --record-backend B	Recording backend: buffered (default) or uring\n");
+	printf("-B, --record-bench N	Write N frames through the recording backend and\n");
+	printf("				report MB/s and write latency, no streaming\n");
+	printf("-p, --pre-trigger S		Keep the last S seconds of raw frames in memory,\n");
+	printf("				capture raw/trigger saves them to burst_N.lraw\n");
+	printf("-R, --replay PATH		Replay a raw container or a directory of captures_N.raw\n");
+	printf("				(give -s WxH for those) instead of the camera\n");
+	printf("-F, --replay-fps F		Replay at F fps, default as fast as possible\n");
+	printf("-L, --replay-loops N	Replay all frames N times, 0 forever (default 1)\n");
+	printf("-H, --headless			No display and no control gui\n");
+	printf("-m, --multi all|DEVS	Stream every Leopard camera, or the comma separated\n");
+	printf("				/dev/video# list, one capture loop for all, no display\n");
+	printf("-c, --cpus LIST		Pin the decode thread of camera i to the i-th cpu\n");
+	printf("-D, --duration S		Stop the multi camera run after S seconds\n");
+	printf("-C, --control PATH	Take stats, stages, trace, exposure N, gain N and stop\n");
+	printf("				commands on a unix socket during the multi camera run\n");
+	printf("-S, --share PATH		Export the capture buffers as dmabufs and hand every\n");
+	printf("				frame to consumers on unix socket PATH, no copies\n");
+	printf("-u, --userptr			Capture into user pointer buffers from a 2MB huge\n");
+	printf("				page arena instead of driver mapped buffers\n");
+	printf("-M, --mlock			Lock the user pointer arena in memory\n");
+	printf("-P, --capture-bench N	Capture N frames into mmap, then userptr buffers\n");
+	printf("				and report fps, unpack and buffer hold time\n");
+	printf("-V, --control-bench N	Time N round trips of exposure, frame rate, extension\n");
+	printf("				unit and sensor register controls, no streaming\n");
+	printf("-Q, --queue-policy P	When decode falls behind: block (default) leaves\n");
+	printf("				the driver short of buffers, drop-oldest or\n");
+	printf("				drop-newest drop frames from the ready queue, with\n");
+	printf("				3 buffers or more\n");
+	printf("-T, --realtime PRIO	Run capture SCHED_FIFO at PRIO with memory locked,\n");
+	printf("				report its scheduling latency, 0 only reports\n");
+	printf("-K, --capture-cpu N	Pin the capture thread to cpu N, an isolated one\n");
+	printf("-A, --tune-buffers S[:P]	Watch the first S seconds of streaming and print the\n");
+	printf("				fewest buffers that cover P%% of processing (default 99)\n");
+	printf("-Y, --tune-apply		Restart the camera with that many buffers (default -A 5)\n");
+	printf("-G, --stage-times S	Print p50/p99/max of every pipeline stage every S seconds\n");
+	printf("-X, --trace PATH		Keep the last frames' pipeline events, kill -USR1 and exit\n");
+	printf("				write them to PATH as a Chrome trace for Perfetto\n");
 }
\ No newline at end of file
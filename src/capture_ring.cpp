@@ -0,0 +1,627 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, capture ring that keeps
+  every requested v4l2 buffer in flight. The non-blocking camera fd sits in
+  an event loop, the ring's own loop on a capture thread or one loop shared
+  by several cameras. As soon as the fd is ready whichever buffer index the
+  driver hands back goes on a ready queue, processing picks it up from there
+  and gives it back to the driver as soon as it is done with it.
+*****************************************************************************/
+#include <sched.h>
+#include <sys/epoll.h>
+#include <time.h>
+
+#include "../includes/shortcuts.h"
+#include "capture_ring.h"
+#include "extend_cam_ctrl.h"
+#include "frame_trace.h"
+
+/* one shot, the fd stays quiet while the driver has no buffer to fill */
+#define CAPTURE_EVENTS (EPOLLIN | EPOLLPRI | EPOLLONESHOT)
+
+/*****************************************************************************
+**                           Function definition
+*****************************************************************************/
+
+/* control changes the device reports, exposure and gain from other apps */
+static const unsigned int ctrl_event_ids[] = {
+	V4L2_CID_EXPOSURE_ABSOLUTE,
+	V4L2_CID_EXPOSURE_AUTO,
+	V4L2_CID_GAIN,
+};
+
+/*
+ * ask for control change events, cameras without them stream all the same
+ * args:
+ * 		fd 	   - camera
+ * 		enable - 0 to unsubscribe
+ */
+static void subscribe_ctrl_events(int fd, int enable)
+{
+	struct v4l2_event_subscription sub;
+
+	for (unsigned int i = 0; i < SIZE(ctrl_event_ids); i++)
+	{
+		CLEAR(sub);
+		sub.type = V4L2_EVENT_CTRL;
+		sub.id = ctrl_event_ids[i];
+		if (ioctl(fd, enable ? VIDIOC_SUBSCRIBE_EVENT : VIDIOC_UNSUBSCRIBE_EVENT,
+				  &sub) < 0)
+			break;
+	}
+}
+
+/* take the pending v4l2 events off the device */
+static void read_ctrl_events(struct capture_ring *ring)
+{
+	struct v4l2_event ev;
+
+	CLEAR(ev);
+	while (ioctl(ring->dev->fd, VIDIOC_DQEVENT, &ev) == 0)
+	{
+		if (ev.type == V4L2_EVENT_CTRL &&
+			(ev.u.ctrl.changes & V4L2_EVENT_CTRL_CH_VALUE))
+			printf("CAPTURE: control %#x of fd %d is now %d\n", ev.id,
+				   ring->dev->fd, ev.u.ctrl.value);
+		ring->ctrl_events++;
+		CLEAR(ev);
+	}
+}
+
+/*
+ * account for a dequeued buffer and describe it for the ready queue
+ * args:
+ * 		ring - capture ring, mutex held
+ * 		buf  - from VIDIOC_DQBUF
+ * 		desc - gets the frame
+ */
+static void take_dequeued(struct capture_ring *ring, struct v4l2_buffer *buf,
+						  struct frame_desc *desc)
+{
+	unsigned int gap = 0;
+
+	/* the driver counts frames it had no buffer for too */
+	if (ring->frames > 0 && buf->sequence > ring->last_sequence + 1)
+		gap = buf->sequence - ring->last_sequence - 1;
+	ring->dropped += gap;
+	ring->last_sequence = buf->sequence;
+	ring->bufs[buf->index] = *buf;
+	ring->dq_time[buf->index] = monotonic_us();
+	ring->in_flight++;
+	if (ring->in_flight > ring->max_in_flight)
+		ring->max_in_flight = ring->in_flight;
+	if (ring->stats != NULL)
+		stream_stats_dequeued(ring->stats, buf, ring->dev->imagesize,
+							  ring->dq_time[buf->index]);
+	if (ring->tune != NULL)
+		buffer_tune_dequeued(ring->tune, ring->dq_time[buf->index],
+							 ring->in_flight, ring->dev->nbufs, gap);
+	ring->frames++;
+
+	desc->index = buf->index;
+	desc->sequence = buf->sequence;
+	desc->bytesused = buf->bytesused;
+	desc->timestamp_us = (uint64_t)buf->timestamp.tv_sec * 1000000 +
+						 buf->timestamp.tv_usec;
+	desc->dq_time = ring->dq_time[buf->index];
+}
+
+/* the ready queue dropped a frame, its buffer goes back to the driver */
+static void drop_ready(void *data, struct frame_desc *desc)
+{
+	capture_ring_put((struct capture_ring *)data, desc->index);
+}
+
+/*
+ * the camera fd is ready, dequeue every buffer the driver filled and put
+ * it on the ready list, called in the loop thread
+ * args:
+ * 		data   - struct capture_ring *ring
+ * 		fd 	   - camera
+ * 		events - from epoll
+ */
+static void capture_ready(void *data, int fd, unsigned int events)
+{
+	struct capture_ring *ring = (struct capture_ring *)data;
+	struct device *dev = ring->dev;
+	struct v4l2_buffer buf;
+	struct frame_desc desc;
+
+	if (events & EPOLLPRI)
+		read_ctrl_events(ring);
+
+	while (1)
+	{
+		__LOCK_MUTEX(&ring->mutex);
+		/* the driver has no buffer to fill, capture_ring_release rearms */
+		if (!ring->running || ring->in_flight >= dev->nbufs)
+		{
+			ring->armed = 0;
+			__UNLOCK_MUTEX(&ring->mutex);
+			return;
+		}
+		__UNLOCK_MUTEX(&ring->mutex);
+
+		CLEAR(buf);
+		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buf.memory = dev->memtype;
+		uint64_t dq_start = frame_trace_enabled() ? trace_clock_ns() : 0;
+		if (ioctl(fd, VIDIOC_DQBUF, &buf) < 0)
+		{
+			if (errno == EAGAIN || errno == EINTR)
+				break;
+			perror("VIDIOC_DQBUF");
+			/* wake up processing in case it is waiting for a frame */
+			__LOCK_MUTEX(&ring->mutex);
+			ring->armed = 0;
+			ring->running = 0;
+			__UNLOCK_MUTEX(&ring->mutex);
+			frame_queue_close(&ring->ready);
+			return;
+		}
+		/* the empty one that ends the batch isn't worth an event */
+		if (dq_start != 0)
+			frame_trace_add("DQBUF", dq_start, trace_clock_ns(), buf.sequence);
+
+		/* processing holds the first reference, so an observer that
+		   puts its own right away can't requeue the buffer */
+		__LOCK_MUTEX(&ring->mutex);
+		ring->refs[buf.index] = 1;
+		capture_observer observer = ring->observer;
+		void *observer_data = ring->observer_data;
+		__UNLOCK_MUTEX(&ring->mutex);
+		if (observer != NULL)
+			observer(observer_data, &buf);
+
+		__LOCK_MUTEX(&ring->mutex);
+		take_dequeued(ring, &buf, &desc);
+		__UNLOCK_MUTEX(&ring->mutex);
+		/* never waits, see capture_ring_start, a drop requeues right away */
+		if (frame_queue_push(&ring->ready, &desc) < 0)
+			capture_ring_put(ring, desc.index);
+	}
+
+	/* nothing more filled, wait for the next one */
+	__LOCK_MUTEX(&ring->mutex);
+	ring->armed = ring->running;
+	if (ring->armed)
+		event_loop_rearm(ring->loop, fd, CAPTURE_EVENTS);
+	__UNLOCK_MUTEX(&ring->mutex);
+}
+
+/*
+ * prepare the ring for a device whose buffers are allocated and queued
+ * args:
+ * 		ring - capture ring to set up
+ * 		dev  - device with buffers from video_alloc_buffers
+ * returns:
+ * 		error value
+ */
+int capture_ring_init(struct capture_ring *ring, struct device *dev)
+{
+	CLEAR(*ring);
+	if (dev->nbufs == 0)
+		return -EINVAL;
+
+	ring->dev = dev;
+	ring->cpu = -1;
+	ring->realtime = -1;
+	ring->policy = FRAME_QUEUE_BLOCK;
+	ring->bufs = (struct v4l2_buffer *)calloc(dev->nbufs, sizeof ring->bufs[0]);
+	ring->dq_time = (double *)calloc(dev->nbufs, sizeof ring->dq_time[0]);
+	ring->refs = (unsigned int *)calloc(dev->nbufs, sizeof ring->refs[0]);
+	if (ring->bufs == NULL || ring->dq_time == NULL || ring->refs == NULL)
+	{
+		capture_ring_free(ring);
+		return -ENOMEM;
+	}
+
+	__INIT_MUTEX(&ring->mutex);
+	return 0;
+}
+
+/*
+ * release the memory that belongs to the ring, stop it first
+ * args:
+ * 		ring - capture ring
+ */
+void capture_ring_free(struct capture_ring *ring)
+{
+	free(ring->bufs);
+	free(ring->dq_time);
+	free(ring->refs);
+	frame_queue_free(&ring->ready);
+	ring->bufs = NULL;
+	ring->dq_time = NULL;
+	ring->refs = NULL;
+}
+
+/*
+ * pin the capture thread to a cpu, call before capture_ring_start
+ * args:
+ * 		ring - capture ring
+ * 		cpu  - cpu number, -1 lets the scheduler pick
+ */
+void capture_ring_set_cpu(struct capture_ring *ring, int cpu)
+{
+	ring->cpu = cpu;
+}
+
+/*
+ * run the capture thread SCHED_FIFO with its stack and the frame buffers
+ * faulted in and probe its scheduling latency, call before
+ * capture_ring_start, the memory is locked by realtime_lock_memory
+ * args:
+ * 		ring 	 - capture ring
+ * 		priority - 1 to 99, 0 only probes the latency at normal priority,
+ * 				   -1 neither
+ */
+void capture_ring_set_realtime(struct capture_ring *ring, int priority)
+{
+	ring->realtime = priority;
+}
+
+/*
+ * account for every dequeued buffer's sequence, payload and timestamp,
+ * call before capture_ring_start
+ * args:
+ * 		ring  - capture ring
+ * 		stats - stream stats, they go on over several starts
+ */
+void capture_ring_set_stats(struct capture_ring *ring,
+							struct stream_stats *stats)
+{
+	ring->stats = stats;
+}
+
+/*
+ * report dequeues and hold times to a buffer tuning, from any thread
+ * args:
+ * 		ring - capture ring
+ * 		tune - buffer tuning, NULL to stop reporting
+ */
+void capture_ring_set_tune(struct capture_ring *ring, struct buffer_tune *tune)
+{
+	__LOCK_MUTEX(&ring->mutex);
+	ring->tune = tune;
+	__UNLOCK_MUTEX(&ring->mutex);
+}
+
+/*
+ * what to do when processing doesn't keep up, call before
+ * capture_ring_start
+ * args:
+ * 		ring   - capture ring
+ * 		policy - FRAME_QUEUE_BLOCK leaves every buffer to processing until
+ * 				 the driver has none, the drop policies keep one with the
+ * 				 driver while processing works on another
+ */
+void capture_ring_set_policy(struct capture_ring *ring,
+							 enum frame_queue_policy policy)
+{
+	ring->policy = policy;
+}
+
+/*
+ * let a loop that serves other cameras too watch this one, instead of a
+ * capture thread of its own, call before capture_ring_start
+ * args:
+ * 		ring - capture ring
+ * 		loop - event loop, its thread does the dequeueing
+ */
+void capture_ring_attach(struct capture_ring *ring, struct event_loop *loop)
+{
+	ring->loop = loop;
+}
+
+/*
+ * put the camera fd in the event loop, on a capture thread of the ring's
+ * own unless it is attached to a shared loop
+ * args:
+ * 		ring - capture ring
+ * returns:
+ * 		error value
+ */
+int capture_ring_start(struct capture_ring *ring)
+{
+	int fd = ring->dev->fd;
+	unsigned int size = ring->dev->nbufs;
+	int ret;
+
+	/*
+	 * a blocking queue holds every buffer, so the loop never waits on it,
+	 * a dropping one leaves a buffer to processing and one to the driver
+	 */
+	if (ring->policy != FRAME_QUEUE_BLOCK)
+	{
+		/* with two the queue and processing would hold both */
+		if (size < 3)
+		{
+			printf("%s needs 3 buffers or more, there are %u\n",
+				   frame_queue_policy_name(ring->policy), size);
+			return -EINVAL;
+		}
+		size -= 2;
+	}
+	/* from an earlier start, if any */
+	frame_queue_free(&ring->ready);
+	ret = frame_queue_init(&ring->ready, size, ring->policy, drop_ready, ring);
+	if (ret < 0)
+		return ret;
+
+	/* dequeue until EAGAIN, never block the loop */
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	subscribe_ctrl_events(fd, 1);
+
+	if (ring->loop == NULL)
+	{
+		if (event_loop_init(&ring->own_loop) < 0)
+			return -1;
+		ring->loop = &ring->own_loop;
+		if (ring->realtime > 0)
+			event_loop_set_priority(&ring->own_loop, ring->realtime);
+	}
+	/* the first frames shouldn't fault in their buffers */
+	if (ring->realtime > 0)
+		for (unsigned int i = 0; i < ring->dev->nbufs; i++)
+			realtime_prefault(ring->dev->buffers[i].start,
+							  ring->dev->buffers[i].length);
+	if (ring->stats != NULL)
+		stream_stats_restart(ring->stats);
+	ring->running = 1;
+	ring->armed = 1;
+	ret = event_loop_add(ring->loop, fd, CAPTURE_EVENTS, capture_ready, ring);
+	if (ret == 0 && ring->realtime >= 0)
+		ret = latency_probe_start(&ring->probe, ring->loop);
+	if (ret == 0 && ring->loop == &ring->own_loop)
+	{
+		ret = event_loop_start(&ring->own_loop, ring->cpu);
+		/* so a trace tells it from processing */
+		if (ret == 0)
+			pthread_setname_np(ring->own_loop.thread, "capture");
+	}
+	if (ret < 0)
+	{
+		latency_probe_stop(&ring->probe);
+		ring->running = 0;
+		ring->armed = 0;
+		if (ring->loop == &ring->own_loop)
+		{
+			event_loop_free(&ring->own_loop);
+			ring->loop = NULL;
+		}
+		return ret;
+	}
+	return 0;
+}
+
+/*
+ * tell capture to finish, a blocked capture_ring_acquire returns NULL
+ * right away, safe from any thread
+ * args:
+ * 		ring - capture ring
+ */
+void capture_ring_cancel(struct capture_ring *ring)
+{
+	__LOCK_MUTEX(&ring->mutex);
+	ring->running = 0;
+	__UNLOCK_MUTEX(&ring->mutex);
+	frame_queue_close(&ring->ready);
+}
+
+/*
+ * stop capture, buffers still held by processing stay dequeued, a shared
+ * loop has to be stopped first or this be called from its thread
+ * args:
+ * 		ring - capture ring
+ */
+void capture_ring_stop(struct capture_ring *ring)
+{
+	capture_ring_cancel(ring);
+	if (ring->loop == NULL)
+		return;
+
+	if (ring->loop == &ring->own_loop)
+		event_loop_stop(&ring->own_loop);
+	latency_probe_stop(&ring->probe);
+	event_loop_remove(ring->loop, ring->dev->fd);
+	if (ring->loop == &ring->own_loop)
+	{
+		event_loop_free(&ring->own_loop);
+		ring->loop = NULL;
+	}
+	subscribe_ctrl_events(ring->dev->fd, 0);
+}
+
+/*
+ * wait for the next dequeued buffer, oldest one first
+ * args:
+ * 		ring - capture ring
+ * returns:
+ * 		v4l2 buffer info, its data is at dev->buffers[buf->index].start
+ * 		NULL once the capture thread stopped
+ */
+struct v4l2_buffer *capture_ring_acquire(struct capture_ring *ring)
+{
+	struct frame_desc desc;
+
+	if (frame_queue_pop(&ring->ready, &desc, 1) < 0)
+		return NULL;
+	return &ring->bufs[desc.index];
+}
+
+/*
+ * processing is done with a buffer, it goes back to the driver unless
+ * another consumer still holds it
+ * args:
+ * 		ring - capture ring
+ * 		buf  - buffer returned by capture_ring_acquire
+ * returns:
+ * 		error value
+ */
+int capture_ring_release(struct capture_ring *ring, struct v4l2_buffer *buf)
+{
+	return capture_ring_put(ring, buf->index);
+}
+
+/*
+ * get called for every buffer the ring dequeues, safe from any thread
+ * args:
+ * 		ring 	 - capture ring
+ * 		observer - NULL to stop, a call already under way still
+ * 				   finishes in the loop thread
+ * 		data 	 - for the observer
+ */
+void capture_ring_observe(struct capture_ring *ring, capture_observer observer,
+						  void *data)
+{
+	__LOCK_MUTEX(&ring->mutex);
+	ring->observer = observer;
+	ring->observer_data = data;
+	__UNLOCK_MUTEX(&ring->mutex);
+}
+
+/*
+ * keep a dequeued buffer from the driver for one more consumer, from the
+ * observer or while already holding a reference
+ * args:
+ * 		ring  - capture ring
+ * 		index - buffer index
+ */
+void capture_ring_hold(struct capture_ring *ring, unsigned int index)
+{
+	__LOCK_MUTEX(&ring->mutex);
+	ring->refs[index]++;
+	__UNLOCK_MUTEX(&ring->mutex);
+}
+
+/*
+ * drop one reference to a buffer, the last one gives it back to the driver
+ * args:
+ * 		ring  - capture ring
+ * 		index - buffer index
+ * returns:
+ * 		error value
+ */
+int capture_ring_put(struct capture_ring *ring, unsigned int index)
+{
+	int ret = 0;
+
+	__LOCK_MUTEX(&ring->mutex);
+	if (index >= ring->dev->nbufs || ring->refs[index] == 0)
+	{
+		__UNLOCK_MUTEX(&ring->mutex);
+		return -EINVAL;
+	}
+	if (--ring->refs[index] > 0)
+	{
+		__UNLOCK_MUTEX(&ring->mutex);
+		return 0;
+	}
+	/* account for the buffer while it is still ours, once it is queued
+	   the loop thread can dequeue it again and overwrite its slot */
+	double hold = monotonic_us() - ring->dq_time[index];
+	ring->hold_count++;
+	ring->hold_total += hold;
+	ring->hold_last = hold;
+	if (hold > ring->hold_max)
+		ring->hold_max = hold;
+	if (ring->tune != NULL)
+		buffer_tune_held(ring->tune, hold);
+	ring->in_flight--;
+	struct v4l2_buffer buf = ring->bufs[index];
+	__UNLOCK_MUTEX(&ring->mutex);
+
+	{
+		TRACE_SCOPE("QBUF", buf.sequence);
+		ret = ioctl(ring->dev->fd, VIDIOC_QBUF, &buf);
+	}
+	if (ret < 0)
+		perror("VIDIOC_QBUF");
+
+	__LOCK_MUTEX(&ring->mutex);
+	/* the driver has a buffer to fill again */
+	if (!ring->armed && ring->running && ring->loop != NULL)
+	{
+		ring->armed = 1;
+		event_loop_rearm(ring->loop, ring->dev->fd, CAPTURE_EVENTS);
+	}
+	__UNLOCK_MUTEX(&ring->mutex);
+	return ret;
+}
+
+/*
+ * how full the ring is
+ * returns:
+ * 		number of buffers dequeued from the driver and not yet requeued,
+ * 		dev->nbufs means the driver has nothing left to fill
+ */
+unsigned int capture_ring_fill(struct capture_ring *ring)
+{
+	unsigned int fill;
+
+	__LOCK_MUTEX(&ring->mutex);
+	fill = ring->in_flight;
+	__UNLOCK_MUTEX(&ring->mutex);
+	return fill;
+}
+
+/*
+ * returns:
+ * 		number of dequeued buffers processing hasn't picked up yet
+ */
+unsigned int capture_ring_ready(struct capture_ring *ring)
+{
+	return frame_queue_depth(&ring->ready);
+}
+
+/* print how deep the ready queue got and what its policy dropped */
+void capture_ring_print_queue(struct capture_ring *ring)
+{
+	unsigned int high_water;
+	unsigned long pushed, dropped;
+
+	frame_queue_stats(&ring->ready, &high_water, &pushed, &dropped);
+	printf("ready queue(%s): high water %u of %u, %lu frames, %lu dropped\n",
+		   frame_queue_policy_name(ring->policy), high_water, ring->ready.size,
+		   pushed, dropped);
+}
+
+/* print the capture thread's scheduling latency, if it was probed */
+void capture_ring_print_latency(struct capture_ring *ring)
+{
+	latency_probe_print(&ring->probe, "capture thread latency");
+}
+
+/*
+ * args:
+ * 		ring  - capture ring
+ * 		index - of a buffer processing has
+ * returns:
+ * 		when it was dequeued, monotonic us
+ */
+double capture_ring_dequeue_time(struct capture_ring *ring, unsigned int index)
+{
+	return index < ring->dev->nbufs ? ring->dq_time[index] : 0;
+}
+
+/*
+ * time between dequeueing a buffer and giving it back to the driver
+ * args:
+ * 		ring 	- capture ring
+ * 		avg_us 	- average hold time since streaming started
+ * 		max_us 	- longest hold time
+ * 		last_us - hold time of the last released buffer
+ */
+void capture_ring_hold_time(struct capture_ring *ring, double *avg_us,
+							double *max_us, double *last_us)
+{
+	__LOCK_MUTEX(&ring->mutex);
+	*avg_us = ring->hold_count ? ring->hold_total / ring->hold_count : 0;
+	*max_us = ring->hold_max;
+	*last_us = ring->hold_last;
+	__UNLOCK_MUTEX(&ring->mutex);
+}
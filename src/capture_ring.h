@@ -0,0 +1,110 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, capture ring that keeps
+  every requested v4l2 buffer in flight. The non-blocking camera fd sits in
+  an event loop, the ring's own loop on a capture thread or one loop shared
+  by several cameras. As soon as the fd is ready whichever buffer index the
+  driver hands back goes on a ready queue, processing picks it up from there
+  and gives it back to the driver as soon as it is done with it. When
+  processing falls behind, the queue policy decides whether the driver
+  runs out of buffers (block) or the queue drops frames to keep one with
+  the driver (drop-oldest, drop-newest).
+
+  Other consumers of a frame, e.g. a frame share client that maps the
+  buffer's dmabuf, take a reference of their own from the observer. A
+  buffer goes back to the driver once the last reference is put.
+*****************************************************************************/
+#pragma once
+#include <pthread.h>
+#include "buffer_tune.h"
+#include "event_loop.h"
+#include "frame_queue.h"
+#include "realtime.h"
+#include "stream_stats.h"
+
+/****************************************************************************
+**                      	Global data
+*****************************************************************************/
+/*
+ * called in the loop thread for every dequeued buffer, before processing
+ * can see it, capture_ring_hold keeps the buffer for another consumer
+ * args:
+ * 		data - as given to capture_ring_observe
+ * 		buf  - from VIDIOC_DQBUF
+ */
+typedef void (*capture_observer)(void *data, struct v4l2_buffer *buf);
+
+struct capture_ring
+{
+	struct device *dev;
+	struct v4l2_buffer *bufs;  /* dequeue info, one per buffer index */
+	double *dq_time;		   /* when each buffer was dequeued, in us */
+	unsigned int *refs;		   /* consumers of each dequeued buffer */
+	struct frame_queue ready;  /* dequeued but not yet processed */
+	enum frame_queue_policy policy;
+	unsigned int in_flight;	   /* buffers owned by userspace */
+	unsigned int max_in_flight;
+	unsigned long frames;
+	unsigned long dropped;	   /* sequence numbers the driver skipped */
+	unsigned int last_sequence;
+	int running;
+	int cpu;				   /* capture thread runs here, -1 anywhere */
+	int realtime;			   /* its SCHED_FIFO priority, 0 normal, -1 no probe */
+	struct latency_probe probe; /* how late the capture thread gets to run */
+	int armed;				   /* fd is in the loop waiting for a frame */
+	unsigned long ctrl_events; /* control changes the driver reported */
+
+	/* how long userspace kept buffers away from the driver, in us */
+	unsigned long hold_count;
+	double hold_total;
+	double hold_max;
+	double hold_last;
+	struct buffer_tune *tune;  /* gets the same, and the dequeues, if set */
+	struct stream_stats *stats; /* gets every dequeued buffer, if set */
+
+	capture_observer observer;
+	void *observer_data;
+
+	/* loop that watches the fd, own_loop unless capture_ring_attach */
+	struct event_loop *loop;
+	struct event_loop own_loop;
+
+	__MUTEX_TYPE mutex;
+};
+
+/****************************************************************************
+**							 Function declaration
+*****************************************************************************/
+int capture_ring_init(struct capture_ring *ring, struct device *dev);
+void capture_ring_free(struct capture_ring *ring);
+
+void capture_ring_set_cpu(struct capture_ring *ring, int cpu);
+void capture_ring_set_realtime(struct capture_ring *ring, int priority);
+void capture_ring_set_stats(struct capture_ring *ring,
+							struct stream_stats *stats);
+void capture_ring_set_tune(struct capture_ring *ring, struct buffer_tune *tune);
+void capture_ring_set_policy(struct capture_ring *ring,
+							 enum frame_queue_policy policy);
+void capture_ring_attach(struct capture_ring *ring, struct event_loop *loop);
+int capture_ring_start(struct capture_ring *ring);
+void capture_ring_cancel(struct capture_ring *ring);
+void capture_ring_stop(struct capture_ring *ring);
+
+struct v4l2_buffer *capture_ring_acquire(struct capture_ring *ring);
+int capture_ring_release(struct capture_ring *ring, struct v4l2_buffer *buf);
+
+void capture_ring_observe(struct capture_ring *ring, capture_observer observer,
+						  void *data);
+void capture_ring_hold(struct capture_ring *ring, unsigned int index);
+int capture_ring_put(struct capture_ring *ring, unsigned int index);
+
+unsigned int capture_ring_fill(struct capture_ring *ring);
+unsigned int capture_ring_ready(struct capture_ring *ring);
+void capture_ring_print_queue(struct capture_ring *ring);
+void capture_ring_print_latency(struct capture_ring *ring);
+double capture_ring_dequeue_time(struct capture_ring *ring, unsigned int index);
+void capture_ring_hold_time(struct capture_ring *ring, double *avg_us,
+							double *max_us, double *last_us);
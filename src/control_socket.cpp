@@ -0,0 +1,194 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, unix socket that takes
+  one text command per line. The socket and its clients are served by an
+  event loop, each complete line goes to the handler in the loop thread,
+  which writes its reply to the client.
+*****************************************************************************/
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "../includes/shortcuts.h"
+#include "control_socket.h"
+
+/*****************************************************************************
+**                           Function definition
+*****************************************************************************/
+
+/* stop watching a client and free its slot */
+static void drop_client(struct control_client *client)
+{
+	event_loop_remove(client->sock->loop, client->fd);
+	close(client->fd);
+	client->fd = -1;
+	client->len = 0;
+}
+
+/*
+ * read what a client sent and hand every complete line to the handler
+ * args:
+ * 		data   - struct control_client *client
+ * 		fd 	   - client socket
+ * 		events - from epoll
+ */
+static void client_ready(void *data, int fd, unsigned int events)
+{
+	struct control_client *client = (struct control_client *)data;
+	struct control_socket *sock = client->sock;
+	ssize_t n;
+
+	(void)events;
+	while (1)
+	{
+		n = read(fd, client->line + client->len,
+				 sizeof(client->line) - 1 - client->len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			return;
+		if (n <= 0)
+		{
+			drop_client(client);
+			return;
+		}
+		client->len += n;
+
+		char *start = client->line;
+		char *end;
+		while ((end = (char *)memchr(start, '\n',
+									 client->len - (start - client->line))) != NULL)
+		{
+			*end = 0;
+			if (end > start && end[-1] == '\r')
+				end[-1] = 0;
+			if (*start)
+				sock->handler(sock->data, start, fd);
+			start = end + 1;
+		}
+		client->len -= start - client->line;
+		memmove(client->line, start, client->len);
+
+		if (client->len == sizeof(client->line) - 1)
+		{
+			dprintf(fd, "error: line too long\n");
+			client->len = 0;
+		}
+	}
+}
+
+/*
+ * take a new client, one that doesn't fit is closed right away
+ * args:
+ * 		data   - struct control_socket *sock
+ * 		fd 	   - listening socket
+ * 		events - from epoll
+ */
+static void accept_ready(void *data, int fd, unsigned int events)
+{
+	struct control_socket *sock = (struct control_socket *)data;
+	int client_fd;
+
+	(void)events;
+	while ((client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+	{
+		struct control_client *client = NULL;
+
+		for (int i = 0; i < CONTROL_CLIENTS_MAX && client == NULL; i++)
+			if (sock->clients[i].fd < 0)
+				client = &sock->clients[i];
+		if (client == NULL)
+		{
+			dprintf(client_fd, "error: more than %d clients\n",
+					CONTROL_CLIENTS_MAX);
+			close(client_fd);
+			continue;
+		}
+		client->fd = client_fd;
+		client->len = 0;
+		if (event_loop_add(sock->loop, client_fd, EPOLLIN | EPOLLRDHUP,
+						   client_ready, client) < 0)
+		{
+			close(client_fd);
+			client->fd = -1;
+		}
+	}
+}
+
+/*
+ * listen on a unix socket, a stale socket file at path is replaced
+ * args:
+ * 		sock 	- control socket
+ * 		loop 	- event loop that serves it
+ * 		path 	- socket file
+ * 		handler - called for every command line
+ * 		data 	- for the handler
+ * returns:
+ * 		error value
+ */
+int control_socket_open(struct control_socket *sock, struct event_loop *loop,
+						const char *path, control_handler handler, void *data)
+{
+	struct sockaddr_un addr;
+
+	CLEAR(*sock);
+	sock->fd = -1;
+	sock->loop = loop;
+	for (int i = 0; i < CONTROL_CLIENTS_MAX; i++)
+	{
+		sock->clients[i].fd = -1;
+		sock->clients[i].sock = sock;
+	}
+	if (strlen(path) >= sizeof(sock->path))
+	{
+		printf("CONTROL: socket path %s is too long\n", path);
+		return -ENAMETOOLONG;
+	}
+	snprintf(sock->path, sizeof(sock->path), "%s", path);
+	sock->handler = handler;
+	sock->data = data;
+
+	CLEAR(addr);
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, sock->path, sizeof(addr.sun_path));
+	sock->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	unlink_socket(sock->path);
+	if (sock->fd < 0 || bind(sock->fd, (struct sockaddr *)&addr, sizeof addr) < 0 ||
+		listen(sock->fd, CONTROL_CLIENTS_MAX) < 0)
+	{
+		printf("CONTROL: couldn't listen on %s: %s\n", sock->path, strerror(errno));
+		control_socket_close(sock);
+		return -1;
+	}
+	if (event_loop_add(loop, sock->fd, EPOLLIN, accept_ready, sock) < 0)
+	{
+		control_socket_close(sock);
+		return -1;
+	}
+	printf("CONTROL: listening on %s\n", sock->path);
+	return 0;
+}
+
+/*
+ * drop the clients and remove the socket, from the loop thread or while
+ * the loop isn't running
+ * args:
+ * 		sock - control socket
+ */
+void control_socket_close(struct control_socket *sock)
+{
+	/* never opened */
+	if (sock->loop == NULL)
+		return;
+	for (int i = 0; i < CONTROL_CLIENTS_MAX; i++)
+		if (sock->clients[i].fd >= 0)
+			drop_client(&sock->clients[i]);
+	if (sock->fd < 0)
+		return;
+	event_loop_remove(sock->loop, sock->fd);
+	close(sock->fd);
+	unlink_socket(sock->path);
+	sock->fd = -1;
+}
@@ -0,0 +1,59 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, unix socket that takes
+  one text command per line, e.g. from
+
+  	socat - UNIX-CONNECT:/tmp/leopard_cam.sock
+
+  The socket and its clients are served by an event loop, each complete line
+  goes to the handler in the loop thread, which writes its reply to the
+  client.
+*****************************************************************************/
+#pragma once
+#include <sys/un.h>
+#include "event_loop.h"
+
+/****************************************************************************
+**                      	Global data
+*****************************************************************************/
+#define CONTROL_CLIENTS_MAX 4
+#define CONTROL_LINE_MAX 128
+
+/*
+ * called in the loop thread for every line, without the newline
+ * args:
+ * 		data 	 - as given to control_socket_open
+ * 		line 	 - the command
+ * 		reply_fd - client to write the answer to
+ */
+typedef void (*control_handler)(void *data, char *line, int reply_fd);
+
+struct control_socket;
+
+struct control_client
+{
+	int fd;					/* -1 for a free slot */
+	unsigned int len;
+	char line[CONTROL_LINE_MAX];
+	struct control_socket *sock;
+};
+
+struct control_socket
+{
+	int fd;					/* listening socket, -1 if not open */
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	struct event_loop *loop;
+	control_handler handler;
+	void *data;
+	struct control_client clients[CONTROL_CLIENTS_MAX];
+};
+
+/****************************************************************************
+**							 Function declaration
+*****************************************************************************/
+int control_socket_open(struct control_socket *sock, struct event_loop *loop,
+						const char *path, control_handler handler, void *data);
+void control_socket_close(struct control_socket *sock);
@@ -0,0 +1,426 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, epoll event loop that
+  waits on many non-blocking fds at once: camera nodes, sockets and timers.
+  A handler is called in the loop thread as soon as its fd is ready, so one
+  thread can service the capture i/o of every camera.
+*****************************************************************************/
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "../includes/shortcuts.h"
+#include "event_loop.h"
+#include "realtime.h"
+
+/* events one epoll_wait hands back at most */
+#define EVENT_LOOP_BATCH 16
+
+/*****************************************************************************
+**                           Function definition
+*****************************************************************************/
+
+/* the slot watching fd, NULL if there is none, hold the mutex */
+static struct event_watch *find_watch(struct event_loop *loop, int fd)
+{
+	for (int i = 0; i < EVENT_LOOP_MAX; i++)
+		if (loop->watches[i].fd == fd && loop->watches[i].handler != NULL)
+			return &loop->watches[i];
+	return NULL;
+}
+
+/*
+ * set up an empty loop
+ * args:
+ * 		loop - event loop
+ * returns:
+ * 		error value
+ */
+int event_loop_init(struct event_loop *loop)
+{
+	struct epoll_event ev;
+
+	CLEAR(*loop);
+	__INIT_MUTEX(&loop->mutex);
+	__INIT_MUTEX(&loop->dispatch_mutex);
+	for (int i = 0; i < EVENT_LOOP_MAX; i++)
+		loop->watches[i].fd = -1;
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	loop->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (loop->epfd < 0 || loop->wake_fd < 0)
+	{
+		perror("EVENT_LOOP: couldn't create epoll fd");
+		event_loop_free(loop);
+		return -1;
+	}
+
+	/* data.ptr NULL tells the wake fd apart from the watches */
+	CLEAR(ev);
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wake_fd, &ev) < 0)
+	{
+		perror("EVENT_LOOP: couldn't watch the wake fd");
+		event_loop_free(loop);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * release the loop, stop it first, the fds it watched are left open
+ * except for timers
+ * args:
+ * 		loop - event loop
+ */
+void event_loop_free(struct event_loop *loop)
+{
+	for (int i = 0; i < EVENT_LOOP_MAX; i++)
+	{
+		if (loop->watches[i].timer && loop->watches[i].fd >= 0)
+			close(loop->watches[i].fd);
+		loop->watches[i].fd = -1;
+		loop->watches[i].handler = NULL;
+	}
+	if (loop->epfd >= 0)
+		close(loop->epfd);
+	if (loop->wake_fd >= 0)
+		close(loop->wake_fd);
+	loop->epfd = -1;
+	loop->wake_fd = -1;
+	__CLOSE_MUTEX(&loop->mutex);
+	__CLOSE_MUTEX(&loop->dispatch_mutex);
+}
+
+/* fill a free slot and hand it to epoll */
+static int add_watch(struct event_loop *loop, int fd, unsigned int events,
+					 event_handler handler, void *data, int timer)
+{
+	struct event_watch *watch = NULL;
+	struct epoll_event ev;
+	int ret;
+
+	__LOCK_MUTEX(&loop->mutex);
+	for (int i = 0; i < EVENT_LOOP_MAX && watch == NULL; i++)
+		if (loop->watches[i].fd < 0)
+			watch = &loop->watches[i];
+	if (watch == NULL)
+	{
+		__UNLOCK_MUTEX(&loop->mutex);
+		printf("EVENT_LOOP: more than %d fds\n", EVENT_LOOP_MAX);
+		return -ENOSPC;
+	}
+
+	CLEAR(ev);
+	ev.events = events;
+	ev.data.ptr = watch;
+	watch->fd = fd;
+	watch->timer = timer;
+	watch->handler = handler;
+	watch->data = data;
+	ret = epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev);
+	if (ret < 0)
+	{
+		ret = -errno;
+		watch->fd = -1;
+		watch->handler = NULL;
+		printf("EVENT_LOOP: couldn't watch fd %d: %s\n", fd, strerror(-ret));
+	}
+	__UNLOCK_MUTEX(&loop->mutex);
+	return ret;
+}
+
+/*
+ * watch an fd, safe from any thread
+ * args:
+ * 		loop    - event loop
+ * 		fd      - non-blocking fd
+ * 		events  - EPOLLIN, EPOLLPRI etc., with EPOLLONESHOT the fd is
+ * 				  quiet after each event until event_loop_rearm
+ * 		handler - called when the fd is ready
+ * 		data    - for the handler
+ * returns:
+ * 		error value
+ */
+int event_loop_add(struct event_loop *loop, int fd, unsigned int events,
+				   event_handler handler, void *data)
+{
+	return add_watch(loop, fd, events, handler, data, 0);
+}
+
+/*
+ * change what an fd is watched for, turns an EPOLLONESHOT fd back on,
+ * safe from any thread
+ * args:
+ * 		loop   - event loop
+ * 		fd     - watched fd
+ * 		events - as for event_loop_add
+ * returns:
+ * 		error value
+ */
+int event_loop_rearm(struct event_loop *loop, int fd, unsigned int events)
+{
+	struct event_watch *watch;
+	struct epoll_event ev;
+	int ret = -ENOENT;
+
+	__LOCK_MUTEX(&loop->mutex);
+	watch = find_watch(loop, fd);
+	if (watch != NULL)
+	{
+		CLEAR(ev);
+		ev.events = events;
+		ev.data.ptr = watch;
+		ret = epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev) < 0 ? -errno : 0;
+	}
+	__UNLOCK_MUTEX(&loop->mutex);
+	return ret;
+}
+
+/*
+ * stop watching an fd, safe from any thread, its handler isn't called
+ * after this, from another thread this waits for the handlers the loop
+ * is calling to return
+ * args:
+ * 		loop - event loop
+ * 		fd   - watched fd
+ */
+void event_loop_remove(struct event_loop *loop, int fd)
+{
+	struct event_watch *watch;
+	int other = !pthread_equal(loop->owner, pthread_self());
+
+	if (other)
+		__LOCK_MUTEX(&loop->dispatch_mutex);
+	__LOCK_MUTEX(&loop->mutex);
+	watch = find_watch(loop, fd);
+	if (watch != NULL)
+	{
+		epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+		watch->handler = NULL;
+		/* events already fetched may still point at the slot, the loop
+		   frees it after its current batch */
+		if (!loop->dispatching && !(other && loop->running))
+			watch->fd = -1;
+	}
+	__UNLOCK_MUTEX(&loop->mutex);
+	if (other)
+		__UNLOCK_MUTEX(&loop->dispatch_mutex);
+}
+
+/*
+ * call a handler from the loop after a delay and then periodically
+ * args:
+ * 		loop        - event loop
+ * 		first_ms    - delay for the first call
+ * 		interval_ms - period after that, 0 for just once
+ * 		handler     - called in the loop thread
+ * 		data        - for the handler
+ * returns:
+ * 		timer fd for event_loop_remove_timer, negative on error
+ */
+int event_loop_add_timer(struct event_loop *loop, unsigned int first_ms,
+						 unsigned int interval_ms, event_handler handler,
+						 void *data)
+{
+	struct itimerspec its;
+	int fd;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (fd < 0)
+	{
+		perror("EVENT_LOOP: timerfd_create");
+		return -1;
+	}
+	/* a zero it_value would disarm the timer */
+	if (first_ms == 0)
+		first_ms = 1;
+	CLEAR(its);
+	its.it_value.tv_sec = first_ms / 1000;
+	its.it_value.tv_nsec = (first_ms % 1000) * 1000000L;
+	its.it_interval.tv_sec = interval_ms / 1000;
+	its.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+	if (timerfd_settime(fd, 0, &its, NULL) < 0 ||
+		add_watch(loop, fd, EPOLLIN, handler, data, 1) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * stop and close a timer, safe from any thread
+ * args:
+ * 		loop - event loop
+ * 		fd   - from event_loop_add_timer
+ */
+void event_loop_remove_timer(struct event_loop *loop, int fd)
+{
+	if (fd < 0)
+		return;
+	event_loop_remove(loop, fd);
+	close(fd);
+}
+
+/*
+ * call the handlers of ready fds until event_loop_cancel, in the calling
+ * thread, a cancelled loop doesn't run again
+ * args:
+ * 		loop - event loop
+ * returns:
+ * 		error value
+ */
+int event_loop_run(struct event_loop *loop)
+{
+	struct epoll_event events[EVENT_LOOP_BATCH];
+	uint64_t count;
+	int ret = 0;
+
+	__LOCK_MUTEX(&loop->mutex);
+	loop->owner = pthread_self();
+	loop->running = 1;
+	__UNLOCK_MUTEX(&loop->mutex);
+
+	while (!__atomic_load_n(&loop->cancelled, __ATOMIC_RELAXED))
+	{
+		int n = epoll_wait(loop->epfd, events, EVENT_LOOP_BATCH, -1);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			perror("EVENT_LOOP: epoll_wait");
+			ret = -1;
+			break;
+		}
+		loop->wakeups++;
+
+		__LOCK_MUTEX(&loop->dispatch_mutex);
+		loop->dispatching = 1;
+		for (int i = 0; i < n; i++)
+		{
+			struct event_watch *watch = (struct event_watch *)events[i].data.ptr;
+
+			if (watch == NULL)
+			{
+				if (read(loop->wake_fd, &count, sizeof count) < 0 && errno != EAGAIN)
+					perror("EVENT_LOOP: wake fd");
+				continue;
+			}
+			/* removed earlier in this batch or while epoll_wait returned */
+			if (watch->handler == NULL)
+				continue;
+			if (watch->timer &&
+				read(watch->fd, &count, sizeof count) < 0 && errno == EAGAIN)
+				continue;
+			watch->handler(watch->data, watch->fd, events[i].events);
+			loop->dispatched++;
+		}
+
+		/* slots removed during the batch can be used again */
+		__LOCK_MUTEX(&loop->mutex);
+		loop->dispatching = 0;
+		for (int i = 0; i < EVENT_LOOP_MAX; i++)
+			if (loop->watches[i].handler == NULL)
+				loop->watches[i].fd = -1;
+		__UNLOCK_MUTEX(&loop->mutex);
+		__UNLOCK_MUTEX(&loop->dispatch_mutex);
+	}
+
+	__LOCK_MUTEX(&loop->mutex);
+	loop->running = 0;
+	for (int i = 0; i < EVENT_LOOP_MAX; i++)
+		if (loop->watches[i].handler == NULL)
+			loop->watches[i].fd = -1;
+	__UNLOCK_MUTEX(&loop->mutex);
+	return ret;
+}
+
+static void *loop_thread(void *arg)
+{
+	struct event_loop *loop = (struct event_loop *)arg;
+
+	if (loop->priority > 0)
+		realtime_enter(loop->priority);
+	event_loop_run(loop);
+	return NULL;
+}
+
+/*
+ * run the thread from event_loop_start SCHED_FIFO, with its stack faulted
+ * in, call before event_loop_start
+ * args:
+ * 		loop 	 - event loop
+ * 		priority - 1 to 99, 0 for normal scheduling
+ */
+void event_loop_set_priority(struct event_loop *loop, int priority)
+{
+	loop->priority = priority;
+}
+
+/*
+ * run the loop on a thread of its own
+ * args:
+ * 		loop - event loop
+ * 		cpu  - cpu to pin the thread to, -1 lets the scheduler pick
+ * returns:
+ * 		error value
+ */
+int event_loop_start(struct event_loop *loop, int cpu)
+{
+	cpu_set_t cpus;
+	int ret;
+
+	ret = __THREAD_CREATE(&loop->thread, loop_thread, loop);
+	if (ret != 0)
+	{
+		printf("Unable to create event loop thread: %s\n", strerror(ret));
+		loop->thread = 0;
+		return -ret;
+	}
+	/* a cpu that isn't there only costs the pinning, not the loop */
+	if (cpu >= 0)
+	{
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+		ret = pthread_setaffinity_np(loop->thread, sizeof cpus, &cpus);
+		if (ret != 0)
+			printf("Event loop thread not pinned to cpu %d: %s\n", cpu,
+				   strerror(ret));
+	}
+	return 0;
+}
+
+/*
+ * make event_loop_run return once the handlers it is calling are done,
+ * safe from any thread and from a signal handler
+ * args:
+ * 		loop - event loop
+ */
+void event_loop_cancel(struct event_loop *loop)
+{
+	uint64_t one = 1;
+
+	__atomic_store_n(&loop->cancelled, 1, __ATOMIC_RELAXED);
+	if (write(loop->wake_fd, &one, sizeof one) < 0 && errno != EAGAIN)
+		perror("EVENT_LOOP: wake fd");
+}
+
+/*
+ * end the thread from event_loop_start and wait for it
+ * args:
+ * 		loop - event loop
+ */
+void event_loop_stop(struct event_loop *loop)
+{
+	event_loop_cancel(loop);
+	if (loop->thread)
+		__THREAD_JOIN(loop->thread);
+	loop->thread = 0;
+}
@@ -0,0 +1,74 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, epoll event loop that
+  waits on many non-blocking fds at once: camera nodes, sockets and timers.
+  A handler is called in the loop thread as soon as its fd is ready, so one
+  thread can service the capture i/o of every camera.
+*****************************************************************************/
+#pragma once
+#include <pthread.h>
+
+/****************************************************************************
+**                      	Global data
+*****************************************************************************/
+#define EVENT_LOOP_MAX 64		/* fds one loop watches */
+
+/*
+ * called in the loop thread
+ * args:
+ * 		data   - as given to event_loop_add
+ * 		fd     - the ready fd
+ * 		events - EPOLLIN, EPOLLPRI, EPOLLERR etc.
+ */
+typedef void (*event_handler)(void *data, int fd, unsigned int events);
+
+struct event_watch
+{
+	int fd;					/* -1 for a free slot */
+	int timer;				/* timerfd, read before the handler runs */
+	event_handler handler;	/* NULL once removed */
+	void *data;
+};
+
+struct event_loop
+{
+	int epfd;
+	int wake_fd;			/* eventfd, ends event_loop_run */
+	int cancelled;			/* event_loop_run returns for good */
+	int dispatching;		/* removed slots aren't reused until the batch ends */
+	int running;			/* event_loop_run is waiting or dispatching */
+	struct event_watch watches[EVENT_LOOP_MAX];
+	unsigned long wakeups;	/* epoll_wait returns with something to do */
+	unsigned long dispatched;
+
+	__THREAD_TYPE thread;	/* from event_loop_start */
+	int priority;			/* its SCHED_FIFO priority, 0 for normal */
+	pthread_t owner;		/* thread in event_loop_run */
+	__MUTEX_TYPE mutex;		/* for the watch table */
+	__MUTEX_TYPE dispatch_mutex; /* held while a batch of handlers runs */
+};
+
+/****************************************************************************
+**							 Function declaration
+*****************************************************************************/
+int event_loop_init(struct event_loop *loop);
+void event_loop_free(struct event_loop *loop);
+
+int event_loop_add(struct event_loop *loop, int fd, unsigned int events,
+				   event_handler handler, void *data);
+int event_loop_rearm(struct event_loop *loop, int fd, unsigned int events);
+void event_loop_remove(struct event_loop *loop, int fd);
+
+int event_loop_add_timer(struct event_loop *loop, unsigned int first_ms,
+						 unsigned int interval_ms, event_handler handler,
+						 void *data);
+void event_loop_remove_timer(struct event_loop *loop, int fd);
+
+int event_loop_run(struct event_loop *loop);
+void event_loop_set_priority(struct event_loop *loop, int priority);
+int event_loop_start(struct event_loop *loop, int cpu);
+void event_loop_cancel(struct event_loop *loop);
+void event_loop_stop(struct event_loop *loop);
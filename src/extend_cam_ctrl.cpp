@@ -41,24 +41,33 @@
 
 #include "../includes/shortcuts.h"
 #include "extend_cam_ctrl.h"
+#include "capture_ring.h"
+#include "isp_kernels.h"
+#include "frame_pool.h"
+#include "snapshot_writer.h"
+#include "raw_recorder.h"
+#include "burst_ring.h"
+#include "frame_source.h"
+#include "frame_share.h"
+#include "buffer_arena.h"
+#include "realtime.h"
+#include "cam_property.h"
+#include "cam_formats.h"
+#include "cam_context.h"
+#include "stage_timer.h"
+#include "frame_trace.h"
 /****************************************************************************
 **                      	Global data 
 *****************************************************************************/
-/* 
- * Since we use fork, variables btw two processes are not shared
- * use mmap for all the variables you need to share between gui and videostreaming
- */
-static int *save_bmp;   /* flag for saving bmp */
-static int *save_raw;   /* flag for saving raw */
-static int *bayer_flag; /* flag for choosing bayer pattern */
-static int *shift_flag; /* flag for shift raw data */
-static int *awb_flag;   /* flag for enable/disable software awb*/
-static int *abc_flag;   /* flag for enable/disable software brightness & contrast optimization */
-float *gamma_val;
+#define DECODE_POOL_BUFFERS 2
 
-static int image_count;
+/* settings are written by the gui thread and read by the streaming thread */
+#define GET_CONTROL(ctx, flag) __atomic_load_n(&(ctx)->controls.flag, __ATOMIC_RELAXED)
+#define SET_CONTROL(ctx, flag, val) \
+	__atomic_store_n(&(ctx)->controls.flag, (val), __ATOMIC_RELAXED)
+/* a capture the gui asked for, cleared by the frame that does it */
+#define TAKE_CONTROL(ctx, flag) __atomic_exchange_n(&(ctx)->controls.flag, 0, __ATOMIC_RELAXED)
 
-struct v4l2_buffer queuebuffer;
 /*****************************************************************************
 **                           Function definition
 *****************************************************************************/
@@ -66,9 +75,9 @@ struct v4l2_buffer queuebuffer;
 /*
  * callback for save bmp image from gui
  */
-void video_capture_save_bmp()
+void video_capture_save_bmp(struct cam_ctx *ctx)
 {
-	set_save_bmp_flag(1);
+	set_save_bmp_flag(ctx, 1);
 }
 
 /*
@@ -77,36 +86,64 @@ void video_capture_save_bmp()
  * 		flag - set the flag when get capture button clicked,
  * 			   reset flag to zero once image is saved
  */
-void set_save_bmp_flag(int flag)
+void set_save_bmp_flag(struct cam_ctx *ctx, int flag)
 {
-	*save_bmp = flag;
+	SET_CONTROL(ctx, save_bmp, flag);
 }
 
 /*
- * save data to bitmap using opencv
+ * queue the image for the snapshot writer, it is encoded to bitmap 
+ * using opencv and written out by the writer thread
  * args:
+ *	 ctx - camera context
  *	 opencv mat image to be captured
  *
  * asserts:
  *   none
  */
-static int save_frame_image_bmp(cv::Mat opencvImage)
+static int save_frame_image_bmp(struct cam_ctx *ctx, cv::Mat opencvImage)
 {
 
 	printf("save one capture bmp\n");
-	cv::imwrite(cv::format("captures_%d.bmp",
-						   image_count),
-				opencvImage);
-
-	return 0;
+	return snapshot_writer_queue_bmp(&ctx->snapshots,
+									 cv::format("captures_%d.bmp",
+												ctx->image_count).c_str(),
+									 opencvImage.data, opencvImage.cols,
+									 opencvImage.rows, opencvImage.type(),
+									 opencvImage.step,
+									 opencvImage.cols * opencvImage.elemSize());
 }
 
 /*
  * callback for save raw image from gui
  */
-void video_capture_save_raw()
+void video_capture_save_raw(struct cam_ctx *ctx)
+{
+	/* in burst mode the capture button saves the pre-trigger frames */
+	if (ctx->pre_trigger_seconds > 0)
+		video_trigger_burst(ctx);
+	else
+		set_save_raw_flag(ctx, 1);
+}
+
+/*
+ * keep the last seconds of raw frames in memory, a trigger writes them
+ * to burst_%d.lraw, takes effect the next time streaming starts
+ * args:
+ * 		seconds - 0 to disable burst mode
+ */
+void set_pre_trigger_seconds(struct cam_ctx *ctx, int seconds)
+{
+	ctx->pre_trigger_seconds = seconds;
+}
+
+/*
+ * flush the pre-trigger ring, for the gui capture and trigger buttons
+ * or anyone else who saw the event
+ */
+void video_trigger_burst(struct cam_ctx *ctx)
 {
-	set_save_raw_flag(1);
+	SET_CONTROL(ctx, burst_flag, 1);
 }
 
 /*
@@ -115,9 +152,9 @@ void video_capture_save_raw()
  * 		flag - set the flag when get capture button clicked,
  * 			   reset flag to zero once image is saved
  */
-void set_save_raw_flag(int flag)
+void set_save_raw_flag(struct cam_ctx *ctx, int flag)
 {
-	*save_raw = flag;
+	SET_CONTROL(ctx, save_raw, flag);
 }
 
 /*
@@ -179,43 +216,69 @@ int set_shift(int *shift_flag)
 	return 2;
 }
 
-void awb_enable(int enable)
+void awb_enable(struct cam_ctx *ctx, int enable)
 {
 	if (enable == 1)
-		*awb_flag = 1;
+		SET_CONTROL(ctx, awb_flag, 1);
 
 	if (enable == 0)
-		*awb_flag = 0;
+		SET_CONTROL(ctx, awb_flag, 0);
 }
 
-void abc_enable(int enable)
+void abc_enable(struct cam_ctx *ctx, int enable)
 {
 	if (enable == 1)
-		*abc_flag = 1;
+		SET_CONTROL(ctx, abc_flag, 1);
 
 	if (enable == 0)
-		*abc_flag = 0;
+		SET_CONTROL(ctx, abc_flag, 0);
 }
 
-void add_gamma_val(float gamma_val_from_gui)
+void add_gamma_val(struct cam_ctx *ctx, float gamma_val_from_gui)
 {
-	*gamma_val = gamma_val_from_gui;
+	__atomic_store(&ctx->controls.gamma_val, &gamma_val_from_gui,
+				   __ATOMIC_RELAXED);
+}
+
+/* 
+ * keep track of exposure and gain set from gui, the camera doesn't report
+ * them per frame so recorded frame headers use these
+ */
+void add_exposure_val(struct cam_ctx *ctx, int exposure)
+{
+	SET_CONTROL(ctx, exposure_val, exposure);
+}
+
+void add_gain_val(struct cam_ctx *ctx, int gain)
+{
+	SET_CONTROL(ctx, gain_val, gain);
+}
+
+/*
+ * callback for start/stop continuous raw recording from gui
+ * args:
+ * 		enable - 1: record every frame into record_%d.lraw, 0: stop
+ */
+void video_record_raw(struct cam_ctx *ctx, int enable)
+{
+	SET_CONTROL(ctx, record_flag, enable);
 }
 /*
  * callback for change sensor datatype shift flag
  * args:
+ * 		ctx 	 - camera context
  * 		datatype - RAW10  -> set *shift_flag = 1
  *  			   RAW12  -> set *shift_flag = 2
  * 				   YUV422 -> set *shift_flag = 3
  */
-void change_datatype(void *datatype)
+void change_datatype(struct cam_ctx *ctx, void *datatype)
 {
 	if (strcmp((char *)datatype, "1") == 0)
-		*shift_flag = 1;
+		SET_CONTROL(ctx, shift_flag, 1);
 	if (strcmp((char *)datatype, "2") == 0)
-		*shift_flag = 2;
+		SET_CONTROL(ctx, shift_flag, 2);
 	if (strcmp((char *)datatype, "3") == 0)
-		*shift_flag = 3;
+		SET_CONTROL(ctx, shift_flag, 3);
 }
 
 /*
@@ -246,39 +309,22 @@ int add_bayer_forcv(int *bayer_flag)
 /*
  * callback for change sensor bayer pattern for debayering
  * args:
+ * 		ctx   - camera context
  * 		bayer - for updating *bayer_flag
  *  			   
  */
-void change_bayerpattern(void *bayer)
+void change_bayerpattern(struct cam_ctx *ctx, void *bayer)
 {
 	if (strcmp((char *)bayer, "1") == 0)
-		*bayer_flag = 1;
+		SET_CONTROL(ctx, bayer_flag, 1);
 	if (strcmp((char *)bayer, "2") == 0)
-		*bayer_flag = 2;
+		SET_CONTROL(ctx, bayer_flag, 2);
 	if (strcmp((char *)bayer, "3") == 0)
-		*bayer_flag = 3;
+		SET_CONTROL(ctx, bayer_flag, 3);
 	if (strcmp((char *)bayer, "4") == 0)
-		*bayer_flag = 4;
+		SET_CONTROL(ctx, bayer_flag, 4);
 }
 
-/* 
- *  apply gamma correction for the given mat
- *  When *gamma_val < 1, the original dark regions will be brighter 
- *  and the histogram will be shifted to the right 
- *  whereas it will be the opposite with *gamma_val > 1
- *  recommend *gamma_val: 0.45(1/2.2)
- */
-static cv::Mat apply_gamma_correction(cv::Mat opencvImage)
-{
-	cv::Mat look_up_table(1, 256, CV_8U);
-	uchar *p = look_up_table.ptr();
-	for (int i = 0; i < 256; i++)
-	{
-		p[i] = cv::saturate_cast<uchar>(pow(i / 255.0, *gamma_val) * 255.0);
-	}
-	LUT(opencvImage, look_up_table, opencvImage);
-	return opencvImage;
-}
  double rgb2rgb_param[3][3] = {
  	409.0, -137.0, -15.0, // + - -
  	-136.0, 468.0, -77.0, // - + -
@@ -300,67 +346,128 @@ int rgb2rgb_param_2[3][3] = {
 	2, 256, -1,
 	2, -1, 256
 };
+/* b, g, r gains applied before the colour correction matrix, 256 = 1x */
+double awb_gain[3] = {267.0, 403.0, 471.0};
+
+/*
+ * start a camera's tables over, nothing is applied until the first frame
+ * builds them
+ * args:
+ * 		tone - tables of one camera
+ */
+void cam_tone_init(struct cam_tone *tone)
+{
+	CLEAR(*tone);
+	tone->gamma = -1;
+	tone->pre_abc_param[0] = -1;
+	tone->lut_param[0] = -1;
+	tone->abc_lut_param[0] = -1;
+	tone->abc_alpha = 1.0;
+	tone->abc_beta = 0.0;
+	/* 
+	 * abc statistics look at every abc_sample_step-th pixel of every 
+	 * abc_sample_step-th row, once every abc_update_period frames, and move 
+	 * alpha/beta towards the new values by abc_smoothing to avoid flicker
+	 */
+	tone->abc_sample_step = 4;
+	tone->abc_update_period = 4;
+	tone->abc_smoothing = 0.25;
+}
+
+/* rebuild the colour correction coefficients when rr..bb change */
+static void update_awb_ccm(struct cam_tone *tone)
+{
+	double param[9] = {
+		bb, bg, br,
+		gb, gg, gr,
+		rb, rg, rr};
+
+	if (memcmp(param, tone->ccm_param, sizeof param) == 0)
+		return;
+
+	double ccm[3][3];
+	const double unity[3] = {1.0, 1.0, 1.0};
+	for (int c = 0; c < 3; c++)
+		for (int k = 0; k < 3; k++)
+			ccm[c][k] = param[c * 3 + k] / 256;
+	build_awb_ccm(&tone->awb_ccm, ccm, unity);
+	memcpy(tone->ccm_param, param, sizeof param);
+}
+
 /* 
- *  apply white balance for the given mat
- *  the basic idea of Leopard AWB algorithm is to find the gray area of the image and apply
- *  Red, Green and Blue gains to make it gray, and then use the gray area to estimate the
- *  color temperature.
+ *  gamma correction and awb gains, rebuilt only when one of them changes
+ *  When gamma < 1, the original dark regions will be brighter 
+ *  and the histogram will be shifted to the right 
+ *  whereas it will be the opposite with gamma > 1
+ *  recommend gamma: 0.45(1/2.2)
+ * args:
+ * 		tone  - tables of the camera
+ * 		gamma - gamma set from the gui
+ * 		awb   - apply awb_gain on top of gamma
+ * returns:
+ * 		1 if the table changed
  */
-static cv::Mat apply_white_balance(cv::Mat opencvImage)
-{
-
-	cv::Mat splitChannelRGB[3];
-	cv::Mat floatImage(4056, 3040, CV_32FC1);
-	floatImage = opencvImage.clone();
-	//floatImage = opencvImage;
-	split(floatImage, splitChannelRGB);
-
-	double R, G, B;
-	B = mean(splitChannelRGB[0])[0];
-	G = mean(splitChannelRGB[1])[0];
-	R = mean(splitChannelRGB[2])[0];
-	double RGB_ORIG[3] = {B, G, R};
-	// /* gain for adjusting each color channel */
-	double KR = 1, KG = 1, KB = 1;
-	double RGB_UPDATE[3] = {KB, KG, KR};
-	KB = 267.0/256;//(R + G + B) / (3 * B);
-	KG = 403.0/256;//(R + G + B) / (3 * G);
-	KR = 471.0/256;//(R + G + B) / (3 * R);
-	// printf("KB = %f\n", KB);
-	// printf("KG = %f\n", KG);
-	// printf("KR = %f\n", KR);
-
-	splitChannelRGB[0] = splitChannelRGB[0] * KB;
-	splitChannelRGB[1] = splitChannelRGB[1] * KG;
-	splitChannelRGB[2] = splitChannelRGB[2] * KR;
-
-	// printf("B = %f\n", RGB_ORIG[0]);
-	// printf("G = %f\n", RGB_ORIG[1]);
-	// printf("R = %f\n", RGB_ORIG[2]);
-	// for (int i =0; i < 3; i++) {
-	// 	for (int j=0; j < 3; j++) {
-	// 		RGB_UPDATE[i] +=  (rgb2rgb_param[i][j]* RGB_ORIG[i] / 256);
-	// 	}
-	// }
-	// printf("KB = %f\n", RGB_UPDATE[0]);
-	// printf("KG = %f\n", RGB_UPDATE[1]);
-	// printf("KR = %f\n", RGB_UPDATE[2]);
-	// /* adjust rgb channel values */
-	 splitChannelRGB[2] = splitChannelRGB[2] * rr / 256 
-	 					+ splitChannelRGB[1] * rg / 256
-						+ splitChannelRGB[0] * rb / 256;
-
-	 splitChannelRGB[1] = splitChannelRGB[2] * gr / 256 
-	 					+ splitChannelRGB[1] * gg / 256
-						+ splitChannelRGB[0] * gb / 256;
-
-	 splitChannelRGB[0] = splitChannelRGB[2] * br / 256 
-	 					+ splitChannelRGB[1] * bg / 256
-						+ splitChannelRGB[0] * bb / 256;
-
-	/* merge three RGB channels back together */
-	merge(splitChannelRGB, 3, opencvImage);
-	return opencvImage;
+static int update_pre_abc_lut(struct cam_tone *tone, float gamma, int awb)
+{
+	double param[4] = {(double)awb, awb_gain[0], awb_gain[1], awb_gain[2]};
+	int gamma_changed = 0;
+
+	if (gamma != tone->gamma)
+	{
+		for (int i = 0; i < 256; i++)
+			tone->gamma_curve[i] = cv::saturate_cast<uchar>(pow(i / 255.0, gamma) * 255.0);
+		tone->gamma = gamma;
+		gamma_changed = 1;
+	}
+	if (!gamma_changed && memcmp(param, tone->pre_abc_param, sizeof param) == 0)
+		return 0;
+
+	for (int c = 0; c < 3; c++)
+		for (int i = 0; i < 256; i++)
+			tone->pre_abc_lut[c][i] = awb ? cv::saturate_cast<uchar>(tone->gamma_curve[i] * awb_gain[c] / 256)
+										  : tone->gamma_curve[i];
+	memcpy(tone->pre_abc_param, param, sizeof param);
+	return 1;
+}
+
+/*
+ * fold abc alpha and beta into the per-channel table when anything changed
+ * args:
+ * 		tone 			- tables of the camera
+ * 		pre_abc_changed - gamma or gains changed since the last call
+ * 		abc 			- apply abc_alpha and abc_beta
+ */
+static void update_tone_lut(struct cam_tone *tone, int pre_abc_changed, int abc)
+{
+	float param[3] = {(float)abc, tone->abc_alpha, tone->abc_beta};
+
+	if (!pre_abc_changed && memcmp(param, tone->lut_param, sizeof param) == 0)
+		return;
+
+	tone->lut_identity = 1;
+	for (int i = 0; i < 256; i++)
+		for (int c = 0; c < 3; c++)
+		{
+			uchar v = tone->pre_abc_lut[c][i];
+			/* convertTo operates with saurate_cast */
+			tone->lut[i][c] = abc ? cv::saturate_cast<uchar>(tone->abc_alpha * v + tone->abc_beta) : v;
+			if (tone->lut[i][c] != i)
+				tone->lut_identity = 0;
+		}
+	memcpy(tone->lut_param, param, sizeof param);
+}
+
+/* abc alpha and beta on their own, for after the colour correction matrix */
+static void update_abc_lut(struct cam_tone *tone)
+{
+	float param[2] = {tone->abc_alpha, tone->abc_beta};
+
+	if (memcmp(param, tone->abc_lut_param, sizeof param) == 0)
+		return;
+
+	for (int i = 0; i < 256; i++)
+		tone->abc_lut[i] = cv::saturate_cast<uchar>(tone->abc_alpha * i + tone->abc_beta);
+	memcpy(tone->abc_lut_param, param, sizeof param);
 }
 
 /*
@@ -370,71 +477,175 @@ static cv::Mat apply_white_balance(cv::Mat opencvImage)
  * Automatic brightness and contrast optimization calculates alpha and beta so that the output range is 0..255.
  * Ref: http://answers.opencv.org/question/75510/how-to-make-auto-adjustmentsbrightness-and-contrast-for-image-android-opencv-image-correction/
  * args:
+ * 	 hist 			 - grayscale histogram of the image before abc
  * 	 clipHistPercent - cut wings of histogram at given percent 
  * 		typical=>1, 0=>Disabled
+ * 	 alpha, beta 	 - result
  */
-static cv::Mat apply_auto_brightness_and_contrast(cv::Mat opencvImage,
-												  float clipHistPercent = 0)
+static void abc_alpha_beta_from_hist(const unsigned int hist[256],
+									 float clipHistPercent,
+									 float *alpha, float *beta)
 {
 	int hist_size = 256;
-	float alpha, beta;
-	double min_gray = 0, max_gray = 0;
+	int min_gray = 0, max_gray = hist_size - 1;
 
-	/* to calculate grayscale histogram */
-	cv::Mat gray;
-	cv::cvtColor(opencvImage, gray, CV_BGR2GRAY);
+	/* calculate cumulative distribution from the histogram */
+	float accumulator[256];
+	accumulator[0] = hist[0];
+	for (int i = 1; i < hist_size; i++)
+	{
+		accumulator[i] = accumulator[i - 1] + hist[i];
+	}
+	float max = accumulator[hist_size - 1];
+	if (max == 0)
+		return;
 
 	if (clipHistPercent == 0)
 	{
 		/* keep full available range */
-		cv::minMaxLoc(gray, &min_gray, &max_gray);
+		while (hist[min_gray] == 0)
+			min_gray++;
+		while (hist[max_gray] == 0)
+			max_gray--;
 	}
 	else
 	{
-		/* the grayscale histogram */
-		cv::Mat hist;
-
-		float range[] = {0, 256};
-		const float *histRange = {range};
-		bool uniform = true;
-		bool accumulate = false;
-		calcHist(&gray, 1, 0, cv::Mat(), hist, 1, &hist_size, &histRange, uniform, accumulate);
-
-		/* calculate cumulative distribution from the histogram */
-		std::vector<float> accumulator(hist_size);
-		accumulator[0] = hist.at<float>(0);
-		for (int i = 1; i < hist_size; i++)
-		{
-			accumulator[i] = accumulator[i - 1] + hist.at<float>(i);
-		}
-
 		/* locate points that cuts at required value */
-		float max = accumulator.back();
 		clipHistPercent *= (max / 100.0); //make percent as absolute
 		clipHistPercent /= 2.0;			  // left and right wings
 		/* locate left cut */
-		min_gray = 0;
-		while (accumulator[min_gray] < clipHistPercent)
+		while (min_gray < hist_size - 1 && accumulator[min_gray] < clipHistPercent)
 			min_gray++;
 
 		/* locate right cut */
-		max_gray = hist_size - 1;
-		while (accumulator[max_gray] >= (max - clipHistPercent))
+		while (max_gray > 0 && accumulator[max_gray] >= (max - clipHistPercent))
 			max_gray--;
 	}
 
 	/* current range */
 	float input_range = max_gray - min_gray;
+	if (input_range <= 0)
+		return;
 
-	alpha = (hist_size - 1) / input_range; // alpha expands current range to histsize range
-	beta = -min_gray * alpha;			   // beta shifts current range so that minGray will go to 0
+	*alpha = (hist_size - 1) / input_range; // alpha expands current range to histsize range
+	*beta = -min_gray * *alpha;			   // beta shifts current range so that minGray will go to 0
+}
+
+/*
+ * work out abc alpha and beta from a decimated grayscale histogram of what 
+ * the image looks like after gamma, awb and before abc, every few frames
+ * args:
+ * 	 tone 			 - tables of the camera
+ * 	 abc 			 - abc enabled, starting over when it gets enabled
+ * 	 clipHistPercent - cut wings of histogram at given percent 
+ * 		typical=>1, 0=>Disabled
+ */
+static void update_auto_brightness_and_contrast(struct cam_tone *tone,
+												cv::Mat opencvImage, int awb,
+												int abc, float clipHistPercent = 0)
+{
+	unsigned int hist[256];
+
+	if (!abc)
+	{
+		tone->abc_settled = 0;
+		return;
+	}
+	if (tone->abc_settled && ++tone->abc_frame_count % tone->abc_update_period != 0)
+		return;
+
+	tone_histogram(opencvImage.ptr(), opencvImage.cols, opencvImage.rows,
+				   opencvImage.step, tone->abc_sample_step, tone->pre_abc_lut,
+				   awb ? &tone->awb_ccm : NULL, hist);
+
+	float alpha = tone->abc_alpha, beta = tone->abc_beta;
+	abc_alpha_beta_from_hist(hist, clipHistPercent, &alpha, &beta);
+
+	/* jump straight to the first estimate, smooth the ones after */
+	if (!tone->abc_settled)
+	{
+		tone->abc_alpha = alpha;
+		tone->abc_beta = beta;
+		tone->abc_frame_count = 0;
+		tone->abc_settled = 1;
+		return;
+	}
+	tone->abc_alpha += tone->abc_smoothing * (alpha - tone->abc_alpha);
+	tone->abc_beta += tone->abc_smoothing * (beta - tone->abc_beta);
+}
+
+/*
+ * configure how auto brightness and contrast samples the image
+ * args:
+ * 		ctx 		  - camera context
+ * 		sample_step   - look at every n-th pixel of every n-th row
+ * 		update_period - refresh the statistics every n frames
+ * 		smoothing 	  - weight of a new estimate, 1 = no smoothing
+ */
+void set_abc_statistics(struct cam_ctx *ctx, int sample_step, int update_period,
+						float smoothing)
+{
+	struct cam_tone *tone = &ctx->tone;
+
+	if (sample_step >= 1)
+		tone->abc_sample_step = sample_step;
+	if (update_period >= 1)
+		tone->abc_update_period = update_period;
+	if (smoothing > 0 && smoothing <= 1)
+		tone->abc_smoothing = smoothing;
+	printf("abc statistics: every %d pixel(s), every %d frame(s), smoothing %.2f\n",
+		   tone->abc_sample_step, tone->abc_update_period, tone->abc_smoothing);
+}
+
+/* 
+ *  apply gamma correction, awb gains and auto brightness and contrast 
+ *  for the given mat, all of them in one lookup table pass
+ *  with awb on, abc is left to apply_white_balance: the lut saturates, and
+ *  a channel clipped ahead of the colour correction matrix would come out 
+ *  of it differently than when abc runs after the matrix
+ */
+static cv::Mat apply_tone_mapping(struct cam_ctx *ctx, cv::Mat opencvImage,
+								  int awb, int abc)
+{
+	struct cam_tone *tone = &ctx->tone;
+	float gamma;
+
+	__atomic_load(&ctx->controls.gamma_val, &gamma, __ATOMIC_RELAXED);
+	if (awb)
+		update_awb_ccm(tone);
+	int changed = update_pre_abc_lut(tone, gamma, awb);
+	{
+		STAGE_TIMER(STAGE_ABC_STATS);
+		update_auto_brightness_and_contrast(tone, opencvImage, awb, abc, 1);
+	}
+	update_tone_lut(tone, changed, abc && !awb);
 
-	/*
-	* Apply brightness and contrast normalization
-	* convertTo operates with saurate_cast
-	*/
-	opencvImage.convertTo(opencvImage, -1, alpha, beta);
+	STAGE_TIMER(STAGE_TONE);
+	if (!tone->lut_identity)
+		LUT(opencvImage, cv::Mat(1, 256, CV_8UC3, tone->lut), opencvImage);
+	return opencvImage;
+}
 
+/* 
+ *  apply white balance for the given mat
+ *  the basic idea of Leopard AWB algorithm is to find the gray area of the image and apply
+ *  Red, Green and Blue gains to make it gray, and then use the gray area to estimate the
+ *  color temperature.
+ *  the gains are part of the tone lut, this applies the rr..bb colour correction 
+ *  matrix in a single fixed-point pass, then auto brightness and contrast
+ */
+static cv::Mat apply_white_balance(struct cam_tone *tone, cv::Mat opencvImage,
+								   int abc)
+{
+	STAGE_TIMER(STAGE_WHITE_BALANCE);
+	update_awb_ccm(tone);
+	apply_awb_ccm(opencvImage.ptr(), opencvImage.cols, opencvImage.rows,
+				  opencvImage.step, &tone->awb_ccm);
+	if (abc)
+	{
+		update_abc_lut(tone);
+		LUT(opencvImage, cv::Mat(1, 256, CV_8U, tone->abc_lut), opencvImage);
+	}
 	return opencvImage;
 }
 
@@ -460,7 +671,8 @@ int open_v4l2_device(char *device_name, struct device *dev)
 	if (device_name == NULL)
 		return -5;
 
-	v4l2_dev = open(device_name, O_RDWR);
+	/* frames are dequeued when the event loop says they are ready */
+	v4l2_dev = open(device_name, O_RDWR | O_NONBLOCK);
 	if (-1 == v4l2_dev)
 	{
 		perror("open video device fail");
@@ -468,30 +680,9 @@ int open_v4l2_device(char *device_name, struct device *dev)
 	}
 	dev->fd = v4l2_dev;
 
-	mmap_variables();
-	*gamma_val = 1.0;
 	return v4l2_dev;
 }
 
-/* mmap the variables for processes share */
-void mmap_variables()
-{
-	save_bmp = (int *)mmap(NULL, sizeof *save_bmp, PROT_READ | PROT_WRITE,
-						   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-	save_raw = (int *)mmap(NULL, sizeof *save_raw, PROT_READ | PROT_WRITE,
-						   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-	shift_flag = (int *)mmap(NULL, sizeof *shift_flag, PROT_READ | PROT_WRITE,
-							 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-	bayer_flag = (int *)mmap(NULL, sizeof *bayer_flag, PROT_READ | PROT_WRITE,
-							 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-	awb_flag = (int *)mmap(NULL, sizeof *awb_flag, PROT_READ | PROT_WRITE,
-						   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-	abc_flag = (int *)mmap(NULL, sizeof *abc_flag, PROT_READ | PROT_WRITE,
-						   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-	gamma_val = (float *)mmap(NULL, sizeof *bayer_flag, PROT_READ | PROT_WRITE,
-							  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-}
-
 /* 
  * retrive device's capabilities
  * 
@@ -570,20 +761,26 @@ void stop_Camera(struct device *dev)
 }
 /*
  * video set format - Leopard camera format is YUYV
- * need to do a v4l2-ctl --list-formats-ext to see the resolution
+ * the size has to be one cam_caps_print lists
  * args: 
  * 		struct device *dev - device infomation
  * 	  	width - resoultion width
  * 		height - resolution height
  * 		pixelformat - V4L2_PIX_FMT_YUYV
- * 
+ * returns:
+ * 		error value
  */
-void video_set_format(struct device *dev, int width,
-					  int height, int pixelformat)
+int video_set_format(struct device *dev, int width,
+					 int height, int pixelformat)
 {
 	struct v4l2_format fmt;
 	int ret;
 
+	if (width <= 0 || height <= 0 ||
+		cam_caps_check_format(dev->fd, pixelformat, width, height) < 0)
+		return -EINVAL;
+
+	CLEAR(fmt);
 	fmt.fmt.pix.width = width;
 	dev->width = width;
 	fmt.fmt.pix.height = height;
@@ -594,10 +791,12 @@ void video_set_format(struct device *dev, int width,
 	ret = ioctl(dev->fd, VIDIOC_S_FMT, &fmt);
 	if (ret < 0)
 	{
+		ret = -errno;
 		printf("Unable to set format: %s (%d).\n", strerror(errno),
 			   errno);
-		return;
+		return ret;
 	}
+	dev->pixelformat = fmt.fmt.pix.pixelformat;
 	printf("Get Video format: %c%c%c%c (%08x) %ux%u\n 	\
 			byte per line:%d\nsize image:%ud\n",
 		   (fmt.fmt.pix.pixelformat >> 0) & 0xff,
@@ -609,7 +808,7 @@ void video_set_format(struct device *dev, int width,
 		   fmt.fmt.pix.height,
 		   fmt.fmt.pix.bytesperline,
 		   fmt.fmt.pix.sizeimage);
-	return;
+	return 0;
 }
 
 /*
@@ -639,6 +838,7 @@ void video_get_format(struct device *dev)
 	dev->height = fmt.fmt.pix.height;
 	dev->bytesperline = fmt.fmt.pix.bytesperline;
 	dev->imagesize = fmt.fmt.pix.bytesperline ? fmt.fmt.pix.sizeimage : 0;
+	dev->pixelformat = fmt.fmt.pix.pixelformat;
 
 	printf("Get Current Video Format: %c%c%c%c (%08x) %ux%u\nbyte per line:%d\nsize image:%ud\n",
 		   (fmt.fmt.pix.pixelformat >> 0) & 0xff,
@@ -654,7 +854,9 @@ void video_get_format(struct device *dev)
 }
 
 /*
- * request, allocate and map buffers
+ * request, allocate and map buffers, dev->memtype picks the memory:
+ * V4L2_MEMORY_MMAP maps the driver's buffers, V4L2_MEMORY_USERPTR gives
+ * the driver buffers from a huge page arena, see buffer_arena.h
  * 
  * args: 
  * 		struct device *dev - put buffers in
@@ -666,15 +868,19 @@ void video_get_format(struct device *dev)
 int video_alloc_buffers(struct device *dev, int nbufs)
 {
 	struct buffer *buffers;
+	unsigned int mapped = 0;
 
 	/* request buffer */
 	struct v4l2_requestbuffers bufrequest;
 	struct v4l2_buffer querybuffer;
+	struct v4l2_buffer queuebuffer;
+	if (dev->memtype != V4L2_MEMORY_USERPTR)
+		dev->memtype = V4L2_MEMORY_MMAP;
+	dev->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 	CLEAR(bufrequest);
-	bufrequest.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	bufrequest.memory = V4L2_MEMORY_MMAP;
+	bufrequest.type = dev->type;
+	bufrequest.memory = dev->memtype;
 	bufrequest.count = nbufs;
-	dev->nbufs = nbufs;
 
 	int ret;
 	ret = ioctl(dev->fd, VIDIOC_REQBUFS, &bufrequest);
@@ -688,242 +894,1339 @@ int video_alloc_buffers(struct device *dev, int nbufs)
 	/* allocate buffer */
 	buffers = (buffer *)malloc(bufrequest.count * sizeof buffers[0]);
 	if (buffers == NULL)
-		return -ENOMEM;
+	{
+		ret = -ENOMEM;
+		goto err_reqbufs;
+	}
 
 	/* map the buffers */
-	for (unsigned int i = 0; i < dev->nbufs; i++)
+	for (unsigned int i = 0; i < bufrequest.count; i++)
 	{
 		CLEAR(querybuffer);
 		querybuffer.type = bufrequest.type;
-		querybuffer.memory = V4L2_MEMORY_MMAP;
+		querybuffer.memory = dev->memtype;
 		querybuffer.index = i;
 
 		ret = ioctl(dev->fd, VIDIOC_QUERYBUF, &querybuffer);
 		if (ret < 0)
 		{
 			printf("Unable to query buffer %u (%d).\n", i, errno);
-			return ret;
+			goto err_map;
 		}
 		printf("length: %u offset: %u\n", querybuffer.length,
 			   querybuffer.m.offset);
 
 		buffers[i].length = querybuffer.length; /* remember for munmap() */
+		buffers[i].dmabuf_fd = -1;
 
-		buffers[i].start = mmap(NULL, querybuffer.length,
-								PROT_READ | PROT_WRITE, MAP_SHARED, dev->fd,
-								querybuffer.m.offset);
+		if (dev->memtype == V4L2_MEMORY_USERPTR)
+		{
+			/* every buffer is as long as the first one */
+			if (i == 0)
+			{
+				size_t size = ((size_t)querybuffer.length + ARENA_ALIGN - 1) &
+							  ~((size_t)ARENA_ALIGN - 1);
+				dev->arena = (struct buffer_arena *)malloc(sizeof *dev->arena);
+				if (dev->arena == NULL ||
+					buffer_arena_init(dev->arena, size * bufrequest.count,
+									  dev->lock_buffers) < 0)
+				{
+					free(dev->arena);
+					dev->arena = NULL;
+					ret = -ENOMEM;
+					goto err_map;
+				}
+			}
+			buffers[i].start = buffer_arena_alloc(dev->arena, querybuffer.length);
+		}
+		else
+			buffers[i].start = mmap(NULL, querybuffer.length,
+									PROT_READ | PROT_WRITE, MAP_SHARED, dev->fd,
+									querybuffer.m.offset);
 
-		if (buffers[i].start == MAP_FAILED)
+		if (buffers[i].start == MAP_FAILED || buffers[i].start == NULL)
 		{
-			/* If you do not exit here you should unmap() and free()
-           	the buffers mapped so far. */
 			printf("Unable to map buffer %u (%d)\n", i, errno);
-			return ret;
+			ret = -ENOMEM;
+			goto err_map;
 		}
+		mapped++;
 
 		printf("Buffer mapped at address %p.\n", buffers[i].start);
 
 		CLEAR(queuebuffer);
 		queuebuffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		queuebuffer.memory = V4L2_MEMORY_MMAP;
+		queuebuffer.memory = dev->memtype;
 		queuebuffer.index = i; /* Queueing buffer index i. */
+		if (dev->memtype == V4L2_MEMORY_USERPTR)
+		{
+			queuebuffer.m.userptr = (unsigned long)buffers[i].start;
+			queuebuffer.length = buffers[i].length;
+		}
 
 		/* Put the buffer in the incoming queue. */
 		ret = ioctl(dev->fd, VIDIOC_QBUF, &queuebuffer);
 		if (ret < 0)
 		{
 			printf("Unable to queue the buffer %d\n", errno);
-			return ret;
+			goto err_map;
 		}
 	}
+	/* the driver may hand out a different number */
+	dev->nbufs = bufrequest.count;
 	dev->buffers = buffers;
 	return 0;
-}
 
-/* 
- * To get frames in few steps
- * 1. prepare information about the buffer you are queueing
- * 	  (done in video_allocate_buffers)
- * 2. activate the device streaming capability
- * 3. queue the buffer,  handling your buffer over to the device,
- *    put it into the incoming queue, wait for it to write stuff in
- * 4. decode the frame
- * 5. dequeue the buffer, the device is done, you may read the buffer
- * 6. put 3-5 in a for loop
- * 
- * args: 
- * 		struct device *dev - every infomation for camera
-*/
-int streaming_loop(struct device *dev)
-{
-	cv::namedWindow("cam", CV_WINDOW_FREERATIO);
-	image_count = 0;
-	//TODO: add a loop flag to exit
-	while (1)
+	/* give back everything mapped so far, dev keeps no buffers */
+err_map:
+	if (dev->memtype != V4L2_MEMORY_USERPTR)
+		for (unsigned int i = 0; i < mapped; i++)
+			munmap(buffers[i].start, buffers[i].length);
+	free(buffers);
+err_reqbufs:
+	CLEAR(bufrequest);
+	bufrequest.type = dev->type;
+	bufrequest.memory = dev->memtype;
+	ioctl(dev->fd, VIDIOC_REQBUFS, &bufrequest);
+	/* the driver let go of the user pointers with REQBUFS 0 */
+	if (dev->arena != NULL)
 	{
-		get_a_frame(dev);
+		buffer_arena_free(dev->arena);
+		free(dev->arena);
+		dev->arena = NULL;
 	}
-	unmap_variables();
-}
-
-/* unmap all the variables after stream ends */
-void unmap_variables()
-{
-	munmap(save_bmp, sizeof *save_bmp);
-	munmap(save_raw, sizeof *save_raw);
-	munmap(shift_flag, sizeof *shift_flag);
-	munmap(bayer_flag, sizeof *bayer_flag);
-	munmap(awb_flag, sizeof *awb_flag);
-	munmap(abc_flag, sizeof *abc_flag);
-	munmap(gamma_val, sizeof *gamma_val);
+	dev->nbufs = 0;
+	return ret;
 }
 
-/* 
- * Typically start two loops:
- * 1. runs for as long as you want to
- *    capture frames (shoot the video).
- * 2. iterates over your buffers everytime. 
+/*
+ * export every mapped buffer as a dmabuf, so other processes and devices
+ * can map a frame instead of copying it
  *
- * args: 
- * 		struct device *dev - every infomation for camera
+ * args:
+ * 		struct device *dev - buffers from video_alloc_buffers
+ * returns:
+ * 		errno, the buffers stay usable without the export
  */
-void get_a_frame(struct device *dev)
+int video_export_buffers(struct device *dev)
 {
+	struct v4l2_exportbuffer expbuf;
+	int ret;
+
+	/* user pointer memory belongs to us, there is nothing to export */
+	if (dev->memtype != V4L2_MEMORY_MMAP)
+		return -EINVAL;
 
 	for (unsigned int i = 0; i < dev->nbufs; i++)
 	{
+		CLEAR(expbuf);
+		expbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		expbuf.index = i;
+		/* consumers only read, the camera owns the contents */
+		expbuf.flags = O_RDONLY | O_CLOEXEC;
 
-		queuebuffer.index = i;
-		/* The buffer's waiting in the outgoing queue. */
-		if (ioctl(dev->fd, VIDIOC_DQBUF, &queuebuffer) < 0)
-		{
-			perror("VIDIOC_DQBUF");
-			return;
-		}
-
-		/* check the capture raw image flag, do this before decode a frame */
-		if (*(save_raw))
+		ret = ioctl(dev->fd, VIDIOC_EXPBUF, &expbuf);
+		if (ret < 0)
 		{
-			printf("save a raw\n");
-			char buf_name[16];
-			snprintf(buf_name, sizeof(buf_name), "captures_%d.raw", image_count);
-			v4l2_core_save_data_to_file(buf_name,
-										dev->buffers->start, dev->imagesize);
-			image_count++;
-			set_save_raw_flag(0);
+			printf("Unable to export buffer %u (%d)\n", i, errno);
+			return ret;
 		}
+		dev->buffers[i].dmabuf_fd = expbuf.fd;
+	}
+	printf("%u buffers exported as dmabuf.\n", dev->nbufs);
+	return 0;
+}
 
-		decode_a_frame(dev, dev->buffers->start, set_shift(shift_flag));
+/* frames come from the camera's capture ring, set up as the context says */
+static int open_camera_source(struct cam_ctx *ctx)
+{
+	int ret = frame_source_v4l2(&ctx->source, &ctx->dev, &ctx->ring);
+	if (ret < 0)
+		return ret;
+	capture_ring_set_policy(&ctx->ring, ctx->queue_policy);
+	capture_ring_set_cpu(&ctx->ring, ctx->capture_cpu);
+	capture_ring_set_realtime(&ctx->ring, ctx->realtime);
+	capture_ring_set_stats(&ctx->ring, &ctx->stats);
+	/* measure until the count is picked, not again after it is applied */
+	if (ctx->tune.window > 0 && ctx->tune_chosen == 0)
+		capture_ring_set_tune(&ctx->ring, &ctx->tune);
+	return 0;
+}
 
-		if (ioctl(dev->fd, VIDIOC_QBUF, &queuebuffer) < 0)
-		{
-			perror("VIDIOC_QBUF");
-			return;
-		}
+/*
+ * start the frame source unless streaming_stop came first, the source is
+ * freed if it doesn't start
+ * args:
+ * 		ctx - camera context
+ * returns:
+ * 		error value
+ */
+static int start_source(struct cam_ctx *ctx)
+{
+	__LOCK_MUTEX(&ctx->stream_mutex);
+	if (ctx->stop_requested || frame_source_start(&ctx->source) < 0)
+	{
+		__UNLOCK_MUTEX(&ctx->stream_mutex);
+		if (!ctx->stop_requested)
+			printf("couldn't start capture thread\n");
+		frame_source_free(&ctx->source);
+		CLEAR(ctx->source);
+		return -1;
 	}
-	return;
+	ctx->source_started = 1;
+	__UNLOCK_MUTEX(&ctx->stream_mutex);
+
+	/* consumers in other processes map the camera buffers, no copies */
+	if (ctx->share_path != NULL && ctx->replay_path == NULL &&
+		(ctx->dev.buffers[0].dmabuf_fd >= 0 || video_export_buffers(&ctx->dev) == 0))
+		frame_share_open(&ctx->share, &ctx->ring, ctx->share_path);
+	return 0;
 }
 
-/* 
- * opencv only support debayering 8 and 16 bits 
- * 
- * decode the frame, move each pixel by certain bits,
- * and mask it for 8 bits, render a frame using opencv
- * args: 
- * 		struct device *dev - every infomation for camera
- * 		const void *p - pointer for the buffer
- * 		int shift - values to shift(RAW10 - 2, RAW12 - 4, YUV422 - 0) 
- * 
- */
-void decode_a_frame(struct device *dev, const void *p, int shift)
+/* keep the last seconds of frames of the current geometry */
+static void start_burst_ring(struct cam_ctx *ctx)
 {
-	int height = dev->height;
-	int width = dev->width;
-	unsigned char tmp;
-	unsigned short *srcShort = (unsigned short *)p;
-	unsigned char *dst = (unsigned char *)p;
-	unsigned short ts;
+	struct device *dev = &ctx->dev;
 
-	/* --- for bayer camera ---*/
-	if (shift != 0)
+	if (ctx->pre_trigger_seconds <= 0)
+		return;
+	int fps = ctx->replay_path ? (int)ctx->replay_fps : get_frame_rate(dev->fd);
+	if (fps <= 0)
+		fps = 30;
+	if (burst_ring_init(&ctx->burst, dev, ctx->pre_trigger_seconds * fps) < 0)
+		printf("couldn't set up the pre-trigger ring, burst mode is off\n");
+}
+
+/*
+ * hand streaming_loop a format to switch to, checked already
+ * args:
+ * 		ctx   - camera context
+ * 		nbufs - buffers to allocate, 0 keeps the count
+ * returns:
+ * 		error value, -EAGAIN if nothing is streaming
+ */
+static int request_reconfigure(struct cam_ctx *ctx, unsigned int width,
+							   unsigned int height, unsigned int pixelformat,
+							   unsigned int fps, unsigned int nbufs)
+{
+	__LOCK_MUTEX(&ctx->stream_mutex);
+	if (!ctx->source_started || ctx->stop_requested)
 	{
-/* shift bits for 16-bit stream and get lower 8-bit for opencv 
-	 	 * debayering */
-/* use openmp loop parallelism to accelate shifting */
-#pragma omp for
-		for (int i = 0; i < height; i++)
-		{
-			for (int j = 0; j < width; j++)
-			{
-				ts = *(srcShort++);
-				if (ts > 64)
-					tmp = (ts - 64) >> shift;
-				else
-				{
-					tmp = 0;
-				}
-				
-				*(dst++) = (unsigned char)tmp;
-			}
-		}
+		__UNLOCK_MUTEX(&ctx->stream_mutex);
+		return -EAGAIN;
+	}
+	ctx->reconfig_width = width;
+	ctx->reconfig_height = height;
+	ctx->reconfig_pixelformat = pixelformat;
+	ctx->reconfig_fps = fps;
+	ctx->reconfig_nbufs = nbufs;
+	ctx->reconfig_pending = 1;
+	/* the loop drains the frames already dequeued and comes back */
+	frame_source_cancel(&ctx->source);
+	__UNLOCK_MUTEX(&ctx->stream_mutex);
+	return 0;
+}
 
-		cv::Mat img(height, width, CV_8UC1, (void *)p);
-		cv::cvtColor(img, img, CV_BayerBG2BGR + add_bayer_forcv(bayer_flag));
-		//flip(img, img, 0); //mirror vertically
-		//flip(img, img, 1); //mirror horizontally
-		//apply_gamma(p, gamma_val, height, width);
-		img = apply_gamma_correction(img);
-		/* check awb flag, awb functionality, only available for bayer camera */
-		if (*(awb_flag) == 1)
-		{
-			img = apply_white_balance(img);
+/*
+ * the warm-up window is over, pick the buffer count and restart the
+ * camera with it if asked to, called by streaming_loop
+ * args:
+ * 		ctx - camera context
+ */
+static void finish_buffer_tune(struct cam_ctx *ctx)
+{
+	struct device *dev = &ctx->dev;
+
+	/* nothing is added after the window, this only stops the reports */
+	capture_ring_set_tune(&ctx->ring, NULL);
+	ctx->tune_chosen = buffer_tune_choose(&ctx->tune, dev->nbufs);
+	if (!ctx->tune_apply || ctx->tune_chosen == dev->nbufs)
+		return;
+	printf("buffer tune: restarting with %u buffers\n", ctx->tune_chosen);
+	request_reconfigure(ctx, dev->width, dev->height, dev->pixelformat,
+						get_frame_rate(dev->fd), ctx->tune_chosen);
+}
+
+/*
+ * switch the camera to the format stream_reconfigure asked for, the
+ * source has ended and every frame of the old format is processed:
+ * stream off, give back the buffers, set the format and frame rate,
+ * allocate buffers for it and stream on again. The decode and snapshot
+ * buffers are kept if they are big enough, the pre-trigger ring is made
+ * anew and a running recording goes on in a new file.
+ * args:
+ * 		ctx - camera context
+ * returns:
+ * 		error value, the source is cleared then
+ */
+static int reconfigure_stream(struct cam_ctx *ctx)
+{
+	struct device *dev = &ctx->dev;
+	unsigned int nbufs = dev->nbufs;
+	unsigned int old_width = dev->width, old_height = dev->height;
+	unsigned int width, height, pixelformat, fps, new_nbufs;
+	int ret;
+
+	__LOCK_MUTEX(&ctx->stream_mutex);
+	width = ctx->reconfig_width;
+	height = ctx->reconfig_height;
+	pixelformat = ctx->reconfig_pixelformat;
+	fps = ctx->reconfig_fps;
+	new_nbufs = ctx->reconfig_nbufs ? ctx->reconfig_nbufs : nbufs;
+	ctx->reconfig_pending = 0;
+	ctx->reconfig_nbufs = 0;
+	ctx->source_started = 0;
+	__UNLOCK_MUTEX(&ctx->stream_mutex);
+
+	/* everything that holds the old buffers or knows the old geometry */
+	frame_share_close(&ctx->share);
+	frame_source_stop(&ctx->source);
+	frame_source_free(&ctx->source);
+	CLEAR(ctx->source);
+	stop_raw_recording(ctx);
+	burst_ring_free(&ctx->burst);
+	stop_Camera(dev);
+	video_free_buffers(dev);
+
+	/* a format the driver refuses leaves the old one streaming */
+	if (video_set_format(dev, width, height, pixelformat) < 0)
+		printf("reconfigure: keeping %ux%u\n", old_width, old_height);
+	else if (fps > 0)
+		set_frame_rate(dev->fd, fps);
+	video_get_format(dev);
+
+	/* on failure dev is left without buffers, nothing to free twice */
+	if (video_alloc_buffers(dev, new_nbufs) < 0)
+	{
+		printf("reconfigure: couldn't allocate buffers for %ux%u\n",
+			   dev->width, dev->height);
+		return -ENOMEM;
+	}
+	start_camera(dev);
+
+	ret = frame_pool_resize(&ctx->decode_pool, (size_t)dev->width * dev->height * 2);
+	if (ret == 0)
+	{
+		size_t snapshot_size = (size_t)dev->width * dev->height * 3;
+		if ((size_t)dev->imagesize > snapshot_size)
+			snapshot_size = dev->imagesize;
+		if (snapshot_writer_resize(&ctx->snapshots, snapshot_size) < 0)
+			printf("reconfigure: snapshots of %ux%u won't fit\n", dev->width,
+				   dev->height);
+		ret = open_camera_source(ctx);
+	}
+	if (ret < 0)
+	{
+		stop_Camera(dev);
+		video_free_buffers(dev);
+		return ret;
+	}
+	ret = start_source(ctx);
+	if (ret < 0)
+		return ret;
+	start_burst_ring(ctx);
+	printf("reconfigure: %ux%u -> %ux%u, %d fps, %u buffers\n", old_width,
+		   old_height, dev->width, dev->height, get_frame_rate(dev->fd),
+		   dev->nbufs);
+	return 0;
+}
+
+/* one more format switch, gap in ms from the last old to the first new frame */
+static void count_reconfigure(struct cam_ctx *ctx, double gap)
+{
+	ctx->reconfig_count++;
+	ctx->reconfig_gap_total += gap;
+	if (gap > ctx->reconfig_gap_max)
+		ctx->reconfig_gap_max = gap;
+	printf("reconfigure: %.1f ms from the last old frame to the first new one\n",
+		   gap);
+}
+
+/* stage times since the last report, now in omp_get_wtime seconds */
+static void report_stage_times(struct cam_ctx *ctx, double now)
+{
+	struct stage_snapshot snap;
+
+	stage_timers_snapshot(&snap);
+	printf("stage times over %.1f s:\n", now - ctx->stage_report_time);
+	stage_timers_print(STDOUT_FILENO, &snap, &ctx->stage_report);
+	ctx->stage_report = snap;
+	ctx->stage_report_time = now;
+}
+
+/* 
+ * To get frames in few steps
+ * 1. prepare information about the buffer you are queueing
+ * 	  (done in video_allocate_buffers)
+ * 2. activate the device streaming capability
+ * 3. start the capture thread, it dequeues whichever buffer the device
+ *    filled first and keeps the rest of them queued
+ * 4. decode the frame
+ * 5. queue the buffer back, handling your buffer over to the device
+ * 6. put 4-5 in a loop until the source ends or streaming_stop, switching
+ *    formats in between when stream_reconfigure asks for it
+ * 
+ * args: 
+ * 		ctx - camera context, its device streaming or a replay set
+*/
+int streaming_loop(struct cam_ctx *ctx)
+{
+	struct device *dev = &ctx->dev;
+	double last_frame = 0, switched = 0;
+
+	ctx->image_count = 0;
+	ctx->tune_chosen = 0;
+	buffer_tune_reset(&ctx->tune);
+	stream_stats_init(&ctx->stats);
+	ctx->stage_report_time = omp_get_wtime();
+	stage_timers_snapshot(&ctx->stage_report);
+	isp_kernels_init();
+
+	/* a replay sets the frame geometry, so it goes first */
+	if (ctx->replay_path != NULL)
+	{
+		if (frame_source_replay(&ctx->source, dev, ctx->replay_path,
+								ctx->replay_fps, ctx->replay_loops) < 0)
+			return -1;
+	}
+	else if (open_camera_source(ctx) < 0)
+		return -ENOMEM;
+
+	/* yuyv is the largest thing we unpack, 2 bytes per pixel */
+	if (frame_pool_init(&ctx->decode_pool, DECODE_POOL_BUFFERS,
+						(size_t)dev->width * dev->height * 2) < 0)
+	{
+		frame_source_free(&ctx->source);
+		return -ENOMEM;
+	}
+	/* what is mapped so far is faulted in now, the rest when it is mapped */
+	if (ctx->realtime > 0 && ctx->replay_path == NULL)
+		realtime_lock_memory();
+	if (start_source(ctx) < 0)
+	{
+		frame_pool_free(&ctx->decode_pool);
+		return -1;
+	}
+
+	/* a snapshot is either the raw frame or the bgr image */
+	size_t snapshot_size = (size_t)dev->width * dev->height * 3;
+	if ((size_t)dev->imagesize > snapshot_size)
+		snapshot_size = dev->imagesize;
+	if (snapshot_writer_init(&ctx->snapshots, snapshot_size,
+							 ctx->snapshot_fsync) < 0)
+		printf("couldn't start snapshot writer, captures are disabled\n");
+	start_burst_ring(ctx);
+	while (1)
+	{
+		while (ctx->source.running)
+		{
+			unsigned long frames = ctx->source.frames;
+
+			get_a_frame(ctx);
+			if (ctx->source.frames == frames)
+				continue;
+			last_frame = omp_get_wtime();
+			if (switched > 0)
+				count_reconfigure(ctx, (last_frame - switched) * 1e3);
+			switched = 0;
+			if (ctx->tune.window > 0 && ctx->tune_chosen == 0 &&
+				buffer_tune_done(&ctx->tune))
+				finish_buffer_tune(ctx);
+			if (ctx->stage_report_seconds > 0 &&
+				last_frame - ctx->stage_report_time >= ctx->stage_report_seconds)
+				report_stage_times(ctx, last_frame);
 		}
-		if (*(abc_flag) == 1)
+		__LOCK_MUTEX(&ctx->stream_mutex);
+		int reconfigure = ctx->reconfig_pending && !ctx->stop_requested;
+		/* another format holds buffers for longer or shorter, tune again */
+		if (reconfigure && ctx->reconfig_nbufs == 0)
 		{
-			img = apply_auto_brightness_and_contrast(img, 1);
+			ctx->tune_chosen = 0;
+			buffer_tune_reset(&ctx->tune);
+		}
+		__UNLOCK_MUTEX(&ctx->stream_mutex);
+		if (!reconfigure)
+			break;
+		switched = last_frame;
+		if (reconfigure_stream(ctx) < 0)
+			break;
+	}
+
+	__LOCK_MUTEX(&ctx->stream_mutex);
+	ctx->source_started = 0;
+	__UNLOCK_MUTEX(&ctx->stream_mutex);
+	frame_share_close(&ctx->share);
+	/* a failed reconfigure already took the source down */
+	if (ctx->source.ops != NULL)
+	{
+		frame_source_stop(&ctx->source);
+		print_stream_stats(ctx);
+		frame_source_free(&ctx->source);
+	}
+	stop_raw_recording(ctx);
+	burst_ring_free(&ctx->burst);
+	stop_snapshot_writer(ctx);
+	frame_pool_free(&ctx->decode_pool);
+	return 0;
+}
+
+static void *stream_thread(void *arg)
+{
+	struct cam_ctx *ctx = (struct cam_ctx *)arg;
+
+	pthread_setname_np(pthread_self(), "stream");
+	streaming_loop(ctx);
+	__atomic_store_n(&ctx->streaming, 0, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/*
+ * run streaming_loop on a thread of its own, the caller keeps the gui
+ * args:
+ * 		ctx - camera context, its device streaming or a replay set
+ * returns:
+ * 		error value
+ */
+int streaming_start(struct cam_ctx *ctx)
+{
+	int ret;
+
+	if (ctx->stream_thread)
+		return -EBUSY;
+	ctx->stop_requested = 0;
+	ctx->streaming = 1;
+	ret = __THREAD_CREATE(&ctx->stream_thread, stream_thread, ctx);
+	if (ret != 0)
+	{
+		printf("Unable to create streaming thread: %s\n", strerror(ret));
+		ctx->streaming = 0;
+		ctx->stream_thread = 0;
+		return -ret;
+	}
+	return 0;
+}
+
+/*
+ * returns:
+ * 		1 while the thread from streaming_start is running, 0 once the
+ * 		source ended or it was stopped
+ */
+int streaming_running(struct cam_ctx *ctx)
+{
+	return __atomic_load_n(&ctx->streaming, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * end streaming_loop from any thread and wait for streaming_start's
+ * thread, frames in flight are finished first
+ * args:
+ * 		ctx - camera context
+ */
+void streaming_stop(struct cam_ctx *ctx)
+{
+	__LOCK_MUTEX(&ctx->stream_mutex);
+	ctx->stop_requested = 1;
+	if (ctx->source_started)
+		frame_source_cancel(&ctx->source);
+	__UNLOCK_MUTEX(&ctx->stream_mutex);
+
+	if (ctx->stream_thread)
+		__THREAD_JOIN(ctx->stream_thread);
+	ctx->stream_thread = 0;
+}
+
+/*
+ * switch a streaming camera to another frame size, format or rate, from
+ * any thread, streaming_loop finishes the frames it has, restarts the
+ * camera with the new format and reports how long the switch took
+ * args:
+ * 		ctx 		- camera context, streaming from the camera
+ * 		width 		- one of the sizes cam_caps_print lists
+ * 		height
+ * 		pixelformat - 0 keeps the current one
+ * 		fps 		- 0 for the driver's default for the size
+ * returns:
+ * 		error value, -EINVAL for a format the camera doesn't list, -EAGAIN
+ * 		if nothing is streaming
+ */
+int stream_reconfigure(struct cam_ctx *ctx, unsigned int width,
+					   unsigned int height, unsigned int pixelformat,
+					   unsigned int fps)
+{
+	int fd = ctx->dev.fd;
+
+	if (ctx->replay_path != NULL)
+		return -EINVAL;
+	if (pixelformat == 0)
+		pixelformat = ctx->dev.pixelformat;
+	if (cam_caps_check_format(fd, pixelformat, width, height) < 0 ||
+		(fps > 0 && cam_caps_check_rate(fd, pixelformat, width, height, fps) < 0))
+		return -EINVAL;
+	return request_reconfigure(ctx, width, height, pixelformat, fps, 0);
+}
+
+/*
+ * returns:
+ * 		number of capture buffers currently held by this process,
+ * 		once it reaches dev->nbufs the device has nothing left to fill
+ */
+unsigned int get_capture_ring_fill(struct cam_ctx *ctx)
+{
+	return capture_ring_fill(&ctx->ring);
+}
+
+/*
+ * enable/disable giving v4l2 buffers back to the driver right after 
+ * unpacking them into a working buffer
+ * args:
+ * 		enable - 1: requeue after unpack, 0: requeue after display
+ */
+void set_out_of_place_decode(struct cam_ctx *ctx, int enable)
+{
+	ctx->out_of_place_decode = enable;
+}
+
+/*
+ * enable/disable fsync after every raw/bmp capture, takes effect
+ * the next time streaming starts
+ * args:
+ * 		enable - 1: wait for the disk before a capture counts as saved
+ */
+void set_snapshot_fsync(struct cam_ctx *ctx, int enable)
+{
+	ctx->snapshot_fsync = enable;
+}
+
+/*
+ * choose how recordings are written
+ * args:
+ * 		name - "buffered": pwrite through the page cache
+ * 			   "uring": O_DIRECT writes on io_uring, several in flight
+ * returns:
+ * 		error value
+ */
+int set_record_backend(struct cam_ctx *ctx, const char *name)
+{
+	if (strcmp(name, "buffered") == 0)
+		ctx->record_backend = &record_backend_buffered;
+	else if (strcmp(name, "uring") == 0)
+		ctx->record_backend = &record_backend_uring;
+	else
+		return -EINVAL;
+	return 0;
+}
+
+/*
+ * write synthetic frames of the current format through the chosen 
+ * recording backend and report sustained MB/s and write latency
+ * args:
+ * 		ctx    - camera context, its current format
+ * 		frames - number of frames to write
+ */
+int record_benchmark(struct cam_ctx *ctx, unsigned int frames)
+{
+	return raw_recorder_benchmark(&ctx->dev, "record_bench.lraw",
+								  ctx->record_backend, frames);
+}
+
+/*
+ * stream frames into one kind of buffer memory and unpack each of them
+ * the way decode does, then print throughput, unpack time and hold time
+ * args:
+ * 		ctx    - camera context, camera open and not streaming
+ * 		frames - number of frames
+ * 		frame  - unpack destination, width * height * 2 bytes
+ * returns:
+ * 		error value
+ */
+static int capture_benchmark_run(struct cam_ctx *ctx, unsigned int frames,
+								 void *frame)
+{
+	struct device *dev = &ctx->dev;
+	unsigned int nbufs = dev->nbufs;
+	int shift_flag = GET_CONTROL(ctx, shift_flag);
+	int shift = set_shift(&shift_flag);
+	struct v4l2_buffer *buf;
+	void *data;
+	double unpack_total = 0, unpack_max = 0;
+	unsigned int count = 0;
+
+	if (video_alloc_buffers(dev, nbufs) < 0)
+	{
+		dev->nbufs = nbufs;
+		return -1;
+	}
+	start_camera(dev);
+	if (frame_source_v4l2(&ctx->source, dev, &ctx->ring) == 0 &&
+		frame_source_start(&ctx->source) == 0)
+	{
+		while (count < frames &&
+			   (buf = frame_source_acquire(&ctx->source, &data)) != NULL)
+		{
+			double start = omp_get_wtime();
+			unpack_a_frame(dev, data, frame, shift);
+			double took = (omp_get_wtime() - start) * 1e6;
+			frame_source_release(&ctx->source, buf);
+			unpack_total += took;
+			if (took > unpack_max)
+				unpack_max = took;
+			count++;
+		}
+		frame_source_stop(&ctx->source);
+		printf("capture bench(%s):\n",
+			   dev->memtype == V4L2_MEMORY_USERPTR ? "userptr" : "mmap");
+		frame_source_print_stats(&ctx->source);
+		printf("unpack: avg %.1f us, max %.1f us\n",
+			   count ? unpack_total / count : 0, unpack_max);
+		print_buffer_hold_time(ctx);
+	}
+	frame_source_free(&ctx->source);
+	stop_Camera(dev);
+	video_free_buffers(dev);
+	dev->nbufs = nbufs;
+	return count == frames ? 0 : -1;
+}
+
+/*
+ * capture the same number of frames into driver mapped buffers and into
+ * the huge page arena, to compare the two
+ * args:
+ * 		ctx    - camera context, camera open and not streaming
+ * 		frames - number of frames for each run
+ * returns:
+ * 		error value
+ */
+int capture_benchmark(struct cam_ctx *ctx, unsigned int frames)
+{
+	struct device *dev = &ctx->dev;
+	enum v4l2_memory memtype = dev->memtype;
+	const enum v4l2_memory modes[] = {V4L2_MEMORY_MMAP, V4L2_MEMORY_USERPTR};
+	void *frame = NULL;
+	int ret = 0;
+
+	if (posix_memalign(&frame, FRAME_POOL_ALIGN,
+					   (size_t)dev->width * dev->height * 2) != 0)
+		return -ENOMEM;
+	for (unsigned int i = 0; i < SIZE(modes) && ret == 0; i++)
+	{
+		dev->memtype = modes[i];
+		ret = capture_benchmark_run(ctx, frames, frame);
+	}
+	dev->memtype = memtype;
+	free(frame);
+	return ret;
+}
+
+/* round trips timed by control_benchmark */
+enum control_bench_op {
+	BENCH_G_CTRL,
+	BENCH_S_CTRL,
+	BENCH_S_PARM,
+	BENCH_XU_GET_CUR,
+	BENCH_SENSOR_REG,
+	BENCH_OPS,
+};
+
+static const char *control_bench_names[BENCH_OPS] = {
+	"G_CTRL exposure", "S_CTRL exposure", "G_PARM+S_PARM",
+	"XU GET_CUR", "sensor reg read",
+};
+
+/*
+ * one round trip of a control, S_CTRL and S_PARM write back what the
+ * camera already has so nothing changes
+ * args:
+ * 		fd   - file descriptor
+ * 		op   - which control
+ * 		ctrl - exposure control read before
+ * returns:
+ * 		ioctl result
+ */
+static int control_bench_once(int fd, int op, struct v4l2_control *ctrl)
+{
+	unsigned char xu[LI_XU_SENSOR_UUID_HWFW_REV_SIZE] = {0};
+	struct v4l2_streamparm parm;
+	int ret;
+
+	switch (op)
+	{
+	case BENCH_G_CTRL:
+		return ioctl(fd, VIDIOC_G_CTRL, ctrl);
+	case BENCH_S_CTRL:
+		return ioctl(fd, VIDIOC_S_CTRL, ctrl);
+	case BENCH_S_PARM:
+		CLEAR(parm);
+		parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		if ((ret = ioctl(fd, VIDIOC_G_PARM, &parm)) != 0)
+			return ret;
+		return ioctl(fd, VIDIOC_S_PARM, &parm);
+	case BENCH_XU_GET_CUR:
+		return read_from_UVC_extension(fd, LI_XU_SENSOR_UUID_HWFW_REV,
+									   LI_XU_SENSOR_UUID_HWFW_REV_SIZE, xu);
+	default:
+		/* what sensor_reg_read does, without its print */
+		xu[0] = 0; /* 0 indicates for read */
+		if ((ret = write_to_UVC_extension(fd, LI_XU_SENSOR_REG_RW,
+										  LI_XU_SENSOR_REG_RW_SIZE, xu)) != 0)
+			return ret;
+		return read_from_UVC_extension(fd, LI_XU_SENSOR_REG_RW,
+									   LI_XU_SENSOR_REG_RW_SIZE, xu);
+	}
+}
+
+static int compare_us(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * time the control round trips the gui and the control socket make,
+ * a control the camera doesn't support is reported and skipped
+ * args:
+ * 		ctx    - camera context, camera open and not streaming
+ * 		rounds - round trips of each control
+ * returns:
+ * 		error value
+ */
+int control_benchmark(struct cam_ctx *ctx, unsigned int rounds)
+{
+	int fd = ctx->dev.fd;
+	struct v4l2_control ctrl;
+	double *took;
+
+	if (rounds == 0)
+		return -EINVAL;
+	if ((took = (double *)malloc(rounds * sizeof *took)) == NULL)
+		return -ENOMEM;
+	CLEAR(ctrl);
+	ctrl.id = V4L2_CID_EXPOSURE_ABSOLUTE;
+
+	printf("control bench: %u round trips each\n", rounds);
+	for (int op = 0; op < BENCH_OPS; op++)
+	{
+		unsigned int count = 0;
+		double total = 0;
+
+		/* the first one also fills ctrl for S_CTRL */
+		if (control_bench_once(fd, op, &ctrl) != 0)
+		{
+			printf("%-16s not supported: %s\n", control_bench_names[op],
+				   strerror(errno));
+			continue;
+		}
+		while (count < rounds)
+		{
+			double start = omp_get_wtime();
+			if (control_bench_once(fd, op, &ctrl) != 0)
+				break;
+			took[count] = (omp_get_wtime() - start) * 1e6;
+			total += took[count++];
+		}
+		if (count < rounds)
+			printf("%-16s failed after %u: %s\n", control_bench_names[op],
+				   count, strerror(errno));
+		if (count == 0)
+			continue;
+		qsort(took, count, sizeof *took, compare_us);
+		printf("%-16s avg %.1f us, p50 %.1f us, p99 %.1f us, max %.1f us\n",
+			   control_bench_names[op], total / count, took[count / 2],
+			   took[(count - 1) * 99 / 100], took[count - 1]);
+	}
+	free(took);
+	return 0;
+}
+
+/* finish the container file and print the recording statistics */
+void stop_raw_recording(struct cam_ctx *ctx)
+{
+	if (!ctx->recorder.running)
+		return;
+	raw_recorder_stop(&ctx->recorder);
+	raw_recorder_print_stats(&ctx->recorder);
+}
+
+/* per-frame values for raw frame headers */
+static void get_frame_meta(struct cam_ctx *ctx, struct raw_frame_meta *meta)
+{
+	int shift_flag = GET_CONTROL(ctx, shift_flag);
+	int bayer_flag = GET_CONTROL(ctx, bayer_flag);
+
+	meta->exposure = GET_CONTROL(ctx, exposure_val);
+	meta->gain = GET_CONTROL(ctx, gain_val);
+	meta->datatype = shift_flag ? shift_flag : 1; /* RAW10 by default */
+	meta->bayer = add_bayer_forcv(&bayer_flag);
+}
+
+/*
+ * keep the frame in the pre-trigger ring and flush it on a trigger,
+ * start or stop recording when the record flag changed, then hand the
+ * frame to the recorder
+ * args:
+ * 		ctx  - camera context
+ * 		buf  - dequeued v4l2 buffer
+ * 		data - its data
+ */
+static void record_a_frame(struct cam_ctx *ctx, struct v4l2_buffer *buf,
+						   const void *data)
+{
+	struct raw_frame_meta meta;
+	int record = GET_CONTROL(ctx, record_flag);
+
+	if (!record && !ctx->recorder.running && !ctx->burst.running)
+		return;
+	STAGE_TIMER(STAGE_RECORD);
+
+	if (ctx->burst.running)
+	{
+		/* the frame the trigger came with is the last one of the burst */
+		get_frame_meta(ctx, &meta);
+		burst_ring_add_frame(&ctx->burst, buf, data, &meta);
+		if (TAKE_CONTROL(ctx, burst_flag))
+			burst_ring_trigger(&ctx->burst);
+	}
+
+	if (record && !ctx->recorder.running)
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "record_%d.lraw", ctx->record_count++);
+		if (raw_recorder_start(&ctx->recorder, &ctx->dev, name,
+							   ctx->record_backend) < 0)
+		{
+			printf("couldn't start recording\n");
+			SET_CONTROL(ctx, record_flag, 0);
+			return;
+		}
+	}
+	else if (!record && ctx->recorder.running)
+		stop_raw_recording(ctx);
+	if (!ctx->recorder.running)
+		return;
+
+	get_frame_meta(ctx, &meta);
+	if (raw_recorder_add_frame(&ctx->recorder, buf, data, &meta) == -ENOMEM)
+	{
+		printf("recording failed, stopping it\n");
+		SET_CONTROL(ctx, record_flag, 0);
+		stop_raw_recording(ctx);
+	}
+}
+
+/* write out pending captures and print the snapshot writer statistics */
+void stop_snapshot_writer(struct cam_ctx *ctx)
+{
+	if (!ctx->snapshots.running)
+		return;
+	snapshot_writer_stop(&ctx->snapshots);
+	snapshot_writer_print_stats(&ctx->snapshots);
+}
+
+/*
+ * replay recorded frames instead of streaming from the camera
+ * args:
+ * 		ctx   - camera context, no device needed
+ * 		path  - raw container file or directory of captures_N.raw files
+ * 		fps   - frames per second, 0 for as fast as decode takes them
+ * 		loops - passes over all frames, 0 for forever
+ */
+void set_replay_source(struct cam_ctx *ctx, const char *path, double fps,
+					   unsigned int loops)
+{
+	ctx->replay_path = path;
+	ctx->replay_fps = fps;
+	ctx->replay_loops = loops;
+}
+
+/*
+ * enable/disable handing frames to cam_ctx_show, decode and isp still run
+ * args:
+ * 		ctx    - camera context
+ * 		enable - 0 for headless runs
+ */
+void set_display(struct cam_ctx *ctx, int enable)
+{
+	ctx->display_enabled = enable;
+}
+
+/*
+ * hand the camera's frames to other processes while streaming
+ * args:
+ * 		ctx  - camera context
+ * 		path - unix socket consumers connect to, NULL for none
+ */
+void set_frame_share(struct cam_ctx *ctx, const char *path)
+{
+	ctx->share_path = path;
+}
+
+/*
+ * what the capture ring does when decode doesn't keep up, takes effect
+ * when streaming starts
+ * args:
+ * 		ctx    - camera context
+ * 		policy - block, drop the oldest or the newest frame
+ */
+void set_queue_policy(struct cam_ctx *ctx, enum frame_queue_policy policy)
+{
+	ctx->queue_policy = policy;
+}
+
+/*
+ * real-time capture, takes effect when streaming starts
+ * args:
+ * 		ctx 	 - camera context
+ * 		priority - SCHED_FIFO priority of the capture thread, 1 to 99, with
+ * 				   the process memory locked, 0 keeps normal scheduling,
+ * 				   both report the capture thread's scheduling latency,
+ * 				   -1 for none of it
+ * 		cpu 	 - for the capture thread, ideally an isolated one, -1
+ * 				   anywhere
+ */
+void set_realtime_capture(struct cam_ctx *ctx, int priority, int cpu)
+{
+	ctx->realtime = priority;
+	ctx->capture_cpu = cpu;
+}
+
+/*
+ * pick the buffer count from the first seconds of streaming, takes effect
+ * when streaming starts and again after every format switch
+ * args:
+ * 		ctx 	   - camera context
+ * 		seconds    - warm-up window, 0 keeps the count as set
+ * 		percentile - of processing hold times the buffers cover, e.g. 99
+ * 		apply 	   - restart the camera with the count, otherwise it is
+ * 					 only printed
+ */
+void set_buffer_tune(struct cam_ctx *ctx, double seconds, double percentile,
+					 int apply)
+{
+	buffer_tune_init(&ctx->tune, seconds, percentile);
+	ctx->tune_apply = apply;
+}
+
+/*
+ * print how long every pipeline stage took every so often while streaming,
+ * the whole run is printed when it stops either way
+ * args:
+ * 		ctx 	- camera context
+ * 		seconds - between reports, 0 for none
+ */
+void set_stage_report(struct cam_ctx *ctx, double seconds)
+{
+	ctx->stage_report_seconds = seconds;
+}
+
+/*
+ * frame loss and latency figures of the camera so far, safe from any
+ * thread while it streams
+ * args:
+ * 		ctx  - camera context
+ * 		snap - gets a copy of them
+ */
+void get_stream_stats(struct cam_ctx *ctx, struct stream_stats *snap)
+{
+	stream_stats_snapshot(&ctx->stats, snap);
+}
+
+/* print frame throughput and, for a camera, the buffer hold time */
+void print_stream_stats(struct cam_ctx *ctx)
+{
+	frame_source_print_stats(&ctx->source);
+	if (ctx->replay_path == NULL)
+	{
+		print_buffer_hold_time(ctx);
+		capture_ring_print_queue(&ctx->ring);
+		capture_ring_print_latency(&ctx->ring);
+
+		struct stream_stats snap;
+		get_stream_stats(ctx, &snap);
+		stream_stats_print(&snap);
+	}
+
+	struct stage_snapshot stages;
+	stage_timers_snapshot(&stages);
+	stage_timers_print(STDOUT_FILENO, &stages, NULL);
+	if (ctx->reconfig_count > 0)
+		printf("reconfigure: %u switches, gap avg %.1f ms, max %.1f ms\n",
+			   ctx->reconfig_count, ctx->reconfig_gap_total / ctx->reconfig_count,
+			   ctx->reconfig_gap_max);
+}
+
+/* print how long v4l2 buffers were kept away from the driver */
+void print_buffer_hold_time(struct cam_ctx *ctx)
+{
+	double avg, max, last;
+	capture_ring_hold_time(&ctx->ring, &avg, &max, &last);
+	printf("buffer hold time(%s): avg %.1f us, max %.1f us, last %.1f us\n",
+		   ctx->out_of_place_decode ? "out of place" : "in place", avg, max, last);
+}
+
+/* 
+ * take the oldest frame the capture thread dequeued, decode it and give 
+ * its buffer back to the device
+ * in out of place mode the buffer goes back as soon as it is unpacked into 
+ * a working buffer, so the isp and display don't keep it from the driver
+ *
+ * args: 
+ * 		ctx - camera context
+ */
+void get_a_frame(struct cam_ctx *ctx)
+{
+	struct device *dev = &ctx->dev;
+	struct v4l2_buffer *buf;
+	void *data;
+	int shift_flag = GET_CONTROL(ctx, shift_flag);
+	int shift = set_shift(&shift_flag);
+
+	buf = frame_source_acquire(&ctx->source, &data);
+	if (buf == NULL)
+		return;
+	/* what this thread traces from here on belongs to this frame */
+	frame_trace_set_frame(buf->sequence);
+	STAGE_TIMER(STAGE_FRAME);
+	ctx->frame_dq_time = ctx->replay_path ? 0
+						 : capture_ring_dequeue_time(&ctx->ring, buf->index);
+
+	/* check the capture raw image flag, do this before decode a frame */
+	if (TAKE_CONTROL(ctx, save_raw))
+	{
+		STAGE_TIMER(STAGE_SAVE_RAW);
+		printf("save a raw\n");
+		char buf_name[16];
+		snprintf(buf_name, sizeof(buf_name), "captures_%d.raw", ctx->image_count);
+		snapshot_writer_queue_raw(&ctx->snapshots, buf_name, data, dev->imagesize);
+		ctx->image_count++;
+	}
+	record_a_frame(ctx, buf, data);
+
+	if (!ctx->out_of_place_decode)
+	{
+		decode_a_frame(ctx, data, shift);
+		frame_source_release(&ctx->source, buf);
+		return;
+	}
+
+	void *frame = frame_pool_get(&ctx->decode_pool, 1);
+	if (frame == NULL)
+	{
+		frame_source_release(&ctx->source, buf);
+		return;
+	}
+	unpack_a_frame(dev, data, frame, shift);
+	frame_source_release(&ctx->source, buf);
+
+	process_a_frame(ctx, frame, shift);
+	frame_pool_put(&ctx->decode_pool, frame);
+	return;
+}
+
+/* 
+ * opencv only support debayering 8 and 16 bits 
+ * 
+ * decode the frame, unpack it into a working buffer and render it
+ * args: 
+ * 		ctx - camera context
+ * 		const void *p - pointer for the buffer
+ * 		int shift - values to shift(RAW10 - 2, RAW12 - 4, YUV422 - 0) 
+ * 
+ */
+void decode_a_frame(struct cam_ctx *ctx, const void *p, int shift)
+{
+	void *frame = frame_pool_get(&ctx->decode_pool, 1);
+	if (frame == NULL)
+		return;
+	unpack_a_frame(&ctx->dev, p, frame, shift);
+	process_a_frame(ctx, frame, shift);
+	frame_pool_put(&ctx->decode_pool, frame);
+}
+
+/*
+ * copy the frame out of the v4l2 buffer, for bayer camera move each pixel 
+ * by certain bits and mask it for 8 bits on the way
+ * args: 
+ * 		struct device *dev - every infomation for camera
+ * 		const void *p - pointer for the v4l2 buffer
+ * 		void *dst - working buffer, width * height * 2 bytes
+ * 		int shift - values to shift(RAW10 - 2, RAW12 - 4, YUV422 - 0) 
+ */
+void unpack_a_frame(struct device *dev, const void *p, void *dst, int shift)
+{
+	STAGE_TIMER(STAGE_UNPACK);
+	/* --- for bayer camera ---*/
+	if (shift != 0)
+	{
+		/* shift bits for 16-bit stream and get lower 8-bit for opencv 
+	 	 * debayering, vectorized and split across threads by stripes */
+		unpack_raw_to_8bit((const unsigned short *)p, (unsigned char *)dst,
+						   dev->width, dev->height, shift, RAW_BLACK_LEVEL);
+	}
+	/* --- for yuv camera ---*/
+	else
+	{
+		memcpy(dst, p, (size_t)dev->width * dev->height * 2);
+	}
+}
+
+/*
+ * hand a processed frame to cam_ctx_show, unless the last one is still
+ * waiting there
+ * args:
+ * 		ctx 		  - camera context
+ * 		img 		  - bgr image
+ * 		window_width  - size to give the window, 0 to leave it
+ * 		window_height
+ */
+static void show_a_frame(struct cam_ctx *ctx, cv::Mat img,
+						 unsigned int window_width, unsigned int window_height)
+{
+	size_t size = (size_t)img.cols * img.rows * 3;
+	STAGE_TIMER(STAGE_SHOW);
+
+	__LOCK_MUTEX(&ctx->show_mutex);
+	if (ctx->show_pending)
+	{
+		__UNLOCK_MUTEX(&ctx->show_mutex);
+		return;
+	}
+	if (size > ctx->show_size)
+	{
+		free(ctx->show_buf);
+		ctx->show_buf = (unsigned char *)malloc(size);
+		ctx->show_size = ctx->show_buf ? size : 0;
+	}
+	if (ctx->show_buf != NULL)
+	{
+		cv::Mat show(img.rows, img.cols, CV_8UC3, ctx->show_buf);
+		img.copyTo(show);
+		ctx->show_width = img.cols;
+		ctx->show_height = img.rows;
+		ctx->show_window_width = window_width;
+		ctx->show_window_height = window_height;
+		ctx->show_dq_time = ctx->frame_dq_time;
+		ctx->show_pending = 1;
+	}
+	__UNLOCK_MUTEX(&ctx->show_mutex);
+}
+
+/*
+ * render a frame that unpack_a_frame put in a working buffer using opencv
+ * args: 
+ * 		ctx - camera context
+ * 		void *frame - 8-bit bayer or yuyv frame
+ * 		int shift - values to shift(RAW10 - 2, RAW12 - 4, YUV422 - 0) 
+ */
+void process_a_frame(struct cam_ctx *ctx, void *frame, int shift)
+{
+	int height = ctx->dev.height;
+	int width = ctx->dev.width;
+
+	/* --- for bayer camera ---*/
+	if (shift != 0)
+	{
+		int bayer_flag = GET_CONTROL(ctx, bayer_flag);
+		cv::Mat img(height, width, CV_8UC1, frame);
+		{
+			STAGE_TIMER(STAGE_DEBAYER);
+			cv::cvtColor(img, img, CV_BayerBG2BGR + add_bayer_forcv(&bayer_flag));
+		}
+		//flip(img, img, 0); //mirror vertically
+		//flip(img, img, 1); //mirror horizontally
+		/* gamma, awb gains and, without awb, abc in one lookup table pass */
+		int awb = (GET_CONTROL(ctx, awb_flag) == 1);
+		int abc = (GET_CONTROL(ctx, abc_flag) == 1);
+		img = apply_tone_mapping(ctx, img, awb, abc);
+		/* check awb flag, awb functionality, only available for bayer camera */
+		if (awb)
+		{
+			/* abc comes after the colour correction matrix */
+			img = apply_white_balance(&ctx->tone, img, abc);
 		}
 		/* check for save capture bmp flag, after decode the image */
-		if (*(save_bmp))
+		if (TAKE_CONTROL(ctx, save_bmp))
 		{
+			STAGE_TIMER(STAGE_SAVE_BMP);
 			printf("save a bmp\n");
-			save_frame_image_bmp(img);
-			image_count++;
-			set_save_bmp_flag(0);
+			save_frame_image_bmp(ctx, img);
+			ctx->image_count++;
 		}
+		if (!ctx->display_enabled)
+			return;
 		//if image larger than 720p by any dimension, reszie the window
 		if (width >= 1280 || height >= 720)
-		{
-			cv::resizeWindow("cam", 1280, 720);
-		}
-
-		cv::imshow("cam", img);
+			show_a_frame(ctx, img, 1280, 720);
+		else
+			show_a_frame(ctx, img, 0, 0);
 	}
 	/* --- for yuv camera ---*/
 	else
 	{
 
-		cv::Mat img(height, width, CV_8UC2, (void *)p);
+		cv::Mat img(height, width, CV_8UC2, frame);
 		//apply_gamma(p, gamma_val, height, width);
-		cv::cvtColor(img, img, cv::COLOR_YUV2BGR_YUY2);
+		{
+			STAGE_TIMER(STAGE_DEBAYER);
+			cv::cvtColor(img, img, cv::COLOR_YUV2BGR_YUY2);
+		}
 
 		/* check for save capture bmp flag, after decode the image */
-		if (*(save_bmp))
+		if (TAKE_CONTROL(ctx, save_bmp))
 		{
+			STAGE_TIMER(STAGE_SAVE_BMP);
 			printf("save a bmp\n");
-			save_frame_image_bmp(img);
-			image_count++;
-			set_save_bmp_flag(0);
+			save_frame_image_bmp(ctx, img);
+			ctx->image_count++;
 		}
 
-		cv::resizeWindow("cam", 640, 480);
-		cv::imshow("cam", img);
+		if (!ctx->display_enabled)
+			return;
+		show_a_frame(ctx, img, 640, 480);
 	}
+}
 
-	if (cv::waitKey(_1MS) == _ESC_KEY)
+/*
+ * show the newest frame of the camera and handle the window events, call
+ * it from the thread that owns the windows and gui, the window is created
+ * with the first frame
+ * args:
+ * 		ctx - camera context
+ * returns:
+ * 		key pressed in the window, -1 for none
+ */
+int cam_ctx_show(struct cam_ctx *ctx)
+{
+	const char *window = ctx->name[0] ? ctx->name : "cam";
+
+	__LOCK_MUTEX(&ctx->show_mutex);
+	if (ctx->show_pending)
+	{
+		cv::Mat img(ctx->show_height, ctx->show_width, CV_8UC3, ctx->show_buf);
+
+		if (!ctx->show_window)
+		{
+			cv::namedWindow(window, CV_WINDOW_FREERATIO);
+			ctx->show_window = 1;
+		}
+		if (ctx->show_window_width && ctx->show_window_height)
+			cv::resizeWindow(window, ctx->show_window_width,
+							 ctx->show_window_height);
+		{
+			STAGE_TIMER(STAGE_IMSHOW);
+			cv::imshow(window, img);
+		}
+		if (ctx->show_dq_time > 0)
+			stream_stats_displayed(&ctx->stats, ctx->show_dq_time);
+		ctx->show_pending = 0;
+	}
+	__UNLOCK_MUTEX(&ctx->show_mutex);
+
+	/* no window to wait on yet, e.g. a camera waiting for a trigger */
+	if (!ctx->show_window)
 	{
-		cv::destroyWindow("cam");
-		exit(0);
+		usleep(_1MS * 1000);
+		return -1;
 	}
+	return cv::waitKey(_1MS);
 }
 
 /*
@@ -941,11 +2244,18 @@ int video_free_buffers(struct device *dev)
 	unsigned int i;
 	int ret;
 
-	if (dev->nbufs == 0)
+	/* a failed video_alloc_buffers leaves none */
+	if (dev->nbufs == 0 || dev->buffers == NULL)
 		return 0;
 
 	for (i = 0; i < dev->nbufs; ++i)
 	{
+		if (dev->buffers[i].dmabuf_fd >= 0)
+			close(dev->buffers[i].dmabuf_fd);
+		dev->buffers[i].dmabuf_fd = -1;
+		/* user pointers go with the arena below */
+		if (dev->memtype == V4L2_MEMORY_USERPTR)
+			continue;
 		ret = munmap(dev->buffers[i].start, dev->buffers[i].length);
 		if (ret < 0)
 		{
@@ -968,6 +2278,13 @@ int video_free_buffers(struct device *dev)
 
 	printf("%u buffers released.\n", dev->nbufs);
 
+	/* the driver let go of the user pointers with REQBUFS 0 */
+	if (dev->arena != NULL)
+	{
+		buffer_arena_free(dev->arena);
+		free(dev->arena);
+		dev->arena = NULL;
+	}
 	free(dev->buffers);
 	dev->buffers = NULL;
 	dev->nbufs = 0;
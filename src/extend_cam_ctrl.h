@@ -31,6 +31,7 @@
   Last edit: 2019/04
 *****************************************************************************/
 #pragma once
+#include "frame_queue.h"
 
 /****************************************************************************
 **                      	Global data 
@@ -40,51 +41,89 @@ struct buffer
 {
 	void *start;
 	size_t length;
+	int dmabuf_fd;	/* from video_export_buffers, -1 if not exported */
 };
 
 
+/* per-camera state, see cam_context.h */
+struct cam_ctx;
+struct cam_tone;
+struct stream_stats;
+
 /****************************************************************************
 **							 Function declaration
 *****************************************************************************/
 int v4l2_core_save_data_to_file(const char *filename, const void *data, int size);
-void set_save_raw_flag(int flag);
-void video_capture_save_raw();
+void set_save_raw_flag(struct cam_ctx *ctx, int flag);
+void video_capture_save_raw(struct cam_ctx *ctx);
+void set_pre_trigger_seconds(struct cam_ctx *ctx, int seconds);
+void video_trigger_burst(struct cam_ctx *ctx);
 
-void set_save_bmp_flag(int flag);
-void video_capture_save_bmp();
+void set_save_bmp_flag(struct cam_ctx *ctx, int flag);
+void video_capture_save_bmp(struct cam_ctx *ctx);
 
-void change_datatype(void* datatype); 
+void change_datatype(struct cam_ctx *ctx, void *datatype);
 int set_shift(int *shift_flag);
 
-void change_bayerpattern(void *bayer); 
+void change_bayerpattern(struct cam_ctx *ctx, void *bayer);
 int add_bayer_forcv(int *bayer_flag);
 
-void add_gamma_val(float gamma_val_from_gui);
-void awb_enable(int enable);
-void abc_enable(int enable);
+void cam_tone_init(struct cam_tone *tone);
+void add_gamma_val(struct cam_ctx *ctx, float gamma_val_from_gui);
+void awb_enable(struct cam_ctx *ctx, int enable);
+void abc_enable(struct cam_ctx *ctx, int enable);
+void set_abc_statistics(struct cam_ctx *ctx, int sample_step, int update_period,
+						float smoothing);
+
+void add_exposure_val(struct cam_ctx *ctx, int exposure);
+void add_gain_val(struct cam_ctx *ctx, int gain);
+void video_record_raw(struct cam_ctx *ctx, int enable);
+void stop_raw_recording(struct cam_ctx *ctx);
+int set_record_backend(struct cam_ctx *ctx, const char *name);
+int record_benchmark(struct cam_ctx *ctx, unsigned int frames);
+int capture_benchmark(struct cam_ctx *ctx, unsigned int frames);
+int control_benchmark(struct cam_ctx *ctx, unsigned int rounds);
 
 int open_v4l2_device(char *device_name, struct device *dev);
 int check_dev_cap(struct device *dev);
 
-void mmap_variables();
-void unmap_variables();
-
 void start_camera(struct device *dev);
 void stop_Camera(struct device *dev);
 
-void video_set_format(struct device *dev, int width,
-					  int height, int pixelformat);
+int video_set_format(struct device *dev, int width,
+					 int height, int pixelformat);
 void video_get_format(struct device *dev);
 
-int streaming_loop(struct device *dev);
-
-void get_a_frame(struct device *dev);
-void decode_a_frame(struct device *dev, const void *p, int shift);
+int streaming_loop(struct cam_ctx *ctx);
+int streaming_start(struct cam_ctx *ctx);
+int streaming_running(struct cam_ctx *ctx);
+void streaming_stop(struct cam_ctx *ctx);
+int stream_reconfigure(struct cam_ctx *ctx, unsigned int width,
+					   unsigned int height, unsigned int pixelformat,
+					   unsigned int fps);
+unsigned int get_capture_ring_fill(struct cam_ctx *ctx);
+
+void set_out_of_place_decode(struct cam_ctx *ctx, int enable);
+void print_buffer_hold_time(struct cam_ctx *ctx);
+void print_stream_stats(struct cam_ctx *ctx);
+void get_stream_stats(struct cam_ctx *ctx, struct stream_stats *snap);
+void set_stage_report(struct cam_ctx *ctx, double seconds);
+void set_replay_source(struct cam_ctx *ctx, const char *path, double fps,
+					   unsigned int loops);
+void set_display(struct cam_ctx *ctx, int enable);
+void set_frame_share(struct cam_ctx *ctx, const char *path);
+void set_queue_policy(struct cam_ctx *ctx, enum frame_queue_policy policy);
+void set_realtime_capture(struct cam_ctx *ctx, int priority, int cpu);
+void set_buffer_tune(struct cam_ctx *ctx, double seconds, double percentile,
+					 int apply);
+void set_snapshot_fsync(struct cam_ctx *ctx, int enable);
+void stop_snapshot_writer(struct cam_ctx *ctx);
+
+void get_a_frame(struct cam_ctx *ctx);
+void decode_a_frame(struct cam_ctx *ctx, const void *p, int shift);
+void unpack_a_frame(struct device *dev, const void *p, void *dst, int shift);
+void process_a_frame(struct cam_ctx *ctx, void *frame, int shift);
  
 int video_alloc_buffers(struct device *dev, int nbufs);
+int video_export_buffers(struct device *dev);
 int video_free_buffers(struct device *dev);
-
-
-
-
-
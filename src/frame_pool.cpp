@@ -0,0 +1,182 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, pool of preallocated,
+  equally sized frame buffers. Stages that need a working copy of a frame
+  take one from the pool and put it back when they are done, so nothing is
+  allocated while streaming.
+*****************************************************************************/
+#include "../includes/shortcuts.h"
+#include "frame_pool.h"
+
+/*****************************************************************************
+**                           Function definition
+*****************************************************************************/
+
+/* allocate and touch every buffer so streaming doesn't take page faults */
+static int alloc_pool_buffers(struct frame_pool *pool, size_t size)
+{
+	for (unsigned int i = 0; i < pool->count; i++)
+	{
+		void *p = NULL;
+		if (posix_memalign(&p, FRAME_POOL_ALIGN, size) != 0)
+			return -ENOMEM;
+		memset(p, 0, size);
+		pool->bufs[i] = (unsigned char *)p;
+	}
+	pool->size = size;
+	return 0;
+}
+
+static void free_pool_buffers(struct frame_pool *pool)
+{
+	for (unsigned int i = 0; i < pool->count; i++)
+	{
+		free(pool->bufs[i]);
+		pool->bufs[i] = NULL;
+	}
+	pool->size = 0;
+}
+
+/*
+ * preallocate the pool
+ * args:
+ * 		pool  - pool to set up
+ * 		count - number of buffers
+ * 		size  - size of each buffer in bytes
+ * returns:
+ * 		error value
+ */
+int frame_pool_init(struct frame_pool *pool, unsigned int count, size_t size)
+{
+	CLEAR(*pool);
+	pool->bufs = (unsigned char **)calloc(count, sizeof pool->bufs[0]);
+	pool->free_list = (unsigned int *)calloc(count, sizeof pool->free_list[0]);
+	if (pool->bufs == NULL || pool->free_list == NULL)
+	{
+		frame_pool_free(pool);
+		return -ENOMEM;
+	}
+	pool->count = count;
+
+	if (alloc_pool_buffers(pool, size) < 0)
+	{
+		printf("Unable to allocate %u frame buffers of %zu bytes\n",
+			   count, size);
+		frame_pool_free(pool);
+		return -ENOMEM;
+	}
+
+	for (unsigned int i = 0; i < count; i++)
+		pool->free_list[i] = i;
+	pool->nfree = count;
+
+	__INIT_MUTEX(&pool->mutex);
+	pthread_cond_init(&pool->cond, NULL);
+	return 0;
+}
+
+/*
+ * release every buffer, nobody may hold one anymore
+ * args:
+ * 		pool - frame pool
+ */
+void frame_pool_free(struct frame_pool *pool)
+{
+	if (pool->bufs)
+		free_pool_buffers(pool);
+	free(pool->bufs);
+	free(pool->free_list);
+	pool->bufs = NULL;
+	pool->free_list = NULL;
+	pool->count = 0;
+	pool->nfree = 0;
+}
+
+/*
+ * make sure every buffer holds at least size bytes, buffers that are
+ * already big enough are kept as they are
+ * args:
+ * 		pool - frame pool, all buffers have to be returned
+ * 		size - new frame size in bytes
+ * returns:
+ * 		error value
+ */
+int frame_pool_resize(struct frame_pool *pool, size_t size)
+{
+	int ret = 0;
+
+	__LOCK_MUTEX(&pool->mutex);
+	if (size <= pool->size)
+	{
+		__UNLOCK_MUTEX(&pool->mutex);
+		return 0;
+	}
+	if (pool->nfree != pool->count)
+	{
+		__UNLOCK_MUTEX(&pool->mutex);
+		return -EBUSY;
+	}
+	free_pool_buffers(pool);
+	ret = alloc_pool_buffers(pool, size);
+	__UNLOCK_MUTEX(&pool->mutex);
+	return ret;
+}
+
+/*
+ * take a buffer from the pool
+ * args:
+ * 		pool - frame pool
+ * 		wait - block until a buffer comes back if all of them are taken
+ * returns:
+ * 		buffer of pool->size bytes, NULL if none is available
+ */
+void *frame_pool_get(struct frame_pool *pool, int wait)
+{
+	void *buf = NULL;
+
+	__LOCK_MUTEX(&pool->mutex);
+	while (wait && pool->nfree == 0 && pool->count > 0)
+		pthread_cond_wait(&pool->cond, &pool->mutex);
+	if (pool->nfree > 0)
+		buf = pool->bufs[pool->free_list[--pool->nfree]];
+	__UNLOCK_MUTEX(&pool->mutex);
+	return buf;
+}
+
+/*
+ * give a buffer back to the pool
+ * args:
+ * 		pool - frame pool
+ * 		buf  - buffer from frame_pool_get
+ */
+void frame_pool_put(struct frame_pool *pool, void *buf)
+{
+	__LOCK_MUTEX(&pool->mutex);
+	for (unsigned int i = 0; i < pool->count; i++)
+	{
+		if (pool->bufs[i] == buf)
+		{
+			pool->free_list[pool->nfree++] = i;
+			pthread_cond_signal(&pool->cond);
+			break;
+		}
+	}
+	__UNLOCK_MUTEX(&pool->mutex);
+}
+
+/*
+ * returns:
+ * 		number of buffers nobody holds right now
+ */
+unsigned int frame_pool_available(struct frame_pool *pool)
+{
+	unsigned int nfree;
+
+	__LOCK_MUTEX(&pool->mutex);
+	nfree = pool->nfree;
+	__UNLOCK_MUTEX(&pool->mutex);
+	return nfree;
+}
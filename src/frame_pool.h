@@ -0,0 +1,41 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, pool of preallocated,
+  equally sized frame buffers. Stages that need a working copy of a frame
+  take one from the pool and put it back when they are done, so nothing is
+  allocated while streaming.
+*****************************************************************************/
+#pragma once
+#include <pthread.h>
+
+/****************************************************************************
+**                      	Global data
+*****************************************************************************/
+/* page aligned, fine for the widest simd loads and for O_DIRECT writes */
+#define FRAME_POOL_ALIGN 4096
+
+struct frame_pool
+{
+	unsigned char **bufs;
+	unsigned int *free_list;	/* indices of buffers nobody holds */
+	unsigned int count;
+	unsigned int nfree;
+	size_t size;
+
+	__MUTEX_TYPE mutex;
+	pthread_cond_t cond;
+};
+
+/****************************************************************************
+**							 Function declaration
+*****************************************************************************/
+int frame_pool_init(struct frame_pool *pool, unsigned int count, size_t size);
+void frame_pool_free(struct frame_pool *pool);
+int frame_pool_resize(struct frame_pool *pool, size_t size);
+
+void *frame_pool_get(struct frame_pool *pool, int wait);
+void frame_pool_put(struct frame_pool *pool, void *buf);
+unsigned int frame_pool_available(struct frame_pool *pool);
@@ -0,0 +1,321 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, bounded lock-free
+  queue of frame descriptors between pipeline stages. Every slot carries a
+  sequence number that says whether it waits for a push or a pop of a
+  given round, a thread claims a slot by moving tail or head past it with
+  a compare and swap and hands it on by bumping its sequence number.
+*****************************************************************************/
+#include "../includes/shortcuts.h"
+#include "frame_queue.h"
+
+static const char *policy_names[] = {"block", "drop-oldest", "drop-newest"};
+
+/*****************************************************************************
+**                           Function definition
+*****************************************************************************/
+
+/*
+ * set up an empty queue
+ * args:
+ * 		q 	   - frame queue
+ * 		size   - frames it holds
+ * 		policy - what a push does when it is full
+ * 		drop   - gives back the buffer of a dropped frame, NULL for none
+ * 		data   - for drop
+ * returns:
+ * 		error value
+ */
+int frame_queue_init(struct frame_queue *q, unsigned int size,
+					 enum frame_queue_policy policy, frame_drop_handler drop,
+					 void *data)
+{
+	CLEAR(*q);
+	if (size == 0)
+		return -EINVAL;
+	q->slots = (struct frame_queue_slot *)calloc(size, sizeof q->slots[0]);
+	if (q->slots == NULL)
+		return -ENOMEM;
+	/* slot i takes the push of round 0 at position i */
+	for (unsigned int i = 0; i < size; i++)
+		q->slots[i].seq = i;
+	q->size = size;
+	q->policy = policy;
+	q->drop = drop;
+	q->drop_data = data;
+	__INIT_MUTEX(&q->mutex);
+	pthread_cond_init(&q->cond, NULL);
+	return 0;
+}
+
+/*
+ * release the queue, nothing may use it any more, frames still in it
+ * aren't given back
+ * args:
+ * 		q - frame queue, a cleared one is ignored
+ */
+void frame_queue_free(struct frame_queue *q)
+{
+	if (q->slots == NULL)
+		return;
+	free(q->slots);
+	q->slots = NULL;
+	__CLOSE_MUTEX(&q->mutex);
+	pthread_cond_destroy(&q->cond);
+}
+
+/* put a frame in the queue unless it is full */
+static int try_push(struct frame_queue *q, const struct frame_desc *desc)
+{
+	unsigned long pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+
+	while (1)
+	{
+		struct frame_queue_slot *slot = &q->slots[pos % q->size];
+		unsigned long seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		long dif = (long)(seq - pos);
+
+		if (dif == 0)
+		{
+			if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+											__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				slot->desc = *desc;
+				__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+				return 0;
+			}
+		}
+		/* the slot still holds last round's frame */
+		else if (dif < 0)
+			return -EAGAIN;
+		else
+			pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	}
+}
+
+/* take the oldest frame unless the queue is empty */
+static int try_pop(struct frame_queue *q, struct frame_desc *desc)
+{
+	unsigned long pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+
+	while (1)
+	{
+		struct frame_queue_slot *slot = &q->slots[pos % q->size];
+		unsigned long seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		long dif = (long)(seq - (pos + 1));
+
+		if (dif == 0)
+		{
+			if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1,
+											__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				*desc = slot->desc;
+				/* free for the push of the next round */
+				__atomic_store_n(&slot->seq, pos + q->size, __ATOMIC_RELEASE);
+				return 0;
+			}
+		}
+		/* nothing pushed here yet */
+		else if (dif < 0)
+			return -EAGAIN;
+		else
+			pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	}
+}
+
+/* frames in the queue, pushes and pops under way may be counted or not */
+unsigned int frame_queue_depth(struct frame_queue *q)
+{
+	unsigned long head = __atomic_load_n(&q->head, __ATOMIC_SEQ_CST);
+	unsigned long tail = __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST);
+
+	return tail > head ? (unsigned int)(tail - head) : 0;
+}
+
+/* wake up the threads in wait_for, if there are any */
+static void wake_waiters(struct frame_queue *q)
+{
+	/* pairs with the one in wait_for, either it sees our change or we
+	   see it waiting */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&q->waiters, __ATOMIC_RELAXED) == 0)
+		return;
+	__LOCK_MUTEX(&q->mutex);
+	pthread_cond_broadcast(&q->cond);
+	__UNLOCK_MUTEX(&q->mutex);
+}
+
+/*
+ * sleep until the queue has room or a frame, or is closed
+ * args:
+ * 		q 	  - frame queue
+ * 		space - 1 to wait for room, 0 for a frame
+ */
+static void wait_for(struct frame_queue *q, int space)
+{
+	__LOCK_MUTEX(&q->mutex);
+	__atomic_add_fetch(&q->waiters, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	unsigned int depth = frame_queue_depth(q);
+	if (!__atomic_load_n(&q->closed, __ATOMIC_RELAXED) &&
+		(space ? depth >= q->size : depth == 0))
+		pthread_cond_wait(&q->cond, &q->mutex);
+	__atomic_sub_fetch(&q->waiters, 1, __ATOMIC_SEQ_CST);
+	__UNLOCK_MUTEX(&q->mutex);
+}
+
+/* one more frame made it in, remember how deep the queue got */
+static void note_push(struct frame_queue *q)
+{
+	unsigned int depth = frame_queue_depth(q);
+	unsigned int high = __atomic_load_n(&q->high_water, __ATOMIC_RELAXED);
+
+	__atomic_add_fetch(&q->pushed, 1, __ATOMIC_RELAXED);
+	while (depth > high &&
+		   !__atomic_compare_exchange_n(&q->high_water, &high, depth, 1,
+										__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+	wake_waiters(q);
+}
+
+/* hand a frame the queue won't keep to the drop handler */
+static void drop_frame(struct frame_queue *q, struct frame_desc *desc)
+{
+	__atomic_add_fetch(&q->dropped, 1, __ATOMIC_RELAXED);
+	if (q->drop != NULL)
+		q->drop(q->drop_data, desc);
+}
+
+/*
+ * add a frame, a full queue does what its policy says
+ * args:
+ * 		q 	 - frame queue
+ * 		desc - frame to add
+ * returns:
+ * 		0 once queued, 1 if a frame was dropped on the way (the oldest one
+ * 		or this one), -EPIPE if the queue is closed, the frame isn't taken
+ */
+int frame_queue_push(struct frame_queue *q, const struct frame_desc *desc)
+{
+	struct frame_desc old;
+	int dropped = 0;
+
+	while (1)
+	{
+		if (__atomic_load_n(&q->closed, __ATOMIC_ACQUIRE))
+			return -EPIPE;
+		if (try_push(q, desc) == 0)
+		{
+			note_push(q);
+			return dropped;
+		}
+		switch (q->policy)
+		{
+		case FRAME_QUEUE_DROP_NEWEST:
+			old = *desc;
+			drop_frame(q, &old);
+			return 1;
+		case FRAME_QUEUE_DROP_OLDEST:
+			/* a consumer may have taken it in the meantime, fine too */
+			if (try_pop(q, &old) == 0)
+			{
+				drop_frame(q, &old);
+				dropped = 1;
+				wake_waiters(q);
+			}
+			break;
+		default:
+			wait_for(q, 1);
+			break;
+		}
+	}
+}
+
+/*
+ * take the oldest frame
+ * args:
+ * 		q 	 - frame queue
+ * 		desc - gets the frame
+ * 		wait - wait for one if the queue is empty
+ * returns:
+ * 		0 for a frame, -EAGAIN if empty and not waiting, -EPIPE once the
+ * 		queue is closed and empty
+ */
+int frame_queue_pop(struct frame_queue *q, struct frame_desc *desc, int wait)
+{
+	while (1)
+	{
+		if (try_pop(q, desc) == 0)
+		{
+			/* a blocked push has room now */
+			wake_waiters(q);
+			return 0;
+		}
+		if (__atomic_load_n(&q->closed, __ATOMIC_ACQUIRE))
+		{
+			/* a push may have finished just before the close */
+			return try_pop(q, desc) == 0 ? 0 : -EPIPE;
+		}
+		if (!wait)
+			return -EAGAIN;
+		wait_for(q, 0);
+	}
+}
+
+/*
+ * refuse further frames and wake every waiting thread, pops still get
+ * the frames that are in, safe from any thread
+ * args:
+ * 		q - frame queue, a cleared one is ignored
+ */
+void frame_queue_close(struct frame_queue *q)
+{
+	if (q->slots == NULL)
+		return;
+	__atomic_store_n(&q->closed, 1, __ATOMIC_RELEASE);
+	__LOCK_MUTEX(&q->mutex);
+	pthread_cond_broadcast(&q->cond);
+	__UNLOCK_MUTEX(&q->mutex);
+}
+
+/*
+ * args:
+ * 		q 		   - frame queue
+ * 		high_water - most frames it held at once
+ * 		pushed 	   - frames that went in
+ * 		dropped    - frames its policy dropped
+ */
+void frame_queue_stats(struct frame_queue *q, unsigned int *high_water,
+					   unsigned long *pushed, unsigned long *dropped)
+{
+	*high_water = __atomic_load_n(&q->high_water, __ATOMIC_RELAXED);
+	*pushed = __atomic_load_n(&q->pushed, __ATOMIC_RELAXED);
+	*dropped = __atomic_load_n(&q->dropped, __ATOMIC_RELAXED);
+}
+
+const char *frame_queue_policy_name(enum frame_queue_policy policy)
+{
+	return (unsigned int)policy < SIZE(policy_names) ? policy_names[policy]
+													  : "unknown";
+}
+
+/*
+ * args:
+ * 		name   - block, drop-oldest or drop-newest
+ * 		policy - gets the policy
+ * returns:
+ * 		error value
+ */
+int frame_queue_parse_policy(const char *name, enum frame_queue_policy *policy)
+{
+	for (unsigned int i = 0; i < SIZE(policy_names); i++)
+		if (strcmp(name, policy_names[i]) == 0)
+		{
+			*policy = (enum frame_queue_policy)i;
+			return 0;
+		}
+	return -EINVAL;
+}
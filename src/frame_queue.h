@@ -0,0 +1,105 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, bounded lock-free
+  queue of frame descriptors between pipeline stages, e.g. the capture loop
+  and processing. Any number of threads push and pop, a single producer and
+  a single consumer is just the cheapest case of it. Pushing and popping
+  never take a lock, only a thread that has to wait does.
+
+  What happens when a push finds the queue full is up to the queue:
+
+  	block       - the push waits for room, nothing is lost
+  	drop-oldest - the oldest frame makes room, consumers see fresh frames
+  	drop-newest - the new frame is dropped, consumers see every frame up
+  	              to the overrun
+
+  A dropped frame goes to the queue's drop handler, which gives its buffer
+  back. The deepest the queue got and the frames it dropped are counted.
+*****************************************************************************/
+#pragma once
+#include <pthread.h>
+#include <stdint.h>
+
+/****************************************************************************
+**                      	Global data
+*****************************************************************************/
+#define FRAME_QUEUE_CACHE_LINE 64
+
+enum frame_queue_policy
+{
+	FRAME_QUEUE_BLOCK = 0,
+	FRAME_QUEUE_DROP_OLDEST,
+	FRAME_QUEUE_DROP_NEWEST,
+};
+
+/* what a stage hands the next one, the frame data stays in its buffer */
+struct frame_desc
+{
+	unsigned int index;		/* v4l2 buffer index */
+	unsigned int sequence;
+	unsigned int bytesused;
+	uint64_t timestamp_us;	/* from the driver */
+	double dq_time;			/* dequeued, monotonic us */
+};
+
+/*
+ * called for every frame the queue drops, by the thread that pushed
+ * args:
+ * 		data - as given to frame_queue_init
+ * 		desc - dropped frame
+ */
+typedef void (*frame_drop_handler)(void *data, struct frame_desc *desc);
+
+struct frame_queue_slot
+{
+	unsigned long seq;		/* tells whose turn the slot is */
+	struct frame_desc desc;
+};
+
+struct frame_queue
+{
+	struct frame_queue_slot *slots;
+	unsigned int size;
+	enum frame_queue_policy policy;
+	frame_drop_handler drop;
+	void *drop_data;
+
+	/* producers and consumers don't share a cache line */
+	char pad0[FRAME_QUEUE_CACHE_LINE];
+	unsigned long tail;		/* next push */
+	char pad1[FRAME_QUEUE_CACHE_LINE - sizeof(unsigned long)];
+	unsigned long head;		/* next pop */
+	char pad2[FRAME_QUEUE_CACHE_LINE - sizeof(unsigned long)];
+
+	int closed;
+	unsigned int waiters;	/* threads in wait_for */
+	unsigned int high_water;
+	unsigned long pushed;
+	unsigned long dropped;
+
+	/* only for threads that wait */
+	__MUTEX_TYPE mutex;
+	pthread_cond_t cond;
+};
+
+/****************************************************************************
+**							 Function declaration
+*****************************************************************************/
+int frame_queue_init(struct frame_queue *q, unsigned int size,
+					 enum frame_queue_policy policy, frame_drop_handler drop,
+					 void *data);
+void frame_queue_free(struct frame_queue *q);
+void frame_queue_close(struct frame_queue *q);
+
+int frame_queue_push(struct frame_queue *q, const struct frame_desc *desc);
+int frame_queue_pop(struct frame_queue *q, struct frame_desc *desc, int wait);
+
+unsigned int frame_queue_depth(struct frame_queue *q);
+void frame_queue_stats(struct frame_queue *q, unsigned int *high_water,
+					   unsigned long *pushed, unsigned long *dropped);
+
+const char *frame_queue_policy_name(enum frame_queue_policy policy);
+int frame_queue_parse_policy(const char *name, enum frame_queue_policy *policy);
@@ -0,0 +1,328 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, hands the camera's
+  frames to other processes without copying them. The socket and its
+  consumers are served by the capture ring's event loop, every dequeued
+  buffer gets one reference per consumer it is sent to.
+*****************************************************************************/
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "../includes/shortcuts.h"
+#include "extend_cam_ctrl.h"
+#include "frame_share.h"
+
+/*****************************************************************************
+**                           Function definition
+*****************************************************************************/
+
+/*
+ * stop watching a consumer and give back every buffer it held, its slot is
+ * freed by the next accept or frame_share_close
+ * args:
+ * 		client - consumer, from the loop thread or frame_share_close
+ */
+static void hang_up(struct frame_share_client *client)
+{
+	struct frame_share *share = client->share;
+
+	event_loop_remove(share->loop, client->fd);
+	/* the loop thread got there first */
+	if (client->gone)
+		return;
+	client->gone = 1;
+	for (unsigned int i = 0; i < V4L_BUFFERS_MAX; i++)
+		if (client->held[i])
+			capture_ring_put(share->ring, i);
+	CLEAR(client->held);
+	client->nheld = 0;
+	printf("SHARE: consumer %d left, %lu frames sent, %lu missed\n",
+		   (int)(client - share->clients), client->sent, client->missed);
+}
+
+/*
+ * send the buffer geometry and every dmabuf fd
+ * args:
+ * 		share - frame share
+ * 		fd 	  - new consumer
+ * returns:
+ * 		error value
+ */
+static int send_hello(struct frame_share *share, int fd)
+{
+	struct device *dev = share->ring->dev;
+	struct frame_share_hello hello;
+	char control[CMSG_SPACE(V4L_BUFFERS_MAX * sizeof(int))];
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+
+	CLEAR(hello);
+	hello.magic = FRAME_SHARE_MAGIC;
+	hello.nbufs = dev->nbufs;
+	hello.width = dev->width;
+	hello.height = dev->height;
+	hello.bytesperline = dev->bytesperline;
+	hello.sizeimage = dev->imagesize;
+
+	CLEAR(control);
+	CLEAR(msg);
+	iov.iov_base = &hello;
+	iov.iov_len = sizeof hello;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = CMSG_SPACE(dev->nbufs * sizeof(int));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(dev->nbufs * sizeof(int));
+	for (unsigned int i = 0; i < dev->nbufs; i++)
+		((int *)CMSG_DATA(cmsg))[i] = dev->buffers[i].dmabuf_fd;
+
+	return sendmsg(fd, &msg, MSG_NOSIGNAL) < 0 ? -errno : 0;
+}
+
+/*
+ * a consumer gave buffers back or hung up
+ * args:
+ * 		data   - struct frame_share_client *client
+ * 		fd 	   - consumer socket
+ * 		events - from epoll
+ */
+static void client_ready(void *data, int fd, unsigned int events)
+{
+	struct frame_share_client *client = (struct frame_share_client *)data;
+	uint32_t index;
+	ssize_t n;
+
+	(void)events;
+	while (1)
+	{
+		n = recv(fd, &index, sizeof index, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			return;
+		if (n <= 0)
+		{
+			hang_up(client);
+			return;
+		}
+		/* only what it was sent, a buffer mustn't be requeued twice */
+		if (n != sizeof index || index >= V4L_BUFFERS_MAX || !client->held[index])
+		{
+			printf("SHARE: consumer %d released a buffer it doesn't hold\n",
+				   (int)(client - client->share->clients));
+			continue;
+		}
+		client->held[index] = 0;
+		client->nheld--;
+		capture_ring_put(client->share->ring, index);
+	}
+}
+
+/*
+ * take a new consumer, one that doesn't fit is closed right away
+ * args:
+ * 		data   - struct frame_share *share
+ * 		fd 	   - listening socket
+ * 		events - from epoll
+ */
+static void accept_ready(void *data, int fd, unsigned int events)
+{
+	struct frame_share *share = (struct frame_share *)data;
+	int client_fd;
+
+	(void)events;
+	while ((client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+	{
+		struct frame_share_client *client = NULL;
+		int ret;
+
+		for (int i = 0; i < FRAME_SHARE_CLIENTS_MAX && client == NULL; i++)
+		{
+			if (share->clients[i].gone)
+			{
+				close(share->clients[i].fd);
+				share->clients[i].fd = -1;
+				share->clients[i].gone = 0;
+			}
+			if (share->clients[i].fd < 0)
+				client = &share->clients[i];
+		}
+		if (client == NULL)
+		{
+			printf("SHARE: more than %d consumers\n", FRAME_SHARE_CLIENTS_MAX);
+			close(client_fd);
+			continue;
+		}
+		ret = send_hello(share, client_fd);
+		if (ret < 0)
+		{
+			printf("SHARE: couldn't send the buffers: %s\n", strerror(-ret));
+			close(client_fd);
+			continue;
+		}
+		if (event_loop_add(share->loop, client_fd, EPOLLIN, client_ready,
+						   client) < 0)
+		{
+			close(client_fd);
+			continue;
+		}
+		client->fd = client_fd;
+		client->sent = 0;
+		client->missed = 0;
+		printf("SHARE: consumer %d connected\n", (int)(client - share->clients));
+	}
+}
+
+/*
+ * capture ring observer, send a new frame to every consumer that has room
+ * for it, each one it reaches holds the buffer until it gives it back
+ * args:
+ * 		data - struct frame_share *share
+ * 		buf  - just dequeued
+ */
+static void share_frame(void *data, struct v4l2_buffer *buf)
+{
+	struct frame_share *share = (struct frame_share *)data;
+	struct frame_share_frame frame;
+
+	CLEAR(frame);
+	frame.index = buf->index;
+	frame.sequence = buf->sequence;
+	frame.bytesused = buf->bytesused;
+	frame.timestamp_us = (uint64_t)buf->timestamp.tv_sec * 1000000 +
+						 buf->timestamp.tv_usec;
+
+	for (int i = 0; i < FRAME_SHARE_CLIENTS_MAX; i++)
+	{
+		struct frame_share_client *client = &share->clients[i];
+
+		if (client->fd < 0 || client->gone)
+			continue;
+		if (client->nheld >= FRAME_SHARE_HELD_MAX)
+		{
+			client->missed++;
+			continue;
+		}
+		/* hold first, the consumer can answer before send returns */
+		capture_ring_hold(share->ring, buf->index);
+		client->held[buf->index] = 1;
+		client->nheld++;
+		if (send(client->fd, &frame, sizeof frame, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+		{
+			client->held[buf->index] = 0;
+			client->nheld--;
+			capture_ring_put(share->ring, buf->index);
+			if (errno == EAGAIN)
+				client->missed++;
+			else
+				hang_up(client);
+			continue;
+		}
+		client->sent++;
+	}
+}
+
+/*
+ * offer the ring's frames on a unix socket, a stale socket file at path is
+ * replaced, call once the ring is started
+ * args:
+ * 		share - frame share
+ * 		ring  - capture ring of a device with exported buffers, see
+ * 				video_export_buffers
+ * 		path  - socket file
+ * returns:
+ * 		error value
+ */
+int frame_share_open(struct frame_share *share, struct capture_ring *ring,
+					 const char *path)
+{
+	struct sockaddr_un addr;
+	struct device *dev = ring->dev;
+
+	CLEAR(*share);
+	share->fd = -1;
+	for (int i = 0; i < FRAME_SHARE_CLIENTS_MAX; i++)
+	{
+		share->clients[i].fd = -1;
+		share->clients[i].share = share;
+	}
+	if (ring->loop == NULL || dev->nbufs > V4L_BUFFERS_MAX)
+		return -EINVAL;
+	for (unsigned int i = 0; i < dev->nbufs; i++)
+		if (dev->buffers[i].dmabuf_fd < 0)
+		{
+			printf("SHARE: buffer %u isn't exported\n", i);
+			return -EINVAL;
+		}
+	if (strlen(path) >= sizeof(share->path))
+	{
+		printf("SHARE: socket path %s is too long\n", path);
+		return -ENAMETOOLONG;
+	}
+	snprintf(share->path, sizeof(share->path), "%s", path);
+	share->ring = ring;
+	share->loop = ring->loop;
+
+	CLEAR(addr);
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, share->path, sizeof(addr.sun_path));
+	share->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	unlink_socket(share->path);
+	if (share->fd < 0 || bind(share->fd, (struct sockaddr *)&addr, sizeof addr) < 0 ||
+		listen(share->fd, FRAME_SHARE_CLIENTS_MAX) < 0)
+	{
+		printf("SHARE: couldn't listen on %s: %s\n", share->path, strerror(errno));
+		frame_share_close(share);
+		return -1;
+	}
+	if (event_loop_add(share->loop, share->fd, EPOLLIN, accept_ready, share) < 0)
+	{
+		frame_share_close(share);
+		return -1;
+	}
+	capture_ring_observe(ring, share_frame, share);
+	printf("SHARE: %u dmabuf buffers on %s\n", dev->nbufs, share->path);
+	return 0;
+}
+
+/*
+ * drop the consumers and give back what they held, call before
+ * capture_ring_stop, from any thread
+ * args:
+ * 		share - frame share
+ */
+void frame_share_close(struct frame_share *share)
+{
+	/* never opened */
+	if (share->ring == NULL)
+		return;
+	/* once the remove waited for the loop no frame is sent any more */
+	capture_ring_observe(share->ring, NULL, NULL);
+	if (share->fd >= 0)
+	{
+		event_loop_remove(share->loop, share->fd);
+		close(share->fd);
+		unlink_socket(share->path);
+		share->fd = -1;
+	}
+	/* no accept runs any more, so the slots stay as they are */
+	for (int i = 0; i < FRAME_SHARE_CLIENTS_MAX; i++)
+	{
+		struct frame_share_client *client = &share->clients[i];
+
+		if (client->fd < 0)
+			continue;
+		hang_up(client);
+		close(client->fd);
+		client->fd = -1;
+		client->gone = 0;
+	}
+	share->ring = NULL;
+}
@@ -0,0 +1,80 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, hands the camera's
+  frames to other processes without copying them. The capture buffers are
+  exported as dmabufs, a consumer (encoder, analytics, recorder) connects
+  to a unix SOCK_SEQPACKET socket and gets
+
+  	struct frame_share_hello   with the dmabuf fd of every buffer attached
+  	struct frame_share_frame   for every frame after that
+
+  It maps the fds once, reads each frame from the buffer with its index
+  and sends the index back as a uint32_t when it is done. The buffer goes
+  back to the driver once the streaming loop and every consumer gave it
+  back, a consumer that holds too many frames misses the next ones until
+  it releases some. Wrap cpu reads in DMA_BUF_IOCTL_SYNC.
+*****************************************************************************/
+#pragma once
+#include <stdint.h>
+#include <sys/un.h>
+#include "capture_ring.h"
+
+/****************************************************************************
+**                      	Global data
+*****************************************************************************/
+#define FRAME_SHARE_CLIENTS_MAX 4
+#define FRAME_SHARE_MAGIC 0x5248534c	/* "LSHR" */
+#define FRAME_SHARE_HELD_MAX 2			/* frames a consumer holds at once */
+
+/* first message, dev->nbufs dmabuf fds come with it in index order */
+struct frame_share_hello
+{
+	uint32_t magic;
+	uint32_t nbufs;
+	uint32_t width;
+	uint32_t height;
+	uint32_t bytesperline;
+	uint32_t sizeimage;
+};
+
+/* one per frame */
+struct frame_share_frame
+{
+	uint32_t index;
+	uint32_t sequence;
+	uint32_t bytesused;
+	uint32_t reserved;
+	uint64_t timestamp_us;
+};
+
+struct frame_share;
+
+struct frame_share_client
+{
+	int fd;					/* -1 for a free slot */
+	int gone;				/* hung up, fd is closed when the slot is reused */
+	unsigned char held[V4L_BUFFERS_MAX]; /* buffers it hasn't given back */
+	unsigned int nheld;
+	unsigned long sent;
+	unsigned long missed;	/* frames it was too busy for */
+	struct frame_share *share;
+};
+
+struct frame_share
+{
+	int fd;					/* listening socket, -1 if not open */
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	struct capture_ring *ring;
+	struct event_loop *loop;
+	struct frame_share_client clients[FRAME_SHARE_CLIENTS_MAX];
+};
+
+/****************************************************************************
+**							 Function declaration
+*****************************************************************************/
+int frame_share_open(struct frame_share *share, struct capture_ring *ring,
+					 const char *path);
+void frame_share_close(struct frame_share *share);
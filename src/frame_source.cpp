@@ -0,0 +1,195 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, where the streaming
+  loop gets its frames from, and the frame source for a real camera built
+  on the capture ring. The replay source lives in replay_source.cpp.
+*****************************************************************************/
+#include "../includes/shortcuts.h"
+#include "extend_cam_ctrl.h"
+#include "frame_source.h"
+
+/*****************************************************************************
+**                           Function definition
+*****************************************************************************/
+
+/*
+ * start handing out frames
+ * args:
+ * 		src - frame source
+ * returns:
+ * 		error value
+ */
+int frame_source_start(struct frame_source *src)
+{
+	int ret = src->ops->start ? src->ops->start(src) : 0;
+	if (ret < 0)
+		return ret;
+	src->frames = 0;
+	src->bytes = 0;
+	src->running = 1;
+	src->start_time = monotonic_us();
+	return 0;
+}
+
+/*
+ * stop handing out frames, a blocked frame_source_acquire returns NULL
+ * args:
+ * 		src - frame source
+ */
+void frame_source_stop(struct frame_source *src)
+{
+	if (src->ops->stop)
+		src->ops->stop(src);
+	if (src->running)
+		src->stop_time = monotonic_us();
+	src->running = 0;
+}
+
+/*
+ * make a blocked frame_source_acquire return NULL, for another thread
+ * that wants the one using the source to finish, frame_source_stop is
+ * still up to that one
+ * args:
+ * 		src - frame source
+ */
+void frame_source_cancel(struct frame_source *src)
+{
+	if (src->ops->cancel)
+		src->ops->cancel(src);
+}
+
+void frame_source_free(struct frame_source *src)
+{
+	if (src->ops && src->ops->free)
+		src->ops->free(src);
+	src->priv = NULL;
+}
+
+/*
+ * wait for the next filled buffer, like VIDIOC_DQBUF
+ * args:
+ * 		src  - frame source
+ * 		data - set to the frame data
+ * returns:
+ * 		buffer to give back with frame_source_release, NULL once the
+ * 		source ended, src->running is cleared then
+ */
+struct v4l2_buffer *frame_source_acquire(struct frame_source *src, void **data)
+{
+	struct v4l2_buffer *buf = src->ops->acquire(src, data);
+	if (buf == NULL)
+	{
+		if (src->running)
+			src->stop_time = monotonic_us();
+		src->running = 0;
+		return NULL;
+	}
+	src->frames++;
+	src->bytes += buf->bytesused;
+	return buf;
+}
+
+/*
+ * give a buffer back, like VIDIOC_QBUF
+ * args:
+ * 		src - frame source
+ * 		buf - from frame_source_acquire
+ * returns:
+ * 		error value
+ */
+int frame_source_release(struct frame_source *src, struct v4l2_buffer *buf)
+{
+	return src->ops->release(src, buf);
+}
+
+/* print how many frames went through and how fast */
+void frame_source_print_stats(struct frame_source *src)
+{
+	double end = src->running ? monotonic_us() : src->stop_time;
+	double seconds = (end - src->start_time) / 1e6;
+
+	if (seconds <= 0)
+		return;
+	printf("%s: %lu frames in %.2f s, %.1f fps, %.1f MB/s\n",
+		   src->ops->name, src->frames, seconds, src->frames / seconds,
+		   src->bytes / 1e6 / seconds);
+}
+
+/*****************************************************************************
+**                      v4l2 source, a camera's capture ring
+*****************************************************************************/
+static int v4l2_source_start(struct frame_source *src)
+{
+	return capture_ring_start((struct capture_ring *)src->priv);
+}
+
+static void v4l2_source_stop(struct frame_source *src)
+{
+	capture_ring_stop((struct capture_ring *)src->priv);
+}
+
+static void v4l2_source_cancel(struct frame_source *src)
+{
+	capture_ring_cancel((struct capture_ring *)src->priv);
+}
+
+static struct v4l2_buffer *v4l2_source_acquire(struct frame_source *src,
+											   void **data)
+{
+	struct v4l2_buffer *buf;
+
+	buf = capture_ring_acquire((struct capture_ring *)src->priv);
+	if (buf != NULL)
+		*data = src->dev->buffers[buf->index].start;
+	return buf;
+}
+
+static int v4l2_source_release(struct frame_source *src,
+							   struct v4l2_buffer *buf)
+{
+	return capture_ring_release((struct capture_ring *)src->priv, buf);
+}
+
+static void v4l2_source_free(struct frame_source *src)
+{
+	capture_ring_free((struct capture_ring *)src->priv);
+}
+
+static const struct frame_source_ops v4l2_source_ops = {
+	"v4l2",
+	v4l2_source_start,
+	v4l2_source_stop,
+	v4l2_source_cancel,
+	v4l2_source_acquire,
+	v4l2_source_release,
+	v4l2_source_free,
+};
+
+/*
+ * frames from a streaming camera, the buffers have to be allocated
+ * and the stream started already, the ring can be set up further
+ * before frame_source_start
+ * args:
+ * 		src  - frame source to set up
+ * 		dev  - camera
+ * 		ring - capture ring to run the camera with
+ * returns:
+ * 		error value
+ */
+int frame_source_v4l2(struct frame_source *src, struct device *dev,
+					  struct capture_ring *ring)
+{
+	int ret;
+
+	CLEAR(*src);
+	ret = capture_ring_init(ring, dev);
+	if (ret < 0)
+		return ret;
+	src->ops = &v4l2_source_ops;
+	src->dev = dev;
+	src->priv = ring;
+	return 0;
+}
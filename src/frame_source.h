@@ -0,0 +1,65 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, where the streaming
+  loop gets its frames from. A frame source hands out filled buffers the
+  way VIDIOC_DQBUF does and takes them back the way VIDIOC_QBUF does. The
+  v4l2 source wraps the capture ring of a real camera, the replay source
+  serves recorded frames so decode and isp run on a box without a camera.
+*****************************************************************************/
+#pragma once
+#include "capture_ring.h"
+
+/****************************************************************************
+**                      	Global data
+*****************************************************************************/
+/* buffers the replay source hands out at the same time */
+#define REPLAY_BUFFERS 4
+
+struct frame_source;
+
+struct frame_source_ops
+{
+	const char *name;
+	int (*start)(struct frame_source *src);
+	void (*stop)(struct frame_source *src);
+	/* wake a blocked acquire from another thread, without waiting */
+	void (*cancel)(struct frame_source *src);
+	/* NULL once the source has nothing more to give */
+	struct v4l2_buffer *(*acquire)(struct frame_source *src, void **data);
+	int (*release)(struct frame_source *src, struct v4l2_buffer *buf);
+	void (*free)(struct frame_source *src);
+};
+
+struct frame_source
+{
+	const struct frame_source_ops *ops;
+	struct device *dev;
+	void *priv;
+	int running;
+
+	unsigned long frames;	/* frames handed out */
+	unsigned long long bytes;
+	double start_time;		/* us */
+	double stop_time;
+};
+
+/****************************************************************************
+**							 Function declaration
+*****************************************************************************/
+int frame_source_v4l2(struct frame_source *src, struct device *dev,
+					  struct capture_ring *ring);
+int frame_source_replay(struct frame_source *src, struct device *dev,
+						const char *path, double fps, unsigned int loops);
+
+int frame_source_start(struct frame_source *src);
+void frame_source_stop(struct frame_source *src);
+void frame_source_cancel(struct frame_source *src);
+void frame_source_free(struct frame_source *src);
+
+struct v4l2_buffer *frame_source_acquire(struct frame_source *src, void **data);
+int frame_source_release(struct frame_source *src, struct v4l2_buffer *buf);
+
+void frame_source_print_stats(struct frame_source *src);
@@ -0,0 +1,320 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, an in-memory ring of
+  trace events written out as Chrome trace json. Writers claim a slot with
+  one atomic add and mark it written last, the dump skips slots that are
+  being written while it reads them.
+*****************************************************************************/
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+#include "../includes/shortcuts.h"
+#include "frame_trace.h"
+
+/****************************************************************************
+**                      	Global data
+*****************************************************************************/
+#define TRACE_THREADS_MAX 64	/* threads named in a dump */
+
+struct trace_thread
+{
+	unsigned int tid;		/* 0 until name is set */
+	char name[16];
+};
+
+int frame_trace_on;
+
+static struct trace_event *events;
+static unsigned long mask;		/* ring size - 1 */
+static unsigned long head;		/* next position to claim */
+static char trace_path[256];
+static struct trace_thread threads[TRACE_THREADS_MAX];
+static unsigned int nthreads;	/* slots claimed, may run past the table */
+
+/* one dump at a time, and start and stop against it */
+static __MUTEX_TYPE mutex = __STATIC_MUTEX_INIT;
+static __THREAD_TYPE dump_thread;
+static sem_t dump_sem;			/* posted by SIGUSR1 */
+static int dump_quit;
+static struct sigaction old_sa;
+
+static __thread unsigned int self_tid;
+static __thread unsigned int self_frame = TRACE_NO_FRAME;
+
+/*****************************************************************************
+**                           Function definition
+*****************************************************************************/
+
+/* nanoseconds on a clock ntp doesn't slew, for traces and stage timers */
+uint64_t trace_clock_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * the frame the calling thread works on, events it records from now on
+ * carry it
+ * args:
+ * 		frame - driver sequence, TRACE_NO_FRAME for none
+ */
+void frame_trace_set_frame(unsigned int frame)
+{
+	self_frame = frame;
+}
+
+unsigned int frame_trace_frame()
+{
+	return self_frame;
+}
+
+/* the calling thread's first event, keep its name while it is still there */
+static void name_thread()
+{
+	unsigned int i = __atomic_fetch_add(&nthreads, 1, __ATOMIC_RELAXED);
+
+	self_tid = syscall(SYS_gettid);
+	if (i >= TRACE_THREADS_MAX)
+		return;
+	prctl(PR_GET_NAME, threads[i].name);
+	/* no quotes or backslashes in the json */
+	threads[i].name[strcspn(threads[i].name, "\"\\")] = '\0';
+	__atomic_store_n(&threads[i].tid, self_tid, __ATOMIC_RELEASE);
+}
+
+/*
+ * record one complete event, from any thread, what TraceScope and
+ * StageTimer call
+ * args:
+ * 		name  - string literal
+ * 		start - ns from trace_clock_ns
+ * 		end   - ns from trace_clock_ns
+ * 		frame - driver sequence, TRACE_NO_FRAME for none
+ */
+void frame_trace_add(const char *name, uint64_t start, uint64_t end,
+					 unsigned int frame)
+{
+	if (!frame_trace_enabled())
+		return;
+	if (self_tid == 0)
+		name_thread();
+
+	unsigned long pos = __atomic_fetch_add(&head, 1, __ATOMIC_RELAXED);
+	struct trace_event *e = &events[pos & mask];
+
+	/* invalid until the last store, the dump checks seq on both sides */
+	__atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&e->start, start, __ATOMIC_RELAXED);
+	__atomic_store_n(&e->dur, end - start, __ATOMIC_RELAXED);
+	__atomic_store_n(&e->name, name, __ATOMIC_RELAXED);
+	__atomic_store_n(&e->tid, self_tid, __ATOMIC_RELAXED);
+	__atomic_store_n(&e->frame, frame, __ATOMIC_RELAXED);
+	__atomic_store_n(&e->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/* copy the event at a position, 0 if it was overwritten or is being written */
+static int read_event(unsigned long pos, struct trace_event *copy)
+{
+	struct trace_event *e = &events[pos & mask];
+
+	if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != pos + 1)
+		return 0;
+	copy->start = __atomic_load_n(&e->start, __ATOMIC_RELAXED);
+	copy->dur = __atomic_load_n(&e->dur, __ATOMIC_RELAXED);
+	copy->name = __atomic_load_n(&e->name, __ATOMIC_RELAXED);
+	copy->tid = __atomic_load_n(&e->tid, __ATOMIC_RELAXED);
+	copy->frame = __atomic_load_n(&e->frame, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&e->seq, __ATOMIC_RELAXED) == pos + 1;
+}
+
+/*
+ * write the events in the ring as Chrome trace json while threads go on
+ * recording, tracing stays on
+ * args:
+ * 		path - file to write, NULL for the one given to frame_trace_start
+ * returns:
+ * 		events written, error value if the file couldn't be written
+ */
+int frame_trace_dump(const char *path)
+{
+	struct trace_event e;
+	int pid = getpid();
+	int count = 0;
+	FILE *fp;
+
+	__LOCK_MUTEX(&mutex);
+	if (events == NULL)
+	{
+		__UNLOCK_MUTEX(&mutex);
+		return -EINVAL;
+	}
+	if (path == NULL)
+		path = trace_path;
+	if ((fp = fopen(path, "w")) == NULL)
+	{
+		fprintf(stderr, "TRACE: couldn't open %s: %s\n", path, strerror(errno));
+		__UNLOCK_MUTEX(&mutex);
+		return -errno;
+	}
+
+	unsigned long end = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+	unsigned long begin = end > mask + 1 ? end - (mask + 1) : 0;
+
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+				"\"args\":{\"name\":\"leopard_cam\"}}",
+			pid);
+	for (unsigned long pos = begin; pos < end; pos++)
+	{
+		if (!read_event(pos, &e))
+			continue;
+		fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+					"\"pid\":%d,\"tid\":%u",
+				e.name, e.start / 1e3, e.dur / 1e3, pid, e.tid);
+		if (e.frame != TRACE_NO_FRAME)
+			fprintf(fp, ",\"args\":{\"frame\":%u}", e.frame);
+		fprintf(fp, "}");
+		count++;
+	}
+	for (unsigned int i = 0; i < TRACE_THREADS_MAX; i++)
+	{
+		unsigned int tid = __atomic_load_n(&threads[i].tid, __ATOMIC_ACQUIRE);
+		if (tid != 0)
+			fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+						"\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+					pid, tid, threads[i].name);
+	}
+	fprintf(fp, "\n]}\n");
+
+	if (fclose(fp) != 0)
+	{
+		fprintf(stderr, "TRACE: couldn't write %s: %s\n", path, strerror(errno));
+		__UNLOCK_MUTEX(&mutex);
+		return -1;
+	}
+	printf("TRACE: %d events written to %s\n", count, path);
+	__UNLOCK_MUTEX(&mutex);
+	return count;
+}
+
+/* ask for a dump from anywhere, async-signal-safe */
+void frame_trace_request_dump()
+{
+	if (frame_trace_enabled())
+		sem_post(&dump_sem);
+}
+
+static void dump_signal(int sig)
+{
+	(void)sig;
+	frame_trace_request_dump();
+}
+
+/* dumps outside the signal handler, file io isn't signal safe */
+static void *dump_loop(void *arg)
+{
+	(void)arg;
+	while (1)
+	{
+		if (sem_wait(&dump_sem) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (__atomic_load_n(&dump_quit, __ATOMIC_ACQUIRE))
+			break;
+		frame_trace_dump(NULL);
+	}
+	return NULL;
+}
+
+/*
+ * start recording, SIGUSR1 writes the ring to path from then on, once
+ * per run
+ * args:
+ * 		path 	- where dumps go
+ * 		nevents - ring size, rounded up to a power of two, 0 for
+ * 				  FRAME_TRACE_EVENTS
+ * returns:
+ * 		error value
+ */
+int frame_trace_start(const char *path, unsigned int nevents)
+{
+	struct sigaction sa;
+	unsigned long size = 1;
+	int ret;
+
+	if (nevents == 0)
+		nevents = FRAME_TRACE_EVENTS;
+	while (size < nevents)
+		size <<= 1;
+
+	__LOCK_MUTEX(&mutex);
+	if (events != NULL)
+	{
+		__UNLOCK_MUTEX(&mutex);
+		return -EBUSY;
+	}
+	events = (struct trace_event *)calloc(size, sizeof events[0]);
+	if (events == NULL)
+	{
+		__UNLOCK_MUTEX(&mutex);
+		return -ENOMEM;
+	}
+	mask = size - 1;
+	head = 0;
+	snprintf(trace_path, sizeof trace_path, "%s", path);
+	__UNLOCK_MUTEX(&mutex);
+
+	sem_init(&dump_sem, 0, 0);
+	ret = __THREAD_CREATE(&dump_thread, dump_loop, NULL);
+	if (ret != 0)
+	{
+		printf("Unable to create trace dump thread: %s\n", strerror(ret));
+		dump_thread = 0;
+	}
+	else
+	{
+		CLEAR(sa);
+		sa.sa_handler = dump_signal;
+		sa.sa_flags = SA_RESTART;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGUSR1, &sa, &old_sa);
+	}
+
+	__atomic_store_n(&frame_trace_on, 1, __ATOMIC_RELEASE);
+	printf("TRACE: %lu events, kill -USR1 %d writes them to %s\n", size,
+		   getpid(), trace_path);
+	return 0;
+}
+
+/*
+ * stop recording and write what the ring holds, safe to call twice; the
+ * ring stays until exit, a scope that saw tracing on may still write to it
+ */
+void frame_trace_stop()
+{
+	if (!frame_trace_enabled())
+		return;
+	__atomic_store_n(&frame_trace_on, 0, __ATOMIC_RELEASE);
+	if (dump_thread != 0)
+	{
+		sigaction(SIGUSR1, &old_sa, NULL);
+		__atomic_store_n(&dump_quit, 1, __ATOMIC_RELEASE);
+		sem_post(&dump_sem);
+		__THREAD_JOIN(dump_thread);
+		dump_thread = 0;
+	}
+	frame_trace_dump(NULL);
+}
@@ -0,0 +1,90 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, a flight recorder of
+  what every thread did to every frame: the dequeue, each processing stage,
+  display, the requeue, file writes and extension unit transfers. The last
+  events stay in a ring in memory and are written out in the Chrome trace
+  format, for chrome://tracing or ui.perfetto.dev, on SIGUSR1, on a call
+  to frame_trace_dump and when tracing stops.
+
+  A TRACE_SCOPE in a block records the rest of the block as one complete
+  event when the block ends, so the ring never holds a begin without its
+  end. Recording one is a clock read, an atomic add to claim a slot and a
+  few stores, no lock. While tracing is off a scope costs one load.
+
+  Every STAGE_TIMER is traced as well, on the same clock, and still is
+  when -DNO_STAGE_TIMERS compiles their histograms out.
+*****************************************************************************/
+#pragma once
+#include <stdint.h>
+
+/****************************************************************************
+**                      	Global data
+*****************************************************************************/
+#define FRAME_TRACE_EVENTS 65536	/* default ring size, a power of two */
+#define TRACE_NO_FRAME 0xffffffffU	/* event not tied to a frame */
+
+struct trace_event
+{
+	unsigned long seq;		/* claimed position + 1 once written, else 0 */
+	uint64_t start;			/* ns, CLOCK_MONOTONIC_RAW */
+	uint64_t dur;			/* ns */
+	const char *name;		/* a string literal, never freed */
+	unsigned int tid;
+	unsigned int frame;		/* driver sequence, TRACE_NO_FRAME for none */
+};
+
+/* tracing is on, read without a lock on every scope */
+extern int frame_trace_on;
+
+/****************************************************************************
+**							 Function declaration
+*****************************************************************************/
+uint64_t trace_clock_ns();
+
+int frame_trace_start(const char *path, unsigned int nevents);
+void frame_trace_stop();
+int frame_trace_dump(const char *path);
+void frame_trace_request_dump();
+
+void frame_trace_add(const char *name, uint64_t start, uint64_t end,
+					 unsigned int frame);
+void frame_trace_set_frame(unsigned int frame);
+unsigned int frame_trace_frame();
+
+static inline int frame_trace_enabled()
+{
+	return __atomic_load_n(&frame_trace_on, __ATOMIC_RELAXED);
+}
+
+/* records the rest of the enclosing block as one event */
+class TraceScope
+{
+public:
+	explicit TraceScope(const char *name, unsigned int frame = TRACE_NO_FRAME)
+		: name(name), frame(frame),
+		  start(frame_trace_enabled() ? trace_clock_ns() : 0) {}
+	~TraceScope()
+	{
+		if (start != 0)
+			frame_trace_add(name, start, trace_clock_ns(),
+							frame != TRACE_NO_FRAME ? frame : frame_trace_frame());
+	}
+
+private:
+	TraceScope(const TraceScope &);
+	TraceScope &operator=(const TraceScope &);
+
+	const char *name;
+	unsigned int frame;
+	uint64_t start;
+};
+
+#define TRACE_SCOPE_NAME2(line) trace_scope_##line
+#define TRACE_SCOPE_NAME(line) TRACE_SCOPE_NAME2(line)
+/* name has to outlive the trace, a string literal; the frame is optional,
+   the thread's current one by default */
+#define TRACE_SCOPE(...) TraceScope TRACE_SCOPE_NAME(__LINE__)(__VA_ARGS__)
@@ -0,0 +1,415 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, per-pixel kernels used
+  by the software ISP path in decode_a_frame. Every kernel has a scalar
+  version plus SSE2/SSSE3/AVX2 versions on x86, the fastest one the CPU supports
+  is picked once at startup. All versions give bit-exact results.
+*****************************************************************************/
+#include <pthread.h>
+#include <stdint.h>
+#include <omp.h> //for openmp
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ISP_X86 1
+#endif
+
+#include "../includes/shortcuts.h"
+#include "isp_kernels.h"
+
+/****************************************************************************
+**                      	Global data
+*****************************************************************************/
+/* rows handed to one thread at a time */
+#define ISP_STRIPE_ROWS 64
+
+typedef void (*unpack_row_fn)(const unsigned short *src, unsigned char *dst,
+							  int width, int shift, int black_level);
+typedef void (*ccm_row_fn)(unsigned char *bgr, int width,
+						   const struct ccm_q12 *q);
+
+static unpack_row_fn unpack_row;
+static ccm_row_fn ccm_row;
+static const char *kernels_name = "scalar";
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+/*****************************************************************************
+**                           Function definition
+*****************************************************************************/
+
+/*
+ * subtract black level, shift the pixel down by RAW10/RAW12 extra bits
+ * and keep the lower 8 bits for opencv debayering
+ */
+static void unpack_row_scalar(const unsigned short *src, unsigned char *dst,
+							  int width, int shift, int black_level)
+{
+	for (int j = 0; j < width; j++)
+	{
+		unsigned short ts = src[j];
+		dst[j] = ts > black_level ? (unsigned char)((ts - black_level) >> shift) : 0;
+	}
+}
+
+#ifdef ISP_X86
+/*
+ * 16 pixels per step, subs_epu16 clamps at zero the same way the
+ * scalar "ts > black_level" check does
+ */
+__attribute__((target("sse2")))
+static void unpack_row_sse2(const unsigned short *src, unsigned char *dst,
+							int width, int shift, int black_level)
+{
+	const __m128i black = _mm_set1_epi16((short)black_level);
+	const __m128i count = _mm_cvtsi32_si128(shift);
+	const __m128i low8 = _mm_set1_epi16(0x00ff);
+	int j = 0;
+
+	for (; j + 16 <= width; j += 16)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i *)(src + j));
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + j + 8));
+		a = _mm_and_si128(_mm_srl_epi16(_mm_subs_epu16(a, black), count), low8);
+		b = _mm_and_si128(_mm_srl_epi16(_mm_subs_epu16(b, black), count), low8);
+		_mm_storeu_si128((__m128i *)(dst + j), _mm_packus_epi16(a, b));
+	}
+	unpack_row_scalar(src + j, dst + j, width - j, shift, black_level);
+}
+
+/*
+ * 32 pixels per step, packus works per 128-bit lane so the
+ * quadwords get put back in order afterwards
+ */
+__attribute__((target("avx2")))
+static void unpack_row_avx2(const unsigned short *src, unsigned char *dst,
+							int width, int shift, int black_level)
+{
+	const __m256i black = _mm256_set1_epi16((short)black_level);
+	const __m128i count = _mm_cvtsi32_si128(shift);
+	const __m256i low8 = _mm256_set1_epi16(0x00ff);
+	int j = 0;
+
+	for (; j + 32 <= width; j += 32)
+	{
+		__m256i a = _mm256_loadu_si256((const __m256i *)(src + j));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(src + j + 16));
+		a = _mm256_and_si256(_mm256_srl_epi16(_mm256_subs_epu16(a, black), count), low8);
+		b = _mm256_and_si256(_mm256_srl_epi16(_mm256_subs_epu16(b, black), count), low8);
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8);
+		_mm256_storeu_si256((__m256i *)(dst + j), packed);
+	}
+	unpack_row_sse2(src + j, dst + j, width - j, shift, black_level);
+}
+#endif
+
+/*
+ * gains and colour correction for one row of bgr pixels, 
+ * rounds to nearest and saturates to 0..255
+ */
+static void ccm_row_scalar(unsigned char *bgr, int width,
+						   const struct ccm_q12 *q)
+{
+	const int round = 1 << (CCM_FRAC_BITS - 1);
+
+	for (int j = 0; j < width; j++, bgr += 3)
+	{
+		int b = bgr[0], g = bgr[1], r = bgr[2];
+		for (int c = 0; c < 3; c++)
+		{
+			int v = (q->m[c][0] * b + q->m[c][1] * g + q->m[c][2] * r + round)
+					>> CCM_FRAC_BITS;
+			bgr[c] = CLIP(v);
+		}
+	}
+}
+
+#ifdef ISP_X86
+/* pshufb masks to split 16 packed bgr pixels into planes and back */
+static unsigned char deinterleave_mask[3][3][16] __attribute__((aligned(16)));
+static unsigned char interleave_mask[3][3][16] __attribute__((aligned(16)));
+
+static void init_shuffle_masks()
+{
+	for (int c = 0; c < 3; c++)
+		for (int r = 0; r < 3; r++)
+			for (int k = 0; k < 16; k++)
+			{
+				/* plane c, pixel k comes from byte 3k+c of the 48 */
+				int src = 3 * k + c;
+				deinterleave_mask[c][r][k] = src / 16 == r ? src % 16 : 0x80;
+				/* packed byte 16r+k goes back to plane (16r+k)%3 */
+				int dst = 16 * r + k;
+				interleave_mask[r][c][k] = dst % 3 == c ? dst / 3 : 0x80;
+			}
+}
+
+/* 
+ * one output channel for 8 pixels held as 16-bit (b,g) and (r,1) pairs,
+ * madd does coefficient * pixel plus the rounding term in 32 bits
+ */
+__attribute__((target("ssse3")))
+static inline __m128i ccm_channel_8(__m128i bg_lo, __m128i bg_hi,
+									__m128i r1_lo, __m128i r1_hi,
+									const short *m)
+{
+	const __m128i k_bg = _mm_set1_epi32(((unsigned short)m[1] << 16) |
+										(unsigned short)m[0]);
+	const __m128i k_r1 = _mm_set1_epi32((1 << (CCM_FRAC_BITS - 1) << 16) |
+										(unsigned short)m[2]);
+	__m128i lo = _mm_add_epi32(_mm_madd_epi16(bg_lo, k_bg),
+							   _mm_madd_epi16(r1_lo, k_r1));
+	__m128i hi = _mm_add_epi32(_mm_madd_epi16(bg_hi, k_bg),
+							   _mm_madd_epi16(r1_hi, k_r1));
+	lo = _mm_srai_epi32(lo, CCM_FRAC_BITS);
+	hi = _mm_srai_epi32(hi, CCM_FRAC_BITS);
+	return _mm_packs_epi32(lo, hi);
+}
+
+/*
+ * 16 pixels per step, planes are split with pshufb, every channel is
+ * computed in 32-bit and narrowed with signed then unsigned saturation
+ */
+__attribute__((target("ssse3")))
+static void ccm_row_ssse3(unsigned char *bgr, int width,
+						  const struct ccm_q12 *q)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i one = _mm_set1_epi16(1);
+	int j = 0;
+
+	for (; j + 16 <= width; j += 16, bgr += 48)
+	{
+		__m128i in[3], plane[3], out[3];
+		for (int r = 0; r < 3; r++)
+			in[r] = _mm_loadu_si128((const __m128i *)(bgr + 16 * r));
+		for (int c = 0; c < 3; c++)
+			plane[c] = _mm_or_si128(
+				_mm_or_si128(_mm_shuffle_epi8(in[0], *(const __m128i *)deinterleave_mask[c][0]),
+							 _mm_shuffle_epi8(in[1], *(const __m128i *)deinterleave_mask[c][1])),
+				_mm_shuffle_epi8(in[2], *(const __m128i *)deinterleave_mask[c][2]));
+
+		__m128i b_lo = _mm_unpacklo_epi8(plane[0], zero);
+		__m128i b_hi = _mm_unpackhi_epi8(plane[0], zero);
+		__m128i g_lo = _mm_unpacklo_epi8(plane[1], zero);
+		__m128i g_hi = _mm_unpackhi_epi8(plane[1], zero);
+		__m128i r_lo = _mm_unpacklo_epi8(plane[2], zero);
+		__m128i r_hi = _mm_unpackhi_epi8(plane[2], zero);
+
+		__m128i bg[4], r1[4];
+		bg[0] = _mm_unpacklo_epi16(b_lo, g_lo);
+		bg[1] = _mm_unpackhi_epi16(b_lo, g_lo);
+		bg[2] = _mm_unpacklo_epi16(b_hi, g_hi);
+		bg[3] = _mm_unpackhi_epi16(b_hi, g_hi);
+		r1[0] = _mm_unpacklo_epi16(r_lo, one);
+		r1[1] = _mm_unpackhi_epi16(r_lo, one);
+		r1[2] = _mm_unpacklo_epi16(r_hi, one);
+		r1[3] = _mm_unpackhi_epi16(r_hi, one);
+
+		for (int c = 0; c < 3; c++)
+			plane[c] = _mm_packus_epi16(
+				ccm_channel_8(bg[0], bg[1], r1[0], r1[1], q->m[c]),
+				ccm_channel_8(bg[2], bg[3], r1[2], r1[3], q->m[c]));
+
+		for (int r = 0; r < 3; r++)
+		{
+			out[r] = _mm_or_si128(
+				_mm_or_si128(_mm_shuffle_epi8(plane[0], *(const __m128i *)interleave_mask[r][0]),
+							 _mm_shuffle_epi8(plane[1], *(const __m128i *)interleave_mask[r][1])),
+				_mm_shuffle_epi8(plane[2], *(const __m128i *)interleave_mask[r][2]));
+			_mm_storeu_si128((__m128i *)(bgr + 16 * r), out[r]);
+		}
+	}
+	ccm_row_scalar(bgr, width - j, q);
+}
+#endif
+
+/* pick the fastest kernels this CPU can run */
+static void select_kernels()
+{
+	unpack_row = unpack_row_scalar;
+	ccm_row = ccm_row_scalar;
+	kernels_name = "scalar";
+#ifdef ISP_X86
+	__builtin_cpu_init();
+	init_shuffle_masks();
+	if (__builtin_cpu_supports("sse2"))
+	{
+		unpack_row = unpack_row_sse2;
+		kernels_name = "sse2";
+	}
+	if (__builtin_cpu_supports("ssse3"))
+	{
+		ccm_row = ccm_row_ssse3;
+		kernels_name = "ssse3";
+	}
+	if (__builtin_cpu_supports("avx2"))
+	{
+		unpack_row = unpack_row_avx2;
+		kernels_name = "avx2";
+	}
+#endif
+	printf("ISP kernels: %s\n", kernels_name);
+}
+
+/*
+ * runtime cpu detection, safe to call more than once
+ */
+void isp_kernels_init()
+{
+	pthread_once(&kernels_once, select_kernels);
+}
+
+/*
+ * returns:
+ * 		name of the instruction set the kernels use
+ */
+const char *isp_kernels_name()
+{
+	isp_kernels_init();
+	return kernels_name;
+}
+
+/*
+ * shift bits for 16-bit stream and get lower 8-bit for opencv debayering,
+ * rows are split in stripes and spread across openmp threads
+ * args:
+ * 		src 		- 16-bit raw frame, width * height pixels
+ * 		dst 		- 8-bit output, must not overlap src
+ * 		width 		- frame width
+ * 		height 		- frame height
+ * 		shift 		- values to shift(RAW10 - 2, RAW12 - 4)
+ * 		black_level - subtracted before shifting, clamps at zero
+ */
+void unpack_raw_to_8bit(const unsigned short *src, unsigned char *dst,
+						int width, int height, int shift, int black_level)
+{
+	isp_kernels_init();
+	int stripes = (height + ISP_STRIPE_ROWS - 1) / ISP_STRIPE_ROWS;
+
+#pragma omp parallel for schedule(static)
+	for (int s = 0; s < stripes; s++)
+	{
+		int row_end = (s + 1) * ISP_STRIPE_ROWS;
+		if (row_end > height)
+			row_end = height;
+
+		for (int i = s * ISP_STRIPE_ROWS; i < row_end; i++)
+			unpack_row(src + (size_t)i * width, dst + (size_t)i * width,
+					   width, shift, black_level);
+	}
+}
+
+/*
+ * fold per-channel gains into the colour correction matrix and convert it
+ * to fixed point, coefficients are clamped to what fits in 16 bits
+ * args:
+ * 		q 	 - fixed-point result
+ * 		ccm  - 3x3 colour correction matrix, bgr order, 1.0 = unity
+ * 		gain - b, g, r gains applied before the matrix
+ */
+void build_awb_ccm(struct ccm_q12 *q, const double ccm[3][3],
+				   const double gain[3])
+{
+	for (int c = 0; c < 3; c++)
+		for (int k = 0; k < 3; k++)
+		{
+			double v = ccm[c][k] * gain[k] * (1 << CCM_FRAC_BITS);
+			v = v < 0 ? v - 0.5 : v + 0.5;
+			if (v > 32767)
+				v = 32767;
+			if (v < -32768)
+				v = -32768;
+			q->m[c][k] = (short)v;
+		}
+}
+
+/*
+ * apply gains and colour correction in one pass over a bgr image, 
+ * in place, rows are split in stripes across openmp threads
+ * args:
+ * 		bgr    - 8-bit 3 channel image
+ * 		width  - image width
+ * 		height - image height
+ * 		step   - bytes per row
+ * 		q 	   - coefficients from build_awb_ccm
+ */
+void apply_awb_ccm(unsigned char *bgr, int width, int height, size_t step,
+				   const struct ccm_q12 *q)
+{
+	isp_kernels_init();
+	int stripes = (height + ISP_STRIPE_ROWS - 1) / ISP_STRIPE_ROWS;
+
+#pragma omp parallel for schedule(static)
+	for (int s = 0; s < stripes; s++)
+	{
+		int row_end = (s + 1) * ISP_STRIPE_ROWS;
+		if (row_end > height)
+			row_end = height;
+
+		for (int i = s * ISP_STRIPE_ROWS; i < row_end; i++)
+			ccm_row(bgr + i * step, width, q);
+	}
+}
+
+/*
+ * grayscale histogram of what a bgr image looks like after a per-channel
+ * lookup table and an optional colour correction, without applying either
+ * args:
+ * 		bgr 		- 8-bit 3 channel image
+ * 		width 		- image width
+ * 		height 		- image height
+ * 		step 		- bytes per row
+ * 		sample_step - only look at every n-th pixel of every n-th row
+ * 		lut 		- b, g, r lookup tables
+ * 		q 			- colour correction from build_awb_ccm, NULL to skip
+ * 		hist 		- 256 bins, filled in
+ */
+void tone_histogram(const unsigned char *bgr, int width, int height,
+					size_t step, int sample_step,
+					const unsigned char lut[3][256], const struct ccm_q12 *q,
+					unsigned int hist[256])
+{
+	if (sample_step < 1)
+		sample_step = 1;
+	memset(hist, 0, 256 * sizeof hist[0]);
+
+#pragma omp parallel
+	{
+		unsigned int local[256] = {0};
+		const int round = 1 << (CCM_FRAC_BITS - 1);
+
+#pragma omp for schedule(static)
+		for (int i = 0; i < height; i += sample_step)
+		{
+			const unsigned char *p = bgr + i * step;
+			for (int j = 0; j < width; j += sample_step)
+			{
+				int b = lut[0][p[3 * j]];
+				int g = lut[1][p[3 * j + 1]];
+				int r = lut[2][p[3 * j + 2]];
+				if (q)
+				{
+					int v[3];
+					for (int c = 0; c < 3; c++)
+					{
+						v[c] = (q->m[c][0] * b + q->m[c][1] * g + q->m[c][2] * r +
+								round) >> CCM_FRAC_BITS;
+						v[c] = CLIP(v[c]);
+					}
+					b = v[0];
+					g = v[1];
+					r = v[2];
+				}
+				/* same weights and rounding as opencv BGR2GRAY */
+				local[(b * 1868 + g * 9617 + r * 4899 + (1 << 13)) >> 14]++;
+			}
+		}
+
+#pragma omp critical
+		for (int k = 0; k < 256; k++)
+			hist[k] += local[k];
+	}
+}
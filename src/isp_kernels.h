@@ -0,0 +1,48 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, per-pixel kernels used
+  by the software ISP path in decode_a_frame. Every kernel has a scalar
+  version plus SSE2/SSSE3/AVX2 versions on x86, the fastest one the CPU supports
+  is picked once at startup. All versions give bit-exact results.
+*****************************************************************************/
+#pragma once
+
+/****************************************************************************
+**                      	Global data
+*****************************************************************************/
+/* sensor black level in the 16-bit raw stream */
+#define RAW_BLACK_LEVEL 64
+
+/* fractional bits of the fixed-point colour correction coefficients */
+#define CCM_FRAC_BITS 12
+
+/* 
+ * per-channel gains folded into a 3x3 colour correction matrix, bgr order
+ * out[c] = (m[c][0] * b + m[c][1] * g + m[c][2] * r) >> CCM_FRAC_BITS
+ */
+struct ccm_q12
+{
+	short m[3][3];
+};
+
+/****************************************************************************
+**							 Function declaration
+*****************************************************************************/
+void isp_kernels_init();
+const char *isp_kernels_name();
+
+void unpack_raw_to_8bit(const unsigned short *src, unsigned char *dst,
+						int width, int height, int shift, int black_level);
+
+void build_awb_ccm(struct ccm_q12 *q, const double ccm[3][3],
+				   const double gain[3]);
+void apply_awb_ccm(unsigned char *bgr, int width, int height, size_t step,
+				   const struct ccm_q12 *q);
+
+void tone_histogram(const unsigned char *bgr, int width, int height,
+					size_t step, int sample_step,
+					const unsigned char lut[3][256], const struct ccm_q12 *q,
+					unsigned int hist[256]);
@@ -0,0 +1,488 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, runs several cameras in
+  one process without display. One event loop does the capture i/o of every
+  camera, and serves the timers and the control socket too. Every camera
+  has its own buffers, capture ring, decode buffer and decode thread, which
+  can be pinned to a cpu. Aggregate throughput and per-camera drops are
+  reported once a second.
+*****************************************************************************/
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <omp.h>
+#include <sched.h>
+#include <signal.h>
+
+#include "../includes/shortcuts.h"
+#include "multi_cam.h"
+#include "extend_cam_ctrl.h"
+#include "cam_property.h"
+#include "cam_formats.h"
+#include "isp_kernels.h"
+#include "stage_timer.h"
+#include "frame_trace.h"
+#include "uvc_extension_unit_ctrl.h"
+
+/****************************************************************************
+**                      	Global data
+*****************************************************************************/
+/* loop the SIGINT handler ends */
+static struct event_loop *volatile sigint_loop;
+
+/*****************************************************************************
+**                           Function definition
+*****************************************************************************/
+
+static void handle_sigint(int sig)
+{
+	(void)sig;
+	if (sigint_loop != NULL)
+		event_loop_cancel(sigint_loop);
+}
+
+/* shift for the datatype in the hardware revision, RAW10 if unknown */
+static int datatype_shift(int datatype)
+{
+	switch (datatype)
+	{
+	case RAW_12_MODE:
+		return 4;
+	case YUY2_MODE:
+		return 0;
+	default:
+		return 2;
+	}
+}
+
+/*
+ * decode thread of one camera, unpacks and debayers every frame into the
+ * camera's own buffers and gives the v4l2 buffer back right after unpack
+ * args:
+ * 		arg - struct cam_stream *cam
+ */
+static void *decode_thread(void *arg)
+{
+	struct cam_stream *cam = (struct cam_stream *)arg;
+	struct device *dev = &cam->dev;
+	void *frame = frame_pool_get(&cam->pool, 1);
+	cv::Mat bgr(dev->height, dev->width, CV_8UC3);
+	struct v4l2_buffer *buf;
+	const char *node = strrchr(cam->name, '/');
+	char name[16];
+
+	/* decode video0 and so on in a trace */
+	snprintf(name, sizeof name, "decode %s", node ? node + 1 : cam->name);
+	pthread_setname_np(pthread_self(), name);
+	omp_set_num_threads(cam->omp_threads);
+	while ((buf = capture_ring_acquire(&cam->ring)) != NULL)
+	{
+		frame_trace_set_frame(buf->sequence);
+		unpack_a_frame(dev, dev->buffers[buf->index].start, frame, cam->shift);
+		/* read by the stats on the loop thread */
+		__atomic_add_fetch(&cam->bytes, buf->bytesused, __ATOMIC_RELAXED);
+		capture_ring_release(&cam->ring, buf);
+
+		if (cam->shift != 0)
+		{
+			cv::Mat img(dev->height, dev->width, CV_8UC1, frame);
+			STAGE_TIMER(STAGE_DEBAYER);
+			cv::cvtColor(img, bgr, CV_BayerBG2BGR + 2);
+		}
+		else
+		{
+			cv::Mat img(dev->height, dev->width, CV_8UC2, frame);
+			STAGE_TIMER(STAGE_DEBAYER);
+			cv::cvtColor(img, bgr, cv::COLOR_YUV2BGR_YUY2);
+		}
+		cam->decoded++;
+	}
+	frame_pool_put(&cam->pool, frame);
+	return NULL;
+}
+
+/*
+ * open one camera and get it streaming into its capture ring
+ * args:
+ * 		cam    - camera to set up, cam->name is the node
+ * 		config - format, rate and buffer count
+ * 		loop   - event loop that does the capture
+ * returns:
+ * 		error value, -ENODEV for a node that doesn't capture video
+ */
+static int open_cam(struct cam_stream *cam, const struct multi_cam_config *config,
+					struct event_loop *loop)
+{
+	struct device *dev = &cam->dev;
+	struct v4l2_capability cap;
+
+	CLEAR(*dev);
+	if (open_v4l2_device(cam->name, dev) < 0)
+		return -1;
+
+	/* a camera can have a metadata node next to the video one */
+	CLEAR(cap);
+	if (ioctl(dev->fd, VIDIOC_QUERYCAP, &cap) < 0 ||
+		!(((cap.capabilities & V4L2_CAP_DEVICE_CAPS) ? cap.device_caps
+													  : cap.capabilities) &
+		  V4L2_CAP_VIDEO_CAPTURE))
+	{
+		close(dev->fd);
+		return -ENODEV;
+	}
+
+	if (config->width && config->height)
+		video_set_format(dev, config->width, config->height, V4L2_PIX_FMT_YUYV);
+	if (config->fps)
+		set_frame_rate(dev->fd, config->fps);
+	video_get_format(dev);
+	cam->shift = datatype_shift(read_cam_datatype(dev->fd));
+
+	dev->memtype = config->memtype;
+	dev->lock_buffers = config->lock_buffers;
+	if (video_alloc_buffers(dev, config->nbufs) < 0)
+	{
+		/* video_set_format has kept the formats of this fd */
+		cam_caps_forget(dev->fd);
+		close(dev->fd);
+		return -1;
+	}
+
+	if (frame_pool_init(&cam->pool, 1, (size_t)dev->width * dev->height * 2) < 0 ||
+		capture_ring_init(&cam->ring, dev) < 0)
+	{
+		video_free_buffers(dev);
+		cam_caps_forget(dev->fd);
+		close(dev->fd);
+		return -ENOMEM;
+	}
+	capture_ring_set_policy(&cam->ring, config->policy);
+	stream_stats_init(&cam->stats);
+	capture_ring_set_stats(&cam->ring, &cam->stats);
+	capture_ring_attach(&cam->ring, loop);
+	start_camera(dev);
+	cam->streaming = 1;
+	return 0;
+}
+
+/*
+ * the commands the control socket takes:
+ * 	stats, stages, trace, exposure N, gain N, stop
+ * args:
+ * 		data 	 - struct multi_cam *mc
+ * 		line 	 - one command
+ * 		reply_fd - client
+ */
+static void handle_command(void *data, char *line, int reply_fd)
+{
+	struct multi_cam *mc = (struct multi_cam *)data;
+	char cmd[16];
+	int val;
+
+	if (sscanf(line, "%15s", cmd) != 1)
+		return;
+	if (strcmp(cmd, "stats") == 0)
+	{
+		for (unsigned int i = 0; i < mc->ncams; i++)
+		{
+			struct cam_stream *cam = &mc->cams[i];
+			unsigned int high_water;
+			unsigned long pushed, queue_dropped;
+
+			frame_queue_stats(&cam->ring.ready, &high_water, &pushed,
+							  &queue_dropped);
+			dprintf(reply_fd,
+					"%s: %lu frames, %lu dropped, ring %u/%u, "
+					"queue %lu dropped, high water %u\n",
+					cam->name, cam->ring.frames, cam->ring.dropped,
+					capture_ring_fill(&cam->ring), cam->dev.nbufs,
+					queue_dropped, high_water);
+		}
+		dprintf(reply_fd, "loop: %lu wakeups, %lu events\n", mc->loop.wakeups,
+				mc->loop.dispatched);
+	}
+	else if (strcmp(cmd, "stages") == 0)
+	{
+		struct stage_snapshot snap;
+		stage_timers_snapshot(&snap);
+		stage_timers_print(reply_fd, &snap, NULL);
+	}
+	else if (strcmp(cmd, "trace") == 0)
+	{
+		/* on the dump thread, a big trace mustn't hold up capture */
+		frame_trace_request_dump();
+		dprintf(reply_fd, frame_trace_enabled() ? "ok\n" : "error: not tracing\n");
+	}
+	else if (strcmp(cmd, "exposure") == 0 && sscanf(line, "%*s %d", &val) == 1)
+	{
+		for (unsigned int i = 0; i < mc->ncams; i++)
+			set_exposure_absolute(mc->cams[i].dev.fd, val);
+		dprintf(reply_fd, "ok\n");
+	}
+	else if (strcmp(cmd, "gain") == 0 && sscanf(line, "%*s %d", &val) == 1)
+	{
+		for (unsigned int i = 0; i < mc->ncams; i++)
+			set_gain(mc->cams[i].dev.fd, val);
+		dprintf(reply_fd, "ok\n");
+	}
+	else if (strcmp(cmd, "stop") == 0)
+	{
+		event_loop_cancel(&mc->loop);
+		dprintf(reply_fd, "ok\n");
+	}
+	else
+		dprintf(reply_fd, "error: unknown command '%s', try stats, stages, trace, "
+				"exposure N, gain N or stop\n", line);
+}
+
+/*
+ * open every camera in the list, nodes that don't capture video are skipped
+ * args:
+ * 		mc        - multi camera state
+ * 		dev_names - /dev/video# paths, from enum_v4l2_devices
+ * 		count     - number of paths
+ * 		config    - same format, rate and buffer count for all of them
+ * returns:
+ * 		number of cameras opened
+ */
+int multi_cam_open(struct multi_cam *mc, char (*dev_names)[64], int count,
+				   const struct multi_cam_config *config)
+{
+	CLEAR(*mc);
+	isp_kernels_init();
+	if (event_loop_init(&mc->loop) < 0)
+		return 0;
+	mc->realtime = config->realtime;
+
+	for (int i = 0; i < count && mc->ncams < MULTI_CAM_MAX; i++)
+	{
+		struct cam_stream *cam = &mc->cams[mc->ncams];
+		int cpu = config->ncpus ? config->cpus[mc->ncams % config->ncpus] : -1;
+
+		snprintf(cam->name, sizeof(cam->name), "%s", dev_names[i]);
+		int ret = open_cam(cam, config, &mc->loop);
+		if (ret == -ENODEV)
+			continue;
+		if (ret < 0)
+		{
+			printf("MULTI_CAM: couldn't open %s\n", cam->name);
+			continue;
+		}
+		cam->cpu = cpu;
+		printf("MULTI_CAM: camera %u %s %ux%u, %u buffers%s", mc->ncams,
+			   cam->name, cam->dev.width, cam->dev.height, cam->dev.nbufs,
+			   cpu >= 0 ? "" : "\n");
+		if (cpu >= 0)
+			printf(", decode on cpu %d\n", cpu);
+		mc->ncams++;
+	}
+	if (mc->ncams > 0 && config->control_path != NULL)
+		control_socket_open(&mc->control, &mc->loop, config->control_path,
+							handle_command, mc);
+	return mc->ncams;
+}
+
+/* once a second from the loop */
+static void report_stats(void *data, int fd, unsigned int events)
+{
+	(void)fd;
+	(void)events;
+	multi_cam_print_stats((struct multi_cam *)data);
+}
+
+/* the duration is up */
+static void end_run(void *data, int fd, unsigned int events)
+{
+	(void)fd;
+	(void)events;
+	event_loop_cancel(&((struct multi_cam *)data)->loop);
+}
+
+/* a cpu that isn't there only costs the pinning, not the stream */
+static void pin_thread(struct cam_stream *cam)
+{
+	cpu_set_t cpus;
+	int ret;
+
+	if (cam->cpu < 0)
+		return;
+	CPU_ZERO(&cpus);
+	CPU_SET(cam->cpu, &cpus);
+	ret = pthread_setaffinity_np(cam->thread, sizeof cpus, &cpus);
+	if (ret != 0)
+		printf("Decode thread of %s not pinned to cpu %d: %s\n", cam->name,
+			   cam->cpu, strerror(ret));
+}
+
+/*
+ * stream all cameras until the time is up, ctrl-c or a stop command, the
+ * capture of every camera runs in the event loop in this thread, SCHED_FIFO
+ * for the run if the config asked for it
+ * args:
+ * 		mc      - opened cameras
+ * 		seconds - how long, 0 until ctrl-c
+ * returns:
+ * 		error value
+ */
+int multi_cam_run(struct multi_cam *mc, double seconds)
+{
+	struct sigaction sa, old_sa;
+	/* the cameras share the cores for their omp stripes */
+	int threads = omp_get_num_procs() / (mc->ncams ? mc->ncams : 1);
+	int report_timer, duration_timer = -1;
+
+	if (mc->ncams == 0)
+		return -ENODEV;
+	sigint_loop = &mc->loop;
+	CLEAR(sa);
+	sa.sa_handler = handle_sigint;
+	sigaction(SIGINT, &sa, &old_sa);
+
+	for (unsigned int i = 0; i < mc->ncams; i++)
+	{
+		struct cam_stream *cam = &mc->cams[i];
+
+		cam->omp_threads = threads > 0 ? threads : 1;
+		if (capture_ring_start(&cam->ring) < 0 ||
+			__THREAD_CREATE(&cam->thread, decode_thread, cam) != 0)
+		{
+			printf("MULTI_CAM: couldn't start %s\n", cam->name);
+			capture_ring_stop(&cam->ring);
+			cam->thread = 0;
+			continue;
+		}
+		pin_thread(cam);
+	}
+	mc->running = 1;
+	mc->start_time = monotonic_us();
+	mc->last_report = mc->start_time;
+	mc->last_bytes = 0;
+
+	report_timer = event_loop_add_timer(&mc->loop, 1000, 1000, report_stats, mc);
+	if (seconds > 0)
+		duration_timer = event_loop_add_timer(&mc->loop, (unsigned int)(seconds * 1000),
+											  0, end_run, mc);
+	/* after the decode threads are created, they'd inherit SCHED_FIFO */
+	if (mc->realtime > 0)
+	{
+		realtime_lock_memory();
+		realtime_enter(mc->realtime);
+	}
+	if (mc->realtime >= 0)
+		latency_probe_start(&mc->probe, &mc->loop);
+	event_loop_run(&mc->loop);
+	latency_probe_stop(&mc->probe);
+	if (mc->realtime > 0)
+		realtime_leave();
+	event_loop_remove_timer(&mc->loop, report_timer);
+	event_loop_remove_timer(&mc->loop, duration_timer);
+
+	for (unsigned int i = 0; i < mc->ncams; i++)
+	{
+		capture_ring_stop(&mc->cams[i].ring);
+		if (mc->cams[i].thread)
+			__THREAD_JOIN(mc->cams[i].thread);
+		mc->cams[i].thread = 0;
+	}
+	mc->running = 0;
+	sigaction(SIGINT, &old_sa, NULL);
+	sigint_loop = NULL;
+
+	/* once more over the whole run */
+	printf("MULTI_CAM: total over %.1f s\n",
+		   (monotonic_us() - mc->start_time) / 1e6);
+	mc->last_report = mc->start_time;
+	mc->last_bytes = 0;
+	for (unsigned int i = 0; i < mc->ncams; i++)
+	{
+		mc->cams[i].last_frames = 0;
+		mc->cams[i].last_dropped = 0;
+	}
+	multi_cam_print_stats(mc);
+	printf("MULTI_CAM: capture loop woke up %lu times for %lu events\n",
+		   mc->loop.wakeups, mc->loop.dispatched);
+	latency_probe_print(&mc->probe, "capture loop latency");
+
+	struct stage_snapshot stages;
+	stage_timers_snapshot(&stages);
+	stage_timers_print(STDOUT_FILENO, &stages, NULL);
+	for (unsigned int i = 0; i < mc->ncams; i++)
+	{
+		struct stream_stats snap;
+
+		printf("MULTI_CAM: %s\n", mc->cams[i].name);
+		stream_stats_snapshot(&mc->cams[i].stats, &snap);
+		stream_stats_print(&snap);
+	}
+	return 0;
+}
+
+/*
+ * per-camera frame rate and drops since the last report, and the total
+ * throughput of all cameras
+ * args:
+ * 		mc - streaming cameras
+ */
+void multi_cam_print_stats(struct multi_cam *mc)
+{
+	double now = monotonic_us();
+	double seconds = (now - mc->last_report) / 1e6;
+	unsigned long total_frames = 0, total_dropped = 0;
+	unsigned long long total_bytes = 0;
+
+	if (seconds <= 0)
+		return;
+
+	for (unsigned int i = 0; i < mc->ncams; i++)
+	{
+		struct cam_stream *cam = &mc->cams[i];
+		unsigned long frames = cam->ring.frames;
+		unsigned long dropped = cam->ring.dropped;
+		unsigned int high_water;
+		unsigned long pushed, queue_dropped;
+
+		frame_queue_stats(&cam->ring.ready, &high_water, &pushed, &queue_dropped);
+		printf("  %s: %.1f fps, %lu dropped (%lu total), ring %u/%u, "
+			   "queue %lu dropped\n",
+			   cam->name, (frames - cam->last_frames) / seconds,
+			   dropped - cam->last_dropped, dropped,
+			   capture_ring_fill(&cam->ring), cam->dev.nbufs, queue_dropped);
+		total_frames += frames - cam->last_frames;
+		total_dropped += dropped - cam->last_dropped;
+		total_bytes += __atomic_load_n(&cam->bytes, __ATOMIC_RELAXED);
+		cam->last_frames = frames;
+		cam->last_dropped = dropped;
+	}
+	printf("MULTI_CAM: %u cameras, %.1f fps, %.1f MB/s, %lu dropped\n",
+		   mc->ncams, total_frames / seconds,
+		   (total_bytes - mc->last_bytes) / 1e6 / seconds, total_dropped);
+	mc->last_report = now;
+	mc->last_bytes = total_bytes;
+}
+
+/*
+ * stop streaming and release every camera
+ * args:
+ * 		mc - opened cameras
+ */
+void multi_cam_close(struct multi_cam *mc)
+{
+	for (unsigned int i = 0; i < mc->ncams; i++)
+	{
+		struct cam_stream *cam = &mc->cams[i];
+
+		if (cam->streaming)
+			stop_Camera(&cam->dev);
+		cam->streaming = 0;
+		capture_ring_free(&cam->ring);
+		frame_pool_free(&cam->pool);
+		video_free_buffers(&cam->dev);
+		cam_caps_forget(cam->dev.fd);
+		close(cam->dev.fd);
+	}
+	mc->ncams = 0;
+	control_socket_close(&mc->control);
+	event_loop_free(&mc->loop);
+}
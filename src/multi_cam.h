@@ -0,0 +1,85 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, runs several cameras in
+  one process without display. One event loop does the capture i/o of every
+  camera, and serves the timers and the control socket too. Every camera
+  has its own buffers, capture ring, decode buffer and decode thread, which
+  can be pinned to a cpu. Aggregate throughput and per-camera drops are
+  reported once a second.
+*****************************************************************************/
+#pragma once
+#include "capture_ring.h"
+#include "frame_pool.h"
+#include "event_loop.h"
+#include "control_socket.h"
+#include "realtime.h"
+
+/****************************************************************************
+**                      	Global data
+*****************************************************************************/
+#define MULTI_CAM_MAX 8
+
+struct multi_cam_config
+{
+	unsigned int nbufs;
+	enum v4l2_memory memtype;	/* V4L2_MEMORY_USERPTR for the huge page arena */
+	int lock_buffers;
+	enum frame_queue_policy policy;	/* when a decode thread falls behind */
+	int realtime;			/* capture loop SCHED_FIFO priority, 0 normal,
+							   -1 without latency probe, see realtime.h */
+	unsigned int width;		/* 0 keeps the current format */
+	unsigned int height;
+	unsigned int fps;		/* 0 keeps the current rate */
+	int cpus[MULTI_CAM_MAX];	/* decode thread of camera i runs on cpus[i] */
+	unsigned int ncpus;		/* 0 leaves them to the scheduler */
+	const char *control_path;	/* unix socket for commands, NULL for none */
+};
+
+struct cam_stream
+{
+	char name[64];
+	struct device dev;
+	struct capture_ring ring;
+	struct stream_stats stats;	/* lost frames and latencies */
+	struct frame_pool pool;	/* decode working buffer */
+	int shift;				/* RAW10 2, RAW12 4, YUV 0 */
+	int streaming;
+	int omp_threads;		/* for the unpack stripes */
+	int cpu;				/* for the decode thread, -1 anywhere */
+
+	__THREAD_TYPE thread;	/* decode thread */
+	unsigned long decoded;
+	unsigned long long bytes;	/* atomic, the decode thread adds */
+
+	/* counters at the last report */
+	unsigned long last_frames;
+	unsigned long last_dropped;
+};
+
+struct multi_cam
+{
+	struct cam_stream cams[MULTI_CAM_MAX];
+	unsigned int ncams;
+	int running;
+
+	/* capture of all cameras, stats timer, duration and control socket */
+	struct event_loop loop;
+	struct control_socket control;
+	int realtime;
+	struct latency_probe probe;	/* how late the capture loop gets to run */
+	double start_time;		/* us */
+	double last_report;
+	unsigned long long last_bytes;
+};
+
+/****************************************************************************
+**							 Function declaration
+*****************************************************************************/
+int multi_cam_open(struct multi_cam *mc, char (*dev_names)[64], int count,
+				   const struct multi_cam_config *config);
+int multi_cam_run(struct multi_cam *mc, double seconds);
+void multi_cam_print_stats(struct multi_cam *mc);
+void multi_cam_close(struct multi_cam *mc);
@@ -0,0 +1,669 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, continuous raw recording
+  into one append-only container file. The capture side copies each frame
+  with its header into a preallocated, page aligned block, a writer thread
+  appends the blocks to the file through a pluggable backend and writes the
+  index when recording stops.
+*****************************************************************************/
+#include "../includes/shortcuts.h"
+#include "raw_recorder.h"
+#include "frame_trace.h"
+
+/* index entries to start with, doubled whenever it runs full */
+#define RAW_RECORD_INDEX_INITIAL 4096
+/* a block in flight that has no index entry */
+#define RAW_RECORD_NO_ENTRY ((unsigned long)-1)
+
+/*****************************************************************************
+**                           Function definition
+*****************************************************************************/
+
+static size_t align_up(size_t size)
+{
+	return (size + RAW_RECORD_ALIGN - 1) & ~((size_t)RAW_RECORD_ALIGN - 1);
+}
+
+/*
+ * container header for frames of the current format
+ * args:
+ * 		h   - header to fill
+ * 		dev - camera, gives frame size and geometry
+ */
+void raw_record_init_header(struct raw_record_header *h, struct device *dev)
+{
+	CLEAR(*h);
+	memcpy(h->magic, RAW_RECORD_MAGIC, sizeof h->magic);
+	h->version = RAW_RECORD_VERSION;
+	h->header_size = RAW_RECORD_ALIGN;
+	h->width = dev->width;
+	h->height = dev->height;
+	h->bytesperline = dev->bytesperline;
+	h->frame_size = dev->imagesize;
+	h->frame_stride = align_up(sizeof(struct raw_frame_header) +
+							   dev->imagesize);
+}
+
+/*
+ * lay a frame out the way it is stored in the file, header then data,
+ * the rest of the frame_stride bytes is left alone
+ * args:
+ * 		block - frame_stride bytes
+ * 		h     - container header
+ * 		buf   - dequeued v4l2 buffer
+ * 		data  - its data
+ * 		meta  - exposure, gain, datatype and bayer pattern
+ * 		index - frame number in the file
+ */
+void raw_record_fill_block(void *block, const struct raw_record_header *h,
+						   const struct v4l2_buffer *buf, const void *data,
+						   const struct raw_frame_meta *meta, uint64_t index)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	struct raw_frame_header *hdr = (struct raw_frame_header *)block;
+	unsigned int size = h->frame_size;
+
+	if (buf->bytesused && buf->bytesused < size)
+		size = buf->bytesused;
+
+	CLEAR(*hdr);
+	hdr->magic = RAW_RECORD_FRAME_MAGIC;
+	hdr->sequence = buf->sequence;
+	hdr->timestamp = (uint64_t)buf->timestamp.tv_sec * 1000000 +
+					 buf->timestamp.tv_usec;
+	hdr->index = index;
+	hdr->pts = size >= 4 ? p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24 : 0;
+	hdr->exposure = meta->exposure;
+	hdr->gain = meta->gain;
+	hdr->datatype = meta->datatype;
+	hdr->bayer = meta->bayer;
+	hdr->size = size;
+	memcpy(hdr + 1, data, size);
+}
+
+/*
+ * returns:
+ * 		bytes of the index block for that many frames, footer included
+ */
+size_t raw_record_index_size(unsigned long frames)
+{
+	return align_up(frames * sizeof(struct raw_record_index_entry) +
+					RAW_RECORD_FOOTER);
+}
+
+/*
+ * put the footer in the last bytes of an index block, so readers find
+ * the index from the end of the file
+ * args:
+ * 		block        - index block, entries already filled in
+ * 		size         - from raw_record_index_size
+ * 		frames       - number of entries
+ * 		index_offset - where the block goes in the file
+ */
+void raw_record_set_footer(void *block, size_t size, unsigned long frames,
+						   off_t index_offset)
+{
+	struct raw_record_footer footer;
+
+	CLEAR(footer);
+	footer.index_offset = index_offset;
+	footer.frame_count = frames;
+	memcpy(footer.magic, RAW_RECORD_INDEX_MAGIC, sizeof footer.magic);
+	memcpy((char *)block + size - RAW_RECORD_FOOTER, &footer, sizeof footer);
+}
+
+/* pool slot of a block, -1 for the header and index blocks */
+static int block_slot(struct raw_recorder *rec, void *block)
+{
+	for (unsigned int i = 0; i < rec->pool.count; i++)
+		if (rec->pool.bufs[i] == block)
+			return i;
+	return -1;
+}
+
+/*
+ * called by the backend once a block is written, or failed to be,
+ * the block goes back to the pool
+ * args:
+ * 		rec   - raw recorder
+ * 		block - block passed to ops->write
+ * 		error - 0 if the whole block made it to the file
+ */
+void raw_recorder_write_done(struct raw_recorder *rec, void *block, int error)
+{
+	int slot = block_slot(rec, block);
+	if (slot < 0)
+		return;
+
+	double latency = monotonic_us() - rec->queued[slot];
+	__LOCK_MUTEX(&rec->mutex);
+	if (error)
+	{
+		rec->errors++;
+		/* the frame isn't in the file, keep it out of the index too */
+		if (rec->entry[slot] != RAW_RECORD_NO_ENTRY)
+			rec->index[rec->entry[slot]].offset = 0;
+	}
+	else
+	{
+		rec->frames++;
+		rec->bytes += rec->header.frame_stride;
+		rec->latency_total += latency;
+		if (latency > rec->latency_max)
+			rec->latency_max = latency;
+		unsigned int bucket = latency / RAW_RECORD_LATENCY_STEP;
+		if (bucket >= RAW_RECORD_LATENCY_BUCKETS)
+			bucket = RAW_RECORD_LATENCY_BUCKETS - 1;
+		rec->latency_hist[bucket]++;
+	}
+	__UNLOCK_MUTEX(&rec->mutex);
+	frame_pool_put(&rec->pool, block);
+}
+
+/*
+ * grow the file ahead of the writes in big steps, so the filesystem
+ * hands out large extents instead of one small one per frame
+ */
+static void preallocate(struct raw_recorder *rec, off_t end)
+{
+	while (rec->prealloc && end > rec->allocated)
+	{
+		if (fallocate(rec->fd, 0, rec->allocated, RAW_RECORD_PREALLOC) < 0)
+		{
+			if (errno == EOPNOTSUPP)
+				printf("RECORD: no preallocation on this filesystem\n");
+			else
+				perror("RECORD: fallocate");
+			rec->prealloc = 0;
+			break;
+		}
+		rec->allocated += RAW_RECORD_PREALLOC;
+	}
+}
+
+/*
+ * remember where a frame goes, the index is written when recording stops,
+ * raw_recorder_write_done takes the entry out again if the write fails
+ * returns:
+ * 		error value, the frame can't be recorded
+ */
+static int add_index_entry(struct raw_recorder *rec, void *block, off_t offset)
+{
+	struct raw_frame_header *hdr = (struct raw_frame_header *)block;
+	int slot = block_slot(rec, block);
+
+	__LOCK_MUTEX(&rec->mutex);
+	rec->entry[slot] = RAW_RECORD_NO_ENTRY;
+	if (rec->index_size == rec->index_capacity)
+	{
+		unsigned long capacity = rec->index_capacity * 2;
+		void *p = realloc(rec->index, capacity * sizeof rec->index[0]);
+		if (p == NULL)
+		{
+			__UNLOCK_MUTEX(&rec->mutex);
+			return -ENOMEM;
+		}
+		rec->index = (struct raw_record_index_entry *)p;
+		rec->index_capacity = capacity;
+	}
+	rec->entry[slot] = rec->index_size;
+	struct raw_record_index_entry *e = &rec->index[rec->index_size++];
+	e->offset = offset;
+	e->timestamp = hdr->timestamp;
+	e->sequence = hdr->sequence;
+	e->reserved = 0;
+	__UNLOCK_MUTEX(&rec->mutex);
+	return 0;
+}
+
+/*
+ * writer thread, append queued frames in order until stopped,
+ * whatever is still queued at stop time gets written first
+ * args:
+ * 		arg - struct raw_recorder *rec
+ */
+static void *writer_thread(void *arg)
+{
+	struct raw_recorder *rec = (struct raw_recorder *)arg;
+	size_t stride = rec->header.frame_stride;
+
+	while (1)
+	{
+		__LOCK_MUTEX(&rec->mutex);
+		while (rec->running && rec->count == 0)
+			pthread_cond_wait(&rec->cond, &rec->mutex);
+		if (rec->count == 0)
+		{
+			__UNLOCK_MUTEX(&rec->mutex);
+			break;
+		}
+		void *block = rec->queue[rec->head];
+		rec->head = (rec->head + 1) % RAW_RECORD_BLOCKS;
+		rec->count--;
+		__UNLOCK_MUTEX(&rec->mutex);
+
+		/* a frame the index can't hold isn't written, the file would
+		   have data its index doesn't list */
+		if (rec->failed || add_index_entry(rec, block, rec->offset) < 0)
+		{
+			if (!rec->failed)
+				printf("RECORD: no memory for the index after %lu frames, "
+					   "recording stops\n", rec->index_size);
+			__atomic_store_n(&rec->failed, 1, __ATOMIC_RELEASE);
+			rec->entry[block_slot(rec, block)] = RAW_RECORD_NO_ENTRY;
+			raw_recorder_write_done(rec, block, 1);
+			continue;
+		}
+		off_t offset = rec->offset;
+		rec->offset += stride;
+		preallocate(rec, rec->offset);
+		/* io_uring only submits here, its write completes later */
+		TRACE_SCOPE("record write", ((struct raw_frame_header *)block)->sequence);
+		if (rec->ops->write(rec, block, stride, offset) < 0)
+			raw_recorder_write_done(rec, block, 1);
+	}
+	return NULL;
+}
+
+/*
+ * write a block that isn't a frame and wait for it
+ * returns:
+ * 		error value
+ */
+static int write_block_sync(struct raw_recorder *rec, void *block, size_t size,
+							off_t offset)
+{
+	int ret = rec->ops->write(rec, block, size, offset);
+	if (ret < 0)
+		return ret;
+	return rec->ops->flush(rec);
+}
+
+/* container header at offset 0 */
+static int write_file_header(struct raw_recorder *rec)
+{
+	void *block = NULL;
+	int ret;
+
+	if (posix_memalign(&block, RAW_RECORD_ALIGN, RAW_RECORD_ALIGN) != 0)
+		return -ENOMEM;
+	memset(block, 0, RAW_RECORD_ALIGN);
+	memcpy(block, &rec->header, sizeof rec->header);
+	ret = write_block_sync(rec, block, RAW_RECORD_ALIGN, 0);
+	free(block);
+	return ret;
+}
+
+/*
+ * index and footer after the last frame, the footer ends up in the last
+ * bytes of the file so readers find the index from the end
+ * returns:
+ * 		size of the index block, negative error value
+ */
+static ssize_t write_index(struct raw_recorder *rec)
+{
+	unsigned long frames = 0;
+	void *block = NULL;
+	int ret;
+
+	/* frames whose write failed have offset 0, the file header's */
+	for (unsigned long i = 0; i < rec->index_size; i++)
+		if (rec->index[i].offset != 0)
+			rec->index[frames++] = rec->index[i];
+	rec->index_size = frames;
+
+	size_t size = raw_record_index_size(frames);
+	if (posix_memalign(&block, RAW_RECORD_ALIGN, size) != 0)
+		return -ENOMEM;
+	memset(block, 0, size);
+	if (frames)
+		memcpy(block, rec->index, frames * sizeof rec->index[0]);
+	raw_record_set_footer(block, size, frames, rec->offset);
+
+	ret = write_block_sync(rec, block, size, rec->offset);
+	free(block);
+	return ret < 0 ? ret : (ssize_t)size;
+}
+
+/*
+ * create the container file and start the writer thread
+ * args:
+ * 		rec      - raw recorder
+ * 		dev      - camera, gives frame size and geometry
+ * 		filename - file to create
+ * 		ops      - backend, NULL for record_backend_buffered
+ * returns:
+ * 		error value
+ */
+int raw_recorder_start(struct raw_recorder *rec, struct device *dev,
+					   const char *filename,
+					   const struct record_backend_ops *ops)
+{
+	struct raw_record_header *h = &rec->header;
+	int ret;
+
+	CLEAR(*rec);
+	rec->ops = ops ? ops : &record_backend_buffered;
+	rec->fd = -1;
+	raw_record_init_header(h, dev);
+
+	rec->index_capacity = RAW_RECORD_INDEX_INITIAL;
+	rec->index = (struct raw_record_index_entry *)
+		calloc(rec->index_capacity, sizeof rec->index[0]);
+	if (rec->index == NULL)
+		return -ENOMEM;
+	ret = frame_pool_init(&rec->pool, RAW_RECORD_BLOCKS, h->frame_stride);
+	if (ret < 0)
+	{
+		free(rec->index);
+		return ret;
+	}
+	__INIT_MUTEX(&rec->mutex);
+	pthread_cond_init(&rec->cond, NULL);
+
+	ret = rec->ops->open(rec, filename);
+	if (ret < 0)
+		goto err_pool;
+	ret = write_file_header(rec);
+	if (ret < 0)
+	{
+		printf("RECORD: couldn't write header to %s\n", filename);
+		goto err_open;
+	}
+	rec->offset = h->header_size;
+	rec->allocated = h->header_size;
+	rec->prealloc = 1;
+
+	rec->running = 1;
+	rec->start_time = monotonic_us();
+	ret = __THREAD_CREATE(&rec->thread, writer_thread, rec);
+	if (ret != 0)
+	{
+		printf("couldn't start record thread: %s\n", strerror(ret));
+		rec->running = 0;
+		ret = -ret;
+		goto err_open;
+	}
+	printf("RECORD: recording to %s (%s, %u bytes per frame)\n",
+		   filename, rec->ops->name, h->frame_stride);
+	return 0;
+
+err_open:
+	rec->ops->close(rec);
+err_pool:
+	frame_pool_free(&rec->pool);
+	free(rec->index);
+	rec->index = NULL;
+	return ret;
+}
+
+/*
+ * write out everything still queued plus the index and close the file
+ * args:
+ * 		rec - raw recorder
+ */
+void raw_recorder_stop(struct raw_recorder *rec)
+{
+	ssize_t index_size;
+
+	if (!rec->running)
+		return;
+	__LOCK_MUTEX(&rec->mutex);
+	rec->running = 0;
+	pthread_cond_signal(&rec->cond);
+	__UNLOCK_MUTEX(&rec->mutex);
+	__THREAD_JOIN(rec->thread);
+
+	rec->ops->flush(rec);
+	index_size = write_index(rec);
+	if (index_size < 0)
+		printf("RECORD: couldn't write the index\n");
+	else if (ftruncate(rec->fd, rec->offset + index_size) < 0)
+		perror("RECORD: ftruncate");
+	rec->stop_time = monotonic_us();
+
+	rec->ops->close(rec);
+	frame_pool_free(&rec->pool);
+	free(rec->index);
+	rec->index = NULL;
+}
+
+/* copy a frame with its header into a block and queue it */
+static int queue_frame(struct raw_recorder *rec, const struct v4l2_buffer *buf,
+					   const void *data, const struct raw_frame_meta *meta,
+					   int wait)
+{
+	void *block;
+	int slot;
+
+	if (!rec->running)
+		return -EINVAL;
+	if (__atomic_load_n(&rec->failed, __ATOMIC_ACQUIRE))
+		return -ENOMEM;
+	block = frame_pool_get(&rec->pool, wait);
+	if (block == NULL)
+	{
+		__LOCK_MUTEX(&rec->mutex);
+		rec->dropped++;
+		__UNLOCK_MUTEX(&rec->mutex);
+		return -ENOSPC;
+	}
+	raw_record_fill_block(block, &rec->header, buf, data, meta,
+						  rec->accepted++);
+
+	slot = block_slot(rec, block);
+	rec->queued[slot] = monotonic_us();
+	__LOCK_MUTEX(&rec->mutex);
+	rec->queue[rec->tail] = block;
+	rec->tail = (rec->tail + 1) % RAW_RECORD_BLOCKS;
+	rec->count++;
+	pthread_cond_signal(&rec->cond);
+	__UNLOCK_MUTEX(&rec->mutex);
+	return 0;
+}
+
+/*
+ * copy a frame with its header into a block and queue it, a full queue
+ * drops the frame instead of waiting for the disk
+ * args:
+ * 		rec  - raw recorder
+ * 		buf  - dequeued v4l2 buffer
+ * 		data - its data, can be requeued as soon as this returns
+ * 		meta - exposure, gain, datatype and bayer pattern
+ * returns:
+ * 		error value, -ENOSPC if the frame got dropped, -ENOMEM once the
+ * 		recording has failed and should be stopped
+ */
+int raw_recorder_add_frame(struct raw_recorder *rec,
+						   const struct v4l2_buffer *buf, const void *data,
+						   const struct raw_frame_meta *meta)
+{
+	return queue_frame(rec, buf, data, meta, 0);
+}
+
+/* write latency below which the given fraction of writes finished, in us */
+static double latency_percentile(struct raw_recorder *rec, double fraction)
+{
+	unsigned long total = 0, sum = 0;
+
+	for (int i = 0; i < RAW_RECORD_LATENCY_BUCKETS; i++)
+		total += rec->latency_hist[i];
+	if (total == 0)
+		return 0;
+	for (int i = 0; i < RAW_RECORD_LATENCY_BUCKETS; i++)
+	{
+		sum += rec->latency_hist[i];
+		if (sum >= total * fraction)
+			return (i + 1) * RAW_RECORD_LATENCY_STEP;
+	}
+	return rec->latency_max;
+}
+
+/* print frames written, drops, throughput and write latency */
+void raw_recorder_print_stats(struct raw_recorder *rec)
+{
+	double end = rec->running ? monotonic_us() : rec->stop_time;
+	double seconds = (end - rec->start_time) / 1e6;
+
+	__LOCK_MUTEX(&rec->mutex);
+	printf("RECORD(%s): %lu frames, %lu dropped, %lu errors, %.1f MB, "
+		   "%.1f MB/s, write latency avg %.1f ms, p99 %.1f ms, max %.1f ms\n",
+		   rec->ops->name, rec->frames, rec->dropped, rec->errors,
+		   rec->bytes / 1e6, seconds > 0 ? rec->bytes / 1e6 / seconds : 0.0,
+		   rec->frames ? rec->latency_total / rec->frames / 1e3 : 0.0,
+		   latency_percentile(rec, 0.99) / 1e3, rec->latency_max / 1e3);
+	__UNLOCK_MUTEX(&rec->mutex);
+}
+
+/*
+ * record synthetic frames as fast as the backend takes them, then print
+ * the sustained throughput and write latency, the file is removed after
+ * args:
+ * 		dev      - camera, gives frame size and geometry
+ * 		filename - scratch file on the disk to test
+ * 		ops      - backend, NULL for record_backend_buffered
+ * 		frames   - number of frames to write
+ * returns:
+ * 		error value
+ */
+int raw_recorder_benchmark(struct device *dev, const char *filename,
+						   const struct record_backend_ops *ops,
+						   unsigned int frames)
+{
+	struct raw_recorder *rec;
+	struct raw_frame_meta meta;
+	struct v4l2_buffer buf;
+	unsigned char *data;
+	int ret;
+
+	rec = (struct raw_recorder *)calloc(1, sizeof *rec);
+	data = (unsigned char *)malloc(dev->imagesize);
+	if (rec == NULL || data == NULL)
+	{
+		free(rec);
+		free(data);
+		return -ENOMEM;
+	}
+	for (unsigned int i = 0; i < dev->imagesize; i++)
+		data[i] = i * 7;
+	meta.exposure = -1;
+	meta.gain = -1;
+	meta.datatype = 0;
+	meta.bayer = 0;
+
+	ret = raw_recorder_start(rec, dev, filename, ops);
+	if (ret == 0)
+	{
+		for (unsigned int i = 0; i < frames; i++)
+		{
+			CLEAR(buf);
+			buf.sequence = i;
+			buf.bytesused = dev->imagesize;
+			if (queue_frame(rec, &buf, data, &meta, 1) == -ENOMEM)
+				break;
+		}
+		raw_recorder_stop(rec);
+		raw_recorder_print_stats(rec);
+		unlink(filename);
+	}
+	free(data);
+	free(rec);
+	return ret;
+}
+
+/*****************************************************************************
+**                      Buffered backend, plain pwrite
+*****************************************************************************/
+struct buffered_backend
+{
+	off_t last_offset;	/* previous block, waiting for writeback */
+	size_t last_size;
+};
+
+static int buffered_open(struct raw_recorder *rec, const char *filename)
+{
+	rec->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (rec->fd < 0)
+	{
+		fprintf(stderr, "RECORD: couldn't open %s: %s\n",
+				filename, strerror(errno));
+		return -errno;
+	}
+	rec->backend = calloc(1, sizeof(struct buffered_backend));
+	if (rec->backend == NULL)
+	{
+		close(rec->fd);
+		rec->fd = -1;
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+/*
+ * write the block, then start writeback for it and drop the previous one
+ * from the page cache once it is on disk, so a long recording doesn't
+ * fill the page cache and stall in writeback all at once
+ */
+static int buffered_write(struct raw_recorder *rec, void *block, size_t size,
+						  off_t offset)
+{
+	struct buffered_backend *b = (struct buffered_backend *)rec->backend;
+	const char *p = (const char *)block;
+	size_t done = 0;
+
+	while (done < size)
+	{
+		ssize_t n = pwrite(rec->fd, p + done, size - done, offset + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+		{
+			perror("RECORD: pwrite");
+			return -1;
+		}
+		done += n;
+	}
+
+	sync_file_range(rec->fd, offset, size, SYNC_FILE_RANGE_WRITE);
+	if (b->last_size)
+	{
+		sync_file_range(rec->fd, b->last_offset, b->last_size,
+						SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+							SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise(rec->fd, b->last_offset, b->last_size,
+					  POSIX_FADV_DONTNEED);
+	}
+	b->last_offset = offset;
+	b->last_size = size;
+
+	raw_recorder_write_done(rec, block, 0);
+	return 0;
+}
+
+/* pwrite is synchronous, nothing is ever in flight */
+static int buffered_flush(struct raw_recorder *rec)
+{
+	(void)rec;
+	return 0;
+}
+
+static void buffered_close(struct raw_recorder *rec)
+{
+	if (fdatasync(rec->fd) < 0)
+		perror("RECORD: fdatasync");
+	close(rec->fd);
+	rec->fd = -1;
+	free(rec->backend);
+	rec->backend = NULL;
+}
+
+const struct record_backend_ops record_backend_buffered = {
+	"buffered",
+	buffered_open,
+	buffered_write,
+	buffered_flush,
+	buffered_close,
+};
@@ -0,0 +1,184 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, continuous raw recording
+  into one append-only container file.
+
+  File layout, every block starts on a RAW_RECORD_ALIGN boundary:
+  	file header     	RAW_RECORD_ALIGN bytes
+  	frame 0         	frame header + raw data, frame_stride bytes
+  	frame 1 ...     	frame_stride bytes each
+  	index           	one entry per frame
+  	footer          	last RAW_RECORD_FOOTER bytes of the file
+  frame n starts at header_size + n * frame_stride, the index at the end
+  lists every frame for readers that don't want to rely on that.
+*****************************************************************************/
+#pragma once
+#include <stdint.h>
+#include <sys/types.h>
+#include "frame_pool.h"
+
+/****************************************************************************
+**                      	Global data
+*****************************************************************************/
+#define RAW_RECORD_MAGIC "LIRAWREC"
+#define RAW_RECORD_INDEX_MAGIC "LIRAWIDX"
+#define RAW_RECORD_FRAME_MAGIC 0x4d52464c /* "LFRM" */
+#define RAW_RECORD_VERSION 1
+
+/* every block is written at and padded to this, good for O_DIRECT too */
+#define RAW_RECORD_ALIGN 4096
+/* frames that can wait for the disk before new ones get dropped */
+#define RAW_RECORD_BLOCKS 8
+/* grow the file by this much at a time */
+#define RAW_RECORD_PREALLOC (256 << 20)
+/* write latency histogram, 100 us per bucket, the last one is open ended */
+#define RAW_RECORD_LATENCY_BUCKETS 1000
+#define RAW_RECORD_LATENCY_STEP 100
+
+struct raw_record_header
+{
+	char magic[8];			/* RAW_RECORD_MAGIC */
+	uint32_t version;
+	uint32_t header_size;	/* offset of frame 0 */
+	uint32_t width;
+	uint32_t height;
+	uint32_t bytesperline;
+	uint32_t frame_size;	/* raw bytes per frame */
+	uint32_t frame_stride;	/* frame header + data, padded */
+	uint32_t reserved[7];
+};
+
+/* 64 bytes in front of every frame's raw data */
+struct raw_frame_header
+{
+	uint32_t magic;			/* RAW_RECORD_FRAME_MAGIC */
+	uint32_t sequence;		/* v4l2 buffer sequence */
+	uint64_t timestamp;		/* v4l2 buffer timestamp, us */
+	uint64_t index;			/* frame number in this file */
+	uint32_t pts;			/* first 4 bytes of the frame, little endian */
+	int32_t exposure;		/* lines, -1 if never set */
+	int32_t gain;			/* -1 if never set */
+	uint16_t datatype;		/* 1 - RAW10, 2 - RAW12, 3 - YUV422 */
+	uint16_t bayer;			/* 0 - BG, 1 - GB, 2 - RG, 3 - GR */
+	uint32_t size;			/* raw bytes following this header */
+	uint32_t reserved[5];
+};
+
+struct raw_record_index_entry
+{
+	uint64_t offset;		/* of the frame header */
+	uint64_t timestamp;
+	uint32_t sequence;
+	uint32_t reserved;
+};
+
+/* last bytes of the file */
+struct raw_record_footer
+{
+	uint64_t index_offset;
+	uint64_t frame_count;
+	char magic[8];			/* RAW_RECORD_INDEX_MAGIC */
+};
+#define RAW_RECORD_FOOTER sizeof(struct raw_record_footer)
+
+/* per-frame values that don't come with the v4l2 buffer */
+struct raw_frame_meta
+{
+	int exposure;
+	int gain;
+	int datatype;
+	int bayer;
+};
+
+struct raw_recorder;
+
+/*
+ * how blocks reach the disk. write() takes over the block and calls
+ * raw_recorder_write_done() once it is on its way, flush() waits until
+ * every write has completed
+ */
+struct record_backend_ops
+{
+	const char *name;
+	int (*open)(struct raw_recorder *rec, const char *filename);
+	int (*write)(struct raw_recorder *rec, void *block, size_t size,
+				 off_t offset);
+	int (*flush)(struct raw_recorder *rec);
+	void (*close)(struct raw_recorder *rec);
+};
+
+struct raw_recorder
+{
+	const struct record_backend_ops *ops;
+	void *backend;	/* backend private data */
+	int fd;
+
+	struct raw_record_header header;
+	struct frame_pool pool;	/* frame_stride bytes each */
+	void *queue[RAW_RECORD_BLOCKS];	/* filled blocks, oldest first */
+	double queued[RAW_RECORD_BLOCKS];	/* us, per pool buffer */
+	unsigned int head;
+	unsigned int tail;
+	unsigned int count;
+	unsigned long accepted;	/* frames queued so far, capture side */
+	int running;
+
+	/* grown by the writer thread, failed writes drop entries, under mutex */
+	struct raw_record_index_entry *index;
+	unsigned long index_size;
+	unsigned long index_capacity;
+	unsigned long entry[RAW_RECORD_BLOCKS];	/* index entry per pool buffer */
+	int failed;			/* out of memory for the index, nothing more is written */
+
+	/* only touched by the writer thread */
+	off_t offset;		/* where the next frame goes */
+	off_t allocated;	/* preallocated up to here */
+	int prealloc;
+
+	/* statistics */
+	unsigned long frames;
+	unsigned long dropped;
+	unsigned long errors;
+	unsigned long long bytes;
+	double latency_total;	/* us, queued to written */
+	double latency_max;
+	unsigned long latency_hist[RAW_RECORD_LATENCY_BUCKETS];
+	double start_time;
+	double stop_time;
+
+	__THREAD_TYPE thread;
+	__MUTEX_TYPE mutex;
+	pthread_cond_t cond;
+};
+
+extern const struct record_backend_ops record_backend_buffered;
+extern const struct record_backend_ops record_backend_uring;
+
+/****************************************************************************
+**							 Function declaration
+*****************************************************************************/
+void raw_record_init_header(struct raw_record_header *h, struct device *dev);
+void raw_record_fill_block(void *block, const struct raw_record_header *h,
+						   const struct v4l2_buffer *buf, const void *data,
+						   const struct raw_frame_meta *meta, uint64_t index);
+size_t raw_record_index_size(unsigned long frames);
+void raw_record_set_footer(void *block, size_t size, unsigned long frames,
+						   off_t index_offset);
+
+int raw_recorder_start(struct raw_recorder *rec, struct device *dev,
+					   const char *filename,
+					   const struct record_backend_ops *ops);
+void raw_recorder_stop(struct raw_recorder *rec);
+
+int raw_recorder_add_frame(struct raw_recorder *rec,
+						   const struct v4l2_buffer *buf, const void *data,
+						   const struct raw_frame_meta *meta);
+void raw_recorder_write_done(struct raw_recorder *rec, void *block, int error);
+
+void raw_recorder_print_stats(struct raw_recorder *rec);
+int raw_recorder_benchmark(struct device *dev, const char *filename,
+						   const struct record_backend_ops *ops,
+						   unsigned int frames);
@@ -0,0 +1,199 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, real-time scheduling,
+  memory locking and prefaulting for the capture thread, and the latency
+  probe that tells how well it works.
+*****************************************************************************/
+#include <pthread.h>
+#include <sched.h>
+
+#include "../includes/shortcuts.h"
+#include "event_loop.h"
+#include "realtime.h"
+
+/*****************************************************************************
+**                           Function definition
+*****************************************************************************/
+
+/*
+ * lock every page the process has and will map, they are faulted in now
+ * instead of when the capture thread first touches them
+ * returns:
+ * 		error value, streaming goes on without it
+ */
+int realtime_lock_memory()
+{
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+	{
+		printf("REALTIME: couldn't lock memory: %s\n", strerror(errno));
+		return -errno;
+	}
+	return 0;
+}
+
+/* touch the stack the thread will use, kept out of line so it is real */
+static void __attribute__((noinline)) prefault_stack()
+{
+	volatile unsigned char stack[REALTIME_STACK_PREFAULT];
+
+	for (size_t i = 0; i < sizeof stack; i += 4096)
+		stack[i] = 0;
+}
+
+/*
+ * make the calling thread SCHED_FIFO and fault in its stack
+ * args:
+ * 		priority - 1 to 99, 0 only prefaults
+ * returns:
+ * 		error value, the thread keeps its normal priority then
+ */
+int realtime_enter(int priority)
+{
+	struct sched_param param;
+	int ret = 0;
+
+	prefault_stack();
+	if (priority <= 0)
+		return 0;
+	CLEAR(param);
+	param.sched_priority = priority;
+	ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+	if (ret != 0)
+	{
+		printf("REALTIME: couldn't run at SCHED_FIFO %d: %s\n", priority,
+			   strerror(ret));
+		return -ret;
+	}
+	printf("REALTIME: thread runs at SCHED_FIFO %d\n", priority);
+	return 0;
+}
+
+/* back to normal scheduling for the calling thread */
+void realtime_leave()
+{
+	struct sched_param param;
+
+	CLEAR(param);
+	pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+}
+
+/*
+ * read one byte of every page, so the first frame doesn't fault them in
+ * args:
+ * 		p 	   - memory, e.g. a mapped v4l2 buffer
+ * 		length - bytes
+ */
+void realtime_prefault(const void *p, size_t length)
+{
+	const volatile unsigned char *bytes = (const volatile unsigned char *)p;
+
+	for (size_t i = 0; i < length; i += 4096)
+		(void)bytes[i];
+}
+
+/*
+ * args:
+ * 		hist - histogram
+ * 		us 	 - one latency
+ */
+void latency_hist_add(struct latency_hist *hist, double us)
+{
+	unsigned int i = 0;
+
+	while (i < LATENCY_BUCKETS - 1 && us >= (double)(1UL << i))
+		i++;
+	hist->count[i]++;
+	hist->samples++;
+	hist->total += us;
+	if (us > hist->max)
+		hist->max = us;
+}
+
+/* print the buckets that have samples, one line each */
+void latency_hist_print(struct latency_hist *hist, const char *name)
+{
+	if (hist->samples == 0)
+		return;
+	printf("%s: %lu samples, avg %.1f us, max %.1f us\n", name, hist->samples,
+		   hist->total / hist->samples, hist->max);
+	for (unsigned int i = 0; i < LATENCY_BUCKETS; i++)
+	{
+		if (hist->count[i] == 0)
+			continue;
+		if (i == LATENCY_BUCKETS - 1)
+			printf("  %7lu us and up: %lu\n", 1UL << (i - 1), hist->count[i]);
+		else
+			printf("  %7lu - %7lu us: %lu\n", i ? 1UL << (i - 1) : 0,
+				   1UL << i, hist->count[i]);
+	}
+}
+
+/*
+ * the probe timer fired, how late it is is the loop thread's scheduling
+ * latency
+ * args:
+ * 		data   - struct latency_probe *probe
+ * 		fd 	   - timer
+ * 		events - from epoll
+ */
+static void probe_ready(void *data, int fd, unsigned int events)
+{
+	struct latency_probe *probe = (struct latency_probe *)data;
+	double now = monotonic_us();
+
+	(void)fd;
+	(void)events;
+	/* late from the first expiration, so a long stall shows in full */
+	latency_hist_add(&probe->hist, now > probe->next ? now - probe->next : 0);
+	probe->next += probe->interval;
+	/* expirations that came and went while the thread didn't run */
+	while (probe->next <= now)
+	{
+		probe->missed++;
+		probe->next += probe->interval;
+	}
+}
+
+/*
+ * measure how late a loop's thread gets to run
+ * args:
+ * 		probe - latency probe, its histogram starts empty
+ * 		loop  - event loop, the capture thread's
+ * returns:
+ * 		error value
+ */
+int latency_probe_start(struct latency_probe *probe, struct event_loop *loop)
+{
+	CLEAR(*probe);
+	probe->loop = loop;
+	probe->interval = LATENCY_PROBE_MS * 1000.0;
+	probe->next = monotonic_us() + probe->interval;
+	probe->fd = event_loop_add_timer(loop, LATENCY_PROBE_MS, LATENCY_PROBE_MS,
+									 probe_ready, probe);
+	return probe->fd < 0 ? -1 : 0;
+}
+
+/* print the histogram and the expirations a stall swallowed */
+void latency_probe_print(struct latency_probe *probe, const char *name)
+{
+	latency_hist_print(&probe->hist, name);
+	if (probe->missed > 0)
+		printf("%s: %lu probes missed while the thread didn't run\n", name,
+			   probe->missed);
+}
+
+/*
+ * stop probing, the histogram stays
+ * args:
+ * 		probe - latency probe, a cleared one is ignored
+ */
+void latency_probe_stop(struct latency_probe *probe)
+{
+	if (probe->loop == NULL || probe->fd < 0)
+		return;
+	event_loop_remove_timer(probe->loop, probe->fd);
+	probe->fd = -1;
+}
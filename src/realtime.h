@@ -0,0 +1,62 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, real-time capture.
+  The thread that dequeues and requeues buffers runs SCHED_FIFO, so a busy
+  host can't keep it from giving the driver its buffers back, with the
+  process memory locked and the thread's stack and the frame buffers
+  touched up front, so it never waits on a page fault either.
+
+  A latency probe is a periodic timer in the capture thread's event loop.
+  How late it fires is the thread's scheduling latency, collected in a
+  histogram. A quiet histogram next to dropped frames points at the device
+  or the USB link, a long tail at the host. SCHED_FIFO needs root or
+  CAP_SYS_NICE, mlockall needs CAP_IPC_LOCK or a large enough memlock
+  limit, e.g. ulimit -l unlimited.
+*****************************************************************************/
+#pragma once
+#include <stddef.h>
+
+/****************************************************************************
+**                      	Global data
+*****************************************************************************/
+#define LATENCY_BUCKETS 20		/* powers of two from 1 us to 0.5 s */
+#define LATENCY_PROBE_MS 5		/* probe period */
+#define REALTIME_STACK_PREFAULT (256 * 1024)
+
+struct latency_hist
+{
+	unsigned long count[LATENCY_BUCKETS];	/* [2^(i-1), 2^i) us, i=0 below 1 us */
+	unsigned long samples;
+	double total;			/* us */
+	double max;
+};
+
+struct event_loop;
+
+struct latency_probe
+{
+	struct latency_hist hist;
+	struct event_loop *loop;
+	int fd;					/* timer, -1 when not running */
+	double next;			/* when the timer is due next, monotonic us */
+	double interval;		/* us */
+	unsigned long missed;	/* expirations a late wakeup skipped */
+};
+
+/****************************************************************************
+**							 Function declaration
+*****************************************************************************/
+int realtime_lock_memory();
+int realtime_enter(int priority);
+void realtime_leave();
+void realtime_prefault(const void *p, size_t length);
+
+void latency_hist_add(struct latency_hist *hist, double us);
+void latency_hist_print(struct latency_hist *hist, const char *name);
+
+int latency_probe_start(struct latency_probe *probe, struct event_loop *loop);
+void latency_probe_stop(struct latency_probe *probe);
+void latency_probe_print(struct latency_probe *probe, const char *name);
@@ -0,0 +1,466 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, O_DIRECT recording
+  backend on io_uring. The recorder's blocks are registered with the ring
+  once, the writer thread only fills submission entries, several writes
+  are in flight at a time and a completion thread hands every block back
+  to the recorder as soon as the kernel is done with it. Nothing goes
+  through the page cache, so long recordings don't end in writeback stalls.
+
+  Talks to the kernel with the raw syscalls, no liburing needed. Falls back
+  to the buffered backend when io_uring or O_DIRECT isn't available, and
+  to buffered writes on the same file when a write refuses O_DIRECT.
+*****************************************************************************/
+#include "../includes/shortcuts.h"
+#include "raw_recorder.h"
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define RECORD_HAVE_URING
+#endif
+#endif
+
+#ifdef RECORD_HAVE_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+/* user_data of the nop that tells the completion thread to quit */
+#define URING_QUIT_TAG 0
+
+/****************************************************************************
+**                      	Global data
+*****************************************************************************/
+struct uring_backend
+{
+	int ring_fd;
+	unsigned int entries;
+
+	/* submission ring, only the writer thread touches it */
+	void *sq_ptr;
+	size_t sq_size;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	/* completion ring, only the completion thread touches it */
+	void *cq_ptr;
+	size_t cq_size;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	int fixed;	/* pool blocks registered with the ring */
+	struct iovec iov[RAW_RECORD_BLOCKS];
+	size_t size[RAW_RECORD_BLOCKS];	/* bytes each write was asked for */
+	off_t offset[RAW_RECORD_BLOCKS];	/* and where to */
+
+	unsigned int in_flight;
+	__THREAD_TYPE thread;
+	__MUTEX_TYPE mutex;
+	pthread_cond_t cond;
+};
+
+/*****************************************************************************
+**                           Function definition
+*****************************************************************************/
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit,
+						  unsigned int min_complete, unsigned int flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+						flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned int opcode, void *arg,
+							 unsigned int nr_args)
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void unmap_rings(struct uring_backend *u)
+{
+	if (u->sqes && u->sqes != MAP_FAILED)
+		munmap(u->sqes, u->sqes_size);
+	if (u->cq_ptr && u->cq_ptr != MAP_FAILED)
+		munmap(u->cq_ptr, u->cq_size);
+	if (u->sq_ptr && u->sq_ptr != MAP_FAILED)
+		munmap(u->sq_ptr, u->sq_size);
+}
+
+/*
+ * create the ring and map the submission/completion queues
+ * returns:
+ * 		error value
+ */
+static int setup_ring(struct uring_backend *u, unsigned int entries)
+{
+	struct io_uring_params p;
+
+	CLEAR(p);
+	u->ring_fd = io_uring_setup(entries, &p);
+	if (u->ring_fd < 0)
+		return -errno;
+	u->entries = p.sq_entries;
+
+	u->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	u->sq_ptr = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE,
+					 MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQ_RING);
+	u->cq_ptr = mmap(NULL, u->cq_size, PROT_READ | PROT_WRITE,
+					 MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_CQ_RING);
+	u->sqes = (struct io_uring_sqe *)mmap(NULL, u->sqes_size,
+										  PROT_READ | PROT_WRITE,
+										  MAP_SHARED | MAP_POPULATE,
+										  u->ring_fd, IORING_OFF_SQES);
+	if (u->sq_ptr == MAP_FAILED || u->cq_ptr == MAP_FAILED ||
+		u->sqes == MAP_FAILED)
+	{
+		int err = -errno;
+		unmap_rings(u);
+		close(u->ring_fd);
+		return err;
+	}
+
+	char *sq = (char *)u->sq_ptr;
+	u->sq_head = (unsigned int *)(sq + p.sq_off.head);
+	u->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	u->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned int *)(sq + p.sq_off.array);
+
+	char *cq = (char *)u->cq_ptr;
+	u->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	u->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return 0;
+}
+
+/* pool slot of a block, -1 for the header and index blocks */
+static int uring_slot(struct raw_recorder *rec, void *block)
+{
+	for (unsigned int i = 0; i < rec->pool.count; i++)
+		if (rec->pool.bufs[i] == block)
+			return i;
+	return -1;
+}
+
+/*
+ * the filesystem took O_DIRECT at open but refuses a write, e.g. for its
+ * alignment, go on through the page cache
+ * returns:
+ * 		0 once the fd is buffered, -1 if it can't be
+ */
+static int drop_direct(struct raw_recorder *rec)
+{
+	int flags = fcntl(rec->fd, F_GETFL);
+
+	if (flags < 0)
+		return -1;
+	if (!(flags & O_DIRECT))
+		return 0;
+	if (fcntl(rec->fd, F_SETFL, flags & ~O_DIRECT) < 0)
+		return -1;
+	printf("RECORD: O_DIRECT write refused, using buffered writes from now on\n");
+	return 0;
+}
+
+/*
+ * write a block and wait for it, once more without O_DIRECT if that is
+ * what the filesystem refuses
+ * returns:
+ * 		error value
+ */
+static int write_sync(struct raw_recorder *rec, const void *block, size_t size,
+					  off_t offset)
+{
+	ssize_t n = pwrite(rec->fd, block, size, offset);
+
+	if (n < 0 && errno == EINVAL && drop_direct(rec) == 0)
+		n = pwrite(rec->fd, block, size, offset);
+	if (n < 0 || (size_t)n != size)
+	{
+		perror("RECORD: pwrite");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * completion thread, hand every written block back to the recorder
+ * args:
+ * 		arg - struct raw_recorder *rec
+ */
+static void *completion_thread(void *arg)
+{
+	struct raw_recorder *rec = (struct raw_recorder *)arg;
+	struct uring_backend *u = (struct uring_backend *)rec->backend;
+	int quit = 0;
+
+	while (!quit)
+	{
+		unsigned int head = *u->cq_head;
+		unsigned int tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+		if (head == tail)
+		{
+			if (io_uring_enter(u->ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+				errno != EINTR)
+			{
+				perror("RECORD: io_uring_enter");
+				break;
+			}
+			continue;
+		}
+
+		for (; head != tail; head++)
+		{
+			struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+			if (cqe->user_data == URING_QUIT_TAG)
+			{
+				quit = 1;
+				continue;
+			}
+			int slot = (int)cqe->user_data - 1;
+			int error = cqe->res < 0 || (size_t)cqe->res != u->size[slot];
+			/* the block is still ours, write it again through the page cache */
+			if (cqe->res == -EINVAL)
+				error = write_sync(rec, rec->pool.bufs[slot], u->size[slot],
+								   u->offset[slot]) < 0;
+			else if (error)
+				fprintf(stderr, "RECORD: write failed: %s\n",
+						cqe->res < 0 ? strerror(-cqe->res) : "short write");
+			raw_recorder_write_done(rec, rec->pool.bufs[slot], error);
+
+			__LOCK_MUTEX(&u->mutex);
+			u->in_flight--;
+			pthread_cond_broadcast(&u->cond);
+			__UNLOCK_MUTEX(&u->mutex);
+		}
+		__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+/*
+ * fill in the next submission entry and submit it
+ * returns:
+ * 		error value
+ */
+static int submit_sqe(struct uring_backend *u, const struct io_uring_sqe *src)
+{
+	unsigned int tail = *u->sq_tail;
+	unsigned int index = tail & *u->sq_mask;
+	int ret;
+
+	u->sqes[index] = *src;
+	u->sq_array[index] = index;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	do
+		ret = io_uring_enter(u->ring_fd, 1, 0, 0);
+	while (ret < 0 && errno == EINTR);
+	return ret < 0 ? -errno : 0;
+}
+
+static void uring_free(struct uring_backend *u)
+{
+	unmap_rings(u);
+	close(u->ring_fd);
+	free(u);
+}
+
+/* fall back to the page cache, for filesystems without O_DIRECT */
+static int fallback_open(struct raw_recorder *rec, const char *filename,
+						 const char *why)
+{
+	printf("RECORD: %s, using buffered writes\n", why);
+	rec->ops = &record_backend_buffered;
+	return rec->ops->open(rec, filename);
+}
+
+static int uring_open(struct raw_recorder *rec, const char *filename)
+{
+	struct uring_backend *u;
+	int ret;
+
+	u = (struct uring_backend *)calloc(1, sizeof *u);
+	if (u == NULL)
+		return -ENOMEM;
+	/* one entry per block plus the quit nop */
+	ret = setup_ring(u, RAW_RECORD_BLOCKS + 1);
+	if (ret < 0)
+	{
+		free(u);
+		return fallback_open(rec, filename, "no io_uring");
+	}
+
+	rec->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+	if (rec->fd < 0 && errno == EINVAL)
+	{
+		uring_free(u);
+		return fallback_open(rec, filename, "no O_DIRECT on this filesystem");
+	}
+	if (rec->fd < 0)
+	{
+		ret = -errno;
+		fprintf(stderr, "RECORD: couldn't open %s: %s\n",
+				filename, strerror(errno));
+		uring_free(u);
+		return ret;
+	}
+
+	for (unsigned int i = 0; i < rec->pool.count; i++)
+	{
+		u->iov[i].iov_base = rec->pool.bufs[i];
+		u->iov[i].iov_len = rec->pool.size;
+	}
+	/* pins the blocks once instead of for every write, needs memlock rlimit */
+	u->fixed = io_uring_register(u->ring_fd, IORING_REGISTER_BUFFERS,
+								 u->iov, rec->pool.count) == 0;
+	if (!u->fixed)
+		printf("RECORD: couldn't register buffers (%s), not using fixed writes\n",
+			   strerror(errno));
+
+	__INIT_MUTEX(&u->mutex);
+	pthread_cond_init(&u->cond, NULL);
+	rec->backend = u;
+	ret = __THREAD_CREATE(&u->thread, completion_thread, rec);
+	if (ret != 0)
+	{
+		printf("couldn't start completion thread: %s\n", strerror(ret));
+		close(rec->fd);
+		rec->fd = -1;
+		rec->backend = NULL;
+		uring_free(u);
+		return -ret;
+	}
+	return 0;
+}
+
+/*
+ * queue a write of a pool block, header and index blocks are written
+ * synchronously since they are written once
+ */
+static int uring_write(struct raw_recorder *rec, void *block, size_t size,
+					   off_t offset)
+{
+	struct uring_backend *u = (struct uring_backend *)rec->backend;
+	struct io_uring_sqe sqe;
+	int slot = uring_slot(rec, block);
+	int ret;
+
+	if (slot < 0)
+		return write_sync(rec, block, size, offset);
+
+	CLEAR(sqe);
+	if (u->fixed)
+	{
+		sqe.opcode = IORING_OP_WRITE_FIXED;
+		sqe.addr = (unsigned long)block;
+		sqe.len = size;
+		sqe.buf_index = slot;
+	}
+	else
+	{
+		u->iov[slot].iov_len = size;
+		sqe.opcode = IORING_OP_WRITEV;
+		sqe.addr = (unsigned long)&u->iov[slot];
+		sqe.len = 1;
+	}
+	sqe.fd = rec->fd;
+	sqe.off = offset;
+	sqe.user_data = slot + 1;
+	u->size[slot] = size;
+	u->offset[slot] = offset;
+
+	/* every block has its own entry, the ring can't run full */
+	__LOCK_MUTEX(&u->mutex);
+	u->in_flight++;
+	__UNLOCK_MUTEX(&u->mutex);
+	ret = submit_sqe(u, &sqe);
+	if (ret < 0)
+	{
+		fprintf(stderr, "RECORD: io_uring submit: %s\n", strerror(-ret));
+		__LOCK_MUTEX(&u->mutex);
+		u->in_flight--;
+		__UNLOCK_MUTEX(&u->mutex);
+		return ret;
+	}
+	return 0;
+}
+
+/* wait until every queued write has completed */
+static int uring_flush(struct raw_recorder *rec)
+{
+	struct uring_backend *u = (struct uring_backend *)rec->backend;
+
+	__LOCK_MUTEX(&u->mutex);
+	while (u->in_flight > 0)
+		pthread_cond_wait(&u->cond, &u->mutex);
+	__UNLOCK_MUTEX(&u->mutex);
+	return 0;
+}
+
+static void uring_close(struct raw_recorder *rec)
+{
+	struct uring_backend *u = (struct uring_backend *)rec->backend;
+	struct io_uring_sqe sqe;
+
+	uring_flush(rec);
+	CLEAR(sqe);
+	sqe.opcode = IORING_OP_NOP;
+	sqe.user_data = URING_QUIT_TAG;
+	if (submit_sqe(u, &sqe) == 0)
+		__THREAD_JOIN(u->thread);
+	else
+		pthread_cancel(u->thread);
+
+	/* O_DIRECT skips the page cache, but not the disk cache or metadata */
+	if (fdatasync(rec->fd) < 0)
+		perror("RECORD: fdatasync");
+	close(rec->fd);
+	rec->fd = -1;
+	uring_free(u);
+	rec->backend = NULL;
+}
+
+const struct record_backend_ops record_backend_uring = {
+	"io_uring O_DIRECT",
+	uring_open,
+	uring_write,
+	uring_flush,
+	uring_close,
+};
+
+#else /* !RECORD_HAVE_URING */
+
+static int uring_open(struct raw_recorder *rec, const char *filename)
+{
+	printf("RECORD: built without io_uring, using buffered writes\n");
+	rec->ops = &record_backend_buffered;
+	return rec->ops->open(rec, filename);
+}
+
+const struct record_backend_ops record_backend_uring = {
+	"io_uring O_DIRECT",
+	uring_open,
+	NULL,
+	NULL,
+	NULL,
+};
+
+#endif
@@ -0,0 +1,430 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, replay frame source.
+  Serves recorded frames instead of a camera's: either a directory of
+  captures_N.raw files or one raw container written by the recorder. The
+  files are mmap'ed once, frames are handed out straight from the mapping
+  at a fixed rate or as fast as the pipeline takes them.
+*****************************************************************************/
+#include <dirent.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "../includes/shortcuts.h"
+#include "frame_source.h"
+#include "raw_recorder.h"
+
+/****************************************************************************
+**                      	Global data
+*****************************************************************************/
+struct replay_frame
+{
+	const unsigned char *data;
+	unsigned int size;
+	unsigned int sequence;	/* as recorded, for containers */
+};
+
+struct replay_map
+{
+	void *addr;
+	size_t size;
+};
+
+struct replay_source
+{
+	struct replay_map *maps;	/* one per mmap'ed file */
+	unsigned int nmaps;
+	struct replay_frame *frames;
+	unsigned int nframes;
+
+	unsigned int pos;			/* next frame to serve */
+	unsigned int loops;			/* passes over the frames, 0 - forever */
+	unsigned int loop;
+	unsigned int sequence;
+	double period_ns;			/* 0 - as fast as possible */
+	struct timespec next;		/* when the next frame is due */
+
+	struct v4l2_buffer bufs[REPLAY_BUFFERS];
+	int busy[REPLAY_BUFFERS];
+	int stopped;
+
+	__MUTEX_TYPE mutex;
+	pthread_cond_t cond;
+};
+
+/*****************************************************************************
+**                           Function definition
+*****************************************************************************/
+
+/* map a whole file read-only, prefaulted so replay doesn't measure the disk */
+static void *map_file(const char *path, size_t *size)
+{
+	struct stat st;
+	void *addr;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		fprintf(stderr, "REPLAY: couldn't open %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size == 0)
+	{
+		close(fd);
+		return NULL;
+	}
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED)
+	{
+		fprintf(stderr, "REPLAY: couldn't mmap %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	*size = st.st_size;
+	return addr;
+}
+
+static int add_map(struct replay_source *r, void *addr, size_t size)
+{
+	void *p = realloc(r->maps, (r->nmaps + 1) * sizeof r->maps[0]);
+	if (p == NULL)
+		return -ENOMEM;
+	r->maps = (struct replay_map *)p;
+	r->maps[r->nmaps].addr = addr;
+	r->maps[r->nmaps].size = size;
+	r->nmaps++;
+	return 0;
+}
+
+/*
+ * frames of a raw container, geometry comes from the container header
+ * returns:
+ * 		error value
+ */
+static int load_container(struct replay_source *r, struct device *dev,
+						  const char *path)
+{
+	const struct raw_record_header *h;
+	const struct raw_record_footer *footer;
+	const struct raw_record_index_entry *index;
+	unsigned char *base;
+	size_t size;
+
+	base = (unsigned char *)map_file(path, &size);
+	if (base == NULL)
+		return -1;
+	if (add_map(r, base, size) < 0)
+	{
+		munmap(base, size);
+		return -ENOMEM;
+	}
+
+	h = (const struct raw_record_header *)base;
+	footer = (const struct raw_record_footer *)(base + size - RAW_RECORD_FOOTER);
+	if (size < RAW_RECORD_ALIGN + RAW_RECORD_FOOTER ||
+		memcmp(h->magic, RAW_RECORD_MAGIC, sizeof h->magic) != 0 ||
+		memcmp(footer->magic, RAW_RECORD_INDEX_MAGIC, sizeof footer->magic) != 0 ||
+		footer->index_offset > size ||
+		footer->frame_count > (size - footer->index_offset) / sizeof *index)
+	{
+		printf("REPLAY: %s isn't a complete raw container\n", path);
+		return -EINVAL;
+	}
+
+	index = (const struct raw_record_index_entry *)(base + footer->index_offset);
+	r->frames = (struct replay_frame *)calloc(footer->frame_count,
+											  sizeof r->frames[0]);
+	if (r->frames == NULL)
+		return -ENOMEM;
+	for (uint64_t i = 0; i < footer->frame_count; i++)
+	{
+		const struct raw_frame_header *f;
+		/* a corrupt index points anywhere, check before reading through it */
+		if (index[i].offset > size - sizeof *f)
+			continue;
+		f = (const struct raw_frame_header *)(base + index[i].offset);
+		if (f->size > size - index[i].offset - sizeof *f ||
+			f->magic != RAW_RECORD_FRAME_MAGIC)
+			continue;
+		r->frames[r->nframes].data = (const unsigned char *)(f + 1);
+		r->frames[r->nframes].size = f->size;
+		r->frames[r->nframes].sequence = f->sequence;
+		r->nframes++;
+	}
+
+	dev->width = h->width;
+	dev->height = h->height;
+	dev->bytesperline = h->bytesperline;
+	dev->imagesize = h->frame_size;
+	return 0;
+}
+
+/* captures_N.raw files sort by N, not by name */
+static int capture_number(const char *name)
+{
+	int n = -1;
+	if (sscanf(name, "captures_%d.raw", &n) != 1)
+		return -1;
+	return n;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+	return capture_number(*(char *const *)a) - capture_number(*(char *const *)b);
+}
+
+/*
+ * every captures_N.raw in a directory, one frame per file, the frame
+ * size has to be set in dev already (-s WxH)
+ * returns:
+ * 		error value
+ */
+static int load_directory(struct replay_source *r, struct device *dev,
+						  const char *path)
+{
+	struct dirent *de;
+	char **names = NULL;
+	unsigned int count = 0;
+	DIR *dir;
+	int ret = 0;
+
+	if (dev->width == 0 || dev->height == 0)
+	{
+		printf("REPLAY: raw files carry no geometry, give the frame size\n");
+		return -EINVAL;
+	}
+	dir = opendir(path);
+	if (dir == NULL)
+	{
+		fprintf(stderr, "REPLAY: couldn't open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	while ((de = readdir(dir)) != NULL)
+	{
+		if (capture_number(de->d_name) < 0)
+			continue;
+		char **p = (char **)realloc(names, (count + 1) * sizeof *names);
+		if (p == NULL)
+			break;
+		names = p;
+		names[count++] = strdup(de->d_name);
+	}
+	closedir(dir);
+	qsort(names, count, sizeof *names, compare_names);
+
+	dev->bytesperline = dev->width * 2;
+	dev->imagesize = dev->bytesperline * dev->height;
+	r->frames = (struct replay_frame *)calloc(count ? count : 1,
+											  sizeof r->frames[0]);
+	for (unsigned int i = 0; i < count && r->frames; i++)
+	{
+		char file[512];
+		size_t size;
+		void *addr;
+
+		snprintf(file, sizeof(file), "%s/%s", path, names[i]);
+		addr = map_file(file, &size);
+		if (addr == NULL)
+			continue;
+		if (size < dev->imagesize || add_map(r, addr, size) < 0)
+		{
+			printf("REPLAY: skipping %s, %zu bytes is no %ux%u frame\n",
+				   file, size, dev->width, dev->height);
+			munmap(addr, size);
+			continue;
+		}
+		r->frames[r->nframes].data = (const unsigned char *)addr;
+		r->frames[r->nframes].size = dev->imagesize;
+		r->frames[r->nframes].sequence = r->nframes;
+		r->nframes++;
+	}
+	for (unsigned int i = 0; i < count; i++)
+		free(names[i]);
+	free(names);
+	if (r->frames == NULL)
+		ret = -ENOMEM;
+	return ret;
+}
+
+static void timespec_add_ns(struct timespec *ts, double ns)
+{
+	long long t = ts->tv_nsec + (long long)ns;
+	ts->tv_sec += t / 1000000000;
+	ts->tv_nsec = t % 1000000000;
+}
+
+static int replay_start(struct frame_source *src)
+{
+	struct replay_source *r = (struct replay_source *)src->priv;
+
+	r->pos = 0;
+	r->loop = 0;
+	r->stopped = 0;
+	clock_gettime(CLOCK_MONOTONIC, &r->next);
+	return 0;
+}
+
+static void replay_stop(struct frame_source *src)
+{
+	struct replay_source *r = (struct replay_source *)src->priv;
+
+	__LOCK_MUTEX(&r->mutex);
+	r->stopped = 1;
+	pthread_cond_broadcast(&r->cond);
+	__UNLOCK_MUTEX(&r->mutex);
+}
+
+/*
+ * next recorded frame, waits for a free buffer and, at a fixed rate,
+ * for the frame to be due
+ */
+static struct v4l2_buffer *replay_acquire(struct frame_source *src, void **data)
+{
+	struct replay_source *r = (struct replay_source *)src->priv;
+	struct v4l2_buffer *buf = NULL;
+	struct replay_frame *f;
+	struct timespec now;
+	int i = 0;
+
+	__LOCK_MUTEX(&r->mutex);
+	while (!r->stopped)
+	{
+		for (i = 0; i < REPLAY_BUFFERS && r->busy[i]; i++)
+			;
+		if (i < REPLAY_BUFFERS)
+			break;
+		pthread_cond_wait(&r->cond, &r->mutex);
+	}
+	if (r->stopped || r->nframes == 0 ||
+		(r->loops && r->loop >= r->loops))
+	{
+		__UNLOCK_MUTEX(&r->mutex);
+		return NULL;
+	}
+	r->busy[i] = 1;
+	f = &r->frames[r->pos];
+	if (++r->pos == r->nframes)
+	{
+		r->pos = 0;
+		r->loop++;
+	}
+	__UNLOCK_MUTEX(&r->mutex);
+
+	if (r->period_ns > 0)
+	{
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &r->next, NULL);
+		timespec_add_ns(&r->next, r->period_ns);
+	}
+
+	buf = &r->bufs[i];
+	CLEAR(*buf);
+	buf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf->memory = V4L2_MEMORY_MMAP;
+	buf->index = i;
+	buf->bytesused = f->size;
+	buf->sequence = r->sequence++;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	buf->timestamp.tv_sec = now.tv_sec;
+	buf->timestamp.tv_usec = now.tv_nsec / 1000;
+	buf->flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+	*data = (void *)f->data;
+	return buf;
+}
+
+static int replay_release(struct frame_source *src, struct v4l2_buffer *buf)
+{
+	struct replay_source *r = (struct replay_source *)src->priv;
+
+	if (buf->index >= REPLAY_BUFFERS)
+		return -EINVAL;
+	__LOCK_MUTEX(&r->mutex);
+	r->busy[buf->index] = 0;
+	pthread_cond_signal(&r->cond);
+	__UNLOCK_MUTEX(&r->mutex);
+	return 0;
+}
+
+static void replay_free(struct frame_source *src)
+{
+	struct replay_source *r = (struct replay_source *)src->priv;
+
+	if (r == NULL)
+		return;
+	for (unsigned int i = 0; i < r->nmaps; i++)
+		munmap(r->maps[i].addr, r->maps[i].size);
+	free(r->maps);
+	free(r->frames);
+	free(r);
+}
+
+static const struct frame_source_ops replay_source_ops = {
+	"replay",
+	replay_start,
+	replay_stop,
+	replay_stop,
+	replay_acquire,
+	replay_release,
+	replay_free,
+};
+
+/*
+ * frames from recorded files instead of a camera
+ * args:
+ * 		src   - frame source to set up
+ * 		dev   - gets the frame geometry, for a directory of raw files
+ * 				width and height have to be set already
+ * 		path  - raw container file or directory of captures_N.raw files
+ * 		fps   - frames per second, 0 for as fast as they are taken
+ * 		loops - passes over all frames, 0 for forever
+ * returns:
+ * 		error value
+ */
+int frame_source_replay(struct frame_source *src, struct device *dev,
+						const char *path, double fps, unsigned int loops)
+{
+	struct replay_source *r;
+	struct stat st;
+	int ret;
+
+	CLEAR(*src);
+	if (stat(path, &st) < 0)
+	{
+		fprintf(stderr, "REPLAY: %s: %s\n", path, strerror(errno));
+		return -errno;
+	}
+	r = (struct replay_source *)calloc(1, sizeof *r);
+	if (r == NULL)
+		return -ENOMEM;
+	src->ops = &replay_source_ops;
+	src->dev = dev;
+	src->priv = r;
+
+	if (S_ISDIR(st.st_mode))
+		ret = load_directory(r, dev, path);
+	else
+		ret = load_container(r, dev, path);
+	if (ret == 0 && r->nframes == 0)
+	{
+		printf("REPLAY: no frames found in %s\n", path);
+		ret = -ENOENT;
+	}
+	if (ret < 0)
+	{
+		frame_source_free(src);
+		return ret;
+	}
+
+	r->loops = loops;
+	r->period_ns = fps > 0 ? 1e9 / fps : 0;
+	__INIT_MUTEX(&r->mutex);
+	pthread_cond_init(&r->cond, NULL);
+	dev->fd = -1;
+	dev->nbufs = REPLAY_BUFFERS;
+	printf("REPLAY: %u frames of %ux%u from %s, %s\n", r->nframes,
+		   dev->width, dev->height, path, fps > 0 ? "paced" : "as fast as possible");
+	return 0;
+}
@@ -0,0 +1,323 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, background writer for
+  raw and bmp snapshots. A snapshot is copied into a pooled buffer and
+  queued, a separate thread writes it to disk so capture never waits for
+  fwrite or fsync.
+*****************************************************************************/
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <vector>
+
+#include "../includes/shortcuts.h"
+#include "snapshot_writer.h"
+#include "frame_trace.h"
+
+/*****************************************************************************
+**                           Function definition
+*****************************************************************************/
+
+/*
+ * write a whole buffer to a new file
+ * args:
+ * 		filename - file to create
+ * 		data     - pointer to data
+ * 		size     - data size in bytes
+ * 		do_fsync - wait until the data reached the disk
+ * returns:
+ * 		error value
+ */
+static int write_file(const char *filename, const void *data, size_t size,
+					  int do_fsync)
+{
+	FILE *fp;
+	int ret = 0;
+
+	TRACE_SCOPE("snapshot write");
+	if ((fp = fopen(filename, "wb")) == NULL)
+	{
+		fprintf(stderr, "SNAPSHOT: couldn't open %s: %s\n",
+				filename, strerror(errno));
+		return -1;
+	}
+	if (fwrite(data, size, 1, fp) < 1)
+		ret = -1;
+	if (fflush(fp) || (do_fsync && fsync(fileno(fp))))
+		ret = -1;
+	if (fclose(fp))
+		ret = -1;
+
+	if (ret < 0)
+		fprintf(stderr, "SNAPSHOT: couldn't write buffer to %s: %s\n",
+				filename, strerror(errno));
+	else
+		printf("SNAPSHOT: saved data to %s\n", filename);
+	return ret;
+}
+
+/*
+ * write one queued snapshot, bmp frames are encoded here so the
+ * capture side only pays for a copy
+ * args:
+ * 		w   - snapshot writer
+ * 		job - snapshot to write
+ */
+static void write_job(struct snapshot_writer *w, struct snapshot_job *job)
+{
+	if (job->type == SNAPSHOT_RAW)
+	{
+		write_file(job->filename, job->data, job->size, w->do_fsync);
+		return;
+	}
+
+	std::vector<uchar> bmp;
+	cv::Mat img(job->height, job->width, job->cv_type, job->data);
+	if (!cv::imencode(".bmp", img, bmp) || bmp.empty())
+	{
+		fprintf(stderr, "SNAPSHOT: couldn't encode %s\n", job->filename);
+		return;
+	}
+	write_file(job->filename, &bmp[0], bmp.size(), w->do_fsync);
+}
+
+/*
+ * writer thread, write queued snapshots in order until stopped,
+ * whatever is still queued at stop time gets written first
+ * args:
+ * 		arg - struct snapshot_writer *w
+ */
+static void *writer_thread(void *arg)
+{
+	struct snapshot_writer *w = (struct snapshot_writer *)arg;
+	struct snapshot_job job;
+
+	while (1)
+	{
+		__LOCK_MUTEX(&w->mutex);
+		while (w->running && w->count == 0)
+			pthread_cond_wait(&w->cond, &w->mutex);
+		if (w->count == 0)
+		{
+			__UNLOCK_MUTEX(&w->mutex);
+			break;
+		}
+		job = w->jobs[w->head];
+		w->head = (w->head + 1) % SNAPSHOT_QUEUE_DEPTH;
+		__UNLOCK_MUTEX(&w->mutex);
+
+		write_job(w, &job);
+		double latency = monotonic_us() - job.queued;
+
+		__LOCK_MUTEX(&w->mutex);
+		w->count--;
+		w->written++;
+		w->latency_total += latency;
+		if (latency > w->latency_max)
+			w->latency_max = latency;
+		__UNLOCK_MUTEX(&w->mutex);
+		/* only now the slot is free for another snapshot, after count
+		   stopped including it, so a queue never looks deeper than the pool */
+		frame_pool_put(&w->pool, job.data);
+	}
+	return NULL;
+}
+
+/*
+ * preallocate snapshot buffers and start the writer thread
+ * args:
+ * 		w        - snapshot writer
+ * 		max_size - largest snapshot in bytes
+ * 		do_fsync - fsync every file before counting it as written
+ * returns:
+ * 		error value
+ */
+int snapshot_writer_init(struct snapshot_writer *w, size_t max_size,
+						 int do_fsync)
+{
+	int ret;
+
+	CLEAR(*w);
+	ret = frame_pool_init(&w->pool, SNAPSHOT_QUEUE_DEPTH, max_size);
+	if (ret < 0)
+		return ret;
+	w->do_fsync = do_fsync;
+	w->running = 1;
+	__INIT_MUTEX(&w->mutex);
+	pthread_cond_init(&w->cond, NULL);
+
+	ret = __THREAD_CREATE(&w->thread, writer_thread, w);
+	if (ret != 0)
+	{
+		printf("couldn't start snapshot writer thread: %s\n", strerror(ret));
+		w->running = 0;
+		frame_pool_free(&w->pool);
+		return -ret;
+	}
+	return 0;
+}
+
+/*
+ * write out everything still queued, stop the thread and free the buffers
+ * args:
+ * 		w - snapshot writer
+ */
+void snapshot_writer_stop(struct snapshot_writer *w)
+{
+	if (!w->running)
+		return;
+	__LOCK_MUTEX(&w->mutex);
+	w->running = 0;
+	pthread_cond_signal(&w->cond);
+	__UNLOCK_MUTEX(&w->mutex);
+	__THREAD_JOIN(w->thread);
+	frame_pool_free(&w->pool);
+}
+
+/*
+ * make room for snapshots of a new frame size, the buffers are kept if
+ * they are big enough, otherwise the queued snapshots are written first,
+ * call from the thread that queues them
+ * args:
+ * 		w        - snapshot writer
+ * 		max_size - largest snapshot in bytes
+ * returns:
+ * 		error value
+ */
+int snapshot_writer_resize(struct snapshot_writer *w, size_t max_size)
+{
+	void *taken[SNAPSHOT_QUEUE_DEPTH];
+	unsigned int n = 0;
+
+	if (!w->running || max_size <= w->pool.size)
+		return 0;
+	/* every buffer back from the writer thread */
+	while (n < SNAPSHOT_QUEUE_DEPTH &&
+		   (taken[n] = frame_pool_get(&w->pool, 1)) != NULL)
+		n++;
+	for (unsigned int i = 0; i < n; i++)
+		frame_pool_put(&w->pool, taken[i]);
+	return frame_pool_resize(&w->pool, max_size);
+}
+
+/* print queue depth, write latency and drops */
+void snapshot_writer_print_stats(struct snapshot_writer *w)
+{
+	__LOCK_MUTEX(&w->mutex);
+	printf("snapshots: %lu written, %lu dropped, %u/%d queued (max %u), "
+		   "write latency avg %.1f ms, max %.1f ms%s\n",
+		   w->written, w->dropped, w->count, SNAPSHOT_QUEUE_DEPTH,
+		   w->max_depth,
+		   w->written ? w->latency_total / w->written / 1e3 : 0.0,
+		   w->latency_max / 1e3, w->do_fsync ? "" : " (no fsync)");
+	__UNLOCK_MUTEX(&w->mutex);
+}
+
+/*
+ * take a pooled buffer for a new snapshot, a full queue drops the
+ * snapshot instead of waiting for the disk
+ * returns:
+ * 		buffer, NULL if the snapshot got dropped
+ */
+static void *get_job_buffer(struct snapshot_writer *w, size_t size)
+{
+	void *data;
+
+	if (!w->running)
+		return NULL;
+	if (size > w->pool.size)
+	{
+		printf("snapshot of %zu bytes doesn't fit in %zu\n", size, w->pool.size);
+		return NULL;
+	}
+	data = frame_pool_get(&w->pool, 0);
+	if (data == NULL)
+	{
+		__LOCK_MUTEX(&w->mutex);
+		w->dropped++;
+		__UNLOCK_MUTEX(&w->mutex);
+		printf("snapshot queue full, dropping snapshot\n");
+		snapshot_writer_print_stats(w);
+	}
+	return data;
+}
+
+/* hand a filled buffer over to the writer thread */
+static void queue_job(struct snapshot_writer *w, struct snapshot_job *job)
+{
+	job->queued = monotonic_us();
+	__LOCK_MUTEX(&w->mutex);
+	w->jobs[w->tail] = *job;
+	w->tail = (w->tail + 1) % SNAPSHOT_QUEUE_DEPTH;
+	w->count++;
+	if (w->count > w->max_depth)
+		w->max_depth = w->count;
+	pthread_cond_signal(&w->cond);
+	__UNLOCK_MUTEX(&w->mutex);
+}
+
+/*
+ * copy a raw frame and queue it for writing
+ * args:
+ * 		w        - snapshot writer
+ * 		filename - file to create
+ * 		data     - frame data, can be reused as soon as this returns
+ * 		size     - data size in bytes
+ * returns:
+ * 		error value, -ENOSPC if the snapshot got dropped
+ */
+int snapshot_writer_queue_raw(struct snapshot_writer *w, const char *filename,
+							  const void *data, size_t size)
+{
+	struct snapshot_job job;
+
+	CLEAR(job);
+	job.data = get_job_buffer(w, size);
+	if (job.data == NULL)
+		return -ENOSPC;
+	memcpy(job.data, data, size);
+	job.type = SNAPSHOT_RAW;
+	job.size = size;
+	snprintf(job.filename, sizeof job.filename, "%s", filename);
+	queue_job(w, &job);
+	return 0;
+}
+
+/*
+ * copy an image and queue it for bmp encoding and writing
+ * args:
+ * 		w         - snapshot writer
+ * 		filename  - file to create
+ * 		data      - first pixel of the image
+ * 		width     - image width
+ * 		height    - image height
+ * 		cv_type   - opencv pixel type, e.g. CV_8UC3
+ * 		step      - bytes between two rows of data
+ * 		row_bytes - bytes of pixel data in one row
+ * returns:
+ * 		error value, -ENOSPC if the snapshot got dropped
+ */
+int snapshot_writer_queue_bmp(struct snapshot_writer *w, const char *filename,
+							  const void *data, int width, int height,
+							  int cv_type, size_t step, size_t row_bytes)
+{
+	struct snapshot_job job;
+
+	CLEAR(job);
+	job.data = get_job_buffer(w, row_bytes * height);
+	if (job.data == NULL)
+		return -ENOSPC;
+	for (int y = 0; y < height; y++)
+		memcpy((unsigned char *)job.data + row_bytes * y,
+			   (const unsigned char *)data + step * y, row_bytes);
+	job.type = SNAPSHOT_BMP;
+	job.size = row_bytes * height;
+	job.width = width;
+	job.height = height;
+	job.cv_type = cv_type;
+	snprintf(job.filename, sizeof job.filename, "%s", filename);
+	queue_job(w, &job);
+	return 0;
+}
@@ -0,0 +1,74 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, background writer for
+  raw and bmp snapshots. A snapshot is copied into a pooled buffer and
+  queued, a separate thread writes it to disk so capture never waits for
+  fwrite or fsync.
+*****************************************************************************/
+#pragma once
+#include "frame_pool.h"
+
+/****************************************************************************
+**                      	Global data
+*****************************************************************************/
+/* snapshots that can wait for the disk before new ones get dropped */
+#define SNAPSHOT_QUEUE_DEPTH 4
+
+enum snapshot_type
+{
+	SNAPSHOT_RAW,
+	SNAPSHOT_BMP
+};
+
+struct snapshot_job
+{
+	int type;
+	char filename[64];
+	void *data;		/* pooled buffer */
+	size_t size;
+	int width;		/* bmp only */
+	int height;
+	int cv_type;
+	double queued;	/* us, for write latency */
+};
+
+struct snapshot_writer
+{
+	struct frame_pool pool;
+	struct snapshot_job jobs[SNAPSHOT_QUEUE_DEPTH];
+	unsigned int head;
+	unsigned int tail;
+	unsigned int count;
+	int running;
+	int do_fsync;
+
+	/* statistics */
+	unsigned long written;
+	unsigned long dropped;
+	unsigned int max_depth;
+	double latency_total;	/* us, queued to on disk */
+	double latency_max;
+
+	__THREAD_TYPE thread;
+	__MUTEX_TYPE mutex;
+	pthread_cond_t cond;
+};
+
+/****************************************************************************
+**							 Function declaration
+*****************************************************************************/
+int snapshot_writer_init(struct snapshot_writer *w, size_t max_size,
+						 int do_fsync);
+void snapshot_writer_stop(struct snapshot_writer *w);
+int snapshot_writer_resize(struct snapshot_writer *w, size_t max_size);
+
+int snapshot_writer_queue_raw(struct snapshot_writer *w, const char *filename,
+							  const void *data, size_t size);
+int snapshot_writer_queue_bmp(struct snapshot_writer *w, const char *filename,
+							  const void *data, int width, int height,
+							  int cv_type, size_t step, size_t row_bytes);
+
+void snapshot_writer_print_stats(struct snapshot_writer *w);
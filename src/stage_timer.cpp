@@ -0,0 +1,232 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, per-thread stage
+  timing histograms. A thread takes a slot the first time it times a
+  stage and only ever writes to that one, readers sum the slots. When the
+  thread exits its counts move to the retired ones and the slot is free
+  for the next thread.
+*****************************************************************************/
+#include <math.h>
+#include <pthread.h>
+
+#include "../includes/shortcuts.h"
+#include "stage_timer.h"
+
+/****************************************************************************
+**                      	Global data
+*****************************************************************************/
+struct stage_thread
+{
+	struct stage_snapshot hist;
+	int used;
+};
+
+static const char *stage_names[STAGE_COUNT] = {
+	"frame", "save raw", "record", "unpack", "debayer", "abc statistics",
+	"tone lut", "white balance", "save bmp", "show", "imshow"};
+
+static struct stage_thread threads[STAGE_THREADS_MAX];
+static struct stage_snapshot retired;	/* of threads that exited */
+/* taking and giving back slots, and reading them */
+static __MUTEX_TYPE mutex = __STATIC_MUTEX_INIT;
+static pthread_key_t thread_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+static __thread struct stage_thread *self;
+static __thread int no_slot;
+
+/*****************************************************************************
+**                           Function definition
+*****************************************************************************/
+
+const char *stage_name(enum stage_id stage)
+{
+	return (unsigned int)stage < STAGE_COUNT ? stage_names[stage] : "unknown";
+}
+
+/* quarter octave buckets, 0 for everything below 2^STAGE_MIN_SHIFT ns */
+static unsigned int bucket_of(uint64_t ns)
+{
+	if (ns < 1UL << STAGE_MIN_SHIFT)
+		return 0;
+	unsigned int msb = 63 - __builtin_clzll(ns);
+	unsigned int i = 1 + (msb - STAGE_MIN_SHIFT) * 4 + ((ns >> (msb - 2)) & 3);
+	return i < STAGE_BUCKETS ? i : STAGE_BUCKETS - 1;
+}
+
+/* largest value that falls into a bucket, in ns */
+static uint64_t bucket_top(unsigned int i)
+{
+	if (i == 0)
+		return (1UL << STAGE_MIN_SHIFT) - 1;
+	unsigned int msb = STAGE_MIN_SHIFT + (i - 1) / 4;
+	return ((uint64_t)(5 + (i - 1) % 4) << (msb - 2)) - 1;
+}
+
+/* add one histogram to another, the source may be written meanwhile */
+static void add_hist(struct stage_hist *sum, struct stage_hist *hist)
+{
+	for (unsigned int i = 0; i < STAGE_BUCKETS; i++)
+		sum->count[i] += __atomic_load_n(&hist->count[i], __ATOMIC_RELAXED);
+	sum->samples += __atomic_load_n(&hist->samples, __ATOMIC_RELAXED);
+	sum->total += __atomic_load_n(&hist->total, __ATOMIC_RELAXED);
+	unsigned long max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+	if (max > sum->max)
+		sum->max = max;
+}
+
+/* a thread that timed stages exits, keep what it counted */
+static void retire_thread(void *data)
+{
+	struct stage_thread *slot = (struct stage_thread *)data;
+
+	__LOCK_MUTEX(&mutex);
+	for (unsigned int s = 0; s < STAGE_COUNT; s++)
+		add_hist(&retired.stages[s], &slot->hist.stages[s]);
+	CLEAR(slot->hist);
+	slot->used = 0;
+	__UNLOCK_MUTEX(&mutex);
+}
+
+static void create_key()
+{
+	pthread_key_create(&thread_key, retire_thread);
+}
+
+/* the calling thread's slot, NULL if every slot is taken */
+static struct stage_thread *take_slot()
+{
+	pthread_once(&key_once, create_key);
+	__LOCK_MUTEX(&mutex);
+	for (unsigned int i = 0; i < STAGE_THREADS_MAX; i++)
+		if (!threads[i].used)
+		{
+			threads[i].used = 1;
+			self = &threads[i];
+			break;
+		}
+	__UNLOCK_MUTEX(&mutex);
+	if (self != NULL)
+		pthread_setspecific(thread_key, self);
+	else
+		no_slot = 1;
+	return self;
+}
+
+/*
+ * record how long a stage took in the calling thread's histogram and in
+ * the trace, what StageTimer calls
+ * args:
+ * 		stage - which one
+ * 		start - ns from trace_clock_ns
+ * 		end   - ns from trace_clock_ns
+ */
+void stage_timer_add(enum stage_id stage, uint64_t start, uint64_t end)
+{
+	uint64_t ns = end - start;
+
+	if (frame_trace_enabled())
+		frame_trace_add(stage_names[stage], start, end, frame_trace_frame());
+	if (self == NULL && (no_slot || take_slot() == NULL))
+		return;
+
+	/* only this thread writes, readers only need whole values */
+	struct stage_hist *hist = &self->hist.stages[stage];
+	unsigned int i = bucket_of(ns);
+	__atomic_store_n(&hist->count[i], hist->count[i] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&hist->samples, hist->samples + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&hist->total, hist->total + ns, __ATOMIC_RELAXED);
+	if (ns > hist->max)
+		__atomic_store_n(&hist->max, ns, __ATOMIC_RELAXED);
+}
+
+/*
+ * every stage summed over all threads since the program started, while
+ * they go on timing
+ * args:
+ * 		snap - gets the sums
+ */
+void stage_timers_snapshot(struct stage_snapshot *snap)
+{
+	CLEAR(*snap);
+	__LOCK_MUTEX(&mutex);
+	for (unsigned int s = 0; s < STAGE_COUNT; s++)
+	{
+		add_hist(&snap->stages[s], &retired.stages[s]);
+		for (unsigned int i = 0; i < STAGE_THREADS_MAX; i++)
+			if (threads[i].used)
+				add_hist(&snap->stages[s], &threads[i].hist.stages[s]);
+	}
+	__UNLOCK_MUTEX(&mutex);
+}
+
+/* ns below which the given share of the samples are, at a bucket's top */
+static uint64_t percentile(const struct stage_hist *hist, unsigned long samples,
+						   double share)
+{
+	unsigned long rank = (unsigned long)ceil(share * samples);
+	unsigned long seen = 0;
+
+	if (rank < 1)
+		rank = 1;
+	for (unsigned int i = 0; i < STAGE_BUCKETS; i++)
+	{
+		seen += hist->count[i];
+		if (seen >= rank)
+			return bucket_top(i) < hist->max ? bucket_top(i) : hist->max;
+	}
+	return hist->max;
+}
+
+/*
+ * print p50, p99, max and average of every stage that ran
+ * args:
+ * 		fd 	  - where to, 1 for stdout
+ * 		now   - from stage_timers_snapshot
+ * 		since - an earlier snapshot, only what came after it counts, NULL
+ * 				for everything
+ */
+void stage_timers_print(int fd, const struct stage_snapshot *now,
+						const struct stage_snapshot *since)
+{
+	if (fd == STDOUT_FILENO)
+		fflush(stdout);
+#ifdef NO_STAGE_TIMERS
+	dprintf(fd, "stage timers are compiled out\n");
+	return;
+#endif
+	dprintf(fd, "%-16s %8s %10s %10s %10s %10s\n", "stage", "frames",
+			"p50 us", "p99 us", "max us", "avg us");
+	for (unsigned int s = 0; s < STAGE_COUNT; s++)
+	{
+		struct stage_hist hist = now->stages[s];
+
+		if (since != NULL)
+		{
+			const struct stage_hist *old = &since->stages[s];
+			unsigned int top = 0;
+
+			for (unsigned int i = 0; i < STAGE_BUCKETS; i++)
+			{
+				hist.count[i] -= old->count[i];
+				if (hist.count[i] > 0)
+					top = i;
+			}
+			hist.samples -= old->samples;
+			hist.total -= old->total;
+			/* the largest one since is in the top bucket that grew */
+			if (bucket_top(top) < hist.max)
+				hist.max = bucket_top(top);
+		}
+		if (hist.samples == 0)
+			continue;
+		dprintf(fd, "%-16s %8lu %10.1f %10.1f %10.1f %10.1f\n",
+				stage_name((enum stage_id)s), hist.samples,
+				percentile(&hist, hist.samples, 0.5) / 1e3,
+				percentile(&hist, hist.samples, 0.99) / 1e3, hist.max / 1e3,
+				(double)hist.total / hist.samples / 1e3);
+	}
+}
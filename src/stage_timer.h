@@ -0,0 +1,95 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, how long every stage
+  of a frame takes: unpack, debayer, the tone lookup table, white balance,
+  saving, recording and display. A STAGE_TIMER in a block times the rest
+  of the block on trace_clock_ns, CLOCK_MONOTONIC_RAW.
+
+  Every thread that times something records into histograms of its own,
+  so timing a stage is two clock reads and a few stores, no lock and no
+  shared cache line. Any thread reads them live, summed over the threads,
+  as p50, p99 and max per stage. The buckets are a quarter octave wide, a
+  percentile is the upper end of its bucket, at most 25% high.
+
+  While frame_trace.h traces, every timed stage is an event in the trace
+  too. Build with -DNO_STAGE_TIMERS and the histograms compile out, a
+  STAGE_TIMER is then only a TRACE_SCOPE, free while tracing is off.
+*****************************************************************************/
+#pragma once
+#include <stdint.h>
+#include "frame_trace.h"
+
+/****************************************************************************
+**                      	Global data
+*****************************************************************************/
+#define STAGE_THREADS_MAX 32	/* threads recording at once */
+#define STAGE_MIN_SHIFT 8		/* below 256 ns is one bucket */
+#define STAGE_OCTAVES 24		/* 256 ns up to 4 s */
+#define STAGE_BUCKETS (1 + STAGE_OCTAVES * 4)
+
+enum stage_id
+{
+	STAGE_FRAME = 0,		/* everything get_a_frame does */
+	STAGE_SAVE_RAW,
+	STAGE_RECORD,			/* recording and the pre-trigger ring */
+	STAGE_UNPACK,			/* shift to 8 bits or copy */
+	STAGE_DEBAYER,			/* cvtColor to bgr */
+	STAGE_ABC_STATS,		/* auto brightness and contrast statistics */
+	STAGE_TONE,				/* gamma, awb gains, abc without awb, one lut */
+	STAGE_WHITE_BALANCE,	/* colour correction matrix, then abc */
+	STAGE_SAVE_BMP,
+	STAGE_SHOW,				/* copy for the display thread */
+	STAGE_IMSHOW,
+	STAGE_COUNT,
+};
+
+struct stage_hist
+{
+	unsigned long count[STAGE_BUCKETS];
+	unsigned long samples;
+	unsigned long total;	/* ns */
+	unsigned long max;
+};
+
+/* what every stage took, in one thread or summed over them */
+struct stage_snapshot
+{
+	struct stage_hist stages[STAGE_COUNT];
+};
+
+/****************************************************************************
+**							 Function declaration
+*****************************************************************************/
+void stage_timer_add(enum stage_id stage, uint64_t start, uint64_t end);
+
+void stage_timers_snapshot(struct stage_snapshot *snap);
+void stage_timers_print(int fd, const struct stage_snapshot *now,
+						const struct stage_snapshot *since);
+const char *stage_name(enum stage_id stage);
+
+/* times the rest of the enclosing block */
+class StageTimer
+{
+public:
+	explicit StageTimer(enum stage_id stage)
+		: stage(stage), start(trace_clock_ns()) {}
+	~StageTimer() { stage_timer_add(stage, start, trace_clock_ns()); }
+
+private:
+	StageTimer(const StageTimer &);
+	StageTimer &operator=(const StageTimer &);
+
+	enum stage_id stage;
+	uint64_t start;
+};
+
+#define STAGE_TIMER_NAME2(line) stage_timer_##line
+#define STAGE_TIMER_NAME(line) STAGE_TIMER_NAME2(line)
+#ifdef NO_STAGE_TIMERS
+#define STAGE_TIMER(stage) TRACE_SCOPE(stage_name(stage))
+#else
+#define STAGE_TIMER(stage) StageTimer STAGE_TIMER_NAME(__LINE__)(stage)
+#endif
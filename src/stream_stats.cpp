@@ -0,0 +1,191 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, frame loss, payload
+  and latency accounting from v4l2 buffer metadata in lock-free
+  histograms.
+*****************************************************************************/
+#include "../includes/shortcuts.h"
+#include "stream_stats.h"
+
+/*****************************************************************************
+**                           Function definition
+*****************************************************************************/
+
+/*
+ * add one sample, from any thread
+ * args:
+ * 		hist - histogram
+ * 		us 	 - value, negative counts as 0
+ */
+void stat_hist_add(struct stat_hist *hist, double us)
+{
+	unsigned long value = us > 0 ? (unsigned long)us : 0;
+	unsigned long max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+	unsigned int i = 0;
+
+	while (i < STAT_BUCKETS - 1 && value >= 1UL << i)
+		i++;
+	__atomic_add_fetch(&hist->count[i], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&hist->samples, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&hist->total, value, __ATOMIC_RELAXED);
+	while (value > max &&
+		   !__atomic_compare_exchange_n(&hist->max, &max, value, 1,
+										__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/* copy a histogram another thread may be adding to */
+static void stat_hist_snapshot(struct stat_hist *hist, struct stat_hist *snap)
+{
+	for (unsigned int i = 0; i < STAT_BUCKETS; i++)
+		snap->count[i] = __atomic_load_n(&hist->count[i], __ATOMIC_RELAXED);
+	snap->samples = __atomic_load_n(&hist->samples, __ATOMIC_RELAXED);
+	snap->total = __atomic_load_n(&hist->total, __ATOMIC_RELAXED);
+	snap->max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+}
+
+/* print the buckets that have samples, one line each */
+void stat_hist_print(const struct stat_hist *hist, const char *name)
+{
+	if (hist->samples == 0)
+		return;
+	printf("%s: %lu samples, avg %.1f us, max %lu us\n", name, hist->samples,
+		   (double)hist->total / hist->samples, hist->max);
+	for (unsigned int i = 0; i < STAT_BUCKETS; i++)
+	{
+		if (hist->count[i] == 0)
+			continue;
+		if (i == STAT_BUCKETS - 1)
+			printf("  %7lu us and up: %lu\n", 1UL << (i - 1), hist->count[i]);
+		else
+			printf("  %7lu - %7lu us: %lu\n", i ? 1UL << (i - 1) : 0, 1UL << i,
+				   hist->count[i]);
+	}
+}
+
+/* start counting from nothing */
+void stream_stats_init(struct stream_stats *stats)
+{
+	CLEAR(*stats);
+}
+
+/*
+ * the camera streams again, e.g. with other buffers, its sequence starts
+ * over, call before the first dequeue
+ * args:
+ * 		stats - stream stats, the counts stay
+ */
+void stream_stats_restart(struct stream_stats *stats)
+{
+	stats->have_last = 0;
+	/* the rate may be another one */
+	stats->period = 0;
+}
+
+/*
+ * account for a dequeued buffer, called by the capture thread only
+ * args:
+ * 		stats 	  - stream stats
+ * 		buf 	  - from VIDIOC_DQBUF
+ * 		imagesize - bytes a whole frame has
+ * 		dq_us 	  - when it was dequeued, monotonic
+ */
+void stream_stats_dequeued(struct stream_stats *stats,
+						   const struct v4l2_buffer *buf, unsigned int imagesize,
+						   double dq_us)
+{
+	uint64_t timestamp = (uint64_t)buf->timestamp.tv_sec * 1000000 +
+						 buf->timestamp.tv_usec;
+
+	__atomic_add_fetch(&stats->frames, 1, __ATOMIC_RELAXED);
+	if (buf->flags & V4L2_BUF_FLAG_ERROR)
+		__atomic_add_fetch(&stats->errors, 1, __ATOMIC_RELAXED);
+	else if (buf->bytesused < imagesize)
+		__atomic_add_fetch(&stats->short_payloads, 1, __ATOMIC_RELAXED);
+
+	/* anything but the monotonic clock can't be compared with ours */
+	if ((buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) ==
+		V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+		stat_hist_add(&stats->latency, dq_us - timestamp);
+
+	if (stats->have_last && buf->sequence > stats->last_sequence + 1)
+	{
+		__atomic_add_fetch(&stats->gaps, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&stats->lost, buf->sequence - stats->last_sequence - 1,
+						   __ATOMIC_RELAXED);
+	}
+	if (stats->have_last && timestamp > stats->last_timestamp)
+	{
+		double interval = timestamp - stats->last_timestamp;
+		unsigned int periods = buf->sequence - stats->last_sequence;
+
+		/* a skipped frame isn't jitter, it is a period more */
+		if (stats->period > 0 && periods > 0)
+		{
+			double jitter = interval - stats->period * periods;
+			stat_hist_add(&stats->jitter, jitter < 0 ? -jitter : jitter);
+		}
+		/* only between neighbours, so the average stays one period */
+		if (periods == 1)
+		{
+			stat_hist_add(&stats->interval, interval);
+			stats->period = stats->period > 0
+								? stats->period + (interval - stats->period) / 16
+								: interval;
+		}
+	}
+	stats->have_last = 1;
+	stats->last_sequence = buf->sequence;
+	stats->last_timestamp = timestamp;
+}
+
+/*
+ * a frame made it to the screen, from the thread that shows it
+ * args:
+ * 		stats - stream stats
+ * 		dq_us - when its buffer was dequeued, monotonic
+ */
+void stream_stats_displayed(struct stream_stats *stats, double dq_us)
+{
+	stat_hist_add(&stats->display, monotonic_us() - dq_us);
+}
+
+/*
+ * copy the figures while other threads go on adding to them, each one is
+ * consistent on its own
+ * args:
+ * 		stats - stream stats
+ * 		snap  - gets the copy
+ */
+void stream_stats_snapshot(struct stream_stats *stats,
+						   struct stream_stats *snap)
+{
+	CLEAR(*snap);
+	snap->frames = __atomic_load_n(&stats->frames, __ATOMIC_RELAXED);
+	snap->gaps = __atomic_load_n(&stats->gaps, __ATOMIC_RELAXED);
+	snap->lost = __atomic_load_n(&stats->lost, __ATOMIC_RELAXED);
+	snap->short_payloads = __atomic_load_n(&stats->short_payloads,
+										   __ATOMIC_RELAXED);
+	snap->errors = __atomic_load_n(&stats->errors, __ATOMIC_RELAXED);
+	stat_hist_snapshot(&stats->interval, &snap->interval);
+	stat_hist_snapshot(&stats->jitter, &snap->jitter);
+	stat_hist_snapshot(&stats->latency, &snap->latency);
+	stat_hist_snapshot(&stats->display, &snap->display);
+}
+
+/* print a snapshot, the histograms that have samples in full */
+void stream_stats_print(const struct stream_stats *snap)
+{
+	if (snap->frames == 0)
+		return;
+	printf("frames: %lu dequeued, %lu lost in %lu gaps, %lu short, %lu errored\n",
+		   snap->frames, snap->lost, snap->gaps, snap->short_payloads,
+		   snap->errors);
+	stat_hist_print(&snap->interval, "frame interval");
+	stat_hist_print(&snap->jitter, "frame interval jitter");
+	stat_hist_print(&snap->latency, "driver to dequeue latency");
+	stat_hist_print(&snap->display, "dequeue to display latency");
+}
@@ -0,0 +1,74 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, per-stream accounting
+  from what the driver says about every buffer it hands back: sequence
+  numbers it skipped, payloads that came short or flagged as errors, the
+  spacing of its timestamps and how long a frame took from the driver's
+  timestamp to the dequeue and from the dequeue to the screen.
+
+  Frames skipped in the sequence with clean payloads were lost before the
+  host, on the sensor or the USB link, or because the driver had no buffer
+  queued, see buffer_tune.h. Short and errored payloads point at the link.
+  A long driver to dequeue latency with a quiet interval is the capture
+  thread running late, a long dequeue to display our own processing.
+
+  Every figure is counted with atomics and every histogram has fixed
+  buckets, so the capture thread, processing and the gui thread add to
+  them without a lock and any thread can take a snapshot while they do.
+*****************************************************************************/
+#pragma once
+#include <stdint.h>
+
+/****************************************************************************
+**                      	Global data
+*****************************************************************************/
+#define STAT_BUCKETS 24			/* powers of two from 1 us to 4 s */
+
+struct stat_hist
+{
+	unsigned long count[STAT_BUCKETS];	/* [2^(i-1), 2^i) us, i=0 below 1 us */
+	unsigned long samples;
+	unsigned long total;	/* us */
+	unsigned long max;
+};
+
+struct v4l2_buffer;
+
+struct stream_stats
+{
+	unsigned long frames;
+	unsigned long gaps;			/* times the sequence skipped */
+	unsigned long lost;			/* sequence numbers skipped */
+	unsigned long short_payloads; /* bytesused below the image size */
+	unsigned long errors;		/* V4L2_BUF_FLAG_ERROR */
+
+	struct stat_hist interval;	/* between driver timestamps */
+	struct stat_hist jitter;	/* of an interval from the running average */
+	struct stat_hist latency;	/* driver timestamp to dequeue */
+	struct stat_hist display;	/* dequeue to display */
+
+	/* the last frame, only the capture thread uses them */
+	int have_last;
+	unsigned int last_sequence;
+	uint64_t last_timestamp;	/* us */
+	double period;				/* running average interval, us, 0 unknown */
+};
+
+/****************************************************************************
+**							 Function declaration
+*****************************************************************************/
+void stat_hist_add(struct stat_hist *hist, double us);
+void stat_hist_print(const struct stat_hist *hist, const char *name);
+
+void stream_stats_init(struct stream_stats *stats);
+void stream_stats_restart(struct stream_stats *stats);
+void stream_stats_dequeued(struct stream_stats *stats,
+						   const struct v4l2_buffer *buf, unsigned int imagesize,
+						   double dq_us);
+void stream_stats_displayed(struct stream_stats *stats, double dq_us);
+void stream_stats_snapshot(struct stream_stats *stats,
+						   struct stream_stats *snap);
+void stream_stats_print(const struct stream_stats *snap);
@@ -11,43 +11,47 @@
   Last edit: 2019/04
 *****************************************************************************/
 
+#include <pthread.h>
+
 #include "../includes/shortcuts.h"
 #include "uvc_extension_unit_ctrl.h"
+#include "frame_trace.h"
 
 /****************************************************************************
 **                      	Global data 
 *****************************************************************************/
-struct uvc_xu_control_query xu_query;
-
-// define the buffer for storage
-unsigned char buf1[LI_XU_SENSOR_MODES_SWITCH_SIZE] = {0}; 
-unsigned char buf2[LI_XU_SENSOR_WINDOW_REPOSITION_SIZE] = {0}; 
-unsigned char buf3[LI_XU_LED_MODES_SIZE] = {0}; 
-unsigned char buf4[LI_XU_SENSOR_GAIN_CONTROL_RGB_SIZE] = {0}; 
-
-unsigned char buf7[LI_XU_SENSOR_UUID_HWFW_REV_SIZE] = {0}; 
-unsigned char buf8[LI_XU_PTS_QUERY_SIZE] = {0};		 
-unsigned char buf9[LI_XU_SOFT_TRIGGER_SIZE] = {0};		  
-unsigned char buf10[LI_XU_TRIGGER_DELAY_SIZE] = {0};	
-unsigned char buf11[LI_XU_TRIGGER_MODE_SIZE] = {0};
-unsigned char buf12[LI_XU_SENSOR_REGISTER_CONFIGURATION_SIZE] = {0};		
-unsigned char buf14[LI_XU_SENSOR_REG_RW_SIZE] = {0};		 
-
-unsigned char buf16[LI_XU_GENERIC_I2C_RW_SIZE] = {0}; 
-unsigned char buf17[LI_XU_SENSOR_DEFECT_PIXEL_TABLE_SIZE] = {0};		
-
-
-unsigned int m_rGain = 0x1;
-unsigned int m_grGain = 0x1;
-unsigned int m_gbGain = 0x1;
-unsigned int m_bGain = 0x1;
-
-int hw_rev;
- char uuid[64];
+/* write-then-read transactions on one camera must not interleave */
+#define XU_LOCKS 16
+static __MUTEX_TYPE xu_locks[XU_LOCKS];
+static pthread_once_t xu_locks_once = PTHREAD_ONCE_INIT;
 
 /*****************************************************************************
 **                           Function definition
 *****************************************************************************/
+static void init_xu_locks()
+{
+	for (int i = 0; i < XU_LOCKS; i++)
+		__INIT_MUTEX(&xu_locks[i]);
+}
+
+/*
+ * lock for the register read/write transactions of one camera, cameras
+ * on different fds hardly ever share one
+ * args:
+ * 		fd - file descriptor
+ * returns:
+ * 		the lock, held
+ */
+static __MUTEX_TYPE *lock_xu(int fd)
+{
+	__MUTEX_TYPE *lock;
+
+	pthread_once(&xu_locks_once, init_xu_locks);
+	lock = &xu_locks[(unsigned int)fd % XU_LOCKS];
+	__LOCK_MUTEX(lock);
+	return lock;
+}
+
 /*
  * handle the error for extension unit control
  * args:
@@ -96,6 +100,7 @@ void error_handle_extension_unit()
 int write_to_UVC_extension(int fd,int property_id,
 							int length, unsigned char *buffer)
 {
+	struct uvc_xu_control_query xu_query;
 
 	CLEAR(xu_query);
 	xu_query.unit = 3;			  //has to be unit 3
@@ -106,6 +111,7 @@ int write_to_UVC_extension(int fd,int property_id,
 
 	int ret = 0;
 
+	TRACE_SCOPE("XU SET_CUR");
 	if ((ret = ioctl(fd, UVCIOC_CTRL_QUERY, &xu_query)) != 0)
 		error_handle_extension_unit();
 
@@ -124,6 +130,9 @@ int write_to_UVC_extension(int fd,int property_id,
 int read_from_UVC_extension(int fd,int property_id,
 							 int length, unsigned char *buffer)
 {
+	struct uvc_xu_control_query xu_query;
+	int ret = 0;
+
 	CLEAR(xu_query);
 	xu_query.unit = 3;			  //has to be unit 3
 	xu_query.query = UVC_GET_CUR; //request code to send to the device
@@ -131,8 +140,11 @@ int read_from_UVC_extension(int fd,int property_id,
 	xu_query.selector = property_id;
 	xu_query.data = buffer; //control buffer
 	
-	if (ioctl(fd, UVCIOC_CTRL_QUERY, &xu_query) != 0)
+	TRACE_SCOPE("XU GET_CUR");
+	if ((ret = ioctl(fd, UVCIOC_CTRL_QUERY, &xu_query)) != 0)
 		error_handle_extension_unit();
+
+	return ret;
 }
 
 /*--------------------------------------------------------------------------- */
@@ -147,7 +159,7 @@ int read_from_UVC_extension(int fd,int property_id,
  */
 void set_sensor_mode(int fd, int mode)
 {
-    CLEAR(buf1);
+    unsigned char buf1[LI_XU_SENSOR_MODES_SWITCH_SIZE] = {0};
     buf1[0] = mode;
     write_to_UVC_extension(fd, LI_XU_SENSOR_MODES_SWITCH, 
         LI_XU_SENSOR_MODES_SWITCH_SIZE, buf1);
@@ -165,7 +177,7 @@ void set_sensor_mode(int fd, int mode)
  */
 void set_pos(int fd, int start_x, int start_y)
 {
-    CLEAR(buf2);
+    unsigned char buf2[LI_XU_SENSOR_WINDOW_REPOSITION_SIZE] = {0};
     buf2[0] = start_x & 0xff;
     buf2[1] = (start_x >> 8) & 0xff;
     buf2[2] = start_y & 0xff;
@@ -185,7 +197,7 @@ void set_pos(int fd, int start_x, int start_y)
  */
 void get_led_status(int fd)
 {
-    CLEAR(buf3);
+    unsigned char buf3[LI_XU_LED_MODES_SIZE] = {0};
     read_from_UVC_extension(fd, LI_XU_LED_MODES,
         LI_XU_LED_MODES_SIZE, buf3);
     printf("V4L2_CORE: led status is %d", buf3[0]);
@@ -204,7 +216,7 @@ void get_led_status(int fd)
  */
 void set_led(int fd, int left_0, int left_1, int right_0, int right_1)
 {
-    CLEAR(buf3);
+    unsigned char buf3[LI_XU_LED_MODES_SIZE] = {0};
     char val = {0};
     if (left_0) val |= 0x04;
     if (left_1) val |= 0x08;
@@ -235,59 +247,82 @@ void set_sensor_gain_rgb(int fd,unsigned int rGain,
 						 unsigned int gbGain,
 						 unsigned int bGain)
 {
-	CLEAR(buf4);
-	if ((m_rGain != rGain) | (m_grGain != grGain) |
-		(m_gbGain != gbGain) | (m_bGain != bGain))
-	{
-		m_rGain = rGain;
-		m_grGain = grGain;
-		m_gbGain = gbGain;
-		m_bGain = bGain;
-
-		buf4[0] = m_rGain & 0xff;
-		buf4[1] = m_rGain >> 8;
-		buf4[2] = m_grGain & 0xff;
-		buf4[3] = m_grGain >> 8;
-		buf4[4] = m_rGain & 0xff;
-		buf4[5] = m_rGain >> 8;
-		buf4[6] = m_grGain & 0xff;
-		buf4[7] = m_grGain >> 8;
-	}
+	unsigned char buf4[LI_XU_SENSOR_GAIN_CONTROL_RGB_SIZE] = {0};
+
+	buf4[0] = rGain & 0xff;
+	buf4[1] = rGain >> 8;
+	buf4[2] = grGain & 0xff;
+	buf4[3] = grGain >> 8;
+	buf4[4] = rGain & 0xff;
+	buf4[5] = rGain >> 8;
+	buf4[6] = grGain & 0xff;
+	buf4[7] = grGain >> 8;
 	
 	write_to_UVC_extension(fd, LI_XU_SENSOR_GAIN_CONTROL_RGB, 
         LI_XU_SENSOR_GAIN_CONTROL_RGB_SIZE, buf4);
-	printf("V4L2_CORE: setter get rGain = 0x%x\r\n", m_rGain);
-	printf("V4L2_CORE: setter get grGain = 0x%x\r\n", m_grGain);
-	printf("V4L2_CORE: setter get gbGain = 0x%x\r\n", m_gbGain);
-	printf("V4L2_CORE: setter get bGain = 0x%x\r\n", m_bGain);
+	printf("V4L2_CORE: setter get rGain = 0x%x\r\n", rGain);
+	printf("V4L2_CORE: setter get grGain = 0x%x\r\n", grGain);
+	printf("V4L2_CORE: setter get gbGain = 0x%x\r\n", gbGain);
+	printf("V4L2_CORE: setter get bGain = 0x%x\r\n", bGain);
 }
 
 /* 
  * read camera uuid hardware firmware revision
  * for uuid and fuseid, request for new driver to fit needs
+ * args:
+ * 		fd 		- file descriptor
+ * 		hw_rev 	- gets the hardware revision without the datatype, can be NULL
+ * 		uuid 	- gets the uuid, LI_UUID_SIZE bytes, can be NULL
+ * returns:
+ * 		firmware revision
  */
-int read_cam_uuid_hwfw_rev(int fd)
+int read_cam_uuid_hwfw_rev(int fd, int *hw_rev, char *uuid)
 {
-    CLEAR(buf7);
-	
-    char uuidBuf[80];
+    unsigned char buf7[LI_XU_SENSOR_UUID_HWFW_REV_SIZE] = {0};
+	char uuidBuf[LI_UUID_SIZE];
+
     read_from_UVC_extension(fd, LI_XU_SENSOR_UUID_HWFW_REV,
         LI_XU_SENSOR_UUID_HWFW_REV_SIZE, buf7);
 	/* upper 4 bits are for camera datatype, clear that flags */
-    hw_rev = buf7[0] | (buf7[1] << 8);
-	hw_rev &= ~(0xf000); 
+    int local_hw_rev = buf7[0] | (buf7[1] << 8);
+	local_hw_rev &= ~(0xf000); 
     int local_fw_rev = buf7[2] | (buf7[3] << 8);
-    for (int i=0; i < (36+9); i++)
-    {
-        uuidBuf[i] = buf7[4+i];
-    }
-    strcpy(uuid, uuidBuf);
-    printf("hardware rev=%x\n", hw_rev);
+    snprintf(uuidBuf, sizeof(uuidBuf), "%.*s", 36 + 9, (const char *)&buf7[4]);
+    printf("hardware rev=%x\n", local_hw_rev);
     printf("firmware rev=%d\n", local_fw_rev);
-    printf("uuid=%s\n", uuid);
+    printf("uuid=%s\n", uuidBuf);
+	if (hw_rev != NULL)
+		*hw_rev = local_hw_rev;
+	if (uuid != NULL)
+		strcpy(uuid, uuidBuf);
 	return local_fw_rev;
 }
 
+/*
+ * read the camera datatype from the upper 4 bits of the hardware revision
+ * uses its own buffer, so cameras can be asked from different threads
+ * args:
+ * 		fd 		 - file descriptor
+ * returns:
+ * 		RAW_10_MODE, RAW_12_MODE, YUY2_MODE etc., 0 if unknown
+ */
+int read_cam_datatype(int fd)
+{
+	unsigned char rev[LI_XU_SENSOR_UUID_HWFW_REV_SIZE] = {0};
+	struct uvc_xu_control_query query;
+
+	CLEAR(query);
+	query.unit = 3;
+	query.query = UVC_GET_CUR;
+	query.size = LI_XU_SENSOR_UUID_HWFW_REV_SIZE;
+	query.selector = LI_XU_SENSOR_UUID_HWFW_REV;
+	query.data = rev;
+	TRACE_SCOPE("XU GET_CUR");
+	if (ioctl(fd, UVCIOC_CTRL_QUERY, &query) != 0)
+		return 0;
+	return (rev[0] | (rev[1] << 8)) & 0xf000;
+}
+
 /*
  * currently PTS information are placed in 2 places
  * 1. UVC video data header 
@@ -312,7 +347,7 @@ int read_cam_uuid_hwfw_rev(int fd)
  */
 void get_pts(int fd)
 {
-	CLEAR(buf8);
+	unsigned char buf8[LI_XU_PTS_QUERY_SIZE] = {0};
 	read_from_UVC_extension(fd, LI_XU_PTS_QUERY, 
         LI_XU_PTS_QUERY_SIZE, buf8);
 	
@@ -328,7 +363,7 @@ void get_pts(int fd)
  */
 void set_pts(int fd,unsigned long initVal)
 {
-	CLEAR(buf8);
+	unsigned char buf8[LI_XU_PTS_QUERY_SIZE] = {0};
 	buf8[0] = (initVal >> 24) & 0xff;
 	buf8[1] = (initVal >> 16) & 0xff;
 	buf8[2] = (initVal >> 8) & 0xff;
@@ -347,7 +382,7 @@ void set_pts(int fd,unsigned long initVal)
  */
 int soft_trigger(int fd)
 {
-    CLEAR(buf9);
+    unsigned char buf9[LI_XU_SOFT_TRIGGER_SIZE] = {0};
 
     printf("V4L2_CORE: send one trigger\n");
 
@@ -359,11 +394,9 @@ int soft_trigger(int fd)
 
 int trigger_delay_time(int fd, unsigned int delay_time)
 {
-    CLEAR(buf10);
+    unsigned char buf10[LI_XU_TRIGGER_DELAY_SIZE] = {0};
     buf10[0] = delay_time & 0xff;
     buf10[1] = (delay_time >> 8) & 0xff;
-    buf10[2] = (delay_time >> 16) & 0xff;
-    buf10[3] = (delay_time >> 24) & 0xff;
 
     printf("V4L2_CORE: trigger delay time %x", delay_time);
 
@@ -375,7 +408,7 @@ int trigger_delay_time(int fd, unsigned int delay_time)
 //TODO: add comments
 int trigger_enable(int fd, int ena, int enb)
 {
-    CLEAR(buf11);
+    unsigned char buf11[LI_XU_TRIGGER_MODE_SIZE] = {0};
     if(ena)
     {
         if(enb) 
@@ -403,7 +436,7 @@ void load_register_setting_from_configuration(int fd,int regCount,
 											  const struct reg_pair *buffer)
 {
 	int i;
-	CLEAR(buf12);
+	unsigned char buf12[LI_XU_SENSOR_REGISTER_CONFIGURATION_SIZE] = {0};
 	printf("V4L2_CORE: save to flash\r\n");
 	//set flags to match definition in firmware
 	buf12[0] = 0x11;
@@ -464,7 +497,7 @@ void load_register_setting_from_flash_manually(int fd)
 {
 	int reg_flash_length, addr, val, i;
 	printf("V4L2_CORE: load from flash\r\n");
-	CLEAR(buf12);
+	unsigned char buf12[LI_XU_SENSOR_REGISTER_CONFIGURATION_SIZE] = {0};
 	read_from_UVC_extension(fd, LI_XU_SENSOR_REGISTER_CONFIGURATION,
 		LI_XU_SENSOR_REGISTER_CONFIGURATION_SIZE, buf12);
 	if (buf12[0] != 0x11 && buf12[1] != 0x22 && buf12[2] != 0x33 && buf12[3] != 0x44)
@@ -497,7 +530,7 @@ void load_register_setting_from_flash_manually(int fd)
 void sensor_reg_write(int fd,int regAddr, int regVal)
 {
 
-	CLEAR(buf14);
+	unsigned char buf14[LI_XU_SENSOR_REG_RW_SIZE] = {0};
 
 	buf14[0] = 1; //1 indicates for write
 	buf14[1] = (regAddr >> 8) & 0xff;
@@ -505,8 +538,11 @@ void sensor_reg_write(int fd,int regAddr, int regVal)
 	buf14[3] = (regVal >> 8) & 0xff;
 	buf14[4] = regVal & 0xff;
 
+	/* latches the address, a read in between must not see it */
+	__MUTEX_TYPE *lock = lock_xu(fd);
 	write_to_UVC_extension(fd, LI_XU_SENSOR_REG_RW, 
         LI_XU_SENSOR_REG_RW_SIZE, buf14);
+	__UNLOCK_MUTEX(lock);
 
 	printf("V4L2_CORE: Write Sensor REG[0x%x]: 0x%x\r\n", regAddr, regVal);
 }
@@ -522,12 +558,13 @@ int sensor_reg_read(int fd,int regAddr)
 
 	int regVal = 0;
 
-	CLEAR(buf14);
+	unsigned char buf14[LI_XU_SENSOR_REG_RW_SIZE] = {0};
 
 	buf14[0] = 0; //0 indicates for read
 	buf14[1] = (regAddr >> 8) & 0xff;
 	buf14[2] = regAddr & 0xff;
 
+	__MUTEX_TYPE *lock = lock_xu(fd);
 	write_to_UVC_extension(fd, LI_XU_SENSOR_REG_RW, 
         LI_XU_SENSOR_REG_RW_SIZE, buf14);
 	buf14[0] = 0; //0 indicates for read
@@ -535,6 +572,7 @@ int sensor_reg_read(int fd,int regAddr)
 	buf14[4] = 0;
 	read_from_UVC_extension(fd, LI_XU_SENSOR_REG_RW, 
         LI_XU_SENSOR_REG_RW_SIZE, buf14);
+	__UNLOCK_MUTEX(lock);
 
 	regVal = (buf14[3] << 8) + buf14[4];
 	printf("V4L2_CORE: Read Sensor REG[0x%x] = 0x%x\r\n", regAddr, regVal);
@@ -567,7 +605,7 @@ void generic_I2C_write(int fd,int rw_flag, int bufCnt,
 {
 	int regVal = 0;
 
-	CLEAR(buf16);
+	unsigned char buf16[LI_XU_GENERIC_I2C_RW_SIZE] = {0};
 
 	buf16[0] = rw_flag;
 	buf16[1] = bufCnt - 1;
@@ -588,8 +626,11 @@ void generic_I2C_write(int fd,int rw_flag, int bufCnt,
 		regVal = (buf16[6] << 8) + buf16[7];
 	}
 
+	/* latches the address, a read in between must not see it */
+	__MUTEX_TYPE *lock = lock_xu(fd);
 	write_to_UVC_extension(fd, LI_XU_GENERIC_I2C_RW, 
         LI_XU_GENERIC_I2C_RW_SIZE, buf16);
+	__UNLOCK_MUTEX(lock);
 	printf("V4L2_CORE: I2C slave ADDR[0x%x], Write REG[0x%x]: 0x%x\r\n",
 		   slaveAddr, regAddr, regVal);
 }
@@ -612,19 +653,21 @@ int generic_I2C_read(int fd,int rw_flag, int bufCnt,
 {
 	int regVal = 0;
 
-	CLEAR(buf16);
+	unsigned char buf16[LI_XU_GENERIC_I2C_RW_SIZE] = {0};
 	buf16[0] = rw_flag;
 	buf16[1] = bufCnt - 1;
 	buf16[2] = slaveAddr >> 8;
 	buf16[3] = slaveAddr & 0xff;
 	buf16[4] = regAddr >> 8;
 	buf16[5] = regAddr & 0xff;
+	__MUTEX_TYPE *lock = lock_xu(fd);
 	write_to_UVC_extension(fd, LI_XU_GENERIC_I2C_RW, 
         LI_XU_GENERIC_I2C_RW_SIZE, buf16);
 	buf16[6] = 0;
 	buf16[7] = 0;
 	read_from_UVC_extension(fd, LI_XU_GENERIC_I2C_RW, 
         LI_XU_GENERIC_I2C_RW_SIZE, buf16);
+	__UNLOCK_MUTEX(lock);
 	if (bufCnt == 1)
 	{
 		regVal = buf16[6];
@@ -58,6 +58,9 @@
 #define LI_XU_GENERIC_I2C_RW_SIZE (262)
 #define LI_XU_SENSOR_DEFECT_PIXEL_TABLE_SIZE (33)
 
+/* uuid and fuse id read along with the revisions, with the terminator */
+#define LI_UUID_SIZE (64)
+
 
 /* --- 8-bit I2C slave address list --- */
 /*  On-semi Sensor */
@@ -185,7 +188,8 @@ void set_sensor_gain_rgb(int fd,unsigned int rGain,
 						 unsigned int grGain,
 						 unsigned int gbGain,
 						 unsigned int bGain);
-int read_cam_uuid_hwfw_rev(int fd);
+int read_cam_uuid_hwfw_rev(int fd, int *hw_rev, char *uuid);
+int read_cam_datatype(int fd);
 
 void get_pts(int fd);
 int soft_trigger(int fd);
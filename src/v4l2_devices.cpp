@@ -126,4 +126,61 @@ char* enum_v4l2_device(char *dev_name)
 
     udev_unref(udev);
     return dev_name;
-}
\ No newline at end of file
+}
+
+/*
+ * list every Leopard camera node instead of only the first one
+ * args:
+ *      dev_names - gets the /dev/video# paths
+ *      max       - size of dev_names
+ * returns:
+ *      number of nodes found, a camera can have a metadata node as well
+ */
+int enum_v4l2_devices(char (*dev_names)[64], int max)
+{
+    struct udev *udev;
+    struct udev_enumerate *enumerate;
+    struct udev_list_entry *devices;
+    struct udev_list_entry *dev_list_entry;
+    int count = 0;
+
+    udev = udev_new();
+    if (!udev)
+    {
+        printf("Can't create udev\n");
+        return 0;
+    }
+
+    enumerate = udev_enumerate_new(udev);
+    udev_enumerate_add_match_subsystem(enumerate, "video4linux");
+    udev_enumerate_scan_devices(enumerate);
+    devices = udev_enumerate_get_list_entry(enumerate);
+
+    udev_list_entry_foreach(dev_list_entry, devices)
+    {
+        const char *path = udev_list_entry_get_name(dev_list_entry);
+        struct udev_device *dev = udev_device_new_from_syspath(udev, path);
+        struct udev_device *usb;
+        const char *node, *vendor;
+
+        if (dev == NULL)
+            continue;
+        node = udev_device_get_devnode(dev);
+        /* the usb parent belongs to dev, no unref for it */
+        usb = udev_device_get_parent_with_subsystem_devtype(
+            dev,
+            "usb",
+            "usb_device");
+        vendor = usb ? udev_device_get_sysattr_value(usb, "idVendor") : NULL;
+        if (node && vendor && strcmp("2a0b", vendor) == 0 && count < max)
+        {
+            snprintf(dev_names[count], 64, "%s", node);
+            printf("Leopard camera %d: %s\n", count, node);
+            count++;
+        }
+        udev_device_unref(dev);
+    }
+    udev_enumerate_unref(enumerate);
+    udev_unref(udev);
+    return count;
+}
@@ -16,4 +16,5 @@
 char* get_manufacturer_name(); 
 char* get_product();
 char *get_serial();
-char *enum_v4l2_device(char *dev_name); 
\ No newline at end of file
+char *enum_v4l2_device(char *dev_name);
+int enum_v4l2_devices(char (*dev_names)[64], int max); 
\ No newline at end of file
@@ -6,9 +6,11 @@
 #include "./ui_control.h"
 #include "../src/cam_property.h"
 #include "../src/v4l2_devices.h"
+#include "../src/cam_formats.h"
+#include "../src/multi_cam.h"
+#include "../src/cam_context.h"
+#include "../src/frame_trace.h"
 
-int v4l2_dev; /* global variable, file descriptor for camera device */
-int fw_rev;   /* global variable, firmware revision for the camera */
 struct v4l2_fract time_per_frame = {1, 15};
 
 static struct option opts[] = {
@@ -16,55 +18,157 @@ static struct option opts[] = {
 	{"nbufs", 1, 0, 'n'},
 	{"size", 1, 0, 's'},
 	{"time-per-frame", 1, 0, 't'},
+	{"in-place", 0, 0, 'i'},
+	{"abc-stats", 1, 0, 'a'},
+	{"fsync", 1, 0, 'f'},
+	{"record", 0, 0, 'r'},
+	{"record-backend", 1, 0, 'b'},
+	{"record-bench", 1, 0, 'B'},
+	{"pre-trigger", 1, 0, 'p'},
+	{"replay", 1, 0, 'R'},
+	{"replay-fps", 1, 0, 'F'},
+	{"replay-loops", 1, 0, 'L'},
+	{"headless", 0, 0, 'H'},
+	{"multi", 1, 0, 'm'},
+	{"cpus", 1, 0, 'c'},
+	{"duration", 1, 0, 'D'},
+	{"control", 1, 0, 'C'},
+	{"share", 1, 0, 'S'},
+	{"userptr", 0, 0, 'u'},
+	{"mlock", 0, 0, 'M'},
+	{"capture-bench", 1, 0, 'P'},
+	{"control-bench", 1, 0, 'V'},
+	{"queue-policy", 1, 0, 'Q'},
+	{"realtime", 1, 0, 'T'},
+	{"capture-cpu", 1, 0, 'K'},
+	{"tune-buffers", 1, 0, 'A'},
+	{"tune-apply", 0, 0, 'Y'},
+	{"stage-times", 1, 0, 'G'},
+	{"trace", 1, 0, 'X'},
 	{0, 0, 0, 0}};
 
+/*
+ * stream several cameras without display until ctrl-c or the duration
+ * args:
+ * 		list    - "all" for every Leopard camera or /dev/video# comma separated
+ * 		config  - format, rate, buffers and cpus for all cameras
+ * 		seconds - 0 until ctrl-c
+ * returns:
+ * 		exit code
+ */
+static int run_multi_cam(char *list, struct multi_cam_config *config,
+						 double seconds)
+{
+	static struct multi_cam mc;
+	char names[MULTI_CAM_MAX * 2][64];
+	int count = 0;
+
+	if (strcmp(list, "all") == 0)
+		count = enum_v4l2_devices(names, SIZE(names));
+	else
+	{
+		for (char *name = strtok(list, ","); name != NULL && count < (int)SIZE(names);
+			 name = strtok(NULL, ","))
+			snprintf(names[count++], sizeof(names[0]), "%s", name);
+	}
+	if (multi_cam_open(&mc, names, count, config) == 0)
+	{
+		printf("no camera to stream\n");
+		return 1;
+	}
+	multi_cam_run(&mc, seconds);
+	multi_cam_close(&mc);
+	return 0;
+}
+
+
+/*
+ * stream on a thread of its own, the camera window and the control gui run
+ * here until escape on the camera window or the stream ends
+ * args:
+ * 		argc, argv - for gtk
+ * 		ctx 	   - opened camera, streaming
+ */
+static void run_gui(int argc, char **argv, struct cam_ctx *ctx)
+{
+	int gui = init_control_gui(argc, argv, ctx) == 0;
+
+	if (streaming_start(ctx) < 0)
+		return;
+	while (streaming_running(ctx))
+	{
+		if (gui)
+			gui = poll_control_gui();
+		if (cam_ctx_show(ctx) == _ESC_KEY)
+			break;
+	}
+	streaming_stop(ctx);
+}
 
 /* main function */
 int main(int argc, char **argv)
 {
-	struct device dev;
+	struct cam_ctx *ctx;
+	struct device *dev;
 	char dev_name[64] = "/dev/video0";
+	int v4l2_dev;
 
 	int do_set_format = 0;
 	int do_set_time_per_frame = 0;
+	int record_bench_frames = 0;
+	int capture_bench_frames = 0;
+	int control_bench_rounds = 0;
+	int realtime = -1;
+	int capture_cpu = -1;
+	double tune_seconds = 0, tune_percentile = 99;
+	int tune_apply = 0;
+	char *replay_path = NULL;
+	char *trace_path = NULL;
+	double replay_fps = 0;
+	unsigned int replay_loops = 1;
+	int headless = 0;
+	char *multi_list = NULL;
+	struct multi_cam_config multi_config;
+	double duration = 0;
 	char *endptr;
-	dev.nbufs = V4L_BUFFERS_DEFAULT;
+	CLEAR(multi_config);
 	int c;
 
-	char *ret_dev_name = enum_v4l2_device(dev_name);
-	v4l2_dev = open_v4l2_device(ret_dev_name, &dev);
+	/* everything about the camera, options below already set some of it */
+	CamContext cam;
+	ctx = cam.get();
+	if (ctx == NULL)
+		return 1;
+	dev = &ctx->dev;
 
-	if (v4l2_dev < 0)
-	{
-		printf("open camera %s failed,err code:%d\n\r", dev_name, v4l2_dev);
-		return 0;
-	}
+	char *ret_dev_name = enum_v4l2_device(dev_name);
+	v4l2_dev = cam_ctx_open(ctx, ret_dev_name);
 
 	/* list all the resolutions */
-	system("v4l2-ctl --list-formats-ext | grep Size | awk '{print $1 $3}'|  	\
-		sed 's/Size/Resolution/g'");
+	if (v4l2_dev >= 0)
+		cam_caps_print(cam_caps_get(v4l2_dev));
 
 
-	while ((c = getopt_long(argc, argv, "n:s:t:", opts, NULL)) != -1)
+	while ((c = getopt_long(argc, argv, "n:s:t:ia:f:rb:B:p:R:F:L:Hm:c:D:C:S:uMP:Q:T:K:A:YG:X:V:", opts, NULL)) != -1)
 	{
 		switch (c)
 		{
 		case 'n':
 			/* set buffer number */
-			dev.nbufs = atoi(optarg);
-			if (dev.nbufs > V4L_BUFFERS_MAX)
-				dev.nbufs = V4L_BUFFERS_MAX;
-			printf("device nbuf %d\n", dev.nbufs);
+			dev->nbufs = atoi(optarg);
+			if (dev->nbufs > V4L_BUFFERS_MAX)
+				dev->nbufs = V4L_BUFFERS_MAX;
+			printf("device nbuf %d\n", dev->nbufs);
 			break;
 		case 's':
 			do_set_format = 1;
-			dev.width = strtol(optarg, &endptr, 10);
+			dev->width = strtol(optarg, &endptr, 10);
 			if (*endptr != 'x' || endptr == optarg)
 			{
 				printf("Invalid size '%s'\n", optarg);
 				return 1;
 			}
-			dev.height = strtol(endptr + 1, &endptr, 10);
+			dev->height = strtol(endptr + 1, &endptr, 10);
 			if (*endptr != 0)
 			{
 				printf("Invalid size '%s'\n", optarg);
@@ -75,6 +179,131 @@ int main(int argc, char **argv)
 			do_set_time_per_frame = 1;
 			time_per_frame.denominator = atoi(optarg);
 			break;
+		case 'i':
+			/* keep v4l2 buffers until the frame is displayed */
+			set_out_of_place_decode(ctx, 0);
+			break;
+		case 'a':
+		{
+			/* step[:period[:smoothing]] */
+			int step = 0, period = 0;
+			float smoothing = 0;
+			if (sscanf(optarg, "%d:%d:%f", &step, &period, &smoothing) < 1)
+			{
+				printf("Invalid abc statistics '%s'\n", optarg);
+				return 1;
+			}
+			set_abc_statistics(ctx, step, period, smoothing);
+			break;
+		}
+		case 'f':
+			/* 0: don't wait for the disk after each capture */
+			set_snapshot_fsync(ctx, atoi(optarg));
+			break;
+		case 'r':
+			/* record every frame from the start */
+			video_record_raw(ctx, 1);
+			break;
+		case 'b':
+			if (set_record_backend(ctx, optarg) < 0)
+			{
+				printf("Invalid record backend '%s'\n", optarg);
+				return 1;
+			}
+			break;
+		case 'B':
+			record_bench_frames = atoi(optarg);
+			break;
+		case 'p':
+			/* capture raw/trigger saves the seconds before the click */
+			set_pre_trigger_seconds(ctx, atoi(optarg));
+			break;
+		case 'R':
+			replay_path = optarg;
+			break;
+		case 'F':
+			replay_fps = atof(optarg);
+			break;
+		case 'L':
+			replay_loops = atoi(optarg);
+			break;
+		case 'H':
+			/* decode and isp without the opencv window and gui */
+			headless = 1;
+			set_display(ctx, 0);
+			break;
+		case 'm':
+			multi_list = optarg;
+			break;
+		case 'c':
+			/* cpu for the decode thread of each camera, in order */
+			for (char *cpu = strtok(optarg, ","); cpu != NULL &&
+				 multi_config.ncpus < MULTI_CAM_MAX; cpu = strtok(NULL, ","))
+				multi_config.cpus[multi_config.ncpus++] = atoi(cpu);
+			break;
+		case 'D':
+			duration = atof(optarg);
+			break;
+		case 'C':
+			/* stats, exposure, gain and stop commands while streaming */
+			multi_config.control_path = optarg;
+			break;
+		case 'S':
+			/* other processes get the frames as dmabufs */
+			set_frame_share(ctx, optarg);
+			break;
+		case 'u':
+			/* frames land in a huge page arena of our own */
+			dev->memtype = V4L2_MEMORY_USERPTR;
+			break;
+		case 'M':
+			dev->lock_buffers = 1;
+			break;
+		case 'P':
+			capture_bench_frames = atoi(optarg);
+			break;
+		case 'V':
+			control_bench_rounds = atoi(optarg);
+			break;
+		case 'Q':
+			/* a slow decode drops frames instead of starving the driver */
+			if (frame_queue_parse_policy(optarg, &multi_config.policy) < 0)
+			{
+				printf("Queue policy is block, drop-oldest or drop-newest\n");
+				return 1;
+			}
+			set_queue_policy(ctx, multi_config.policy);
+			break;
+		case 'T':
+			/* 0 only measures, to compare against a priority */
+			realtime = atoi(optarg);
+			if (realtime < 0 || realtime > 99)
+			{
+				printf("Real-time priority is 0 to 99\n");
+				return 1;
+			}
+			break;
+		case 'K':
+			capture_cpu = atoi(optarg);
+			break;
+		case 'A':
+			/* seconds[:percentile] */
+			if (sscanf(optarg, "%lf:%lf", &tune_seconds, &tune_percentile) < 1 ||
+				tune_seconds <= 0 || tune_percentile <= 0 || tune_percentile > 100)
+			{
+				printf("Invalid buffer tuning '%s'\n", optarg);
+				return 1;
+			}
+			break;
+		case 'Y':
+			tune_apply = 1;
+			break;
+		case 'G':
+			set_stage_report(ctx, atof(optarg));
+			break;
+		case 'X':
+			trace_path = optarg;
+			break;
 		default:
 			printf("Invalid option -%c\n", c);
 			printf("Run %s -h for help.\n", argv[0]);
@@ -85,11 +314,48 @@ int main(int argc, char **argv)
 	if (optind >= argc) {
 		usage(argv[0]);
 	}
+	set_realtime_capture(ctx, realtime, capture_cpu);
+	/* -Y alone tunes over the default window */
+	if (tune_apply && tune_seconds == 0)
+		tune_seconds = 5;
+	set_buffer_tune(ctx, tune_seconds, tune_percentile, tune_apply);
+	multi_config.realtime = realtime;
+	/* the last dump once everything has stopped, however main ends */
+	if (trace_path != NULL && frame_trace_start(trace_path, 0) == 0)
+		atexit(frame_trace_stop);
+
+	/* recorded frames through the whole pipeline, no camera needed */
+	if (replay_path != NULL)
+	{
+		set_replay_source(ctx, replay_path, replay_fps, replay_loops);
+		return streaming_loop(ctx) < 0;
+	}
+	/* every camera in one process, each one opens its own node */
+	if (multi_list != NULL)
+	{
+		cam_ctx_close(ctx);
+		multi_config.nbufs = dev->nbufs;
+		multi_config.memtype = dev->memtype;
+		multi_config.lock_buffers = dev->lock_buffers;
+		if (do_set_format)
+		{
+			multi_config.width = dev->width;
+			multi_config.height = dev->height;
+		}
+		if (do_set_time_per_frame)
+			multi_config.fps = time_per_frame.denominator;
+		return run_multi_cam(multi_list, &multi_config, duration);
+	}
+	if (v4l2_dev < 0)
+	{
+		printf("open camera %s failed,err code:%d\n\r", dev_name, v4l2_dev);
+		return 0;
+	}
 
 	/* Set the video format. */
 	if (do_set_format)
 	{
-		video_set_format(&dev, dev.width, dev.height, V4L2_PIX_FMT_YUYV);
+		video_set_format(dev, dev->width, dev->height, V4L2_PIX_FMT_YUYV);
 	}
 	/* Set the frame rate. */
 	if (do_set_time_per_frame)
@@ -99,8 +365,7 @@ int main(int argc, char **argv)
 
 
 	/* 
-	 * run a v4l2-ctl --list-formats-ext 
-	 * to see the resolution and available frame rate 
+	 * pick the resolution and frame rate from the list printed at start
 	 */
 	//video_set_format(&dev, 1344, 972, V4L2_PIX_FMT_YUYV);
 	//set_frame_rate(v4l2_dev, 5);
@@ -108,34 +373,40 @@ int main(int argc, char **argv)
 	/* list the current frame rate */
 	get_frame_rate(v4l2_dev);
 
-	/* try to get all the static camera info before fork */
-	fw_rev = read_cam_uuid_hwfw_rev(v4l2_dev);
-	check_dev_cap(&dev);
-	video_get_format(&dev);
-	video_alloc_buffers(&dev, dev.nbufs);
+	check_dev_cap(dev);
+	video_get_format(dev);
+	if (record_bench_frames > 0)
+	{
+		/* disk test only, no streaming */
+		record_benchmark(ctx, record_bench_frames);
+		return 0;
+	}
+	if (capture_bench_frames > 0)
+	{
+		/* mmap against userptr buffers, no display */
+		capture_benchmark(ctx, capture_bench_frames);
+		return 0;
+	}
+	if (control_bench_rounds > 0)
+	{
+		/* control latency only, no streaming */
+		control_benchmark(ctx, control_bench_rounds);
+		return 0;
+	}
+	video_alloc_buffers(dev, dev->nbufs);
 
 	//sensor_reg_read(v4l2_dev, 0x55d7);
 	//generic_I2C_read(v4l2_dev, 0x02, 8, 0x20, 0x0210);
 
 	/* Activate streaming */
-	start_camera(&dev);
-	pid_t pid;
-	pid = fork();
-	if (pid == 0)
-	{ /* child process */
-		init_control_gui(argc, argv);
-	}
-	else if (pid > 0)
-	{ /* parent process */
-		streaming_loop(&dev);
-		/* Deactivate streaming */
-		stop_Camera(&dev);
-		video_free_buffers(&dev);
-	}
+	start_camera(dev);
+	if (headless)
+		streaming_loop(ctx);
 	else
-	{
-		fprintf(stderr, "ERROR:fork() failed\n");
-	}
+		run_gui(argc, argv, ctx);
+	/* Deactivate streaming */
+	stop_Camera(dev);
+	video_free_buffers(dev);
 
 /* individual camera tests, detail info is in uvc_extension_unit_ctrl.h */
 #ifdef AP0202_WRITE_REG_ON_THE_FLY
@@ -197,6 +468,5 @@ int main(int argc, char **argv)
 	get_gain(v4l2_dev);
 #endif
 
-	close(v4l2_dev);
 	return 0;
 }
@@ -14,6 +14,8 @@
 #include <gdk/gdkkeysyms.h>
 #include "../includes/shortcuts.h"
 #include "ui_control.h"
+#include "../src/cam_context.h"
+#include "../src/cam_formats.h"
 /****************************************************************************
 **                      	Global data 
 *****************************************************************************/
@@ -30,12 +32,14 @@ GtkWidget *label_reg_val, *entry_reg_val;
 GtkWidget *button_read, *button_write;
 GtkWidget *check_button_just_sensor;
 GtkWidget *label_capture, *button_capture_bmp, *button_capture_raw;
+GtkWidget *check_button_record;
 GtkWidget *label_gamma, *entry_gamma, *button_apply_gamma;
 GtkWidget *label_trig, *check_button_trig_en, *button_trig;
+GtkWidget *label_resolution, *combo_resolution, *button_resolution;
 
 int address_width_flag;
-extern int v4l2_dev;
-extern int fw_rev;
+static struct cam_ctx *cam;        /* camera the gui controls */
+static GtkWidget *control_window;  /* NULL once it is closed */
 /****************************************************************************
 **                      	External Callbacks
 *****************************************************************************/
@@ -43,10 +47,8 @@ extern char *get_manufacturer_name();
 extern char *get_product();
 extern char *get_serial();
 
-extern int read_cam_uuid_hwfw_rev(int fd);
-
-extern void change_datatype(void *datatype);
-extern void change_bayerpattern(void *bayer);
+extern void change_datatype(struct cam_ctx *ctx, void *datatype);
+extern void change_bayerpattern(struct cam_ctx *ctx, void *bayer);
 
 extern void set_exposure_absolute(int fd, int exposure_absolute);
 extern void set_gain(int fd, int analog_gain);
@@ -61,16 +63,23 @@ extern int generic_I2C_read(int fd, int rw_flag, int bufCnt,
                             int slaveAddr, int regAddr);
 
 
-extern void video_capture_save_bmp();
-extern void video_capture_save_raw();
+extern void video_capture_save_bmp(struct cam_ctx *ctx);
+extern void video_capture_save_raw(struct cam_ctx *ctx);
+extern void video_record_raw(struct cam_ctx *ctx, int enable);
+extern void video_trigger_burst(struct cam_ctx *ctx);
+extern void add_exposure_val(struct cam_ctx *ctx, int exposure);
+extern void add_gain_val(struct cam_ctx *ctx, int gain);
 
 
-extern void add_gamma_val(float gamma_val_from_gui);
-extern void awb_enable(int enable);
-extern void abc_enable(int enable);
+extern void add_gamma_val(struct cam_ctx *ctx, float gamma_val_from_gui);
+extern void awb_enable(struct cam_ctx *ctx, int enable);
+extern void abc_enable(struct cam_ctx *ctx, int enable);
 
-extern void soft_trigger(int fd);
-extern void trigger_enable(int fd, int ena, int enb);
+extern int stream_reconfigure(struct cam_ctx *ctx, unsigned int width,
+                              unsigned int height, unsigned int pixelformat,
+                              unsigned int fps);
+extern int soft_trigger(int fd);
+extern int trigger_enable(int fd, int ena, int enb);
 
 /****************************************************************************
 **                      	Internal Callbacks
@@ -79,14 +88,14 @@ extern void trigger_enable(int fd, int ena, int enb);
 void radio_datatype(GtkWidget *widget, gpointer data)
 {   
     (void)widget;
-    change_datatype(data);
+    change_datatype(cam, data);
 }
 
 /* callback for bayer pattern choice updates*/
 void radio_bayerpattern(GtkWidget *widget, gpointer data)
 {
     (void)widget;
-    change_bayerpattern(data);
+    change_bayerpattern(cam, data);
 }
 
 /* callback for updating exposure time line */
@@ -94,7 +103,8 @@ void hscale_exposure_up(GtkRange *widget)
 {
     int exposure_time;
     exposure_time = (int)gtk_range_get_value(widget);
-    set_exposure_absolute(v4l2_dev, exposure_time);
+    set_exposure_absolute(cam->dev.fd, exposure_time);
+    add_exposure_val(cam, exposure_time);
     g_print("exposure is %d lines\n", exposure_time);
 }
 
@@ -103,7 +113,8 @@ void hscale_gain_up(GtkRange *widget)
 {
     int gain;
     gain = (int)gtk_range_get_value(widget);
-    set_gain(v4l2_dev, gain);
+    set_gain(cam->dev.fd, gain);
+    add_gain_val(cam, gain);
     g_print("gain is %d\n", gain);
 }
 
@@ -111,9 +122,9 @@ void hscale_gain_up(GtkRange *widget)
 void enable_ae(GtkToggleButton *toggle_button)
 {
     if (gtk_toggle_button_get_active(toggle_button))
-        set_exposure_auto(v4l2_dev, 0);
+        set_exposure_auto(cam->dev.fd, 0);
     else
-        set_exposure_auto(v4l2_dev, 1);
+        set_exposure_auto(cam->dev.fd, 1);
 }
 
 /* callback for enabling/disabling auto white balance */
@@ -121,12 +132,12 @@ void enable_awb(GtkToggleButton *toggle_button)
 {
     if (gtk_toggle_button_get_active(toggle_button)) {
         g_print("awb enable\n");
-        awb_enable(1);
+        awb_enable(cam, 1);
     }
     else 
     {
         g_print("awb disable\n");
-        awb_enable(0);
+        awb_enable(cam, 0);
     }
 }
 
@@ -136,12 +147,12 @@ void enable_abc(GtkToggleButton *toggle_button)
     if (gtk_toggle_button_get_active(toggle_button)) 
     {
         g_print("auto brighness and contrast optimization enable\n");
-        abc_enable(1);
+        abc_enable(cam, 1);
     }
     else
     {
         g_print("auto brighness and contrast optimization disable\n");
-        abc_enable(0);
+        abc_enable(cam, 0);
     }
 }
 
@@ -178,7 +189,7 @@ void register_write(GtkWidget *widget)
                              NULL, 16);
         int regVal = strtol((char *)gtk_entry_get_text(GTK_ENTRY(entry_reg_val)),
                             NULL, 16);
-        sensor_reg_write(v4l2_dev, regAddr, regVal);
+        sensor_reg_write(cam->dev.fd, regAddr, regVal);
     }
 
     /* generic i2c slave read */
@@ -196,9 +207,9 @@ void register_write(GtkWidget *widget)
 
         /* write 8/16 bit data */
         if (addr_width_for_rw(address_width_flag) != 1)
-            generic_I2C_write(v4l2_dev, 0x82, 2, slaveAddr, regAddr, buf);
+            generic_I2C_write(cam->dev.fd, 0x82, 2, slaveAddr, regAddr, buf);
         else
-            generic_I2C_write(v4l2_dev, 0x81, 1, slaveAddr, regAddr, buf);
+            generic_I2C_write(cam->dev.fd, 0x81, 1, slaveAddr, regAddr, buf);
 
     }
 }
@@ -213,7 +224,7 @@ void register_read(GtkWidget *widget)
         int regAddr = strtol((char *)gtk_entry_get_text(GTK_ENTRY(entry_reg_addr)),
                              NULL, 16);
 
-        int regVal = sensor_reg_read(v4l2_dev, regAddr);
+        int regVal = sensor_reg_read(cam->dev.fd, regAddr);
         char buf[6];
         snprintf(buf, sizeof(buf), "0x%x", regVal);
         gtk_entry_set_text(GTK_ENTRY(entry_reg_val), buf);
@@ -226,7 +237,7 @@ void register_read(GtkWidget *widget)
                                NULL, 16);
         int regAddr = strtol((char *)gtk_entry_get_text(GTK_ENTRY(entry_reg_addr)),
                              NULL, 16);
-        int regVal = generic_I2C_read(v4l2_dev, 0x02, 1, slaveAddr, regAddr);
+        int regVal = generic_I2C_read(cam->dev.fd, 0x02, 1, slaveAddr, regAddr);
         char buf[6];
         snprintf(buf, sizeof(buf), "0x%x", regVal);
         gtk_entry_set_text(GTK_ENTRY(entry_reg_val), buf);
@@ -237,21 +248,35 @@ void register_read(GtkWidget *widget)
 void capture_bmp(GtkWidget *widget)
 {
     (void)widget;
-    video_capture_save_bmp();
+    video_capture_save_bmp(cam);
 }
 
 /* callback for captuing raw */
 void capture_raw(GtkWidget *widget)
 {
     (void)widget;
-    video_capture_save_raw();
+    video_capture_save_raw(cam);
+}
+
+/* callback for starting/stopping continuous raw recording */
+void enable_record(GtkToggleButton *toggle_button)
+{
+    if (gtk_toggle_button_get_active(toggle_button)) {
+        g_print("recording start\n");
+        video_record_raw(cam, 1);
+    }
+    else
+    {
+        g_print("recording stop\n");
+        video_record_raw(cam, 0);
+    }
 }
 
 
 void gamma_correction(GtkWidget)
 {
     float gamma = atof((char *)gtk_entry_get_text(GTK_ENTRY(entry_gamma)));
-    add_gamma_val(gamma);
+    add_gamma_val(cam, gamma);
     g_print("gamma = %f\n", gamma);
 }
 
@@ -262,7 +287,9 @@ void send_trigger(GtkWidget *widget)
     if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(check_button_trig_en)))
     {
         g_print("trigger enabled\n");
-        soft_trigger(v4l2_dev);
+        soft_trigger(cam->dev.fd);
+        /* keep the frames leading up to the trigger if burst mode is on */
+        video_trigger_burst(cam);
         g_print("send one trigger\n");
     }
     else
@@ -271,6 +298,54 @@ void send_trigger(GtkWidget *widget)
     }
 }
 
+/* callback for switching the streaming camera to the chosen resolution */
+void apply_resolution(GtkWidget *widget)
+{
+    (void)widget;
+    gchar *size = gtk_combo_box_text_get_active_text(
+        GTK_COMBO_BOX_TEXT(combo_resolution));
+    unsigned int width, height;
+
+    if (size == NULL)
+        return;
+    if (sscanf(size, "%ux%u", &width, &height) == 2 &&
+        stream_reconfigure(cam, width, height, 0, 0) < 0)
+        g_print("couldn't switch to %s\n", size);
+    g_free(size);
+}
+
+/*
+ * list the discrete frame sizes of the current pixel format, the current
+ * one selected
+ * args:
+ *      combo - GtkComboBoxText to fill
+ */
+static void fill_resolutions(GtkWidget *combo)
+{
+    const struct cam_caps *caps = cam_caps_get(cam->dev.fd);
+    unsigned int n = 0;
+
+    if (caps == NULL)
+        return;
+    for (unsigned int i = 0; i < caps->nformats; i++)
+    {
+        const struct cam_format *format = &caps->formats[i];
+        if (format->pixelformat != cam->dev.pixelformat)
+            continue;
+        for (unsigned int j = 0; j < format->nsizes; j++)
+        {
+            char size[32];
+            snprintf(size, sizeof(size), "%ux%u", format->sizes[j].width,
+                     format->sizes[j].height);
+            gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(combo), size);
+            if (format->sizes[j].width == cam->dev.width &&
+                format->sizes[j].height == cam->dev.height)
+                gtk_combo_box_set_active(GTK_COMBO_BOX(combo), n);
+            n++;
+        }
+    }
+}
+
 /* callback for enabling/disablign sensor trigger */
 void enable_trig(GtkWidget *widget)
 {
@@ -278,15 +353,15 @@ void enable_trig(GtkWidget *widget)
     if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(check_button_trig_en)))
     {
         /* positive edge */
-        trigger_enable(v4l2_dev, 1, 1);
+        trigger_enable(cam->dev.fd, 1, 1);
         // /* negative edge */
-        // trigger_enable(v4l2_dev, 1, 0);
+        // trigger_enable(cam->dev.fd, 1, 0);
 
     }
     else 
     {        
         /* disable trigger */
-        trigger_enable(v4l2_dev, 0, 0);
+        trigger_enable(cam->dev.fd, 0, 0);
 
     }
 }
@@ -295,12 +370,19 @@ static gboolean check_escape(GtkWidget *widget, GdkEventKey *event)
 {
     (void)widget;
     if (event->keyval == GDK_KEY_Escape) {
-        gtk_main_quit();
+        gtk_widget_destroy(widget);
         return TRUE;
     }
     return FALSE;
 }
 
+/* the window is gone, either escape or closed by the window manager */
+static void control_gui_destroyed(GtkWidget *widget)
+{
+    (void)widget;
+    control_window = NULL;
+}
+
 /****************************************************************************
 **                      	Main GUI
 *****************************************************************************/
@@ -308,11 +390,25 @@ static gboolean check_escape(GtkWidget *widget, GdkEventKey *event)
 //g++ ui_control.cpp -o test2 `gtk-config --cflags --libs`
 //pass
 //g++ ui_control.cpp -o test `pkg-config --cflags gtk+-3.0` `pkg-config --libs gtk+-3.0`
-int init_control_gui(int argc, char *argv[])
+/*
+ * build the control window for a camera, the caller pumps its events with
+ * poll_control_gui in the same thread that shows the frames
+ * args:
+ *      argc, argv - for gtk
+ *      ctx        - camera to control, an opened one
+ * returns:
+ *      error value
+ */
+int init_control_gui(int argc, char *argv[], struct cam_ctx *ctx)
 {
 
     /* --- GTK initialization --- */
-    gtk_init(&argc, &argv);
+    cam = ctx;
+    if (!gtk_init_check(&argc, &argv))
+    {
+        printf("couldn't initialize gtk, no control window\n");
+        return -1;
+    }
     GtkWidget *window;
     window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
     gtk_window_set_title(GTK_WINDOW(window), "Camera Control");
@@ -332,7 +428,7 @@ int init_control_gui(int argc, char *argv[])
 
     char fw_rev_buf[20];
     snprintf(fw_rev_buf, sizeof(fw_rev_buf), "Firmware Rev: %d",
-             fw_rev);
+             cam->fw_rev);
     label_fw_rev = gtk_label_new("Firmware Rev:");
     gtk_label_set_text(GTK_LABEL(label_fw_rev), fw_rev_buf);
 
@@ -468,6 +564,9 @@ int init_control_gui(int argc, char *argv[])
 
     g_signal_connect(button_capture_bmp, "clicked", G_CALLBACK(capture_bmp), NULL);
     g_signal_connect(button_capture_raw, "clicked", G_CALLBACK(capture_raw), NULL);
+    check_button_record = gtk_check_button_new_with_label("Record raw");
+    g_signal_connect(GTK_TOGGLE_BUTTON(check_button_record), "toggled",
+                     G_CALLBACK(enable_record), NULL);
 
     /* --- row 11 --- */
     label_gamma = gtk_label_new("Gamma Correction:");
@@ -487,6 +586,14 @@ int init_control_gui(int argc, char *argv[])
              G_CALLBACK(enable_trig), NULL);
     g_signal_connect(button_trig, "clicked", G_CALLBACK(send_trigger), NULL);
 
+    /* --- row 13 --- */
+    label_resolution = gtk_label_new("Resolution:");
+    combo_resolution = gtk_combo_box_text_new();
+    fill_resolutions(combo_resolution);
+    button_resolution = gtk_button_new_with_label("Switch");
+    g_signal_connect(button_resolution, "clicked", G_CALLBACK(apply_resolution),
+                     NULL);
+
     /* ---------------- Layout, don't change ---------------------------- */
     // zero row: device info, fw revision
     int row = 0;
@@ -560,6 +667,7 @@ int init_control_gui(int argc, char *argv[])
     gtk_grid_attach(GTK_GRID(grid), label_capture, col++, row, 1, 1);
     gtk_grid_attach(GTK_GRID(grid), button_capture_bmp, col++, row, 1, 1);
     gtk_grid_attach(GTK_GRID(grid), button_capture_raw, col++, row, 1, 1);
+    gtk_grid_attach(GTK_GRID(grid), check_button_record, col++, row, 1, 1);
 
     // evelenth row: gamma correction
     row++;
@@ -575,6 +683,13 @@ int init_control_gui(int argc, char *argv[])
     gtk_grid_attach(GTK_GRID(grid), check_button_trig_en, col++, row, 1, 1);
     gtk_grid_attach(GTK_GRID(grid), button_trig, col++, row, 1, 1);
 
+    // thirteenth row: switch resolution while streaming
+    row++;
+    col = 0;
+    gtk_grid_attach(GTK_GRID(grid), label_resolution, col++, row, 1, 1);
+    gtk_grid_attach(GTK_GRID(grid), combo_resolution, col++, row, 1, 1);
+    gtk_grid_attach(GTK_GRID(grid), button_resolution, col++, row, 1, 1);
+
     /* --- Grid Setup --- */
     gtk_grid_set_column_homogeneous(GTK_GRID(grid), FALSE);
     gtk_widget_set_hexpand(grid, TRUE);
@@ -584,10 +699,22 @@ int init_control_gui(int argc, char *argv[])
     gtk_container_set_border_width(GTK_CONTAINER(grid), 2);
 
     gtk_container_add(GTK_CONTAINER(window), grid);
-    g_signal_connect(window, "delete-event", G_CALLBACK(gtk_main_quit),
+    g_signal_connect(window, "destroy", G_CALLBACK(control_gui_destroyed),
                      NULL);
 
     gtk_widget_show_all(window);
-    gtk_main();
+    control_window = window;
     return 0;
+}
+
+/*
+ * handle whatever gtk events are pending, never blocks
+ * returns:
+ *      1 while the control window is open, 0 once it is closed
+ */
+int poll_control_gui()
+{
+    while (control_window != NULL && gtk_events_pending())
+        gtk_main_iteration_do(FALSE);
+    return control_window != NULL;
 }
\ No newline at end of file
@@ -14,6 +14,8 @@
 #pragma once
 #include <gtk/gtk.h>
 
+struct cam_ctx;
+
 void radio_datatype(GtkWidget *widget, gpointer data);
 void radio_bayerpattern(GtkWidget *widget, gpointer data);
 
@@ -35,4 +37,5 @@ void capture_raw(GtkWidget *widget);
 
 void send_trigger(GtkWidget *widget);
 void enable_trig(GtkWidget *widget);
-int init_control_gui(int argc, char* argv[]);
+int init_control_gui(int argc, char* argv[], struct cam_ctx *ctx);
+int poll_control_gui();
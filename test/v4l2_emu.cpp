@@ -0,0 +1,1505 @@
+/****************************************************************************
+  This sample is released as public domain.  It is distributed in the hope it
+  will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+  This is the sample code for Leopard USB3.0 camera, an LD_PRELOAD shim that
+  emulates a camera on a box without one. open/ioctl/mmap/close on the fake
+  /dev/video# are served here, everything else goes to libc.
+
+  	LD_PRELOAD=./libv4l2_emu.so ./leopard_cam
+
+  Emulated: QUERYCAP, ENUM_FMT/FRAMESIZES/FRAMEINTERVALS, G/S/TRY_FMT,
+  G/S_PARM, QUERYCTRL, G/S_CTRL, REQBUFS/QUERYBUF/QBUF/DQBUF/EXPBUF/
+  STREAMON/STREAMOFF with synthetic Bayer or YUYV frames in mmap or user
+  pointer buffers, and
+  UVCIOC_CTRL_QUERY for the Leopard extension unit, backed by an in-memory
+  sensor register file.
+
+  A node can be opened several times, e.g. a v4l2-ctl next to the tool.
+  Like a vb2 driver, the fd that allocates buffers owns streaming until it
+  frees them or closes: QBUF, DQBUF, EXPBUF, STREAMON, STREAMOFF and REQBUFS
+  from another fd get EBUSY, so does S_PARM. S_FMT gets EBUSY from any fd
+  while buffers exist.
+
+  Each fake fd is an eventfd, the owner's one counts the filled buffers,
+  so poll and epoll on it behave like on a real camera. Each buffer lives
+  in a memfd of its own, EXPBUF hands out a duplicate of it in place of a
+  dmabuf.
+
+  Environment:
+  	V4L2_EMU_DEVICE   - fake device nodes, comma separated (/dev/video0)
+  	V4L2_EMU_SIZES    - frame sizes, first one is the default
+  	                    (1280x720,1920x1080,640x480)
+  	V4L2_EMU_FPS      - frame rates, first one is the default (30,60,15)
+  	V4L2_EMU_DATATYPE - raw10, raw12 or yuyv (raw10)
+  	V4L2_EMU_LATENCY  - us each ioctl takes, e.g. "xu=250,ctrl=120,*=20"
+  	                    names: querycap fmt enum parm ctrl xu reqbufs
+  	                    querybuf qbuf dqbuf streamon streamoff, * for
+  	                    the rest
+*****************************************************************************/
+#include <dlfcn.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/eventfd.h>
+
+#include "../includes/shortcuts.h"
+#include "../src/uvc_extension_unit_ctrl.h"
+
+/****************************************************************************
+**                      	Global data
+*****************************************************************************/
+#define EMU_MAX_DEVICES 8
+#define EMU_MAX_OPENS 16		/* fds open on one node at a time */
+#define EMU_MAX_SIZES 16
+#define EMU_MAX_RATES 16
+#define EMU_XU_MAX_SIZE 512		/* largest extension unit control */
+#define EMU_I2C_ENTRIES 1024	/* generic i2c registers kept */
+#define EMU_PTS_HZ 25000000		/* FX3 PTS counter, 403MHz / 16 */
+
+enum emu_buf_state
+{
+	EMU_BUF_DEQUEUED = 0,
+	EMU_BUF_QUEUED,
+	EMU_BUF_FILLING,
+	EMU_BUF_DONE,
+};
+
+enum emu_latency
+{
+	EMU_LAT_QUERYCAP = 0,
+	EMU_LAT_FMT,
+	EMU_LAT_ENUM,
+	EMU_LAT_PARM,
+	EMU_LAT_CTRL,
+	EMU_LAT_XU,
+	EMU_LAT_REQBUFS,
+	EMU_LAT_QUERYBUF,
+	EMU_LAT_QBUF,
+	EMU_LAT_DQBUF,
+	EMU_LAT_STREAMON,
+	EMU_LAT_STREAMOFF,
+	EMU_LAT_OTHER,
+	EMU_LAT_COUNT,
+};
+
+static const char *latency_names[EMU_LAT_COUNT] = {
+	"querycap", "fmt", "enum", "parm", "ctrl", "xu", "reqbufs",
+	"querybuf", "qbuf", "dqbuf", "streamon", "streamoff", "*",
+};
+
+struct emu_ctrl
+{
+	unsigned int id;
+	const char *name;
+	enum v4l2_ctrl_type type;
+	int min, max, step, def;
+};
+
+static const struct emu_ctrl ctrls[] = {
+	{V4L2_CID_BRIGHTNESS, "Brightness", V4L2_CTRL_TYPE_INTEGER, 0, 255, 1, 128},
+	{V4L2_CID_CONTRAST, "Contrast", V4L2_CTRL_TYPE_INTEGER, 0, 255, 1, 128},
+	{V4L2_CID_GAIN, "Gain", V4L2_CTRL_TYPE_INTEGER, 1, 64, 1, 1},
+	{V4L2_CID_AUTOGAIN, "Gain, Automatic", V4L2_CTRL_TYPE_BOOLEAN, 0, 1, 1, 0},
+	{V4L2_CID_EXPOSURE_AUTO, "Exposure, Auto", V4L2_CTRL_TYPE_MENU,
+	 V4L2_EXPOSURE_MANUAL, V4L2_EXPOSURE_APERTURE_PRIORITY, 1,
+	 V4L2_EXPOSURE_MANUAL},
+	{V4L2_CID_EXPOSURE_ABSOLUTE, "Exposure (Absolute)", V4L2_CTRL_TYPE_INTEGER,
+	 1, 4000, 1, 1000},
+};
+
+/* a generic i2c register, slave address and register address */
+struct emu_i2c_reg
+{
+	uint16_t slave;
+	uint16_t addr;
+	uint16_t val;
+	uint16_t used;
+};
+
+struct emu_buffer
+{
+	struct v4l2_buffer buf;
+	enum emu_buf_state state;
+	unsigned long order;	/* queue or done order, oldest first */
+};
+
+/* one open of a node */
+struct emu_open
+{
+	int fd;					/* fake fd, -1 for a free slot */
+	pid_t pid;				/* process that opened it */
+};
+
+/*
+ * one emulated camera, in shared memory so the gui process the tool forks
+ * off sees the same registers and controls as the streaming one
+ */
+struct emu_dev
+{
+	char path[64];
+	struct emu_open opens[EMU_MAX_OPENS];
+	unsigned int nopens;
+	int fd;					/* fd that owns the buffers, -1 for none */
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+
+	struct v4l2_pix_format pix;
+	struct v4l2_fract timeperframe;
+	int ctrl_val[SIZE(ctrls)];
+
+	/* buffers */
+	enum v4l2_memory memory;	/* from REQBUFS */
+	int memfd[V4L_BUFFERS_MAX];	/* mmap buffers only */
+	unsigned char *mem;		/* all buffers back to back */
+	size_t buf_size;		/* page aligned, buffer i is at i * buf_size */
+	unsigned int nbufs;
+	struct emu_buffer bufs[V4L_BUFFERS_MAX];
+	unsigned long order;
+
+	/* streaming */
+	int streaming;
+	pthread_t thread;
+	unsigned char *pattern;	/* one frame of test pattern */
+	unsigned int sequence;
+	unsigned long frames;
+	unsigned long dropped;	/* no buffer was queued */
+	struct timespec stream_start;
+	uint32_t pts_base;
+
+	/* extension unit */
+	unsigned char xu[LI_XU_SENSOR_DEFECT_PIXEL_TABLE + 1][EMU_XU_MAX_SIZE];
+	int trigger_mode;
+	unsigned int triggers;	/* soft triggers not served yet */
+	uint16_t reg_addr;		/* sensor register latched for a read */
+	uint16_t i2c_slave, i2c_addr;
+	struct emu_i2c_reg i2c[EMU_I2C_ENTRIES];
+	uint16_t regs[65536];	/* sensor register file */
+};
+
+static struct emu_dev *devs[EMU_MAX_DEVICES];
+static unsigned int ndevs;
+
+static struct v4l2_frmsize_discrete sizes[EMU_MAX_SIZES] = {
+	{1280, 720}, {1920, 1080}, {640, 480}};
+static unsigned int nsizes = 3;
+static unsigned int rates[EMU_MAX_RATES] = {30, 60, 15};
+static unsigned int nrates = 3;
+static int datatype_mode = RAW_10_MODE;
+static unsigned int latency_us[EMU_LAT_COUNT];
+
+/* the libc functions this shim sits in front of */
+static int (*real_open)(const char *path, int flags, ...);
+static int (*real_close)(int fd);
+static int (*real_ioctl)(int fd, unsigned long request, ...);
+static void *(*real_mmap)(void *addr, size_t length, int prot, int flags,
+						  int fd, off_t offset);
+
+/*****************************************************************************
+**                           Function definition
+*****************************************************************************/
+
+static void resolve_libc()
+{
+	if (real_open != NULL)
+		return;
+	real_close = (int (*)(int))dlsym(RTLD_NEXT, "close");
+	real_ioctl = (int (*)(int, unsigned long, ...))dlsym(RTLD_NEXT, "ioctl");
+	real_mmap = (void *(*)(void *, size_t, int, int, int, off_t))
+		dlsym(RTLD_NEXT, "mmap");
+	real_open = (int (*)(const char *, int, ...))dlsym(RTLD_NEXT, "open");
+}
+
+/* the open of fd on a device, NULL if fd isn't one of its */
+static struct emu_open *find_open(struct emu_dev *dev, int fd)
+{
+	for (int i = 0; i < EMU_MAX_OPENS; i++)
+		if (dev->opens[i].fd == fd)
+			return &dev->opens[i];
+	return NULL;
+}
+
+static struct emu_dev *find_dev_by_fd(int fd)
+{
+	if (fd < 0)
+		return NULL;
+	for (unsigned int i = 0; i < ndevs; i++)
+		if (find_open(devs[i], fd) != NULL)
+			return devs[i];
+	return NULL;
+}
+
+static struct emu_dev *find_dev_by_path(const char *path)
+{
+	if (path == NULL)
+		return NULL;
+	for (unsigned int i = 0; i < ndevs; i++)
+		if (strcmp(devs[i]->path, path) == 0)
+			return devs[i];
+	return NULL;
+}
+
+static void sleep_us(unsigned int us)
+{
+	struct timespec ts;
+
+	if (us == 0)
+		return;
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000L;
+	while (clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, &ts) == EINTR)
+		;
+}
+
+/*
+ * parse "name=us,name=us" into latency_us
+ * args:
+ * 		spec - V4L2_EMU_LATENCY
+ */
+static void parse_latency(const char *spec)
+{
+	int set[EMU_LAT_COUNT] = {0};
+	char copy[256];
+	char *save, *item;
+
+	snprintf(copy, sizeof(copy), "%s", spec);
+	for (item = strtok_r(copy, ",", &save); item != NULL;
+		 item = strtok_r(NULL, ",", &save))
+	{
+		char *eq = strchr(item, '=');
+		int found = 0;
+
+		if (eq == NULL)
+			continue;
+		*eq = '\0';
+		for (int i = 0; i < EMU_LAT_COUNT; i++)
+		{
+			if (strcmp(item, latency_names[i]) == 0)
+			{
+				latency_us[i] = strtoul(eq + 1, NULL, 10);
+				set[i] = 1;
+				found = 1;
+			}
+		}
+		if (!found)
+			fprintf(stderr, "V4L2_EMU: unknown ioctl %s in V4L2_EMU_LATENCY\n",
+					item);
+	}
+	/* ioctls without their own latency take the default one */
+	for (int i = 0; i < EMU_LAT_OTHER; i++)
+		if (!set[i])
+			latency_us[i] = latency_us[EMU_LAT_OTHER];
+}
+
+static void parse_config()
+{
+	const char *env;
+	char copy[256];
+	char *save, *item;
+
+	if ((env = getenv("V4L2_EMU_SIZES")) != NULL)
+	{
+		nsizes = 0;
+		snprintf(copy, sizeof(copy), "%s", env);
+		for (item = strtok_r(copy, ",", &save);
+			 item != NULL && nsizes < EMU_MAX_SIZES;
+			 item = strtok_r(NULL, ",", &save))
+		{
+			unsigned int w, h;
+			/* YUYV macro pixels, the width has to be even */
+			if (sscanf(item, "%ux%u", &w, &h) == 2 && w >= 2 && h >= 1)
+			{
+				sizes[nsizes].width = w & ~1u;
+				sizes[nsizes].height = h;
+				nsizes++;
+			}
+		}
+		if (nsizes == 0)
+		{
+			sizes[0].width = 1280;
+			sizes[0].height = 720;
+			nsizes = 1;
+		}
+	}
+	if ((env = getenv("V4L2_EMU_FPS")) != NULL)
+	{
+		nrates = 0;
+		snprintf(copy, sizeof(copy), "%s", env);
+		for (item = strtok_r(copy, ",", &save);
+			 item != NULL && nrates < EMU_MAX_RATES;
+			 item = strtok_r(NULL, ",", &save))
+			if (atoi(item) > 0)
+				rates[nrates++] = atoi(item);
+		if (nrates == 0)
+			rates[nrates++] = 30;
+	}
+	if ((env = getenv("V4L2_EMU_DATATYPE")) != NULL)
+	{
+		if (strcmp(env, "raw12") == 0)
+			datatype_mode = RAW_12_MODE;
+		else if (strcmp(env, "yuyv") == 0)
+			datatype_mode = YUY2_MODE;
+		else
+			datatype_mode = RAW_10_MODE;
+	}
+	if ((env = getenv("V4L2_EMU_LATENCY")) != NULL)
+		parse_latency(env);
+}
+
+/*
+ * put the format closest to the requested one in pix, like uvcvideo
+ * args:
+ * 		pix - requested format, overwritten with the one the device gives
+ */
+static void try_format(struct v4l2_pix_format *pix)
+{
+	unsigned int best = 0;
+	unsigned int best_dist = ~0u;
+
+	for (unsigned int i = 0; i < nsizes; i++)
+	{
+		unsigned int dw = sizes[i].width > pix->width ?
+			sizes[i].width - pix->width : pix->width - sizes[i].width;
+		unsigned int dh = sizes[i].height > pix->height ?
+			sizes[i].height - pix->height : pix->height - sizes[i].height;
+		if (dw + dh < best_dist)
+		{
+			best_dist = dw + dh;
+			best = i;
+		}
+	}
+	CLEAR(*pix);
+	/* Leopard cameras send raw bayer as YUYV, two bytes a pixel */
+	pix->pixelformat = V4L2_PIX_FMT_YUYV;
+	pix->width = sizes[best].width;
+	pix->height = sizes[best].height;
+	pix->field = V4L2_FIELD_NONE;
+	pix->bytesperline = pix->width * 2;
+	pix->sizeimage = pix->bytesperline * pix->height;
+	pix->colorspace = V4L2_COLORSPACE_SRGB;
+}
+
+/* closest supported frame interval to the requested one */
+static void try_interval(struct v4l2_fract *tpf)
+{
+	double want = (tpf->numerator && tpf->denominator) ?
+		(double)tpf->denominator / tpf->numerator : rates[0];
+	unsigned int best = 0;
+
+	for (unsigned int i = 1; i < nrates; i++)
+		if (fabs(rates[i] - want) < fabs(rates[best] - want))
+			best = i;
+	tpf->numerator = 1;
+	tpf->denominator = rates[best];
+}
+
+/*
+ * create the shared state for a fake device node
+ * args:
+ * 		path - node the application opens
+ * returns:
+ * 		error value
+ */
+static int add_device(const char *path)
+{
+	struct emu_dev *dev;
+	pthread_mutexattr_t mattr;
+	pthread_condattr_t cattr;
+
+	if (ndevs >= EMU_MAX_DEVICES)
+		return -ENOSPC;
+	dev = (struct emu_dev *)real_mmap(NULL, sizeof *dev, PROT_READ | PROT_WRITE,
+									  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (dev == MAP_FAILED)
+		return -ENOMEM;
+	memset(dev, 0, sizeof *dev);
+	snprintf(dev->path, sizeof(dev->path), "%s", path);
+	dev->fd = -1;
+	for (int i = 0; i < EMU_MAX_OPENS; i++)
+		dev->opens[i].fd = -1;
+	for (int i = 0; i < V4L_BUFFERS_MAX; i++)
+		dev->memfd[i] = -1;
+
+	pthread_mutexattr_init(&mattr);
+	pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+	pthread_mutex_init(&dev->mutex, &mattr);
+	pthread_mutexattr_destroy(&mattr);
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&dev->cond, &cattr);
+	pthread_condattr_destroy(&cattr);
+
+	dev->pix.width = sizes[0].width;
+	dev->pix.height = sizes[0].height;
+	try_format(&dev->pix);
+	dev->timeperframe.numerator = 1;
+	dev->timeperframe.denominator = rates[0];
+	for (unsigned int i = 0; i < SIZE(ctrls); i++)
+		dev->ctrl_val[i] = ctrls[i].def;
+
+	/* hardware revision with the datatype in the upper 4 bits */
+	unsigned char *rev = dev->xu[LI_XU_SENSOR_UUID_HWFW_REV];
+	int hw_rev = 0x0001 | datatype_mode;
+	rev[0] = hw_rev & 0xff;
+	rev[1] = hw_rev >> 8;
+	rev[2] = 1;
+	rev[3] = 0;
+	snprintf((char *)rev + 4, LI_XU_SENSOR_UUID_HWFW_REV_SIZE - 4,
+			 "00000000-0000-0000-0000-%012x", ndevs);
+
+	devs[ndevs++] = dev;
+	return 0;
+}
+
+__attribute__((constructor)) static void emu_init()
+{
+	const char *env = getenv("V4L2_EMU_DEVICE");
+	char copy[256];
+	char *save, *item;
+
+	resolve_libc();
+	parse_config();
+
+	snprintf(copy, sizeof(copy), "%s", env ? env : "/dev/video0");
+	for (item = strtok_r(copy, ",", &save); item != NULL;
+		 item = strtok_r(NULL, ",", &save))
+		add_device(item);
+}
+
+/*****************************************************************************
+**                      synthetic frames
+*****************************************************************************/
+/* 75% color bars, white yellow cyan green magenta red blue black */
+static const unsigned char bars[8][3] = {
+	{191, 191, 191}, {191, 191, 0}, {0, 191, 191}, {0, 191, 0},
+	{191, 0, 191}, {191, 0, 0}, {0, 0, 191}, {0, 0, 0}};
+
+/*
+ * one frame of color bars over a vertical ramp, YUYV or RGGB bayer in
+ * 16-bit words with 10 or 12 significant bits
+ * args:
+ * 		dev - emulated camera, dev->pattern gets the frame
+ */
+static void make_pattern(struct emu_dev *dev)
+{
+	unsigned int w = dev->pix.width, h = dev->pix.height;
+	int extra = datatype_mode == RAW_12_MODE ? 4 : 2;
+
+	for (unsigned int y = 0; y < h; y++)
+	{
+		unsigned char *row = dev->pattern + (size_t)y * dev->pix.bytesperline;
+		/* darker to the bottom, so a rolling frame is easy to see */
+		unsigned int ramp = 256 - (y * 192) / h;
+
+		for (unsigned int x = 0; x < w; x++)
+		{
+			const unsigned char *c = bars[(x * 8) / w];
+			int r = c[0] * ramp >> 8, g = c[1] * ramp >> 8, b = c[2] * ramp >> 8;
+
+			if (datatype_mode == YUY2_MODE)
+			{
+				int Y = (66 * r + 129 * g + 25 * b + 128) / 256 + 16;
+				int U = (-38 * r - 74 * g + 112 * b + 128) / 256 + 128;
+				int V = (112 * r - 94 * g - 18 * b + 128) / 256 + 128;
+				row[2 * x] = Y;
+				row[2 * x + 1] = (x & 1) ? V : U;
+			}
+			else
+			{
+				int v = (y & 1) ? ((x & 1) ? b : g) : ((x & 1) ? g : r);
+				uint16_t word = v << extra;
+				row[2 * x] = word & 0xff;
+				row[2 * x + 1] = word >> 8;
+			}
+		}
+	}
+}
+
+/* microseconds since the stream started, for the PTS counter */
+static uint32_t stream_pts(struct emu_dev *dev)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double us = (now.tv_sec - dev->stream_start.tv_sec) * 1e6 +
+				(now.tv_nsec - dev->stream_start.tv_nsec) / 1e3;
+	return dev->pts_base + (uint32_t)(us * (EMU_PTS_HZ / 1e6));
+}
+
+/*
+ * copy the pattern rolled down by one line per frame, with the PTS in
+ * the first 4 bytes like the FX3 firmware does
+ */
+static void fill_frame(struct emu_dev *dev, unsigned char *dst,
+					   unsigned int sequence, uint32_t pts)
+{
+	size_t bpl = dev->pix.bytesperline;
+	unsigned int h = dev->pix.height;
+	unsigned int roll = sequence % h;
+
+	memcpy(dst, dev->pattern + (size_t)(h - roll) * bpl, roll * bpl);
+	memcpy(dst + roll * bpl, dev->pattern, (size_t)(h - roll) * bpl);
+	dst[0] = pts & 0xff;
+	dst[1] = (pts >> 8) & 0xff;
+	dst[2] = (pts >> 16) & 0xff;
+	dst[3] = (pts >> 24) & 0xff;
+}
+
+/* oldest buffer in the given state, -1 if there is none */
+static int oldest_buffer(struct emu_dev *dev, enum emu_buf_state state)
+{
+	int found = -1;
+
+	for (unsigned int i = 0; i < dev->nbufs; i++)
+		if (dev->bufs[i].state == state &&
+			(found < 0 || dev->bufs[i].order < dev->bufs[found].order))
+			found = i;
+	return found;
+}
+
+/*
+ * sensor thread, fills the oldest queued buffer once a frame interval,
+ * in trigger mode only when a soft trigger came in
+ * args:
+ * 		arg - struct emu_dev *dev
+ */
+static void *sensor_thread(void *arg)
+{
+	struct emu_dev *dev = (struct emu_dev *)arg;
+	struct timespec next;
+	uint64_t one = 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while (1)
+	{
+		pthread_mutex_lock(&dev->mutex);
+		long period = 1000000000L * dev->timeperframe.numerator /
+					  dev->timeperframe.denominator;
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		/* fell more than a frame behind, don't send a burst to catch up */
+		if ((now.tv_sec - next.tv_sec) * 1000000000L +
+			now.tv_nsec - next.tv_nsec > period)
+			next = now;
+		next.tv_nsec += period;
+		while (next.tv_nsec >= 1000000000L)
+		{
+			next.tv_nsec -= 1000000000L;
+			next.tv_sec++;
+		}
+		/* STREAMOFF wakes this up */
+		while (dev->streaming &&
+			   pthread_cond_timedwait(&dev->cond, &dev->mutex, &next) != ETIMEDOUT)
+			;
+		if (!dev->streaming)
+		{
+			pthread_mutex_unlock(&dev->mutex);
+			break;
+		}
+		if (dev->trigger_mode)
+		{
+			if (dev->triggers == 0)
+			{
+				pthread_mutex_unlock(&dev->mutex);
+				continue;
+			}
+			dev->triggers--;
+		}
+
+		/* the sensor sends a frame whether or not there is a buffer */
+		unsigned int sequence = dev->sequence++;
+		int index = oldest_buffer(dev, EMU_BUF_QUEUED);
+		if (index < 0)
+		{
+			dev->dropped++;
+			pthread_mutex_unlock(&dev->mutex);
+			continue;
+		}
+		struct emu_buffer *b = &dev->bufs[index];
+		b->state = EMU_BUF_FILLING;
+		pthread_mutex_unlock(&dev->mutex);
+
+		/* a user pointer is only valid in the process that queued it */
+		fill_frame(dev, dev->memory == V4L2_MEMORY_USERPTR
+							? (unsigned char *)b->buf.m.userptr
+							: dev->mem + (size_t)index * dev->buf_size,
+				   sequence, stream_pts(dev));
+
+		pthread_mutex_lock(&dev->mutex);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		b->buf.sequence = sequence;
+		b->buf.timestamp.tv_sec = now.tv_sec;
+		b->buf.timestamp.tv_usec = now.tv_nsec / 1000;
+		b->buf.bytesused = dev->pix.sizeimage;
+		b->buf.field = V4L2_FIELD_NONE;
+		b->buf.flags = V4L2_BUF_FLAG_DONE | V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC |
+					   V4L2_BUF_FLAG_TSTAMP_SRC_SOE;
+		if (dev->memory == V4L2_MEMORY_MMAP)
+			b->buf.flags |= V4L2_BUF_FLAG_MAPPED;
+		b->state = EMU_BUF_DONE;
+		b->order = dev->order++;
+		dev->frames++;
+		/* one count per filled buffer, that is what poll sees */
+		if (write(dev->fd, &one, sizeof one) < 0)
+			perror("V4L2_EMU: eventfd");
+		pthread_cond_broadcast(&dev->cond);
+		pthread_mutex_unlock(&dev->mutex);
+	}
+	return NULL;
+}
+
+/*****************************************************************************
+**                      buffer ioctls
+*****************************************************************************/
+static void free_buffers(struct emu_dev *dev)
+{
+	if (dev->mem != NULL)
+		munmap(dev->mem, dev->nbufs * dev->buf_size);
+	for (int i = 0; i < V4L_BUFFERS_MAX; i++)
+	{
+		if (dev->memfd[i] >= 0)
+			real_close(dev->memfd[i]);
+		dev->memfd[i] = -1;
+	}
+	dev->mem = NULL;
+	dev->nbufs = 0;
+}
+
+static int emu_reqbufs(struct emu_dev *dev, struct v4l2_requestbuffers *req)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	unsigned int count = req->count;
+
+	if (req->type != V4L2_BUF_TYPE_VIDEO_CAPTURE ||
+		(req->memory != V4L2_MEMORY_MMAP && req->memory != V4L2_MEMORY_USERPTR))
+		return -EINVAL;
+	if (dev->streaming)
+		return -EBUSY;
+	free_buffers(dev);
+	if (count == 0)
+		return 0;
+	if (count > V4L_BUFFERS_MAX)
+		count = V4L_BUFFERS_MAX;
+	dev->memory = (enum v4l2_memory)req->memory;
+
+	/* the application brings the memory with every QBUF */
+	if (dev->memory == V4L2_MEMORY_USERPTR)
+	{
+		dev->nbufs = count;
+		for (unsigned int i = 0; i < count; i++)
+		{
+			struct v4l2_buffer *buf = &dev->bufs[i].buf;
+			CLEAR(*buf);
+			buf->index = i;
+			buf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+			buf->memory = V4L2_MEMORY_USERPTR;
+			buf->length = dev->pix.sizeimage;
+			buf->flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+			dev->bufs[i].state = EMU_BUF_DEQUEUED;
+		}
+		req->count = count;
+		return 0;
+	}
+
+	dev->buf_size = (dev->pix.sizeimage + page - 1) & ~(page - 1);
+	/* reserve room for all of them, then map each memfd into its place */
+	dev->mem = (unsigned char *)real_mmap(NULL, count * dev->buf_size,
+										  PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS,
+										  -1, 0);
+	if (dev->mem == MAP_FAILED)
+	{
+		dev->mem = NULL;
+		return -ENOMEM;
+	}
+	dev->nbufs = count;
+	for (unsigned int i = 0; i < count; i++)
+	{
+		dev->memfd[i] = memfd_create("v4l2_emu", MFD_CLOEXEC);
+		if (dev->memfd[i] < 0 || ftruncate(dev->memfd[i], dev->buf_size) < 0 ||
+			real_mmap(dev->mem + i * dev->buf_size, dev->buf_size,
+					  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+					  dev->memfd[i], 0) == MAP_FAILED)
+		{
+			free_buffers(dev);
+			return -ENOMEM;
+		}
+	}
+	for (unsigned int i = 0; i < count; i++)
+	{
+		struct v4l2_buffer *buf = &dev->bufs[i].buf;
+		CLEAR(*buf);
+		buf->index = i;
+		buf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buf->memory = V4L2_MEMORY_MMAP;
+		buf->length = dev->pix.sizeimage;
+		buf->m.offset = i * dev->buf_size;
+		buf->flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+		dev->bufs[i].state = EMU_BUF_DEQUEUED;
+	}
+	req->count = count;
+	return 0;
+}
+
+static int emu_querybuf(struct emu_dev *dev, struct v4l2_buffer *buf)
+{
+	if (buf->type != V4L2_BUF_TYPE_VIDEO_CAPTURE || buf->index >= dev->nbufs)
+		return -EINVAL;
+	*buf = dev->bufs[buf->index].buf;
+	return 0;
+}
+
+/* a dmabuf stand-in, the duplicate maps the same pages at offset 0 */
+static int emu_expbuf(struct emu_dev *dev, struct v4l2_exportbuffer *exp)
+{
+	if (exp->type != V4L2_BUF_TYPE_VIDEO_CAPTURE || exp->index >= dev->nbufs ||
+		exp->plane != 0 || dev->memory != V4L2_MEMORY_MMAP)
+		return -EINVAL;
+	exp->fd = fcntl(dev->memfd[exp->index],
+					(exp->flags & O_CLOEXEC) ? F_DUPFD_CLOEXEC : F_DUPFD, 0);
+	return exp->fd < 0 ? -errno : 0;
+}
+
+static int emu_qbuf(struct emu_dev *dev, struct v4l2_buffer *buf)
+{
+	struct emu_buffer *b;
+
+	if (buf->type != V4L2_BUF_TYPE_VIDEO_CAPTURE ||
+		buf->memory != dev->memory || buf->index >= dev->nbufs)
+		return -EINVAL;
+	b = &dev->bufs[buf->index];
+	if (b->state != EMU_BUF_DEQUEUED)
+		return -EINVAL;
+	if (dev->memory == V4L2_MEMORY_USERPTR)
+	{
+		if (buf->m.userptr == 0 || buf->length < dev->pix.sizeimage)
+			return -EINVAL;
+		b->buf.m.userptr = buf->m.userptr;
+		b->buf.length = buf->length;
+	}
+	b->state = EMU_BUF_QUEUED;
+	b->order = dev->order++;
+	b->buf.flags = (b->buf.flags & ~V4L2_BUF_FLAG_DONE) | V4L2_BUF_FLAG_QUEUED;
+	*buf = b->buf;
+	return 0;
+}
+
+static int emu_dqbuf(struct emu_dev *dev, struct v4l2_buffer *buf)
+{
+	uint64_t count;
+	int index;
+
+	if (buf->type != V4L2_BUF_TYPE_VIDEO_CAPTURE || buf->memory != dev->memory)
+		return -EINVAL;
+	while ((index = oldest_buffer(dev, EMU_BUF_DONE)) < 0)
+	{
+		if (!dev->streaming)
+			return -EINVAL;
+		if (fcntl(dev->fd, F_GETFL) & O_NONBLOCK)
+			return -EAGAIN;
+		pthread_cond_wait(&dev->cond, &dev->mutex);
+	}
+	/* take one count off the eventfd, it is at least 1 here */
+	if (read(dev->fd, &count, sizeof count) < 0)
+		perror("V4L2_EMU: eventfd");
+	dev->bufs[index].state = EMU_BUF_DEQUEUED;
+	dev->bufs[index].buf.flags &= ~V4L2_BUF_FLAG_QUEUED;
+	*buf = dev->bufs[index].buf;
+	return 0;
+}
+
+static int emu_streamon(struct emu_dev *dev)
+{
+	if (dev->streaming)
+		return 0;
+	if (dev->nbufs == 0)
+		return -EINVAL;
+	free(dev->pattern);
+	dev->pattern = (unsigned char *)malloc(dev->pix.sizeimage);
+	if (dev->pattern == NULL)
+		return -ENOMEM;
+	make_pattern(dev);
+	clock_gettime(CLOCK_MONOTONIC, &dev->stream_start);
+	dev->sequence = 0;
+	dev->streaming = 1;
+	if (pthread_create(&dev->thread, NULL, sensor_thread, dev) != 0)
+	{
+		dev->streaming = 0;
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+/*
+ * stop the sensor thread and take every buffer back from the driver,
+ * called with the mutex held, drops and retakes it for the join
+ */
+static int emu_streamoff(struct emu_dev *dev)
+{
+	uint64_t count;
+
+	if (dev->streaming)
+	{
+		dev->streaming = 0;
+		pthread_cond_broadcast(&dev->cond);
+		pthread_mutex_unlock(&dev->mutex);
+		pthread_join(dev->thread, NULL);
+		pthread_mutex_lock(&dev->mutex);
+	}
+	for (unsigned int i = 0; i < dev->nbufs; i++)
+	{
+		if (dev->bufs[i].state == EMU_BUF_DONE &&
+			read(dev->fd, &count, sizeof count) < 0)
+			perror("V4L2_EMU: eventfd");
+		dev->bufs[i].state = EMU_BUF_DEQUEUED;
+		dev->bufs[i].buf.flags &= ~(V4L2_BUF_FLAG_QUEUED | V4L2_BUF_FLAG_DONE);
+	}
+	return 0;
+}
+
+/*****************************************************************************
+**                      extension unit
+*****************************************************************************/
+/* size of each Leopard extension unit control, 0 if there is no such one */
+static int xu_size(int selector)
+{
+	switch (selector)
+	{
+	case LI_XU_SENSOR_MODES_SWITCH: return LI_XU_SENSOR_MODES_SWITCH_SIZE;
+	case LI_XU_SENSOR_WINDOW_REPOSITION: return LI_XU_SENSOR_WINDOW_REPOSITION_SIZE;
+	case LI_XU_LED_MODES: return LI_XU_LED_MODES_SIZE;
+	case LI_XU_SENSOR_GAIN_CONTROL_RGB: return LI_XU_SENSOR_GAIN_CONTROL_RGB_SIZE;
+	case LI_XU_SENSOR_GAIN_CONTROL_A: return LI_XU_SENSOR_GAIN_CONTROL_A_SIZE;
+	case LI_XU_SENSOR_UUID_HWFW_REV: return LI_XU_SENSOR_UUID_HWFW_REV_SIZE;
+	case LI_XU_PTS_QUERY: return LI_XU_PTS_QUERY_SIZE;
+	case LI_XU_SOFT_TRIGGER: return LI_XU_SOFT_TRIGGER_SIZE;
+	case LI_XU_TRIGGER_DELAY: return LI_XU_TRIGGER_DELAY_SIZE;
+	case LI_XU_TRIGGER_MODE: return LI_XU_TRIGGER_MODE_SIZE;
+	case LI_XU_SENSOR_REGISTER_CONFIGURATION: return LI_XU_SENSOR_REGISTER_CONFIGURATION_SIZE;
+	case LI_XU_SENSOR_REG_RW: return LI_XU_SENSOR_REG_RW_SIZE;
+	case LI_XU_GENERIC_I2C_RW: return LI_XU_GENERIC_I2C_RW_SIZE;
+	case LI_XU_SENSOR_DEFECT_PIXEL_TABLE: return LI_XU_SENSOR_DEFECT_PIXEL_TABLE_SIZE;
+	default: return 0;
+	}
+}
+
+static struct emu_i2c_reg *i2c_reg(struct emu_dev *dev, uint16_t slave,
+								   uint16_t addr, int create)
+{
+	for (unsigned int i = 0; i < EMU_I2C_ENTRIES; i++)
+	{
+		struct emu_i2c_reg *r = &dev->i2c[i];
+		if (r->used && r->slave == slave && r->addr == addr)
+			return r;
+		if (!r->used && create)
+		{
+			r->used = 1;
+			r->slave = slave;
+			r->addr = addr;
+			r->val = 0;
+			return r;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * SET_CUR, what the firmware does with each control
+ * args:
+ * 		dev  - emulated camera
+ * 		sel  - extension unit selector
+ * 		data - control data, xu_size(sel) bytes
+ */
+static void xu_set(struct emu_dev *dev, int sel, const unsigned char *data)
+{
+	switch (sel)
+	{
+	case LI_XU_SENSOR_UUID_HWFW_REV:
+		/* read only */
+		return;
+	case LI_XU_PTS_QUERY:
+		/* sent most significant byte first, read back little endian */
+		dev->pts_base = data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3];
+		clock_gettime(CLOCK_MONOTONIC, &dev->stream_start);
+		return;
+	case LI_XU_SOFT_TRIGGER:
+		dev->triggers++;
+		return;
+	case LI_XU_TRIGGER_MODE:
+		dev->trigger_mode = data[0] != 0;
+		dev->triggers = 0;
+		break;
+	case LI_XU_SENSOR_REG_RW:
+		/* byte 0: 1 write, 0 latch the address for the next read */
+		dev->reg_addr = data[1] << 8 | data[2];
+		if (data[0] == 1)
+			dev->regs[dev->reg_addr] = data[3] << 8 | data[4];
+		return;
+	case LI_XU_GENERIC_I2C_RW:
+	{
+		/* byte 0 bit 7 is write, byte 1 length - 1, data from byte 6 */
+		dev->i2c_slave = data[2] << 8 | data[3];
+		dev->i2c_addr = data[4] << 8 | data[5];
+		if (data[0] & 0x80)
+		{
+			struct emu_i2c_reg *r = i2c_reg(dev, dev->i2c_slave,
+											dev->i2c_addr, 1);
+			if (r != NULL)
+				r->val = data[1] == 0 ? data[6] : (data[6] << 8 | data[7]);
+		}
+		return;
+	}
+	default:
+		break;
+	}
+	memcpy(dev->xu[sel], data, xu_size(sel));
+}
+
+/* GET_CUR */
+static void xu_get(struct emu_dev *dev, int sel, unsigned char *data)
+{
+	int size = xu_size(sel);
+
+	memcpy(data, dev->xu[sel], size);
+	switch (sel)
+	{
+	case LI_XU_PTS_QUERY:
+	{
+		uint32_t pts = dev->streaming ? stream_pts(dev) : dev->pts_base;
+		data[0] = pts & 0xff;
+		data[1] = (pts >> 8) & 0xff;
+		data[2] = (pts >> 16) & 0xff;
+		data[3] = (pts >> 24) & 0xff;
+		break;
+	}
+	case LI_XU_SENSOR_REG_RW:
+		memset(data, 0, size);
+		data[1] = dev->reg_addr >> 8;
+		data[2] = dev->reg_addr & 0xff;
+		data[3] = dev->regs[dev->reg_addr] >> 8;
+		data[4] = dev->regs[dev->reg_addr] & 0xff;
+		break;
+	case LI_XU_GENERIC_I2C_RW:
+	{
+		struct emu_i2c_reg *r = i2c_reg(dev, dev->i2c_slave, dev->i2c_addr, 0);
+		uint16_t val = r ? r->val : 0;
+		memset(data, 0, size);
+		data[2] = dev->i2c_slave >> 8;
+		data[3] = dev->i2c_slave & 0xff;
+		data[4] = dev->i2c_addr >> 8;
+		data[5] = dev->i2c_addr & 0xff;
+		data[6] = val >> 8;
+		data[7] = val & 0xff;
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+static int emu_xu_query(struct emu_dev *dev, struct uvc_xu_control_query *q)
+{
+	int size;
+
+	if (q->unit != 3)
+		return -ENOENT;
+	size = xu_size(q->selector);
+	if (size == 0)
+		return -ENOENT;
+
+	switch (q->query)
+	{
+	case UVC_SET_CUR:
+		if (q->size != size)
+			return -ENOBUFS;
+		xu_set(dev, q->selector, q->data);
+		return 0;
+	case UVC_GET_CUR:
+		if (q->size != size)
+			return -ENOBUFS;
+		xu_get(dev, q->selector, q->data);
+		return 0;
+	case UVC_GET_LEN:
+		if (q->size != 2)
+			return -ENOBUFS;
+		q->data[0] = size & 0xff;
+		q->data[1] = size >> 8;
+		return 0;
+	case UVC_GET_INFO:
+		if (q->size != 1)
+			return -ENOBUFS;
+		q->data[0] = UVC_CONTROL_CAP_GET | UVC_CONTROL_CAP_SET;
+		return 0;
+	default:
+		return -EBADRQC;
+	}
+}
+
+/*****************************************************************************
+**                      format, rate and control ioctls
+*****************************************************************************/
+static int find_ctrl(unsigned int id)
+{
+	for (unsigned int i = 0; i < SIZE(ctrls); i++)
+		if (ctrls[i].id == id)
+			return i;
+	return -1;
+}
+
+static int emu_queryctrl(struct v4l2_queryctrl *qc)
+{
+	int i;
+
+	if (qc->id & V4L2_CTRL_FLAG_NEXT_CTRL)
+	{
+		unsigned int id = qc->id & ~V4L2_CTRL_FLAG_NEXT_CTRL;
+		i = -1;
+		for (unsigned int j = 0; j < SIZE(ctrls); j++)
+			if (ctrls[j].id > id && (i < 0 || ctrls[j].id < ctrls[i].id))
+				i = j;
+	}
+	else
+		i = find_ctrl(qc->id);
+	if (i < 0)
+		return -EINVAL;
+
+	CLEAR(*qc);
+	qc->id = ctrls[i].id;
+	qc->type = ctrls[i].type;
+	snprintf((char *)qc->name, sizeof(qc->name), "%s", ctrls[i].name);
+	qc->minimum = ctrls[i].min;
+	qc->maximum = ctrls[i].max;
+	qc->step = ctrls[i].step;
+	qc->default_value = ctrls[i].def;
+	return 0;
+}
+
+static int emu_enum(struct emu_dev *dev, unsigned long request, void *arg)
+{
+	(void)dev;
+	switch (request)
+	{
+	case VIDIOC_ENUM_FMT:
+	{
+		struct v4l2_fmtdesc *f = (struct v4l2_fmtdesc *)arg;
+		if (f->type != V4L2_BUF_TYPE_VIDEO_CAPTURE || f->index != 0)
+			return -EINVAL;
+		unsigned int index = f->index;
+		CLEAR(*f);
+		f->index = index;
+		f->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		f->pixelformat = V4L2_PIX_FMT_YUYV;
+		snprintf((char *)f->description, sizeof(f->description), "YUYV 4:2:2");
+		return 0;
+	}
+	case VIDIOC_ENUM_FRAMESIZES:
+	{
+		struct v4l2_frmsizeenum *s = (struct v4l2_frmsizeenum *)arg;
+		if (s->pixel_format != V4L2_PIX_FMT_YUYV || s->index >= nsizes)
+			return -EINVAL;
+		s->type = V4L2_FRMSIZE_TYPE_DISCRETE;
+		s->discrete = sizes[s->index];
+		return 0;
+	}
+	case VIDIOC_ENUM_FRAMEINTERVALS:
+	{
+		struct v4l2_frmivalenum *iv = (struct v4l2_frmivalenum *)arg;
+		unsigned int i;
+		if (iv->pixel_format != V4L2_PIX_FMT_YUYV || iv->index >= nrates)
+			return -EINVAL;
+		for (i = 0; i < nsizes; i++)
+			if (sizes[i].width == iv->width && sizes[i].height == iv->height)
+				break;
+		if (i == nsizes)
+			return -EINVAL;
+		iv->type = V4L2_FRMIVAL_TYPE_DISCRETE;
+		iv->discrete.numerator = 1;
+		iv->discrete.denominator = rates[iv->index];
+		return 0;
+	}
+	default:
+		return -ENOTTY;
+	}
+}
+
+/* latency bucket for an ioctl */
+static enum emu_latency ioctl_latency(unsigned long request)
+{
+	switch (request)
+	{
+	case VIDIOC_QUERYCAP: return EMU_LAT_QUERYCAP;
+	case VIDIOC_G_FMT:
+	case VIDIOC_S_FMT:
+	case VIDIOC_TRY_FMT: return EMU_LAT_FMT;
+	case VIDIOC_ENUM_FMT:
+	case VIDIOC_ENUM_FRAMESIZES:
+	case VIDIOC_ENUM_FRAMEINTERVALS: return EMU_LAT_ENUM;
+	case VIDIOC_G_PARM:
+	case VIDIOC_S_PARM: return EMU_LAT_PARM;
+	case VIDIOC_QUERYCTRL:
+	case VIDIOC_G_CTRL:
+	case VIDIOC_S_CTRL: return EMU_LAT_CTRL;
+	case UVCIOC_CTRL_QUERY: return EMU_LAT_XU;
+	case VIDIOC_REQBUFS: return EMU_LAT_REQBUFS;
+	case VIDIOC_QUERYBUF: return EMU_LAT_QUERYBUF;
+	case VIDIOC_QBUF: return EMU_LAT_QBUF;
+	case VIDIOC_DQBUF: return EMU_LAT_DQBUF;
+	case VIDIOC_STREAMON: return EMU_LAT_STREAMON;
+	case VIDIOC_STREAMOFF: return EMU_LAT_STREAMOFF;
+	default: return EMU_LAT_OTHER;
+	}
+}
+
+/* ioctls only the fd that owns the buffers may issue, as in vb2 */
+static int owner_only(unsigned long request)
+{
+	switch (request)
+	{
+	case VIDIOC_REQBUFS:
+	case VIDIOC_QBUF:
+	case VIDIOC_DQBUF:
+	case VIDIOC_EXPBUF:
+	case VIDIOC_STREAMON:
+	case VIDIOC_STREAMOFF:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * serve an ioctl on a fake device node
+ * args:
+ * 		dev     - emulated camera
+ * 		fd      - fake fd it came on
+ * 		request - ioctl request
+ * 		arg     - its argument
+ * returns:
+ * 		0 or negative errno
+ */
+static int emu_ioctl(struct emu_dev *dev, int fd, unsigned long request,
+					 void *arg)
+{
+	int ret = 0;
+
+	if (arg == NULL)
+		return -EFAULT;
+	sleep_us(latency_us[ioctl_latency(request)]);
+
+	pthread_mutex_lock(&dev->mutex);
+	if (owner_only(request) && dev->fd >= 0 && dev->fd != fd)
+	{
+		pthread_mutex_unlock(&dev->mutex);
+		return -EBUSY;
+	}
+	switch (request)
+	{
+	case VIDIOC_QUERYCAP:
+	{
+		struct v4l2_capability *cap = (struct v4l2_capability *)arg;
+		CLEAR(*cap);
+		snprintf((char *)cap->driver, sizeof(cap->driver), "uvcvideo");
+		snprintf((char *)cap->card, sizeof(cap->card), "Leopard USB3.0 emulated");
+		snprintf((char *)cap->bus_info, sizeof(cap->bus_info), "emu:%.27s",
+				 dev->path);
+		cap->version = 0x00050000;
+		cap->device_caps = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_STREAMING;
+		cap->capabilities = cap->device_caps | V4L2_CAP_DEVICE_CAPS;
+		break;
+	}
+	case VIDIOC_ENUM_FMT:
+	case VIDIOC_ENUM_FRAMESIZES:
+	case VIDIOC_ENUM_FRAMEINTERVALS:
+		ret = emu_enum(dev, request, arg);
+		break;
+	case VIDIOC_G_FMT:
+	case VIDIOC_S_FMT:
+	case VIDIOC_TRY_FMT:
+	{
+		struct v4l2_format *fmt = (struct v4l2_format *)arg;
+		if (fmt->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+			ret = -EINVAL;
+		else if (request == VIDIOC_G_FMT)
+			fmt->fmt.pix = dev->pix;
+		else if (request == VIDIOC_S_FMT && dev->nbufs > 0)
+			ret = -EBUSY;
+		else
+		{
+			try_format(&fmt->fmt.pix);
+			if (request == VIDIOC_S_FMT)
+				dev->pix = fmt->fmt.pix;
+		}
+		break;
+	}
+	case VIDIOC_G_PARM:
+	case VIDIOC_S_PARM:
+	{
+		struct v4l2_streamparm *parm = (struct v4l2_streamparm *)arg;
+		if (parm->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+		{
+			ret = -EINVAL;
+			break;
+		}
+		/* uvcvideo won't change the rate under someone else's buffers */
+		if (request == VIDIOC_S_PARM && dev->fd >= 0 && dev->fd != fd)
+		{
+			ret = -EBUSY;
+			break;
+		}
+		if (request == VIDIOC_S_PARM)
+		{
+			try_interval(&parm->parm.capture.timeperframe);
+			dev->timeperframe = parm->parm.capture.timeperframe;
+		}
+		CLEAR(parm->parm);
+		parm->parm.capture.capability = V4L2_CAP_TIMEPERFRAME;
+		parm->parm.capture.timeperframe = dev->timeperframe;
+		parm->parm.capture.readbuffers = dev->nbufs;
+		break;
+	}
+	case VIDIOC_QUERYCTRL:
+		ret = emu_queryctrl((struct v4l2_queryctrl *)arg);
+		break;
+	case VIDIOC_G_CTRL:
+	case VIDIOC_S_CTRL:
+	{
+		struct v4l2_control *ctrl = (struct v4l2_control *)arg;
+		int i = find_ctrl(ctrl->id);
+		if (i < 0)
+		{
+			ret = -EINVAL;
+			break;
+		}
+		if (request == VIDIOC_S_CTRL)
+		{
+			/* uvcvideo clamps to the control range */
+			int val = ctrl->value;
+			if (val < ctrls[i].min)
+				val = ctrls[i].min;
+			if (val > ctrls[i].max)
+				val = ctrls[i].max;
+			dev->ctrl_val[i] = val;
+		}
+		ctrl->value = dev->ctrl_val[i];
+		break;
+	}
+	case UVCIOC_CTRL_QUERY:
+		ret = emu_xu_query(dev, (struct uvc_xu_control_query *)arg);
+		break;
+	case VIDIOC_REQBUFS:
+	{
+		struct v4l2_requestbuffers *req = (struct v4l2_requestbuffers *)arg;
+		ret = emu_reqbufs(dev, req);
+		/* buffers make the fd the owner, freeing them lets it go */
+		if (ret == 0)
+			dev->fd = req->count > 0 ? fd : -1;
+		break;
+	}
+	case VIDIOC_QUERYBUF:
+		ret = emu_querybuf(dev, (struct v4l2_buffer *)arg);
+		break;
+	case VIDIOC_EXPBUF:
+		ret = emu_expbuf(dev, (struct v4l2_exportbuffer *)arg);
+		break;
+	case VIDIOC_QBUF:
+		ret = emu_qbuf(dev, (struct v4l2_buffer *)arg);
+		break;
+	case VIDIOC_DQBUF:
+		ret = emu_dqbuf(dev, (struct v4l2_buffer *)arg);
+		break;
+	case VIDIOC_STREAMON:
+	case VIDIOC_STREAMOFF:
+		if (*(int *)arg != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+			ret = -EINVAL;
+		else if (request == VIDIOC_STREAMON)
+			ret = emu_streamon(dev);
+		else
+			ret = emu_streamoff(dev);
+		break;
+	default:
+		ret = -ENOTTY;
+		break;
+	}
+	pthread_mutex_unlock(&dev->mutex);
+	return ret;
+}
+
+/*****************************************************************************
+**                      libc entry points
+*****************************************************************************/
+static int emu_open(const char *path, int flags, mode_t mode)
+{
+	struct emu_dev *dev;
+	struct emu_open *slot;
+	int fd;
+
+	resolve_libc();
+	dev = find_dev_by_path(path);
+	if (dev == NULL)
+		return real_open(path, flags, mode);
+
+	pthread_mutex_lock(&dev->mutex);
+	slot = find_open(dev, -1);
+	if (slot == NULL)
+	{
+		pthread_mutex_unlock(&dev->mutex);
+		errno = EMFILE;
+		return -1;
+	}
+	fd = eventfd(0, EFD_SEMAPHORE | EFD_CLOEXEC |
+					((flags & O_NONBLOCK) ? EFD_NONBLOCK : 0));
+	if (fd >= 0)
+	{
+		slot->fd = fd;
+		slot->pid = getpid();
+		if (dev->nopens++ == 0)
+		{
+			dev->frames = 0;
+			dev->dropped = 0;
+		}
+	}
+	pthread_mutex_unlock(&dev->mutex);
+	if (fd >= 0)
+		fprintf(stderr, "V4L2_EMU: %s is emulated, %ux%u %u fps\n", path,
+				dev->pix.width, dev->pix.height, dev->timeperframe.denominator);
+	return fd;
+}
+
+extern "C" int open(const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+
+	if (flags & (O_CREAT | O_TMPFILE))
+	{
+		va_list ap;
+		va_start(ap, flags);
+		mode = va_arg(ap, int);
+		va_end(ap);
+	}
+	return emu_open(path, flags, mode);
+}
+
+extern "C" int open64(const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+
+	if (flags & (O_CREAT | O_TMPFILE))
+	{
+		va_list ap;
+		va_start(ap, flags);
+		mode = va_arg(ap, int);
+		va_end(ap);
+	}
+	return emu_open(path, flags, mode);
+}
+
+/* what open turns into with _FORTIFY_SOURCE */
+extern "C" int __open_2(const char *path, int flags)
+{
+	return emu_open(path, flags, 0);
+}
+
+extern "C" int __open64_2(const char *path, int flags)
+{
+	return emu_open(path, flags, 0);
+}
+
+extern "C" int close(int fd)
+{
+	struct emu_dev *dev;
+	struct emu_open *slot;
+	int last = 0;
+
+	resolve_libc();
+	dev = find_dev_by_fd(fd);
+	if (dev == NULL)
+		return real_close(fd);
+
+	pthread_mutex_lock(&dev->mutex);
+	slot = find_open(dev, fd);
+	/* a forked off process closing its copy leaves the device alone */
+	if (slot != NULL && slot->pid == getpid())
+	{
+		/* the owner going away stops streaming and frees the buffers */
+		if (dev->fd == fd)
+		{
+			emu_streamoff(dev);
+			free_buffers(dev);
+			free(dev->pattern);
+			dev->pattern = NULL;
+			dev->fd = -1;
+		}
+		slot->fd = -1;
+		last = --dev->nopens == 0;
+	}
+	pthread_mutex_unlock(&dev->mutex);
+	if (last)
+		fprintf(stderr, "V4L2_EMU: %s closed, %lu frames, %lu dropped\n",
+				dev->path, dev->frames, dev->dropped);
+	return real_close(fd);
+}
+
+extern "C" int ioctl(int fd, unsigned long request, ...) __THROW
+{
+	struct emu_dev *dev;
+	va_list ap;
+	void *arg;
+	int ret;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	resolve_libc();
+	dev = find_dev_by_fd(fd);
+	if (dev == NULL)
+		return real_ioctl(fd, request, arg);
+
+	ret = emu_ioctl(dev, fd, request, arg);
+	if (ret < 0)
+	{
+		errno = -ret;
+		return -1;
+	}
+	return 0;
+}
+
+static void *emu_mmap(void *addr, size_t length, int prot, int flags,
+					  int fd, off_t offset)
+{
+	struct emu_dev *dev;
+	void *ret = MAP_FAILED;
+
+	resolve_libc();
+	dev = find_dev_by_fd(fd);
+	if (dev == NULL)
+		return real_mmap(addr, length, prot, flags, fd, offset);
+
+	/* the offset QUERYBUF gave out, within one buffer */
+	pthread_mutex_lock(&dev->mutex);
+	if (dev->nbufs > 0 && dev->memory == V4L2_MEMORY_MMAP &&
+		offset % dev->buf_size == 0 &&
+		(size_t)offset / dev->buf_size < dev->nbufs &&
+		length <= dev->buf_size)
+		ret = real_mmap(addr, length, prot, flags,
+						dev->memfd[offset / dev->buf_size], 0);
+	else
+		errno = EINVAL;
+	pthread_mutex_unlock(&dev->mutex);
+	return ret;
+}
+
+extern "C" void *mmap(void *addr, size_t length, int prot, int flags,
+					  int fd, off_t offset) __THROW
+{
+	return emu_mmap(addr, length, prot, flags, fd, offset);
+}
+
+extern "C" void *mmap64(void *addr, size_t length, int prot, int flags,
+						int fd, off64_t offset) __THROW
+{
+	return emu_mmap(addr, length, prot, flags, fd, offset);
+}